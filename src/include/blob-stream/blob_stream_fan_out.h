@@ -0,0 +1,47 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/blob-stream
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef BLOB_STREAM_FAN_OUT_H
+#define BLOB_STREAM_FAN_OUT_H
+
+#include <blob-stream/blob_stream_out.h>
+#include <clog/clog.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+struct ImprintAllocator;
+struct FldInStream;
+
+typedef struct BlobStreamFanOutReceiver {
+    size_t receivedBeforeChunkId;
+    size_t receivedChunkCount;
+    bool isEvicted;
+} BlobStreamFanOutReceiver;
+
+typedef struct BlobStreamFanOut {
+    BlobStreamOut* blobStream;
+    BlobStreamTransferId transferId;
+    BlobStreamFanOutReceiver* receivers;
+    size_t receiverCount;
+    uint64_t* receivedBits;
+    size_t atomsPerReceiver;
+    uint32_t* missingCounts;
+    size_t maxGroupSendCount;
+    size_t maxStragglerCount;
+    size_t evictedCount;
+    Clog log;
+} BlobStreamFanOut;
+
+void blobStreamFanOutInit(BlobStreamFanOut* self, struct ImprintAllocator* memory, BlobStreamOut* blobStream,
+                          BlobStreamTransferId transferId, size_t receiverCount, Clog log);
+void blobStreamFanOutSetStragglerPolicy(BlobStreamFanOut* self, size_t maxGroupSendCount, size_t maxStragglerCount);
+int blobStreamFanOutReceive(BlobStreamFanOut* self, size_t receiverIndex, struct FldInStream* inStream);
+int blobStreamFanOutPrepareSend(BlobStreamFanOut* self, MonotonicTimeMs now, const BlobStreamOutEntry* entries[],
+                                size_t maxEntriesCount);
+int blobStreamFanOutPrepareUnicast(const BlobStreamFanOut* self, size_t receiverIndex, BlobStreamOut* unicast);
+bool blobStreamFanOutIsComplete(const BlobStreamFanOut* self);
+
+#endif
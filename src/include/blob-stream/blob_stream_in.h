@@ -7,6 +7,7 @@
 #define BLOB_STREAM_IN_H
 
 #include <bit-array/bit_array.h>
+#include <blob-stream/chunk_geometry.h>
 #include <blob-stream/types.h>
 #include <clog/clog.h>
 #include <stdbool.h>
@@ -15,24 +16,65 @@
 
 struct ImprintAllocator;
 struct ImprintAllocatorWithFree;
+struct BlobStreamSegmentPool;
+struct FldInStream;
+struct FldOutStream;
+
+typedef struct BlobStreamInSegmentView {
+    const uint8_t* octets;
+    size_t octetCount;
+} BlobStreamInSegmentView;
 
 typedef struct BlobStreamIn {
     BitArray bitArray;
+    BitArray expiredBitArray;
     size_t fixedChunkSize;
     size_t octetCount;
+    size_t octetCapacity;
+    size_t chunkCapacity;
+    size_t receivedChunkCount;
+    size_t expiredChunkCount;
+    BlobStreamChunkGeometry geometry;
     uint8_t* blob;
     bool isComplete;
     struct ImprintAllocatorWithFree* blobAllocator;
+    struct BlobStreamSegmentPool* segmentPool;
+    uint8_t** segments;
+    size_t segmentCount;
+    size_t chunksPerSegment;
+    uint8_t chunksPerSegmentShift;
+    bool isChunksPerSegmentPowerOfTwo;
+    const uint8_t* baseline;
+    size_t baselineOctetCount;
     Clog log;
 } BlobStreamIn;
 
 void blobStreamInInit(BlobStreamIn* self, struct ImprintAllocator* memory,
                       struct ImprintAllocatorWithFree* blobAllocator, size_t totalOctetCount, size_t fixedChunkSize,
                       Clog log);
+void blobStreamInInitSegmented(BlobStreamIn* self, struct ImprintAllocator* memory,
+                               struct BlobStreamSegmentPool* segmentPool,
+                               struct ImprintAllocatorWithFree* linearizeAllocator, size_t totalOctetCount,
+                               size_t fixedChunkSize, Clog log);
+size_t blobStreamInStorageSize(size_t totalOctetCount, size_t fixedChunkSize);
+void blobStreamInInitWithStorage(BlobStreamIn* self, void* storage, size_t storageSize, size_t totalOctetCount,
+                                 size_t fixedChunkSize, Clog log);
 void blobStreamInDestroy(BlobStreamIn* self);
 void blobStreamInReset(BlobStreamIn* self);
+int blobStreamInReinit(BlobStreamIn* self, size_t totalOctetCount, size_t fixedChunkSize);
+void blobStreamInSetBaseline(BlobStreamIn* self, const uint8_t* baseline, size_t baselineOctetCount);
 bool blobStreamInIsComplete(const BlobStreamIn* self);
 void blobStreamInSetChunk(BlobStreamIn* self, BlobStreamChunkId chunkId, const uint8_t* octets, size_t octetCount);
+int blobStreamInSetEncodedChunk(BlobStreamIn* self, BlobStreamChunkId chunkId, uint8_t encoding,
+                                const uint8_t* octets, size_t octetCount);
+int blobStreamInExpireChunks(BlobStreamIn* self, BlobStreamChunkId firstChunkId, size_t chunkCount);
+bool blobStreamInIsChunkExpired(const BlobStreamIn* self, BlobStreamChunkId chunkId);
+const uint8_t* blobStreamInGetChunk(const BlobStreamIn* self, BlobStreamChunkId chunkId);
+size_t blobStreamInGetSegmentViews(const BlobStreamIn* self, BlobStreamInSegmentView* views, size_t maxViewCount);
+int blobStreamInLinearize(BlobStreamIn* self, struct ImprintAllocatorWithFree* blobAllocator);
+size_t blobStreamInStateOctetCount(const BlobStreamIn* self);
+int blobStreamInWriteState(const BlobStreamIn* self, struct FldOutStream* outStream);
+int blobStreamInReadState(BlobStreamIn* self, struct FldInStream* inStream);
 const char* blobStreamInToString(const BlobStreamIn* self, char* buf, size_t maxBuf);
 
 #endif
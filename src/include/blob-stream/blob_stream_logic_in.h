@@ -11,16 +11,68 @@
 
 #include <blob-stream/blob_stream_in.h>
 #include <flood/out_stream.h>
+#include <monotonic-time/monotonic_time.h>
 
 struct FldInStream;
+struct BlobStreamChunkCache;
 
 typedef struct BlobStreamLogicIn {
     BlobStreamIn* blobStream;
+    BlobStreamTransferId transferId;
+    struct BlobStreamChunkCache* chunkCache;
+    size_t pendingHashAnswerFirstChunkId;
+    size_t pendingHashAnswerEndChunkId;
+    bool isPullMode;
+    size_t maxChunksPerRequest;
+    MonotonicTimeMs requestInterval;
+    MonotonicTimeMs retryInterval;
+    MonotonicTimeMs lastRequestAt;
+    MonotonicTimeMs requestPassStartedAt;
+    size_t requestChunkId;
+    bool isRequestPassStarted;
+    size_t ackEveryChunkCount;
+    MonotonicTimeMs maxAckDelay;
+    size_t unackedChunkCount;
+    size_t expectedChunkId;
+    bool isAckPending;
+    bool isAckUrgent;
+    bool isAckDelayStarted;
+    MonotonicTimeMs ackDelayStartedAt;
+    size_t receiveWindowChunkCount;
+    size_t receiveWindowEndChunkId;
+    size_t droppedChunkCount;
+    bool isCompact;
+    bool isTransferIdElided;
 } BlobStreamLogicIn;
 
-void blobStreamLogicInInit(BlobStreamLogicIn* self, BlobStreamIn* blobStream);
+typedef struct BlobStreamStartTransfer {
+    BlobStreamTransferId transferId;
+    size_t octetCount;
+    size_t fixedChunkSize;
+    bool isDelta;
+    BlobStreamBaselineId baselineId;
+    bool isCompact;
+    bool isTransferIdElided;
+} BlobStreamStartTransfer;
+
+void blobStreamLogicInInit(BlobStreamLogicIn* self, BlobStreamIn* blobStream, BlobStreamTransferId transferId);
+void blobStreamLogicInSetCompact(BlobStreamLogicIn* self, bool isTransferIdElided);
+void blobStreamLogicInSetChunkCache(BlobStreamLogicIn* self, struct BlobStreamChunkCache* chunkCache);
+int blobStreamLogicInReadStartTransfer(struct FldInStream* inStream, size_t maxChunkSize,
+                                       BlobStreamStartTransfer* startTransfer);
+int blobStreamLogicInSendAckStartTransfer(const BlobStreamStartTransfer* startTransfer, FldOutStream* outStream);
 int blobStreamLogicInReceive(BlobStreamLogicIn* self, struct FldInStream* inStream);
+int blobStreamLogicInReceiveDatagram(BlobStreamLogicIn* self, struct FldInStream* inStream);
 int blobStreamLogicInSend(BlobStreamLogicIn* self, FldOutStream* outStream);
+void blobStreamLogicInSetAckFrequency(BlobStreamLogicIn* self, size_t ackEveryChunkCount, MonotonicTimeMs maxAckDelay);
+bool blobStreamLogicInIsAckPending(const BlobStreamLogicIn* self);
+void blobStreamLogicInSetReceiveWindow(BlobStreamLogicIn* self, size_t windowChunkCount);
+bool blobStreamLogicInIsAckDue(BlobStreamLogicIn* self, MonotonicTimeMs now);
+int blobStreamLogicInSendIfDue(BlobStreamLogicIn* self, MonotonicTimeMs now, FldOutStream* outStream);
+void blobStreamLogicInSetPullMode(BlobStreamLogicIn* self, size_t maxChunksPerRequest, MonotonicTimeMs requestInterval,
+                                  MonotonicTimeMs retryInterval);
+int blobStreamLogicInSendRequest(BlobStreamLogicIn* self, MonotonicTimeMs now, FldOutStream* outStream);
+int blobStreamLogicInSendResume(const BlobStreamLogicIn* self, FldOutStream* outStream, size_t* fromChunkId);
 void blobStreamLogicInDestroy(BlobStreamLogicIn* self);
 void blobStreamLogicInClear(BlobStreamLogicIn* self);
 
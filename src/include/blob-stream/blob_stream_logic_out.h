@@ -17,18 +17,35 @@ struct FldOutStream;
 typedef struct BlobStreamLogicOut {
     BlobStreamOut* blobStream;
     BlobStreamTransferId transferId;
+    bool isCompactRequested;
+    bool isTransferIdElisionRequested;
+    bool isCompact;
+    bool isTransferIdElided;
+    bool isStartTransferAcked;
 } BlobStreamLogicOut;
 
 void blobStreamLogicOutInit(BlobStreamLogicOut* self, BlobStreamOut* blobStream, BlobStreamTransferId transferId);
 int blobStreamLogicOutPrepareSend(BlobStreamLogicOut* self, MonotonicTimeMs now, const BlobStreamOutEntry* entries[],
                                   size_t maxEntriesCount);
+size_t blobStreamLogicOutEntryOctetCount(const BlobStreamOutEntry* entry);
 int blobStreamLogicOutSendEntry(struct FldOutStream* tempStream, const BlobStreamOutEntry* entry,
                                 BlobStreamTransferId transferId);
+void blobStreamLogicOutSetCompact(BlobStreamLogicOut* self, bool isTransferIdElided);
+int blobStreamLogicOutSendEntries(BlobStreamLogicOut* self, struct FldOutStream* tempStream,
+                                  const BlobStreamOutEntry* entries[], size_t entryCount);
+int blobStreamLogicOutSendEntryRun(struct FldOutStream* tempStream, const BlobStreamOutEntry* entries[],
+                                   size_t entryCount, BlobStreamTransferId transferId, size_t* segmentOctetSize);
+int blobStreamLogicOutSendChunkHashes(BlobStreamLogicOut* self, struct FldOutStream* tempStream,
+                                      BlobStreamChunkId firstChunkId);
+int blobStreamLogicOutSendExpired(BlobStreamLogicOut* self, struct FldOutStream* tempStream, size_t* fromChunkId);
 int blobStreamLogicOutReceive(BlobStreamLogicOut* self, struct FldInStream* inStream);
+int blobStreamLogicOutReceiveDatagram(BlobStreamLogicOut* self, struct FldInStream* inStream);
 void blobStreamLogicOutDestroy(BlobStreamLogicOut* self);
 const char* blobStreamLogicOutToString(const BlobStreamLogicOut* self, char* buf, size_t maxBuf);
 bool blobStreamLogicOutIsComplete(BlobStreamLogicOut* self);
 bool blobStreamLogicOutIsAllSent(BlobStreamLogicOut* self);
 int blobStreamLogicOutStartTransfer(BlobStreamLogicOut* self, struct FldOutStream* tempStream);
+int blobStreamLogicOutSendFlight(BlobStreamLogicOut* self, MonotonicTimeMs now, struct FldOutStream* tempStream,
+                                 const BlobStreamOutEntry* entries[], size_t maxEntriesCount);
 
 #endif
@@ -0,0 +1,55 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/blob-stream
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef BLOB_STREAM_MULTI_SOURCE_H
+#define BLOB_STREAM_MULTI_SOURCE_H
+
+#include <blob-stream/blob_stream_logic_in.h>
+#include <clog/clog.h>
+#include <monotonic-time/monotonic_time.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+struct ImprintAllocator;
+struct FldInStream;
+struct FldOutStream;
+
+#define BLOB_STREAM_MULTI_SOURCE_MAX_SOURCE_COUNT (8)
+#define BLOB_STREAM_MULTI_SOURCE_NO_SOURCE (0xff)
+
+typedef struct BlobStreamSource {
+    BlobStreamLogicIn logicIn;
+    MonotonicTimeMs smoothedRtt;
+    bool hasRtt;
+    size_t window;
+    size_t outstandingCount;
+    size_t deliveredChunkCount;
+    size_t timedOutChunkCount;
+    bool isEnabled;
+} BlobStreamSource;
+
+typedef struct BlobStreamMultiSource {
+    BlobStreamIn* blobStream;
+    BlobStreamSource sources[BLOB_STREAM_MULTI_SOURCE_MAX_SOURCE_COUNT];
+    size_t sourceCount;
+    uint8_t* chunkSources;
+    MonotonicTimeMs* chunkRequestedAt;
+    size_t nextChunkId;
+    size_t maxWindow;
+    MonotonicTimeMs initialTimeout;
+    Clog log;
+} BlobStreamMultiSource;
+
+void blobStreamMultiSourceInit(BlobStreamMultiSource* self, struct ImprintAllocator* memory, BlobStreamIn* blobStream,
+                               size_t maxWindow, MonotonicTimeMs initialTimeout, Clog log);
+int blobStreamMultiSourceAddSource(BlobStreamMultiSource* self, const BlobStreamStartTransfer* startTransfer);
+int blobStreamMultiSourceSendRequest(BlobStreamMultiSource* self, size_t sourceIndex, MonotonicTimeMs now,
+                                     struct FldOutStream* outStream);
+int blobStreamMultiSourceReceive(BlobStreamMultiSource* self, size_t sourceIndex, MonotonicTimeMs now,
+                                 struct FldInStream* inStream);
+bool blobStreamMultiSourceIsComplete(const BlobStreamMultiSource* self);
+
+#endif
@@ -0,0 +1,62 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/blob-stream
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef BLOB_STREAM_MUX_H
+#define BLOB_STREAM_MUX_H
+
+#include <blob-stream/blob_stream_logic_in.h>
+#include <blob-stream/blob_stream_logic_out.h>
+#include <blob-stream/blob_stream_pool.h>
+#include <clog/clog.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+struct ImprintAllocator;
+struct FldInStream;
+
+typedef struct BlobStreamMuxEntry {
+    uint32_t key;
+    size_t activeIndex;
+    BlobStreamLogicIn logicIn;
+    BlobStreamLogicOut logicOut;
+    bool isFromInPool;
+    bool isAckStartPending;
+    bool isPendingAck;
+    uint32_t previousPendingAck;
+    uint32_t nextPendingAck;
+    BlobStreamStartTransfer startTransfer;
+} BlobStreamMuxEntry;
+
+typedef struct BlobStreamMux {
+    BlobStreamMuxEntry* entries;
+    uint32_t* freeEntries;
+    size_t freeCount;
+    uint32_t* activeEntries;
+    size_t activeCount;
+    uint32_t pendingAckHead;
+    uint32_t pendingAckTail;
+    size_t pendingAckCount;
+    uint32_t* table;
+    size_t tableMask;
+    uint8_t tableShift;
+    size_t capacity;
+    BlobStreamTransferId nextTransferId;
+    BlobStreamInPool* inPool;
+    size_t maxChunkSize;
+    Clog log;
+} BlobStreamMux;
+
+void blobStreamMuxInit(BlobStreamMux* self, struct ImprintAllocator* memory, size_t capacity, Clog log);
+void blobStreamMuxSetInPool(BlobStreamMux* self, BlobStreamInPool* inPool, size_t maxChunkSize);
+BlobStreamLogicOut* blobStreamMuxAddOut(BlobStreamMux* self, BlobStreamOut* blobStream);
+BlobStreamLogicIn* blobStreamMuxAddIn(BlobStreamMux* self, BlobStreamIn* blobStream, BlobStreamTransferId transferId);
+BlobStreamLogicOut* blobStreamMuxFindOut(const BlobStreamMux* self, BlobStreamTransferId transferId);
+BlobStreamLogicIn* blobStreamMuxFindIn(const BlobStreamMux* self, BlobStreamTransferId transferId);
+int blobStreamMuxRemoveOut(BlobStreamMux* self, BlobStreamTransferId transferId);
+int blobStreamMuxRemoveIn(BlobStreamMux* self, BlobStreamTransferId transferId);
+int blobStreamMuxReceive(BlobStreamMux* self, struct FldInStream* inStream);
+int blobStreamMuxSendIn(BlobStreamMux* self, MonotonicTimeMs now, FldOutStream* outStream);
+
+#endif
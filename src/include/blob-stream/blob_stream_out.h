@@ -7,6 +7,7 @@
 #define BLOB_STREAM_OUT_H
 
 #include <bit-array/bit_array.h>
+#include <blob-stream/chunk_geometry.h>
 #include <blob-stream/types.h>
 #include <clog/clog.h>
 #include <monotonic-time/monotonic_time.h>
@@ -17,38 +18,135 @@
 struct ImprintAllocatorWithFree;
 struct ImprintAllocator;
 
+#define BLOB_STREAM_OUT_MAX_RANGE_COUNT (BLOB_STREAM_MAX_REQUEST_RANGE_COUNT)
+#define BLOB_STREAM_OUT_NO_CHUNK (UINT32_MAX)
+#define BLOB_STREAM_OUT_MAX_TAIL_LOSS_PROBE_COUNT (2)
+
+typedef enum BlobStreamOutOrder {
+    BlobStreamOutOrderSequential,
+    BlobStreamOutOrderInterleaved,
+} BlobStreamOutOrder;
+
+typedef struct BlobStreamOutRange {
+    BlobStreamChunkId firstChunkId;
+    BlobStreamChunkId endChunkId;
+} BlobStreamOutRange;
+
+typedef struct BlobStreamOutRangeQueue {
+    BlobStreamOutRange ranges[BLOB_STREAM_OUT_MAX_RANGE_COUNT];
+    size_t head;
+    size_t count;
+} BlobStreamOutRangeQueue;
+
 typedef struct BlobStreamOutEntry {
     const uint8_t* octets;
     size_t octetCount;
     BlobStreamChunkId chunkId;
     MonotonicTimeMs lastSentAtTime;
     size_t sendCount;
+    MonotonicTimeMs deadline;
+    BlobStreamChunkId previousInFlight;
+    BlobStreamChunkId nextInFlight;
+    bool isInFlight;
     bool isReceived;
+    bool isExpired;
+    bool isPrepared;
+    uint8_t encoding;
+    uint8_t unchangedRunOctets[4];
 } BlobStreamOutEntry;
 
 typedef struct BlobStreamOut {
     size_t fixedChunkSize;
     size_t octetCount;
     size_t chunkCount;
+    size_t chunkCapacity;
+    BlobStreamChunkGeometry geometry;
     size_t sentChunkEntryCount;
+    size_t receivedChunkCount;
+    size_t receivedBeforeChunkId;
+    size_t expiredChunkCount;
+    size_t pendingExpiredChunkCount;
+    MonotonicTimeMs earliestDeadline;
+    BlobStreamChunkId inFlightHead;
+    BlobStreamChunkId inFlightTail;
+    BlobStreamOutOrder order;
+    size_t interleaveStride;
+    size_t nextOrderIndex;
+    size_t orderBlockFirstChunkId;
+    size_t orderBlockChunkCount;
+    bool isPullMode;
+    size_t receiveWindowEndChunkId;
+    BlobStreamOutRange priorityRanges[BLOB_STREAM_OUT_MAX_RANGE_COUNT];
+    size_t priorityRangeCount;
+    size_t priorityRangeIndex;
+    BlobStreamChunkId priorityChunkId;
+    BlobStreamOutRangeQueue requestedRanges;
     const uint8_t* blob;
     bool isComplete;
     BlobStreamOutEntry* entries;
     struct ImprintAllocatorWithFree* blobAllocator;
     MonotonicTimeMs thresholdForRedundancy;
+    MonotonicTimeMs smoothedRtt;
+    bool hasRtt;
+    bool isRttSamplePending;
+    MonotonicTimeMs rttSampleSentAt;
+    MonotonicTimeMs minProbeTimeout;
+    size_t tailProbeCount;
+    size_t tailProbeReceivedChunkCount;
+    size_t tailLossProbeCount;
+    uint64_t ticksPerSecond;
+    uint64_t pacingOctetsPerSecond;
+    uint64_t pacingCredit;
+    MonotonicTimeMs pacedAt;
+    size_t maxChunksPerSend;
+    uint8_t* compressionCache;
+    size_t compressionCacheOctetCount;
+    const uint8_t* baseline;
+    size_t baselineOctetCount;
+    BlobStreamBaselineId baselineId;
+    bool isDelta;
+    uint8_t* deltaCache;
     Clog log;
 } BlobStreamOut;
 
 void blobStreamOutInit(BlobStreamOut* self, struct ImprintAllocator* allocator,
                        struct ImprintAllocatorWithFree* blobAllocator, const uint8_t* octets, size_t totalOctetCount,
                        size_t fixedChunkSize, Clog log);
+size_t blobStreamOutStorageSize(size_t totalOctetCount, size_t fixedChunkSize);
+void blobStreamOutInitWithStorage(BlobStreamOut* self, void* storage, size_t storageSize, const uint8_t* octets,
+                                  size_t totalOctetCount, size_t fixedChunkSize, Clog log);
 void blobStreamOutDestroy(BlobStreamOut* self);
 void blobStreamOutReset(BlobStreamOut* self);
+int blobStreamOutReinit(BlobStreamOut* self, const uint8_t* octets, size_t totalOctetCount, size_t fixedChunkSize);
+size_t blobStreamOutMinChunkSize(const BlobStreamOut* self);
+int blobStreamOutSetCompressionCache(BlobStreamOut* self, uint8_t* cache, size_t cacheOctetCount);
+int blobStreamOutSetBaseline(BlobStreamOut* self, BlobStreamBaselineId baselineId, const uint8_t* baseline,
+                             size_t baselineOctetCount, uint8_t* deltaCache);
+int blobStreamOutSalvage(BlobStreamOut* self, BlobStreamTransferId previousTransferId, const BlobStreamOut* previous);
+void blobStreamOutPrecompress(BlobStreamOut* self);
 bool blobStreamOutIsComplete(const BlobStreamOut* self);
 bool blobStreamOutIsAllSent(const BlobStreamOut* self);
 void blobStreamOutMarkReceived(BlobStreamOut* self, BlobStreamChunkId everythingBeforeThis, BitArrayAtom maskReceived);
+void blobStreamOutMarkChunkReceived(BlobStreamOut* self, BlobStreamChunkId chunkId);
+void blobStreamOutSetPullMode(BlobStreamOut* self, bool isPullMode);
+void blobStreamOutSetReceiveWindow(BlobStreamOut* self, size_t endChunkId);
+void blobStreamOutSetTimeBase(BlobStreamOut* self, uint64_t ticksPerSecond);
+void blobStreamOutSetPacingRate(BlobStreamOut* self, uint64_t octetsPerSecond);
+void blobStreamOutSetTailLossProbe(BlobStreamOut* self, MonotonicTimeMs minProbeTimeout);
+MonotonicTimeMs blobStreamOutProbeTimeout(const BlobStreamOut* self);
+void blobStreamOutSetOrder(BlobStreamOut* self, BlobStreamOutOrder order);
+int blobStreamOutAddPriorityRange(BlobStreamOut* self, BlobStreamChunkId firstChunkId, size_t chunkCount);
+int blobStreamOutRequestChunks(BlobStreamOut* self, BlobStreamChunkId firstChunkId, size_t chunkCount);
 int blobStreamOutGetChunksToSend(BlobStreamOut* self, MonotonicTimeMs now, const BlobStreamOutEntry** resultEntries,
                                  size_t maxEntriesCount);
+int blobStreamOutGetChunksToSendLimited(BlobStreamOut* self, MonotonicTimeMs now,
+                                        const BlobStreamOutEntry** resultEntries, size_t maxEntriesCount,
+                                        size_t maxNewEntriesCount);
+int blobStreamOutSetDeadline(BlobStreamOut* self, BlobStreamChunkId firstChunkId, size_t chunkCount,
+                             MonotonicTimeMs deadline);
+bool blobStreamOutNextExpiredRange(const BlobStreamOut* self, size_t fromChunkId, size_t* firstChunkId,
+                                   size_t* chunkCount);
+size_t blobStreamOutInFlightCount(const BlobStreamOut* self);
 const char* blobStreamOutToString(const BlobStreamOut* self, char* buf, size_t maxBuf);
 
 #endif
@@ -0,0 +1,51 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/blob-stream
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef BLOB_STREAM_PIPELINE_H
+#define BLOB_STREAM_PIPELINE_H
+
+#include <blob-stream/blob_stream_logic_out.h>
+#include <blob-stream/blob_stream_scheduler.h>
+#include <clog/clog.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+struct ImprintAllocator;
+struct FldInStream;
+
+typedef void (*BlobStreamPipelineCompleteFn)(void* userData, BlobStreamTransferId transferId,
+                                             BlobStreamOut* blobStream, bool wasSuperseded);
+
+typedef struct BlobStreamPipelineTransfer {
+    BlobStreamLogicOut logic;
+    BlobStreamPipelineCompleteFn onComplete;
+    void* userData;
+    bool isCompleteNotified;
+} BlobStreamPipelineTransfer;
+
+typedef struct BlobStreamPipeline {
+    BlobStreamPipelineTransfer* transfers;
+    size_t capacity;
+    size_t head;
+    size_t count;
+    BlobStreamTransferId nextTransferId;
+    size_t maxInFlightOctetCount;
+    bool isLatestWins;
+    bool isSalvageEnabled;
+    Clog log;
+} BlobStreamPipeline;
+
+void blobStreamPipelineInit(BlobStreamPipeline* self, struct ImprintAllocator* memory, size_t capacity,
+                            BlobStreamTransferId firstTransferId, size_t maxInFlightOctetCount, Clog log);
+void blobStreamPipelineSetLatestWins(BlobStreamPipeline* self, bool isSalvageEnabled);
+BlobStreamLogicOut* blobStreamPipelineEnqueue(BlobStreamPipeline* self, BlobStreamOut* blobStream,
+                                              BlobStreamPipelineCompleteFn onComplete, void* userData);
+size_t blobStreamPipelineInFlightOctetCount(const BlobStreamPipeline* self);
+int blobStreamPipelinePrepareSend(BlobStreamPipeline* self, MonotonicTimeMs now, BlobStreamScheduledEntry* results,
+                                  size_t maxResultCount);
+int blobStreamPipelineReceive(BlobStreamPipeline* self, struct FldInStream* inStream);
+
+#endif
@@ -0,0 +1,46 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/blob-stream
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef BLOB_STREAM_POOL_H
+#define BLOB_STREAM_POOL_H
+
+#include <blob-stream/blob_stream_in.h>
+#include <blob-stream/blob_stream_out.h>
+
+struct ImprintAllocator;
+struct ImprintAllocatorWithFree;
+
+typedef struct BlobStreamInPool {
+    BlobStreamIn* streams;
+    BlobStreamIn** freeStreams;
+    size_t freeCount;
+    size_t capacity;
+    Clog log;
+} BlobStreamInPool;
+
+void blobStreamInPoolInit(BlobStreamInPool* self, struct ImprintAllocator* memory,
+                          struct ImprintAllocatorWithFree* blobAllocator, size_t streamCount, size_t maxOctetCount,
+                          size_t fixedChunkSize, Clog log);
+void blobStreamInPoolDestroy(BlobStreamInPool* self);
+BlobStreamIn* blobStreamInPoolAcquire(BlobStreamInPool* self, size_t octetCount, size_t fixedChunkSize);
+void blobStreamInPoolRelease(BlobStreamInPool* self, BlobStreamIn* stream);
+
+typedef struct BlobStreamOutPool {
+    BlobStreamOut* streams;
+    BlobStreamOut** freeStreams;
+    size_t freeCount;
+    size_t capacity;
+    Clog log;
+} BlobStreamOutPool;
+
+void blobStreamOutPoolInit(BlobStreamOutPool* self, struct ImprintAllocator* memory,
+                           struct ImprintAllocatorWithFree* blobAllocator, size_t streamCount, size_t maxOctetCount,
+                           size_t fixedChunkSize, Clog log);
+void blobStreamOutPoolDestroy(BlobStreamOutPool* self);
+BlobStreamOut* blobStreamOutPoolAcquire(BlobStreamOutPool* self, const uint8_t* octets, size_t octetCount,
+                                        size_t fixedChunkSize);
+void blobStreamOutPoolRelease(BlobStreamOutPool* self, BlobStreamOut* stream);
+
+#endif
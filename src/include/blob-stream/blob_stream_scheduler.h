@@ -0,0 +1,44 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/blob-stream
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef BLOB_STREAM_SCHEDULER_H
+#define BLOB_STREAM_SCHEDULER_H
+
+#include <blob-stream/blob_stream_logic_out.h>
+#include <clog/clog.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+struct ImprintAllocator;
+
+typedef struct BlobStreamSchedulerStream {
+    BlobStreamLogicOut* logic;
+    uint8_t priority;
+    size_t weight;
+    int64_t deficit;
+} BlobStreamSchedulerStream;
+
+typedef struct BlobStreamScheduledEntry {
+    BlobStreamLogicOut* logic;
+    const BlobStreamOutEntry* entry;
+} BlobStreamScheduledEntry;
+
+typedef struct BlobStreamScheduler {
+    BlobStreamSchedulerStream* streams;
+    size_t streamCount;
+    size_t capacity;
+    size_t quantumOctetCount;
+    size_t nextStreamIndex;
+    Clog log;
+} BlobStreamScheduler;
+
+void blobStreamSchedulerInit(BlobStreamScheduler* self, struct ImprintAllocator* memory, size_t capacity,
+                             size_t quantumOctetCount, Clog log);
+int blobStreamSchedulerAdd(BlobStreamScheduler* self, BlobStreamLogicOut* logic, uint8_t priority, size_t weight);
+int blobStreamSchedulerRemove(BlobStreamScheduler* self, const BlobStreamLogicOut* logic);
+int blobStreamSchedulerPrepareSend(BlobStreamScheduler* self, MonotonicTimeMs now, size_t octetBudget,
+                                   BlobStreamScheduledEntry* results, size_t maxResultCount);
+
+#endif
@@ -0,0 +1,28 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/blob-stream
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef BLOB_STREAM_SEGMENT_POOL_H
+#define BLOB_STREAM_SEGMENT_POOL_H
+
+#include <clog/clog.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+struct ImprintAllocator;
+
+typedef struct BlobStreamSegmentPool {
+    uint8_t** freeSegments;
+    size_t freeCount;
+    size_t segmentCount;
+    size_t segmentOctetSize;
+    Clog log;
+} BlobStreamSegmentPool;
+
+void blobStreamSegmentPoolInit(BlobStreamSegmentPool* self, struct ImprintAllocator* allocator,
+                               size_t segmentOctetSize, size_t segmentCount, Clog log);
+uint8_t* blobStreamSegmentPoolAlloc(BlobStreamSegmentPool* self);
+void blobStreamSegmentPoolFree(BlobStreamSegmentPool* self, uint8_t* segment);
+
+#endif
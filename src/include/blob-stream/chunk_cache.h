@@ -0,0 +1,45 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/blob-stream
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef BLOB_STREAM_CHUNK_CACHE_H
+#define BLOB_STREAM_CHUNK_CACHE_H
+
+#include <clog/clog.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+struct ImprintAllocator;
+
+typedef uint64_t BlobStreamChunkHash;
+
+typedef struct BlobStreamChunkCacheEntry {
+    BlobStreamChunkHash hash;
+    uint8_t* octets;
+    size_t octetCount;
+    uint32_t moreRecent;
+    uint32_t lessRecent;
+} BlobStreamChunkCacheEntry;
+
+typedef struct BlobStreamChunkCache {
+    BlobStreamChunkCacheEntry* entries;
+    uint32_t* table;
+    size_t tableMask;
+    size_t capacity;
+    size_t count;
+    size_t maxChunkOctetCount;
+    uint32_t mostRecent;
+    uint32_t leastRecent;
+    Clog log;
+} BlobStreamChunkCache;
+
+BlobStreamChunkHash blobStreamChunkHash(const uint8_t* octets, size_t octetCount);
+void blobStreamChunkCacheInit(BlobStreamChunkCache* self, struct ImprintAllocator* memory, size_t capacity,
+                              size_t maxChunkOctetCount, Clog log);
+void blobStreamChunkCacheClear(BlobStreamChunkCache* self);
+const BlobStreamChunkCacheEntry* blobStreamChunkCacheFind(BlobStreamChunkCache* self, BlobStreamChunkHash hash);
+void blobStreamChunkCacheInsert(BlobStreamChunkCache* self, BlobStreamChunkHash hash, const uint8_t* octets,
+                                size_t octetCount);
+
+#endif
@@ -0,0 +1,45 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/blob-stream
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef BLOB_STREAM_CHUNK_GEOMETRY_H
+#define BLOB_STREAM_CHUNK_GEOMETRY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/// Precalculated chunk layout of a blob, so the per chunk paths do not need any divisions.
+typedef struct BlobStreamChunkGeometry {
+    size_t fixedChunkSize;
+    size_t octetCount;
+    size_t chunkCount;
+    size_t lastChunkOctetCount;
+    uint8_t chunkShift;
+    bool isPowerOfTwo;
+} BlobStreamChunkGeometry;
+
+void blobStreamChunkGeometryInit(BlobStreamChunkGeometry* self, size_t octetCount, size_t fixedChunkSize);
+bool blobStreamIsPowerOfTwo(size_t value);
+uint8_t blobStreamLog2(size_t powerOfTwo);
+
+/// Calculates the octet offset of a chunk in the blob
+/// @param self chunk geometry
+/// @param chunkId the zero based index of the chunk
+/// @return octet offset
+static inline size_t blobStreamChunkGeometryOffset(const BlobStreamChunkGeometry* self, size_t chunkId)
+{
+    return self->isPowerOfTwo ? chunkId << self->chunkShift : chunkId * self->fixedChunkSize;
+}
+
+/// Returns the expected octet count of a chunk
+/// @param self chunk geometry
+/// @param chunkId the zero based index of the chunk
+/// @return fixedChunkSize for all chunks but the last one
+static inline size_t blobStreamChunkGeometryOctetCount(const BlobStreamChunkGeometry* self, size_t chunkId)
+{
+    return chunkId + 1 == self->chunkCount ? self->lastChunkOctetCount : self->fixedChunkSize;
+}
+
+#endif
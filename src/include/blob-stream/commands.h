@@ -11,5 +11,22 @@
 
 #define BLOB_STREAM_LOGIC_CMD_ACK_START_TRANSFER (0x03)
 #define BLOB_STREAM_LOGIC_CMD_ACK_CHUNK (0x04)
+#define BLOB_STREAM_LOGIC_CMD_SET_CHUNK_ENCODED (0x05)
+#define BLOB_STREAM_LOGIC_CMD_CHUNK_HASHES (0x06)
+#define BLOB_STREAM_LOGIC_CMD_ACK_CHUNK_HASHES (0x07)
+#define BLOB_STREAM_LOGIC_CMD_RESUME_TRANSFER (0x08)
+#define BLOB_STREAM_LOGIC_CMD_CHUNKS_EXPIRED (0x09)
+#define BLOB_STREAM_LOGIC_CMD_REQUEST_CHUNKS (0x0A)
+#define BLOB_STREAM_LOGIC_CMD_SET_CHUNKS_COMPACT (0x0B)
+#define BLOB_STREAM_LOGIC_CMD_ACK_CHUNK_COMPACT (0x0C)
+
+#define BLOB_STREAM_CHUNK_ENCODING_RAW (0x00)
+#define BLOB_STREAM_CHUNK_ENCODING_LZ (0x01)
+#define BLOB_STREAM_CHUNK_ENCODING_XOR (0x02)
+#define BLOB_STREAM_CHUNK_ENCODING_UNCHANGED (0x04)
+
+#define BLOB_STREAM_START_TRANSFER_FLAG_DELTA (0x01)
+#define BLOB_STREAM_START_TRANSFER_FLAG_COMPACT (0x02)
+#define BLOB_STREAM_START_TRANSFER_FLAG_NO_TRANSFER_ID (0x04)
 
 #endif
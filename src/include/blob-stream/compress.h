@@ -0,0 +1,16 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/blob-stream
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef BLOB_STREAM_COMPRESS_H
+#define BLOB_STREAM_COMPRESS_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+int blobStreamCompress(const uint8_t* source, size_t sourceOctetCount, uint8_t* target, size_t targetMaxOctetCount);
+int blobStreamDecompress(const uint8_t* source, size_t sourceOctetCount, uint8_t* target,
+                         size_t targetMaxOctetCount);
+
+#endif
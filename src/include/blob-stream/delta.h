@@ -0,0 +1,16 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/blob-stream
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef BLOB_STREAM_DELTA_H
+#define BLOB_STREAM_DELTA_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+bool blobStreamOctetsAreEqual(const uint8_t* a, const uint8_t* b, size_t octetCount);
+void blobStreamXorOctets(uint8_t* target, const uint8_t* a, const uint8_t* b, size_t octetCount);
+
+#endif
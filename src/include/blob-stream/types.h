@@ -8,9 +8,20 @@
 
 #define BLOB_STREAM_CHUNK_SIZE (1024)
 #define BLOB_STREAM_MAX_WINDOW_COUNT (512)
+#define BLOB_STREAM_STORAGE_ALIGNMENT (64)
+#define BLOB_STREAM_MAX_CHUNK_SIZE (65535)
+#define BLOB_STREAM_SET_CHUNK_HEADER_OCTET_SIZE (1 + 2 + 4 + 2)
+#define BLOB_STREAM_SET_CHUNK_ENCODED_HEADER_OCTET_SIZE (BLOB_STREAM_SET_CHUNK_HEADER_OCTET_SIZE + 1)
+#define BLOB_STREAM_MAX_REQUEST_RANGE_COUNT (8)
 
-typedef uint16_t BlobStreamChunkId;
+// Ticks per second of the time values passed to the blob streams
+#define BLOB_STREAM_TIME_BASE_MILLISECONDS (1000)
+#define BLOB_STREAM_TIME_BASE_MICROSECONDS (1000000)
+#define BLOB_STREAM_TIME_BASE_NANOSECONDS (1000000000)
+
+typedef uint32_t BlobStreamChunkId;
 typedef uint16_t BlobStreamTransferId;
+typedef uint32_t BlobStreamBaselineId;
 
 #endif
 
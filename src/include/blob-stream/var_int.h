@@ -0,0 +1,23 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/blob-stream
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef BLOB_STREAM_VAR_INT_H
+#define BLOB_STREAM_VAR_INT_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+struct FldInStream;
+struct FldOutStream;
+
+#define BLOB_STREAM_VAR_INT_MAX_OCTET_SIZE (10)
+
+size_t blobStreamVarIntOctetCount(uint64_t value);
+int blobStreamVarIntWrite(struct FldOutStream* outStream, uint64_t value);
+int blobStreamVarIntRead(struct FldInStream* inStream, uint64_t* value);
+uint64_t blobStreamZigZagEncode(int64_t value);
+int64_t blobStreamZigZagDecode(uint64_t value);
+
+#endif
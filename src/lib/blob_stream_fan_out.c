@@ -0,0 +1,278 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/blob-stream
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include <blob-stream/blob_stream_fan_out.h>
+#include <blob-stream/commands.h>
+#include <flood/in_stream.h>
+#include <imprint/allocator.h>
+
+#define BLOB_STREAM_FAN_OUT_MAX_PREFERRED_COUNT (BLOB_STREAM_OUT_MAX_RANGE_COUNT)
+
+/// Initializes sending of one blob to a group of receivers over a shared channel
+/// Every chunk is sent once to the group. The BLOB_STREAM_LOGIC_CMD_ACK_CHUNK from every receiver is aggregated,
+/// and a chunk is only considered received when all receivers that are not evicted have it.
+/// All receivers must use transferId and be known before anything is sent.
+/// @param self fan out
+/// @param memory allocator for the per receiver and per chunk book keeping
+/// @param blobStream the blob stream sent to the group
+/// @param transferId the transfer id for the group
+/// @param receiverCount the number of receivers in the group
+/// @param log the log to use
+void blobStreamFanOutInit(BlobStreamFanOut* self, struct ImprintAllocator* memory, BlobStreamOut* blobStream,
+                          BlobStreamTransferId transferId, size_t receiverCount, Clog log)
+{
+    size_t chunkCount = blobStream->chunkCount;
+    self->log = log;
+    self->blobStream = blobStream;
+    self->transferId = transferId;
+    self->receiverCount = receiverCount;
+    self->atomsPerReceiver = (chunkCount + 63) / 64;
+    self->receivers = IMPRINT_ALLOC_TYPE_COUNT(memory, BlobStreamFanOutReceiver, receiverCount);
+    self->receivedBits = IMPRINT_ALLOC_TYPE_COUNT(memory, uint64_t, receiverCount * self->atomsPerReceiver);
+    self->missingCounts = IMPRINT_ALLOC_TYPE_COUNT(memory, uint32_t, chunkCount);
+    self->evictedCount = 0;
+
+    for (size_t i = 0; i < receiverCount; ++i) {
+        self->receivers[i].receivedBeforeChunkId = 0;
+        self->receivers[i].receivedChunkCount = 0;
+        self->receivers[i].isEvicted = false;
+    }
+    for (size_t i = 0; i < receiverCount * self->atomsPerReceiver; ++i) {
+        self->receivedBits[i] = 0;
+    }
+    for (size_t i = 0; i < chunkCount; ++i) {
+        self->missingCounts[i] = (uint32_t) receiverCount;
+    }
+
+    blobStreamFanOutSetStragglerPolicy(self, 3, receiverCount / 100 > 1 ? receiverCount / 100 : 1);
+}
+
+/// Sets when receivers are evicted from the group
+/// A chunk that has been sent maxGroupSendCount times to the group and is still missing at maxStragglerCount
+/// receivers or fewer, evicts those receivers. The group no longer waits for them, and they should be repaired
+/// with unicast, see blobStreamFanOutPrepareUnicast().
+/// @param self fan out
+/// @param maxGroupSendCount the number of group sends of a chunk before the stragglers are evicted
+/// @param maxStragglerCount the maximum number of receivers that are evicted for one chunk
+void blobStreamFanOutSetStragglerPolicy(BlobStreamFanOut* self, size_t maxGroupSendCount, size_t maxStragglerCount)
+{
+    self->maxGroupSendCount = maxGroupSendCount;
+    self->maxStragglerCount = maxStragglerCount;
+}
+
+static bool hasChunk(const BlobStreamFanOut* self, size_t receiverIndex, size_t chunkId)
+{
+    const uint64_t* bits = self->receivedBits + receiverIndex * self->atomsPerReceiver;
+    return (bits[chunkId / 64] >> (chunkId % 64)) & 1;
+}
+
+static void chunkNoLongerMissing(BlobStreamFanOut* self, size_t chunkId)
+{
+    if (--self->missingCounts[chunkId] == 0) {
+        blobStreamOutMarkChunkReceived(self->blobStream, (BlobStreamChunkId) chunkId);
+    }
+}
+
+static void markReceiverChunk(BlobStreamFanOut* self, size_t receiverIndex, size_t chunkId)
+{
+    uint64_t* bits = self->receivedBits + receiverIndex * self->atomsPerReceiver;
+    uint64_t mask = (uint64_t) 1 << (chunkId % 64);
+    if (bits[chunkId / 64] & mask) {
+        return;
+    }
+    bits[chunkId / 64] |= mask;
+    self->receivers[receiverIndex].receivedChunkCount++;
+    chunkNoLongerMissing(self, chunkId);
+}
+
+/// Receives a BLOB_STREAM_LOGIC_CMD_ACK_CHUNK from a receiver in the group
+/// Acks from evicted receivers are ignored.
+/// @param self fan out
+/// @param receiverIndex the receiver that sent the ack
+/// @param inStream stream to read from
+/// @return negative on error
+int blobStreamFanOutReceive(BlobStreamFanOut* self, size_t receiverIndex, struct FldInStream* inStream)
+{
+    uint8_t cmd;
+    int cmdErr = fldInStreamReadUInt8(inStream, &cmd);
+    if (cmdErr < 0) {
+        return cmdErr;
+    }
+
+    if (cmd != BLOB_STREAM_LOGIC_CMD_ACK_CHUNK) {
+        CLOG_C_SOFT_ERROR(&self->log, "fan out can only receive ack chunk, got %02X", cmd)
+        return -2;
+    }
+
+    BlobStreamTransferId transferId;
+    uint32_t waitingForChunkId;
+    uint64_t receiveMask;
+    fldInStreamReadUInt16(inStream, &transferId);
+    fldInStreamReadUInt32(inStream, &waitingForChunkId);
+    fldInStreamReadUInt64(inStream, &receiveMask);
+    // The group channel is not flow controlled, so the receive window is not used
+    uint32_t receiveWindowEndChunkId;
+    int windowErr = fldInStreamReadUInt32(inStream, &receiveWindowEndChunkId);
+    if (windowErr < 0) {
+        return windowErr;
+    }
+
+    if (transferId != self->transferId) {
+        CLOG_C_SOFT_ERROR(&self->log, "ack chunk for wrong transferId %04X vs %04X", transferId, self->transferId)
+        return -1;
+    }
+
+    size_t chunkCount = self->blobStream->chunkCount;
+    if (receiverIndex >= self->receiverCount || waitingForChunkId > chunkCount) {
+        CLOG_C_SOFT_ERROR(&self->log, "illegal ack from receiver %zu waiting for %04X", receiverIndex,
+                          waitingForChunkId)
+        return -3;
+    }
+
+    BlobStreamFanOutReceiver* receiver = &self->receivers[receiverIndex];
+    if (receiver->isEvicted) {
+        return 0;
+    }
+
+    for (size_t i = receiver->receivedBeforeChunkId; i < waitingForChunkId; ++i) {
+        markReceiverChunk(self, receiverIndex, i);
+    }
+    if (waitingForChunkId > receiver->receivedBeforeChunkId) {
+        receiver->receivedBeforeChunkId = waitingForChunkId;
+    }
+
+    for (size_t i = 0; receiveMask != 0 && i < 64; ++i, receiveMask >>= 1) {
+        size_t chunkId = waitingForChunkId + i + 1;
+        if (chunkId >= chunkCount) {
+            break;
+        }
+        if (receiveMask & 1) {
+            markReceiverChunk(self, receiverIndex, chunkId);
+        }
+    }
+
+    return 0;
+}
+
+static void evictReceiver(BlobStreamFanOut* self, size_t receiverIndex)
+{
+    CLOG_C_NOTICE(&self->log, "evicting straggler %zu with %zu chunks received", receiverIndex,
+                  self->receivers[receiverIndex].receivedChunkCount)
+    self->receivers[receiverIndex].isEvicted = true;
+    self->evictedCount++;
+    for (size_t chunkId = 0; chunkId < self->blobStream->chunkCount; ++chunkId) {
+        if (!hasChunk(self, receiverIndex, chunkId)) {
+            chunkNoLongerMissing(self, chunkId);
+        }
+    }
+}
+
+static void evictStragglers(BlobStreamFanOut* self, size_t chunkId)
+{
+    for (size_t i = 0; i < self->receiverCount && self->missingCounts[chunkId] > 0; ++i) {
+        if (!self->receivers[i].isEvicted && !hasChunk(self, i, chunkId)) {
+            evictReceiver(self, i);
+        }
+    }
+}
+
+/// Calculates which chunks to send to the group
+/// Of the chunks that are due for a resend, the ones that are missing at the most receivers are sent first.
+/// Stragglers are evicted before that, see blobStreamFanOutSetStragglerPolicy().
+/// @param self fan out
+/// @param now the current time
+/// @param entries the target entries
+/// @param maxEntriesCount maximum number of entries to fill
+/// @return the number of entries filled, or negative on error
+int blobStreamFanOutPrepareSend(BlobStreamFanOut* self, MonotonicTimeMs now, const BlobStreamOutEntry* entries[],
+                                size_t maxEntriesCount)
+{
+    BlobStreamOut* blobStream = self->blobStream;
+    size_t preferredCount = maxEntriesCount < BLOB_STREAM_FAN_OUT_MAX_PREFERRED_COUNT
+                                ? maxEntriesCount
+                                : BLOB_STREAM_FAN_OUT_MAX_PREFERRED_COUNT;
+    BlobStreamChunkId stragglerChunkIds[BLOB_STREAM_FAN_OUT_MAX_PREFERRED_COUNT];
+    size_t stragglerChunkCount = 0;
+    BlobStreamChunkId preferred[BLOB_STREAM_FAN_OUT_MAX_PREFERRED_COUNT];
+    size_t preferredFoundCount = 0;
+
+    // Evicting changes the in flight list, so the straggler chunks are only collected here
+    for (BlobStreamChunkId chunkId = blobStream->inFlightHead; chunkId != BLOB_STREAM_OUT_NO_CHUNK;
+         chunkId = blobStream->entries[chunkId].nextInFlight) {
+        const BlobStreamOutEntry* entry = &blobStream->entries[chunkId];
+        if (now - entry->lastSentAtTime <= blobStream->thresholdForRedundancy) {
+            break;
+        }
+        uint32_t missingCount = self->missingCounts[chunkId];
+        if (entry->sendCount >= self->maxGroupSendCount && missingCount <= self->maxStragglerCount) {
+            if (stragglerChunkCount < BLOB_STREAM_FAN_OUT_MAX_PREFERRED_COUNT) {
+                stragglerChunkIds[stragglerChunkCount++] = chunkId;
+            }
+            continue;
+        }
+
+        // Keep the due chunks that are missing at most receivers, sorted with the most missing first
+        size_t insertIndex = preferredFoundCount;
+        while (insertIndex > 0 && self->missingCounts[preferred[insertIndex - 1]] < missingCount) {
+            if (insertIndex < preferredCount) {
+                preferred[insertIndex] = preferred[insertIndex - 1];
+            }
+            insertIndex--;
+        }
+        if (insertIndex < preferredCount) {
+            preferred[insertIndex] = chunkId;
+            if (preferredFoundCount < preferredCount) {
+                preferredFoundCount++;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < stragglerChunkCount; ++i) {
+        evictStragglers(self, stragglerChunkIds[i]);
+    }
+
+    for (size_t i = 0; i < preferredFoundCount; ++i) {
+        if (!blobStream->entries[preferred[i]].isReceived) {
+            blobStreamOutRequestChunks(blobStream, preferred[i], 1);
+        }
+    }
+
+    return blobStreamOutGetChunksToSend(blobStream, now, entries, maxEntriesCount);
+}
+
+/// Prepares a unicast blob stream for repairing an evicted receiver
+/// The chunks that the receiver has acknowledged to the group are marked as received, so only the missing
+/// chunks are sent. The unicast blob stream must have the same payload and chunk size as the group.
+/// @param self fan out
+/// @param receiverIndex the evicted receiver
+/// @param unicast the blob stream to send to the receiver only
+/// @return the number of chunks that needs to be repaired, or negative on error
+int blobStreamFanOutPrepareUnicast(const BlobStreamFanOut* self, size_t receiverIndex, BlobStreamOut* unicast)
+{
+    if (unicast->chunkCount != self->blobStream->chunkCount ||
+        unicast->fixedChunkSize != self->blobStream->fixedChunkSize) {
+        CLOG_C_SOFT_ERROR(&self->log, "unicast blob stream does not match the group")
+        return -1;
+    }
+
+    size_t missingCount = 0;
+    for (size_t chunkId = 0; chunkId < unicast->chunkCount; ++chunkId) {
+        if (hasChunk(self, receiverIndex, chunkId)) {
+            blobStreamOutMarkChunkReceived(unicast, (BlobStreamChunkId) chunkId);
+        } else {
+            missingCount++;
+        }
+    }
+
+    return (int) missingCount;
+}
+
+/// Checks if every receiver that is not evicted has received the blob
+/// @param self fan out
+/// @return true if complete
+bool blobStreamFanOutIsComplete(const BlobStreamFanOut* self)
+{
+    return blobStreamOutIsComplete(self->blobStream);
+}
@@ -4,7 +4,36 @@
  *--------------------------------------------------------------------------------------------------------*/
 
 #include <blob-stream/blob_stream_in.h>
+#include <blob-stream/blob_stream_segment_pool.h>
+#include <blob-stream/commands.h>
+#include <blob-stream/compress.h>
+#include <blob-stream/delta.h>
+#include <flood/in_stream.h>
+#include <flood/out_stream.h>
+#include <imprint/linear_allocator.h>
 #include <imprint/tagged_allocator.h>
+#include <inttypes.h>
+
+static void setGeometry(BlobStreamIn* self, size_t octetCount, size_t fixedChunkSize)
+{
+    self->octetCount = octetCount;
+    self->fixedChunkSize = fixedChunkSize;
+    self->receivedChunkCount = 0;
+    self->expiredChunkCount = 0;
+    self->baseline = 0;
+    self->baselineOctetCount = 0;
+    blobStreamChunkGeometryInit(&self->geometry, octetCount, fixedChunkSize);
+    if (self->segmentPool != 0) {
+        self->chunksPerSegment = self->segmentPool->segmentOctetSize / fixedChunkSize;
+        self->isChunksPerSegmentPowerOfTwo = blobStreamIsPowerOfTwo(self->chunksPerSegment);
+        self->chunksPerSegmentShift = self->isChunksPerSegmentPowerOfTwo ? blobStreamLog2(self->chunksPerSegment)
+                                                                         : 0;
+    } else {
+        self->chunksPerSegment = 0;
+        self->isChunksPerSegmentPowerOfTwo = false;
+        self->chunksPerSegmentShift = 0;
+    }
+}
 
 /// Initialize a blob stream
 /// Allocates memory for a blob stream which is later defined by calling
@@ -22,22 +51,211 @@ void blobStreamInInit(BlobStreamIn* self, struct ImprintAllocator* memory,
 {
     self->log = log;
     self->blob = IMPRINT_ALLOC((ImprintAllocator*) blobAllocator, octetCount, "blob stream in payload");
-    self->octetCount = octetCount;
-    self->fixedChunkSize = fixedChunkSize;
+    self->octetCapacity = octetCount;
     self->isComplete = false;
     self->blobAllocator = blobAllocator;
-    size_t chunkCount = (octetCount + self->fixedChunkSize - 1) / self->fixedChunkSize;
-    bitArrayInit(&self->bitArray, memory, chunkCount);
+    self->segmentPool = 0;
+    self->segments = 0;
+    self->segmentCount = 0;
+    setGeometry(self, octetCount, fixedChunkSize);
+    self->chunkCapacity = self->geometry.chunkCount;
+    bitArrayInit(&self->bitArray, memory, self->geometry.chunkCount);
+    bitArrayInit(&self->expiredBitArray, memory, self->geometry.chunkCount);
 
     CLOG_C_VERBOSE(&self->log, "initialize. Expecting %zu octets", self->octetCount)
 }
 
+/// Initialize a blob stream that stores the chunks in segments
+/// Instead of one contiguous allocation of the whole blob, the chunks are stored
+/// in fixed size segments taken from the segmentPool when the first chunk in that segment arrives.
+/// @param self incoming blob stream
+/// @param memory allocator for things that are not explicitly freed
+/// @param segmentPool the pool to take segments from. Segments are returned in blobStreamInDestroy().
+/// @param linearizeAllocator if set, the blob is linearized with this allocator as soon as it is complete.
+/// @param octetCount the total size of the blob to be received.
+/// @param fixedChunkSize the size of each chunk. segmentOctetSize must be a multiple of it.
+void blobStreamInInitSegmented(BlobStreamIn* self, struct ImprintAllocator* memory,
+                               struct BlobStreamSegmentPool* segmentPool,
+                               struct ImprintAllocatorWithFree* linearizeAllocator, size_t octetCount,
+                               size_t fixedChunkSize, Clog log)
+{
+    CLOG_ASSERT(segmentPool->segmentOctetSize % fixedChunkSize == 0,
+                "segment size %zu must be a multiple of chunk size %zu", segmentPool->segmentOctetSize,
+                fixedChunkSize)
+
+    self->log = log;
+    self->blob = 0;
+    self->isComplete = false;
+    self->blobAllocator = linearizeAllocator;
+    self->segmentPool = segmentPool;
+    setGeometry(self, octetCount, fixedChunkSize);
+    self->segmentCount = (octetCount + segmentPool->segmentOctetSize - 1) / segmentPool->segmentOctetSize;
+    self->segments = IMPRINT_ALLOC_TYPE_COUNT(memory, uint8_t*, self->segmentCount);
+    for (size_t i = 0; i < self->segmentCount; ++i) {
+        self->segments[i] = 0;
+    }
+    self->octetCapacity = self->segmentCount * segmentPool->segmentOctetSize;
+    self->chunkCapacity = self->geometry.chunkCount;
+    bitArrayInit(&self->bitArray, memory, self->geometry.chunkCount);
+    bitArrayInit(&self->expiredBitArray, memory, self->geometry.chunkCount);
+
+    CLOG_C_VERBOSE(&self->log, "initialize segmented. Expecting %zu octets in %zu segments", self->octetCount,
+                   self->segmentCount)
+}
+
+static size_t alignStorage(size_t octetCount)
+{
+    return (octetCount + BLOB_STREAM_STORAGE_ALIGNMENT - 1) & ~((size_t) BLOB_STREAM_STORAGE_ALIGNMENT - 1);
+}
+
+static size_t bookKeepingStorageSize(size_t chunkCount)
+{
+    size_t atomCount = (chunkCount + BIT_ARRAY_BITS_IN_ATOM - 1) / BIT_ARRAY_BITS_IN_ATOM;
+    return 2 * alignStorage(atomCount * sizeof(BitArrayAtom)) + BLOB_STREAM_STORAGE_ALIGNMENT;
+}
+
+/// Calculates the number of octets needed for blobStreamInInitWithStorage()
+/// @param octetCount the total size of the blob to be received.
+/// @param fixedChunkSize the size of each chunk.
+/// @return the number of octets needed for the storage
+size_t blobStreamInStorageSize(size_t octetCount, size_t fixedChunkSize)
+{
+    size_t chunkCount = (octetCount + fixedChunkSize - 1) / fixedChunkSize;
+    return alignStorage(octetCount) + bookKeepingStorageSize(chunkCount);
+}
+
+/// Initialize a blob stream where the payload and book keeping is placed in caller provided storage
+/// The payload is placed first in the storage, followed by the bit arrays. Nothing is allocated
+/// and nothing is freed in blobStreamInDestroy().
+/// @param self incoming blob stream
+/// @param storage storage aligned to BLOB_STREAM_STORAGE_ALIGNMENT
+/// @param storageSize size of storage, must be at least blobStreamInStorageSize()
+/// @param octetCount the total size of the blob to be received.
+/// @param fixedChunkSize the size of each chunk.
+void blobStreamInInitWithStorage(BlobStreamIn* self, void* storage, size_t storageSize, size_t octetCount,
+                                 size_t fixedChunkSize, Clog log)
+{
+    CLOG_ASSERT(((uintptr_t) storage & (BLOB_STREAM_STORAGE_ALIGNMENT - 1)) == 0, "storage must be aligned")
+    CLOG_ASSERT(storageSize >= blobStreamInStorageSize(octetCount, fixedChunkSize), "storage is too small %zu",
+                storageSize)
+
+    uint8_t* octets = (uint8_t*) storage;
+    size_t chunkCount = (octetCount + fixedChunkSize - 1) / fixedChunkSize;
+    size_t payloadStorageSize = alignStorage(octetCount);
+
+    self->log = log;
+    self->blob = octets;
+    self->octetCapacity = octetCount;
+    self->isComplete = false;
+    self->blobAllocator = 0;
+    self->segmentPool = 0;
+    self->segments = 0;
+    self->segmentCount = 0;
+    setGeometry(self, octetCount, fixedChunkSize);
+    self->chunkCapacity = chunkCount;
+
+    ImprintLinearAllocator bookKeeping;
+    imprintLinearAllocatorInit(&bookKeeping, octets + payloadStorageSize, bookKeepingStorageSize(chunkCount),
+                               "blob stream in book keeping");
+    bitArrayInit(&self->bitArray, &bookKeeping.info, chunkCount);
+    bitArrayInit(&self->expiredBitArray, &bookKeeping.info, chunkCount);
+
+    CLOG_C_VERBOSE(&self->log, "initialize in storage. Expecting %zu octets", self->octetCount)
+}
+
+static void releaseSegments(BlobStreamIn* self)
+{
+    for (size_t i = 0; i < self->segmentCount; ++i) {
+        if (self->segments[i] != 0) {
+            blobStreamSegmentPoolFree(self->segmentPool, self->segments[i]);
+            self->segments[i] = 0;
+        }
+    }
+}
+
 /// Frees the blob memory
+/// Segments, if any, are returned to the segment pool.
 void blobStreamInDestroy(BlobStreamIn* self)
 {
-    IMPRINT_FREE(self->blobAllocator, self->blob);
+    if (self->segmentPool != 0) {
+        releaseSegments(self);
+    }
+    if (self->blob != 0 && self->blobAllocator != 0) {
+        IMPRINT_FREE(self->blobAllocator, self->blob);
+    }
     self->blob = 0;
     bitArrayDestroy(&self->bitArray);
+    bitArrayDestroy(&self->expiredBitArray);
+}
+
+/// Clears the received state so the blob stream can be reused for a new transfer of the same size
+/// No memory is allocated. For a segmented blob stream, the segments are returned to the segment pool and the
+/// linearized blob (see blobStreamInLinearize()) is freed. The baseline is cleared.
+/// @param self incoming blob stream
+void blobStreamInReset(BlobStreamIn* self)
+{
+    if (self->segmentPool != 0) {
+        if (self->blob != 0) {
+            IMPRINT_FREE(self->blobAllocator, self->blob);
+            self->blob = 0;
+        }
+        releaseSegments(self);
+    }
+    bitArrayReset(&self->bitArray);
+    bitArrayReset(&self->expiredBitArray);
+    self->receivedChunkCount = 0;
+    self->expiredChunkCount = 0;
+    self->baseline = 0;
+    self->baselineOctetCount = 0;
+    self->isComplete = false;
+}
+
+/// Reuses the blob stream for a new transfer of the same or smaller size
+/// The payload, bit array and segment table from the original init are reused.
+/// @param self incoming blob stream
+/// @param octetCount the total size of the blob to be received.
+/// @param fixedChunkSize the size of each chunk.
+/// @return negative if the new transfer does not fit in the original allocation
+int blobStreamInReinit(BlobStreamIn* self, size_t octetCount, size_t fixedChunkSize)
+{
+    size_t chunkCount = (octetCount + fixedChunkSize - 1) / fixedChunkSize;
+    if (octetCount > self->octetCapacity || chunkCount > self->chunkCapacity) {
+        CLOG_C_SOFT_ERROR(&self->log, "can not reinit to %zu octets, capacity is %zu", octetCount,
+                          self->octetCapacity)
+        return -1;
+    }
+
+    if (self->segmentPool != 0 && self->segmentPool->segmentOctetSize % fixedChunkSize != 0) {
+        CLOG_C_SOFT_ERROR(&self->log, "chunk size %zu does not fit segment size", fixedChunkSize)
+        return -2;
+    }
+
+    blobStreamInReset(self);
+
+    setGeometry(self, octetCount, fixedChunkSize);
+    if (self->segmentPool != 0) {
+        size_t segmentOctetSize = self->segmentPool->segmentOctetSize;
+        self->segmentCount = (octetCount + segmentOctetSize - 1) / segmentOctetSize;
+    }
+    // The bit arrays keep the original capacity. The bits after chunkCount are never set, so the first unset bit
+    // is still the first missing chunk.
+
+    CLOG_C_VERBOSE(&self->log, "reinit. Expecting %zu octets", self->octetCount)
+
+    return 0;
+}
+
+/// Sets the baseline for a delta transfer
+/// Chunks that the sender reports as unchanged are copied from the baseline and XOR:ed chunks are
+/// applied on top of it. Must be called before any chunks are received.
+/// @param self incoming blob stream
+/// @param baseline the baseline payload, must be valid until the blob stream is complete
+/// @param baselineOctetCount the number of octets in the baseline
+void blobStreamInSetBaseline(BlobStreamIn* self, const uint8_t* baseline, size_t baselineOctetCount)
+{
+    CLOG_ASSERT(self->receivedChunkCount == 0, "baseline must be set before chunks are received")
+    self->baseline = baseline;
+    self->baselineOctetCount = baselineOctetCount;
 }
 
 /// Checks if the blob stream is complete
@@ -48,6 +266,55 @@ bool blobStreamInIsComplete(const BlobStreamIn* self)
     return self->isComplete;
 }
 
+static size_t segmentIndexForChunk(const BlobStreamIn* self, BlobStreamChunkId chunkId, size_t* indexInSegment)
+{
+    if (self->isChunksPerSegmentPowerOfTwo) {
+        *indexInSegment = chunkId & (self->chunksPerSegment - 1);
+        return chunkId >> self->chunksPerSegmentShift;
+    }
+
+    *indexInSegment = chunkId % self->chunksPerSegment;
+    return chunkId / self->chunksPerSegment;
+}
+
+static uint8_t* chunkTarget(BlobStreamIn* self, BlobStreamChunkId chunkId)
+{
+    if (bitArrayIsSet(&self->bitArray, chunkId)) {
+        CLOG_C_VERBOSE(&self->log, "chunkId %" PRIu32 " is already received", chunkId)
+        return 0;
+    }
+
+    if (self->blob != 0) {
+        return self->blob + blobStreamChunkGeometryOffset(&self->geometry, chunkId);
+    }
+
+    size_t indexInSegment;
+    size_t segmentIndex = segmentIndexForChunk(self, chunkId, &indexInSegment);
+    if (self->segments[segmentIndex] == 0) {
+        self->segments[segmentIndex] = blobStreamSegmentPoolAlloc(self->segmentPool);
+        if (self->segments[segmentIndex] == 0) {
+            CLOG_C_SOFT_ERROR(&self->log, "no free segment, dropping chunkId %" PRIu32, chunkId)
+            return 0;
+        }
+    }
+
+    return self->segments[segmentIndex] + blobStreamChunkGeometryOffset(&self->geometry, indexInSegment);
+}
+
+static void markChunkReceived(BlobStreamIn* self, BlobStreamChunkId chunkId)
+{
+    bitArraySet(&self->bitArray, chunkId);
+    self->receivedChunkCount++;
+
+    if (self->receivedChunkCount == self->geometry.chunkCount) {
+        CLOG_C_VERBOSE(&self->log, "stream is complete")
+        self->isComplete = true;
+        if (self->segmentPool != 0 && self->blobAllocator != 0) {
+            blobStreamInLinearize(self, self->blobAllocator);
+        }
+    }
+}
+
 /// Sets a received chunk (part) to the blob memory
 /// @param self incoming blob stream
 /// @param chunkId the zero based index of the chunk
@@ -56,38 +323,417 @@ bool blobStreamInIsComplete(const BlobStreamIn* self)
 /// fixedChunkSize, apart from maybe the last chunk.
 void blobStreamInSetChunk(BlobStreamIn* self, BlobStreamChunkId chunkId, const uint8_t* octets, size_t octetCount)
 {
-    size_t offset = chunkId * self->fixedChunkSize;
-    if (offset + octetCount > self->octetCount) {
+    const BlobStreamChunkGeometry* geometry = &self->geometry;
+    if (chunkId >= geometry->chunkCount) {
         CLOG_C_ERROR(&self->log, "blobStreamInSetChunk overwrite")
+        return;
     }
 
-    uint8_t* target = self->blob + offset;
+    CLOG_C_VERBOSE(&self->log, "setChunk chunkId: %" PRIu32 " octetCount: %zu", chunkId, octetCount)
+
+    size_t expectedOctetCount = blobStreamChunkGeometryOctetCount(geometry, chunkId);
+    if (octetCount != expectedOctetCount) {
+        CLOG_C_ERROR(&self->log, "chunk size must be exactly %zu, but was %zu", expectedOctetCount, octetCount)
+        return;
+    }
 
-    CLOG_C_VERBOSE(&self->log, "setChunk chunkId: %hu octetCount: %zu", chunkId, octetCount)
+    uint8_t* target = chunkTarget(self, chunkId);
+    if (target == 0) {
+        return;
+    }
 
-    if (chunkId == self->bitArray.bitCount - 1) {
-        size_t expectedLastChunkSize = (self->octetCount % self->fixedChunkSize);
-        if (expectedLastChunkSize == 0) {
-            expectedLastChunkSize = self->fixedChunkSize;
+    tc_memcpy_octets(target, octets, octetCount);
+
+    markChunkReceived(self, chunkId);
+}
+
+/// Gives up on chunks that the sender will never send, since their deadline has passed
+/// The chunks that are not already received are zero filled and counted as received, so the blob stream can
+/// still complete. Use blobStreamInIsChunkExpired() to find the holes.
+/// @param self incoming blob stream
+/// @param firstChunkId the first chunk in the range
+/// @param chunkCount the number of chunks in the range
+/// @return the number of chunks that expired, or negative on error
+int blobStreamInExpireChunks(BlobStreamIn* self, BlobStreamChunkId firstChunkId, size_t chunkCount)
+{
+    if ((size_t) firstChunkId + chunkCount > self->geometry.chunkCount) {
+        CLOG_C_SOFT_ERROR(&self->log, "illegal expire range %" PRIu32 " count %zu", firstChunkId, chunkCount)
+        return -1;
+    }
+
+    size_t expiredCount = 0;
+    for (size_t i = 0; i < chunkCount; ++i) {
+        BlobStreamChunkId chunkId = firstChunkId + (BlobStreamChunkId) i;
+        if (bitArrayIsSet(&self->bitArray, chunkId)) {
+            continue;
         }
-        if (octetCount != expectedLastChunkSize) {
-            CLOG_C_ERROR(&self->log, "last chunk size must exactly. %zu vs %zu", octetCount, expectedLastChunkSize)
+        uint8_t* target = chunkTarget(self, chunkId);
+        if (target == 0) {
+            return -2;
+        }
+        tc_memset_octets(target, 0, blobStreamChunkGeometryOctetCount(&self->geometry, chunkId));
+        bitArraySet(&self->expiredBitArray, chunkId);
+        self->expiredChunkCount++;
+        expiredCount++;
+        markChunkReceived(self, chunkId);
+    }
+
+    CLOG_C_VERBOSE(&self->log, "%zu chunks expired from %" PRIu32, expiredCount, firstChunkId)
+
+    return (int) expiredCount;
+}
+
+/// Checks if a chunk was never received, since it expired on the sender
+/// @param self incoming blob stream
+/// @param chunkId the zero based index of the chunk
+/// @return true if the chunk is a zero filled hole
+bool blobStreamInIsChunkExpired(const BlobStreamIn* self, BlobStreamChunkId chunkId)
+{
+    return chunkId < self->geometry.chunkCount && bitArrayIsSet(&self->expiredBitArray, chunkId);
+}
+
+static bool isCoveredByBaseline(const BlobStreamIn* self, BlobStreamChunkId chunkId)
+{
+    const BlobStreamChunkGeometry* geometry = &self->geometry;
+    return self->baseline != 0 && blobStreamChunkGeometryOffset(geometry, chunkId) +
+                                          blobStreamChunkGeometryOctetCount(geometry, chunkId) <=
+                                      self->baselineOctetCount;
+}
+
+static int setUnchangedRun(BlobStreamIn* self, BlobStreamChunkId chunkId, const uint8_t* octets, size_t octetCount)
+{
+    if (octetCount != 4) {
+        CLOG_C_SOFT_ERROR(&self->log, "unchanged run for chunkId %" PRIu32 " has wrong size %zu", chunkId, octetCount)
+        return -5;
+    }
+
+    uint32_t runCount = ((uint32_t) octets[0] << 24) | ((uint32_t) octets[1] << 16) | ((uint32_t) octets[2] << 8) |
+                        octets[3];
+    if (runCount == 0 || (size_t) chunkId + runCount > self->geometry.chunkCount) {
+        CLOG_C_SOFT_ERROR(&self->log, "illegal unchanged run %" PRIu32 " from chunkId %" PRIu32, runCount, chunkId)
+        return -5;
+    }
+
+    BlobStreamChunkId lastChunkId = chunkId + runCount - 1;
+    if (!isCoveredByBaseline(self, lastChunkId)) {
+        CLOG_C_SOFT_ERROR(&self->log, "unchanged chunkId %" PRIu32 " is not in the baseline", lastChunkId)
+        return -4;
+    }
+
+    for (BlobStreamChunkId id = chunkId; id <= lastChunkId; ++id) {
+        uint8_t* target = chunkTarget(self, id);
+        if (target == 0) {
+            continue;
+        }
+        tc_memcpy_octets(target, self->baseline + blobStreamChunkGeometryOffset(&self->geometry, id),
+                         blobStreamChunkGeometryOctetCount(&self->geometry, id));
+        markChunkReceived(self, id);
+    }
+
+    CLOG_C_VERBOSE(&self->log, "unchanged chunkId: %" PRIu32 " count: %" PRIu32, chunkId, runCount)
+
+    return 0;
+}
+
+/// Sets a received encoded chunk
+/// The chunk is decoded directly into the blob memory. XOR:ed and unchanged chunks need a baseline,
+/// see blobStreamInSetBaseline().
+/// @param self incoming blob stream
+/// @param chunkId the zero based index of the chunk
+/// @param encoding how the octets are encoded, a combination of BLOB_STREAM_CHUNK_ENCODING_LZ and
+/// BLOB_STREAM_CHUNK_ENCODING_XOR, or BLOB_STREAM_CHUNK_ENCODING_UNCHANGED
+/// @param octets the encoded octets of the chunk
+/// @param octetCount the number of encoded octets
+/// @return negative if the chunk could not be decoded
+int blobStreamInSetEncodedChunk(BlobStreamIn* self, BlobStreamChunkId chunkId, uint8_t encoding,
+                                const uint8_t* octets, size_t octetCount)
+{
+    const BlobStreamChunkGeometry* geometry = &self->geometry;
+    if (chunkId >= geometry->chunkCount) {
+        CLOG_C_SOFT_ERROR(&self->log, "encoded chunkId %" PRIu32 " is out of range", chunkId)
+        return -1;
+    }
+
+    if (encoding == BLOB_STREAM_CHUNK_ENCODING_RAW) {
+        blobStreamInSetChunk(self, chunkId, octets, octetCount);
+        return 0;
+    }
+
+    if (encoding == BLOB_STREAM_CHUNK_ENCODING_UNCHANGED) {
+        return setUnchangedRun(self, chunkId, octets, octetCount);
+    }
+
+    if ((encoding & ~(BLOB_STREAM_CHUNK_ENCODING_LZ | BLOB_STREAM_CHUNK_ENCODING_XOR)) != 0) {
+        CLOG_C_SOFT_ERROR(&self->log, "unknown chunk encoding %02X", encoding)
+        return -2;
+    }
+
+    bool isXor = (encoding & BLOB_STREAM_CHUNK_ENCODING_XOR) != 0;
+    if (isXor && !isCoveredByBaseline(self, chunkId)) {
+        CLOG_C_SOFT_ERROR(&self->log, "XOR chunkId %" PRIu32 " is not in the baseline", chunkId)
+        return -4;
+    }
+
+    size_t expectedOctetCount = blobStreamChunkGeometryOctetCount(geometry, chunkId);
+    if (!(encoding & BLOB_STREAM_CHUNK_ENCODING_LZ) && octetCount != expectedOctetCount) {
+        CLOG_C_SOFT_ERROR(&self->log, "chunk size must be exactly %zu, but was %zu", expectedOctetCount, octetCount)
+        return -3;
+    }
+
+    uint8_t* target = chunkTarget(self, chunkId);
+    if (target == 0) {
+        return 0;
+    }
+
+    if (encoding & BLOB_STREAM_CHUNK_ENCODING_LZ) {
+        int decodedOctetCount = blobStreamDecompress(octets, octetCount, target, expectedOctetCount);
+        if (decodedOctetCount < 0 || (size_t) decodedOctetCount != expectedOctetCount) {
+            CLOG_C_SOFT_ERROR(&self->log, "could not decompress chunkId %" PRIu32 " (%d)", chunkId,
+                              decodedOctetCount)
+            return -3;
         }
     } else {
-        if (octetCount != self->fixedChunkSize) {
-            CLOG_C_ERROR(&self->log, "chunk size must be equal to fixed chunk size. %zu vs %zu", octetCount,
-                         self->fixedChunkSize)
+        tc_memcpy_octets(target, octets, octetCount);
+    }
+
+    if (isXor) {
+        const uint8_t* baselineOctets = self->baseline + blobStreamChunkGeometryOffset(geometry, chunkId);
+        blobStreamXorOctets(target, target, baselineOctets, expectedOctetCount);
+    }
+
+    CLOG_C_VERBOSE(&self->log, "setEncodedChunk chunkId: %" PRIu32 " octetCount: %zu", chunkId, octetCount)
+
+    markChunkReceived(self, chunkId);
+
+    return 0;
+}
+
+/// Gets the octets of a received chunk
+/// @param self incoming blob stream
+/// @param chunkId the zero based index of the chunk
+/// @return the chunk octets, or NULL if the chunk is not received yet
+const uint8_t* blobStreamInGetChunk(const BlobStreamIn* self, BlobStreamChunkId chunkId)
+{
+    if (chunkId >= self->geometry.chunkCount || !bitArrayIsSet(&self->bitArray, chunkId)) {
+        return 0;
+    }
+
+    if (self->blob != 0) {
+        return self->blob + blobStreamChunkGeometryOffset(&self->geometry, chunkId);
+    }
+
+    size_t indexInSegment;
+    size_t segmentIndex = segmentIndexForChunk(self, chunkId, &indexInSegment);
+
+    return self->segments[segmentIndex] + blobStreamChunkGeometryOffset(&self->geometry, indexInSegment);
+}
+
+/// Gets a scatter list of the received payload
+/// For a contiguous blob stream, it is always a single view. Should only be called on a complete blob stream.
+/// @param self incoming blob stream
+/// @param views target views
+/// @param maxViewCount maximum number of views to fill in
+/// @return the number of views filled in
+size_t blobStreamInGetSegmentViews(const BlobStreamIn* self, BlobStreamInSegmentView* views, size_t maxViewCount)
+{
+    if (self->blob != 0) {
+        if (maxViewCount == 0) {
+            return 0;
         }
+        views[0].octets = self->blob;
+        views[0].octetCount = self->octetCount;
+        return 1;
     }
 
-    bitArraySet(&self->bitArray, chunkId);
+    size_t segmentOctetSize = self->segmentPool->segmentOctetSize;
+    size_t count = self->segmentCount < maxViewCount ? self->segmentCount : maxViewCount;
+    for (size_t i = 0; i < count; ++i) {
+        views[i].octets = self->segments[i];
+        size_t offset = i * segmentOctetSize;
+        size_t octetsLeft = self->octetCount - offset;
+        views[i].octetCount = octetsLeft < segmentOctetSize ? octetsLeft : segmentOctetSize;
+    }
 
-    tc_memcpy_octets(target, octets, octetCount);
+    return count;
+}
 
-    if (bitArrayAreAllSet(&self->bitArray)) {
-        CLOG_C_VERBOSE(&self->log, "stream is complete")
-        self->isComplete = true;
+/// Copies the segments into a single contiguous blob and returns the segments to the pool
+/// After this call, `blob` holds the complete payload and is freed in blobStreamInDestroy().
+/// @param self incoming blob stream
+/// @param blobAllocator allocator for the contiguous blob
+/// @return negative on error
+int blobStreamInLinearize(BlobStreamIn* self, struct ImprintAllocatorWithFree* blobAllocator)
+{
+    if (self->blob != 0) {
+        return 0;
+    }
+
+    if (!self->isComplete) {
+        CLOG_C_SOFT_ERROR(&self->log, "can not linearize an incomplete blob stream")
+        return -2;
+    }
+
+    uint8_t* blob = IMPRINT_ALLOC((ImprintAllocator*) blobAllocator, self->octetCount, "blob stream in payload");
+    if (blob == 0) {
+        return -1;
+    }
+
+    size_t segmentOctetSize = self->segmentPool->segmentOctetSize;
+    for (size_t i = 0; i < self->segmentCount; ++i) {
+        size_t offset = i * segmentOctetSize;
+        size_t octetsLeft = self->octetCount - offset;
+        size_t segmentOctetCount = octetsLeft < segmentOctetSize ? octetsLeft : segmentOctetSize;
+        tc_memcpy_octets(blob + offset, self->segments[i], segmentOctetCount);
+    }
+
+    releaseSegments(self);
+    self->blob = blob;
+    self->blobAllocator = blobAllocator;
+
+    CLOG_C_VERBOSE(&self->log, "linearized %zu segments", self->segmentCount)
+
+    return 0;
+}
+
+#define BLOB_STREAM_IN_STATE_VERSION (0x01)
+#define BLOB_STREAM_IN_STATE_HEADER_OCTET_SIZE (1 + 4 + 2 + 4)
+
+static size_t atomCountForChunks(size_t chunkCount)
+{
+    return (chunkCount + BIT_ARRAY_BITS_IN_ATOM - 1) / BIT_ARRAY_BITS_IN_ATOM;
+}
+
+/// Calculates the number of octets needed for blobStreamInWriteState()
+/// @param self incoming blob stream
+/// @return the number of octets
+size_t blobStreamInStateOctetCount(const BlobStreamIn* self)
+{
+    const BlobStreamChunkGeometry* geometry = &self->geometry;
+    size_t payloadOctetCount = self->receivedChunkCount * geometry->fixedChunkSize;
+    if (geometry->chunkCount > 0 && bitArrayIsSet(&self->bitArray, geometry->chunkCount - 1)) {
+        payloadOctetCount -= geometry->fixedChunkSize - geometry->lastChunkOctetCount;
+    }
+
+    return BLOB_STREAM_IN_STATE_HEADER_OCTET_SIZE + atomCountForChunks(geometry->chunkCount) * sizeof(BitArrayAtom) +
+           payloadOctetCount;
+}
+
+/// Writes the received bit array and the received chunks, so the transfer can be resumed later
+/// The state can be kept in memory or written to a file by the application and later restored with
+/// blobStreamInReadState().
+/// @param self incoming blob stream
+/// @param outStream target stream, must have room for blobStreamInStateOctetCount() octets
+/// @return negative on error
+int blobStreamInWriteState(const BlobStreamIn* self, struct FldOutStream* outStream)
+{
+    if (outStream->pos + blobStreamInStateOctetCount(self) > outStream->size) {
+        CLOG_C_SOFT_ERROR(&self->log, "state needs %zu octets", blobStreamInStateOctetCount(self))
+        return -2;
+    }
+
+    const BlobStreamChunkGeometry* geometry = &self->geometry;
+    fldOutStreamWriteUInt8(outStream, BLOB_STREAM_IN_STATE_VERSION);
+    fldOutStreamWriteUInt32(outStream, (uint32_t) self->octetCount);
+    fldOutStreamWriteUInt16(outStream, (uint16_t) self->fixedChunkSize);
+    fldOutStreamWriteUInt32(outStream, (uint32_t) self->receivedChunkCount);
+
+    for (size_t atomStart = 0; atomStart < geometry->chunkCount; atomStart += BIT_ARRAY_BITS_IN_ATOM) {
+        BitArrayAtom atom = 0;
+        for (size_t bit = 0; bit < BIT_ARRAY_BITS_IN_ATOM && atomStart + bit < geometry->chunkCount; ++bit) {
+            if (bitArrayIsSet(&self->bitArray, atomStart + bit)) {
+                atom |= (BitArrayAtom) 1 << bit;
+            }
+        }
+        fldOutStreamWriteUInt64(outStream, atom);
+    }
+
+    for (size_t chunkId = 0; chunkId < geometry->chunkCount; ++chunkId) {
+        const uint8_t* octets = blobStreamInGetChunk(self, (BlobStreamChunkId) chunkId);
+        if (octets != 0) {
+            fldOutStreamWriteOctets(outStream, octets, blobStreamChunkGeometryOctetCount(geometry, chunkId));
+        }
+    }
+
+    CLOG_C_VERBOSE(&self->log, "wrote state with %zu received chunks", self->receivedChunkCount)
+
+    return 0;
+}
+
+/// Restores the state written by blobStreamInWriteState()
+/// The blob stream must be newly initialized (or reset) with the same octetCount and fixedChunkSize.
+/// @param self incoming blob stream
+/// @param inStream stream to read from
+/// @return negative on error
+int blobStreamInReadState(BlobStreamIn* self, struct FldInStream* inStream)
+{
+    if (self->receivedChunkCount != 0) {
+        CLOG_C_SOFT_ERROR(&self->log, "state can only be restored into an empty blob stream")
+        return -1;
     }
+
+    uint8_t version;
+    uint32_t octetCount;
+    uint16_t fixedChunkSize;
+    uint32_t receivedChunkCount;
+    fldInStreamReadUInt8(inStream, &version);
+    fldInStreamReadUInt32(inStream, &octetCount);
+    fldInStreamReadUInt16(inStream, &fixedChunkSize);
+    int headerErr = fldInStreamReadUInt32(inStream, &receivedChunkCount);
+    if (headerErr < 0) {
+        return headerErr;
+    }
+
+    if (version != BLOB_STREAM_IN_STATE_VERSION || octetCount != self->octetCount ||
+        fixedChunkSize != self->fixedChunkSize) {
+        CLOG_C_SOFT_ERROR(&self->log, "state version %02X, %u octets and chunk size %hu does not match", version,
+                          octetCount, fixedChunkSize)
+        return -2;
+    }
+
+    const BlobStreamChunkGeometry* geometry = &self->geometry;
+    size_t atomOctetCount = atomCountForChunks(geometry->chunkCount) * sizeof(BitArrayAtom);
+    if (inStream->pos + atomOctetCount > inStream->size) {
+        return -3;
+    }
+
+    FldInStream atomStream;
+    fldInStreamInit(&atomStream, inStream->p, atomOctetCount);
+    inStream->p += atomOctetCount;
+    inStream->pos += atomOctetCount;
+
+    for (size_t atomStart = 0; atomStart < geometry->chunkCount; atomStart += BIT_ARRAY_BITS_IN_ATOM) {
+        BitArrayAtom atom;
+        fldInStreamReadUInt64(&atomStream, &atom);
+        for (size_t bit = 0; atom != 0; ++bit, atom >>= 1) {
+            if (!(atom & 1)) {
+                continue;
+            }
+            size_t chunkId = atomStart + bit;
+            if (chunkId >= geometry->chunkCount) {
+                return -3;
+            }
+            uint8_t* target = chunkTarget(self, (BlobStreamChunkId) chunkId);
+            if (target == 0) {
+                return -4;
+            }
+            size_t chunkOctetCount = blobStreamChunkGeometryOctetCount(geometry, chunkId);
+            int octetsErr = fldInStreamReadOctets(inStream, target, chunkOctetCount);
+            if (octetsErr < 0) {
+                return octetsErr;
+            }
+            markChunkReceived(self, (BlobStreamChunkId) chunkId);
+        }
+    }
+
+    if (self->receivedChunkCount != receivedChunkCount) {
+        CLOG_C_SOFT_ERROR(&self->log, "state has %zu chunks, expected %u", self->receivedChunkCount,
+                          receivedChunkCount)
+        return -5;
+    }
+
+    CLOG_C_VERBOSE(&self->log, "restored state with %zu received chunks", self->receivedChunkCount)
+
+    return 0;
 }
 
 /// returns a debug string of the state of the blob stream. Not implemented.
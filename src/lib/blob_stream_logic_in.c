@@ -4,48 +4,603 @@
  *--------------------------------------------------------------------------------------------------------*/
 
 #include <blob-stream/blob_stream_logic_in.h>
+#include <blob-stream/chunk_cache.h>
 #include <blob-stream/commands.h>
 #include <clog/clog.h>
 #include <flood/in_stream.h>
 #include <inttypes.h>
 #include <blob-stream/debug.h>
+#include <blob-stream/var_int.h>
 
 /// Initializes the receive logic for a blobstream
 /// @param self incoming blob stream logic
 /// @param blobStream the blob stream to set chunks to.
-void blobStreamLogicInInit(BlobStreamLogicIn* self, BlobStreamIn* blobStream)
+/// @param transferId the transfer id that this logic accepts chunks for
+void blobStreamLogicInInit(BlobStreamLogicIn* self, BlobStreamIn* blobStream, BlobStreamTransferId transferId)
 {
     CLOG_VERBOSE("blobStreamLogicInInit: with blobstream of octetCount %zu", blobStream->octetCount)
     self->blobStream = blobStream;
+    self->transferId = transferId;
+    self->chunkCache = 0;
+    self->pendingHashAnswerFirstChunkId = 0;
+    self->pendingHashAnswerEndChunkId = 0;
+    self->isPullMode = false;
+    self->maxChunksPerRequest = 0;
+    self->requestInterval = 0;
+    self->retryInterval = 0;
+    self->lastRequestAt = 0;
+    self->requestPassStartedAt = 0;
+    self->requestChunkId = 0;
+    self->isRequestPassStarted = false;
+    self->ackEveryChunkCount = 1;
+    self->maxAckDelay = 0;
+    self->unackedChunkCount = 0;
+    self->expectedChunkId = 0;
+    self->isAckPending = false;
+    self->isAckUrgent = false;
+    self->isAckDelayStarted = false;
+    self->ackDelayStartedAt = 0;
+    self->receiveWindowChunkCount = SIZE_MAX;
+    self->receiveWindowEndChunkId = blobStream->geometry.chunkCount;
+    self->droppedChunkCount = 0;
+    self->isCompact = false;
+    self->isTransferIdElided = false;
 }
 
-static int setChunk(BlobStreamLogicIn* self, FldInStream* inStream)
+/// Uses the compact wire format that was accepted in the start transfer
+/// Acks are sent as BLOB_STREAM_LOGIC_CMD_ACK_CHUNK_COMPACT. Call it when the read start transfer has isCompact set.
+/// @param self incoming blob stream logic
+/// @param isTransferIdElided true if the transferId is left out of the compact commands
+void blobStreamLogicInSetCompact(BlobStreamLogicIn* self, bool isTransferIdElided)
+{
+    self->isCompact = true;
+    self->isTransferIdElided = isTransferIdElided;
+}
+
+/// Enables chunk deduplication
+/// Chunks advertised with BLOB_STREAM_LOGIC_CMD_CHUNK_HASHES that are found in the cache are copied
+/// into the blob stream and never sent by the sender. All received chunks are inserted into the cache.
+/// @param self incoming blob stream logic
+/// @param chunkCache the content addressed chunk cache, can be shared between transfers
+void blobStreamLogicInSetChunkCache(BlobStreamLogicIn* self, struct BlobStreamChunkCache* chunkCache)
+{
+    self->chunkCache = chunkCache;
+}
+
+/// Enables pull mode, where the receiver requests the chunks it is missing
+/// Send the requests with blobStreamLogicInSendRequest(). The missing chunks are requested in passes from
+/// the start of the blob, so each chunk is requested at most once per pass and the sender never
+/// retransmits on timers.
+/// @param self incoming blob stream logic
+/// @param maxChunksPerRequest the maximum number of chunks in one request, paces the download. Must not be zero.
+/// @param requestInterval the minimum time between two requests
+/// @param retryInterval the minimum time between two passes, should be longer than the round trip time
+void blobStreamLogicInSetPullMode(BlobStreamLogicIn* self, size_t maxChunksPerRequest, MonotonicTimeMs requestInterval,
+                                  MonotonicTimeMs retryInterval)
+{
+    CLOG_ASSERT(maxChunksPerRequest > 0, "pull mode needs at least one chunk per request")
+
+    self->isPullMode = true;
+    self->maxChunksPerRequest = maxChunksPerRequest;
+    self->requestInterval = requestInterval;
+    self->retryInterval = retryInterval;
+    self->isRequestPassStarted = false;
+}
+
+/// Sets how often acks are needed, see blobStreamLogicInSendIfDue()
+/// An ack is due when ackEveryChunkCount new chunks have been received, when the receive state has changed and
+/// maxAckDelay has passed, or right away when a gap is detected or filled, a duplicate chunk is received,
+/// chunk hashes are answered or the blob is complete. maxAckDelay should be shorter than the
+/// thresholdForRedundancy of the sender, or chunks are resent before they are acked.
+/// The default is an ack for every new chunk.
+/// @param self incoming blob stream logic
+/// @param ackEveryChunkCount the number of new chunks that makes an ack due
+/// @param maxAckDelay the longest time an ack is delayed after the receive state changed
+void blobStreamLogicInSetAckFrequency(BlobStreamLogicIn* self, size_t ackEveryChunkCount, MonotonicTimeMs maxAckDelay)
+{
+    self->ackEveryChunkCount = ackEveryChunkCount > 0 ? ackEveryChunkCount : 1;
+    self->maxAckDelay = maxAckDelay;
+}
+
+static size_t receiveWindowEnd(const BlobStreamLogicIn* self, size_t waitingForChunkId)
+{
+    size_t chunkCount = self->blobStream->geometry.chunkCount;
+    if (self->receiveWindowChunkCount >= chunkCount - waitingForChunkId) {
+        return chunkCount;
+    }
+
+    return waitingForChunkId + self->receiveWindowChunkCount;
+}
+
+/// Sets the receive window, the number of chunks from the first missing chunk that are accepted
+/// The window is sent with every ack, and the sender does not send chunks outside of it. Chunks outside
+/// the window that are received anyway are dropped. Lower it when the consumer is not keeping up,
+/// and raise it again when it has caught up. An ack is due right away when the window opens up.
+/// The default window covers the whole blob.
+/// @param self incoming blob stream logic
+/// @param windowChunkCount the number of chunks from the first missing chunk that are accepted
+void blobStreamLogicInSetReceiveWindow(BlobStreamLogicIn* self, size_t windowChunkCount)
+{
+    self->receiveWindowChunkCount = windowChunkCount;
+    size_t endChunkId = receiveWindowEnd(self, bitArrayFirstUnset(&self->blobStream->bitArray));
+    if (endChunkId == self->receiveWindowEndChunkId) {
+        return;
+    }
+
+    self->isAckPending = true;
+    if (endChunkId > self->receiveWindowEndChunkId) {
+        self->isAckUrgent = true;
+    }
+    self->receiveWindowEndChunkId = endChunkId;
+}
+
+/// Reads a BLOB_STREAM_LOGIC_CMD_START_TRANSFER command
+/// Used before the incoming blob stream is created. If the suggested chunk size is larger than
+/// maxChunkSize, the chunk size is lowered to maxChunkSize and the sender is expected to use that
+/// chunk size when it receives the ack. The sender also tells the smallest chunk size it can lower to, and the
+/// start transfer is refused if maxChunkSize is below that.
+/// For a delta transfer, isDelta is set and the application is expected to look up the baseline with baselineId and
+/// call blobStreamInSetBaseline() before any chunks are received.
+/// If the sender requests the compact format, isCompact is set. Clear it before the ack to refuse it, or call
+/// blobStreamLogicInSetCompact() to use it.
+/// @param inStream stream to read from, including the command octet
+/// @param maxChunkSize the largest chunk size this receiver accepts, up to BLOB_STREAM_MAX_CHUNK_SIZE
+/// @param startTransfer the negotiated transfer information
+/// @return negative on error
+int blobStreamLogicInReadStartTransfer(FldInStream* inStream, size_t maxChunkSize,
+                                       BlobStreamStartTransfer* startTransfer)
+{
+    uint8_t cmd;
+    int cmdResult = fldInStreamReadUInt8(inStream, &cmd);
+    if (cmdResult < 0) {
+        return cmdResult;
+    }
+
+    if (cmd != BLOB_STREAM_LOGIC_CMD_START_TRANSFER) {
+        CLOG_SOFT_ERROR("expected start transfer, but got %02X %s", cmd, blobStreamCmdToString(cmd))
+        return -2;
+    }
+
+    uint16_t transferId;
+    int transferErr = fldInStreamReadUInt16(inStream, &transferId);
+    if (transferErr < 0) {
+        return transferErr;
+    }
+
+    uint32_t octetCount;
+    int octetCountErr = fldInStreamReadUInt32(inStream, &octetCount);
+    if (octetCountErr < 0) {
+        return octetCountErr;
+    }
+
+    uint16_t fixedChunkSize;
+    int chunkSizeErr = fldInStreamReadUInt16(inStream, &fixedChunkSize);
+    if (chunkSizeErr < 0) {
+        return chunkSizeErr;
+    }
+
+    uint16_t minChunkSize;
+    int minChunkSizeErr = fldInStreamReadUInt16(inStream, &minChunkSize);
+    if (minChunkSizeErr < 0) {
+        return minChunkSizeErr;
+    }
+
+    if (fixedChunkSize == 0 || minChunkSize == 0 || minChunkSize > fixedChunkSize) {
+        CLOG_SOFT_ERROR("start transfer with illegal chunk size %hu (min %hu)", fixedChunkSize, minChunkSize)
+        return -3;
+    }
+
+    uint8_t flags;
+    int flagsErr = fldInStreamReadUInt8(inStream, &flags);
+    if (flagsErr < 0) {
+        return flagsErr;
+    }
+
+    uint32_t baselineId = 0;
+    if (flags & BLOB_STREAM_START_TRANSFER_FLAG_DELTA) {
+        int baselineErr = fldInStreamReadUInt32(inStream, &baselineId);
+        if (baselineErr < 0) {
+            return baselineErr;
+        }
+    }
+
+    startTransfer->isDelta = (flags & BLOB_STREAM_START_TRANSFER_FLAG_DELTA) != 0;
+    startTransfer->isCompact = (flags & BLOB_STREAM_START_TRANSFER_FLAG_COMPACT) != 0;
+    startTransfer->isTransferIdElided = startTransfer->isCompact &&
+                                        (flags & BLOB_STREAM_START_TRANSFER_FLAG_NO_TRANSFER_ID) != 0;
+    startTransfer->baselineId = baselineId;
+    startTransfer->transferId = transferId;
+    startTransfer->octetCount = octetCount;
+    startTransfer->fixedChunkSize = fixedChunkSize < maxChunkSize ? fixedChunkSize : maxChunkSize;
+    if (startTransfer->fixedChunkSize < minChunkSize) {
+        CLOG_SOFT_ERROR("start transfer %04X needs a chunk size of at least %hu, but %zu is the maximum", transferId,
+                        minChunkSize, maxChunkSize)
+        return -4;
+    }
+
+    CLOG_VERBOSE("start transfer %04X octetCount: %u chunkSize: %zu (suggested %hu)", transferId, octetCount,
+                 startTransfer->fixedChunkSize, fixedChunkSize)
+
+    return 0;
+}
+
+/// Writes a BLOB_STREAM_LOGIC_CMD_ACK_START_TRANSFER with the negotiated chunk size and the accepted flags
+/// @param startTransfer the result from blobStreamLogicInReadStartTransfer()
+/// @param outStream stream to write to
+/// @return negative on error
+int blobStreamLogicInSendAckStartTransfer(const BlobStreamStartTransfer* startTransfer, FldOutStream* outStream)
+{
+    uint8_t acceptedFlags = 0;
+    if (startTransfer->isDelta) {
+        acceptedFlags |= BLOB_STREAM_START_TRANSFER_FLAG_DELTA;
+    }
+    if (startTransfer->isCompact) {
+        acceptedFlags |= BLOB_STREAM_START_TRANSFER_FLAG_COMPACT;
+        if (startTransfer->isTransferIdElided) {
+            acceptedFlags |= BLOB_STREAM_START_TRANSFER_FLAG_NO_TRANSFER_ID;
+        }
+    }
+
+    fldOutStreamWriteUInt8(outStream, BLOB_STREAM_LOGIC_CMD_ACK_START_TRANSFER);
+    fldOutStreamWriteUInt16(outStream, startTransfer->transferId);
+    fldOutStreamWriteUInt16(outStream, (uint16_t) startTransfer->fixedChunkSize);
+    return fldOutStreamWriteUInt8(outStream, acceptedFlags);
+}
+
+static int validateChunk(const BlobStreamLogicIn* self, uint32_t chunkId, uint8_t encoding, uint16_t octetLength)
+{
+    const BlobStreamIn* blobStream = self->blobStream;
+    if (chunkId >= blobStream->geometry.chunkCount || octetLength > blobStream->fixedChunkSize) {
+        CLOG_SOFT_ERROR("illegal chunk %u octetLength %hu", chunkId, octetLength)
+        return -3;
+    }
+
+    if (encoding == BLOB_STREAM_CHUNK_ENCODING_RAW &&
+        octetLength != blobStreamChunkGeometryOctetCount(&blobStream->geometry, chunkId)) {
+        CLOG_SOFT_ERROR("wrong octetLength %hu for chunk %u", octetLength, chunkId)
+        return -4;
+    }
+
+    return 0;
+}
+
+static int applyChunk(BlobStreamLogicIn* self, uint32_t chunkId, uint8_t encoding, const uint8_t* octets,
+                      uint16_t octetLength)
 {
+    int validateErr = validateChunk(self, chunkId, encoding, octetLength);
+    if (validateErr < 0) {
+        return validateErr;
+    }
+
+    BlobStreamIn* blobStream = self->blobStream;
+    if (chunkId >= self->receiveWindowEndChunkId) {
+        CLOG_VERBOSE("dropping chunk %u outside of receive window %zu", chunkId, self->receiveWindowEndChunkId)
+        self->droppedChunkCount++;
+        return 0;
+    }
+
+    bool wasReceived = bitArrayIsSet(&blobStream->bitArray, chunkId);
+    int result = 0;
+    if (encoding != BLOB_STREAM_CHUNK_ENCODING_RAW) {
+        result = blobStreamInSetEncodedChunk(blobStream, (BlobStreamChunkId) chunkId, encoding, octets, octetLength);
+    } else {
+        blobStreamInSetChunk(blobStream, (BlobStreamChunkId) chunkId, octets, octetLength);
+    }
+
+    if (result < 0) {
+        return result;
+    }
+
+    self->isAckPending = true;
+    if (wasReceived || chunkId != self->expectedChunkId) {
+        // The sender resent a chunk or a chunk is lost, so tell the sender as soon as possible
+        self->isAckUrgent = true;
+    }
+    if (chunkId >= self->expectedChunkId) {
+        self->expectedChunkId = chunkId + 1;
+    }
+    if (!wasReceived) {
+        self->unackedChunkCount++;
+    }
+
+    if (blobStream->isComplete) {
+        self->isAckUrgent = true;
+    }
+
+    if (!wasReceived && self->chunkCache != 0) {
+        const uint8_t* chunkOctets = blobStreamInGetChunk(blobStream, (BlobStreamChunkId) chunkId);
+        if (chunkOctets != 0) {
+            size_t chunkOctetCount = blobStreamChunkGeometryOctetCount(&blobStream->geometry, chunkId);
+            blobStreamChunkCacheInsert(self->chunkCache, blobStreamChunkHash(chunkOctets, chunkOctetCount),
+                                       chunkOctets, chunkOctetCount);
+        }
+    }
+
+    return result;
+}
+
+static int setChunk(BlobStreamLogicIn* self, FldInStream* inStream, bool isEncoded, bool isApplying)
+{
+    uint16_t transferId;
+    int transferErr = fldInStreamReadUInt16(inStream, &transferId);
+    if (transferErr < 0) {
+        return transferErr;
+    }
+
     uint32_t chunkId;
     int readErr = fldInStreamReadUInt32(inStream, &chunkId);
     if (readErr < 0) {
         return readErr;
     }
 
+    uint8_t encoding = BLOB_STREAM_CHUNK_ENCODING_RAW;
+    if (isEncoded) {
+        int encodingErr = fldInStreamReadUInt8(inStream, &encoding);
+        if (encodingErr < 0) {
+            return encodingErr;
+        }
+    }
+
     uint16_t octetLength;
     int readLengthErr = fldInStreamReadUInt16(inStream, &octetLength);
     if (readLengthErr < 0) {
         return readLengthErr;
     }
 
-    if (octetLength > self->blobStream->fixedChunkSize) {
-        CLOG_ERROR("octetLength overrun %hu", octetLength)
+    if (inStream->pos + octetLength > inStream->size) {
+        CLOG_SOFT_ERROR("set chunk payload is truncated %hu", octetLength)
+        return -2;
     }
 
-    blobStreamInSetChunk(self->blobStream, (BlobStreamChunkId) chunkId, inStream->p, octetLength);
+    const uint8_t* octets = inStream->p;
     inStream->p += octetLength;
     inStream->pos += octetLength;
 
+    if (transferId != self->transferId) {
+        CLOG_SOFT_ERROR("set chunk for wrong transferId %04X vs %04X", transferId, self->transferId)
+        return 0;
+    }
+
+    if (!isApplying) {
+        return validateChunk(self, chunkId, encoding, octetLength);
+    }
+
+    return applyChunk(self, chunkId, encoding, octets, octetLength);
+}
+
+static int setChunksCompact(BlobStreamLogicIn* self, FldInStream* inStream, bool isApplying)
+{
+    BlobStreamTransferId transferId = self->transferId;
+    if (!self->isTransferIdElided) {
+        int transferErr = fldInStreamReadUInt16(inStream, &transferId);
+        if (transferErr < 0) {
+            return transferErr;
+        }
+    }
+
+    uint64_t chunkCount;
+    int countErr = blobStreamVarIntRead(inStream, &chunkCount);
+    if (countErr < 0) {
+        return countErr;
+    }
+
+    const BlobStreamChunkGeometry* geometry = &self->blobStream->geometry;
+    bool isForThisTransfer = transferId == self->transferId;
+    if (!isForThisTransfer) {
+        CLOG_SOFT_ERROR("set chunks compact for wrong transferId %04X vs %04X", transferId, self->transferId)
+        // The implicit lengths of the raw chunks can only be found out for this transfer
+        return -1;
+    }
+
+    // A chunk rejected by applyChunk() or validateChunk() does not stop the rest of the chunks, the command is
+    // still consumed. An illegal chunk id or a truncated length is returned at once: the lengths of the rest of the
+    // chunks, and so the rest of the datagram, can not be parsed after it
+    int result = 0;
+    int64_t expectedChunkId = 0;
+    for (uint64_t i = 0; i < chunkCount; ++i) {
+        uint64_t key;
+        int keyErr = blobStreamVarIntRead(inStream, &key);
+        if (keyErr < 0) {
+            return keyErr;
+        }
+
+        int64_t chunkId = expectedChunkId + blobStreamZigZagDecode(key >> 1);
+        if (chunkId < 0 || (uint64_t) chunkId >= geometry->chunkCount) {
+            CLOG_SOFT_ERROR("illegal compact chunk %" PRId64, chunkId)
+            return -3;
+        }
+
+        uint8_t encoding = BLOB_STREAM_CHUNK_ENCODING_RAW;
+        uint64_t octetLength;
+        if (key & 1) {
+            int encodingErr = fldInStreamReadUInt8(inStream, &encoding);
+            if (encodingErr < 0) {
+                return encodingErr;
+            }
+            int lengthErr = blobStreamVarIntRead(inStream, &octetLength);
+            if (lengthErr < 0) {
+                return lengthErr;
+            }
+        } else {
+            octetLength = blobStreamChunkGeometryOctetCount(geometry, (size_t) chunkId);
+        }
+
+        if (octetLength > UINT16_MAX || inStream->pos + octetLength > inStream->size) {
+            CLOG_SOFT_ERROR("set chunks compact payload is truncated %" PRIu64, octetLength)
+            return -2;
+        }
+
+        const uint8_t* octets = inStream->p;
+        inStream->p += octetLength;
+        inStream->pos += octetLength;
+
+        int chunkErr = isApplying ? applyChunk(self, (uint32_t) chunkId, encoding, octets, (uint16_t) octetLength)
+                                  : validateChunk(self, (uint32_t) chunkId, encoding, (uint16_t) octetLength);
+        if (chunkErr < 0 && result == 0) {
+            result = chunkErr;
+        }
+        expectedChunkId = chunkId + 1;
+    }
+
+    return result;
+}
+
+static int chunkHashes(BlobStreamLogicIn* self, FldInStream* inStream, bool isApplying)
+{
+    uint16_t transferId;
+    int transferErr = fldInStreamReadUInt16(inStream, &transferId);
+    if (transferErr < 0) {
+        return transferErr;
+    }
+
+    uint32_t firstChunkId;
+    int readErr = fldInStreamReadUInt32(inStream, &firstChunkId);
+    if (readErr < 0) {
+        return readErr;
+    }
+
+    uint16_t hashCount;
+    int countErr = fldInStreamReadUInt16(inStream, &hashCount);
+    if (countErr < 0) {
+        return countErr;
+    }
+
+    if (inStream->pos + (size_t) hashCount * sizeof(BlobStreamChunkHash) > inStream->size) {
+        CLOG_SOFT_ERROR("chunk hashes are truncated %hu", hashCount)
+        return -2;
+    }
+
+    if (transferId != self->transferId) {
+        CLOG_SOFT_ERROR("chunk hashes for wrong transferId %04X vs %04X", transferId, self->transferId)
+        inStream->p += hashCount * sizeof(BlobStreamChunkHash);
+        inStream->pos += hashCount * sizeof(BlobStreamChunkHash);
+        return 0;
+    }
+
+    BlobStreamIn* blobStream = self->blobStream;
+    size_t endChunkId = (size_t) firstChunkId + hashCount;
+    if (endChunkId > blobStream->geometry.chunkCount) {
+        CLOG_SOFT_ERROR("illegal chunk hash range %u count %hu", firstChunkId, hashCount)
+        return -3;
+    }
+
+    if (!isApplying) {
+        inStream->p += hashCount * sizeof(BlobStreamChunkHash);
+        inStream->pos += hashCount * sizeof(BlobStreamChunkHash);
+        return 0;
+    }
+
+    size_t foundCount = 0;
+    for (size_t chunkId = firstChunkId; chunkId < endChunkId; ++chunkId) {
+        BlobStreamChunkHash hash;
+        fldInStreamReadUInt64(inStream, &hash);
+        if (self->chunkCache == 0 || bitArrayIsSet(&blobStream->bitArray, chunkId)) {
+            continue;
+        }
+        const BlobStreamChunkCacheEntry* entry = blobStreamChunkCacheFind(self->chunkCache, hash);
+        if (entry == 0 || entry->octetCount != blobStreamChunkGeometryOctetCount(&blobStream->geometry, chunkId)) {
+            continue;
+        }
+        blobStreamInSetChunk(blobStream, (BlobStreamChunkId) chunkId, entry->octets, entry->octetCount);
+        foundCount++;
+    }
+
+    self->isAckPending = true;
+    self->isAckUrgent = true;
+
+    if (self->pendingHashAnswerFirstChunkId == self->pendingHashAnswerEndChunkId) {
+        self->pendingHashAnswerFirstChunkId = firstChunkId;
+        self->pendingHashAnswerEndChunkId = endChunkId;
+    } else {
+        if (firstChunkId < self->pendingHashAnswerFirstChunkId) {
+            self->pendingHashAnswerFirstChunkId = firstChunkId;
+        }
+        if (endChunkId > self->pendingHashAnswerEndChunkId) {
+            self->pendingHashAnswerEndChunkId = endChunkId;
+        }
+    }
+
+    CLOG_VERBOSE("chunk hashes from %u count %hu, found %zu in cache", firstChunkId, hashCount, foundCount)
+
     return 0;
 }
 
+static int chunksExpired(BlobStreamLogicIn* self, FldInStream* inStream, bool isApplying)
+{
+    BlobStreamTransferId transferId;
+    int transferErr = fldInStreamReadUInt16(inStream, &transferId);
+    if (transferErr < 0) {
+        return transferErr;
+    }
+
+    uint16_t rangeCount;
+    int countErr = fldInStreamReadUInt16(inStream, &rangeCount);
+    if (countErr < 0) {
+        return countErr;
+    }
+
+    if (inStream->pos + (size_t) rangeCount * (4 + 4) > inStream->size) {
+        CLOG_SOFT_ERROR("chunks expired is truncated %hu", rangeCount)
+        return -2;
+    }
+
+    bool isForThisTransfer = transferId == self->transferId;
+    if (!isForThisTransfer) {
+        CLOG_SOFT_ERROR("chunks expired for wrong transferId %04X vs %04X", transferId, self->transferId)
+    }
+
+    // A rejected range does not stop the rest of the ranges, so the whole command is always consumed
+    int result = 0;
+    for (size_t i = 0; i < rangeCount; ++i) {
+        uint32_t firstChunkId;
+        uint32_t chunkCount;
+        fldInStreamReadUInt32(inStream, &firstChunkId);
+        fldInStreamReadUInt32(inStream, &chunkCount);
+        if (!isForThisTransfer) {
+            continue;
+        }
+        if (!isApplying) {
+            if ((size_t) firstChunkId + chunkCount > self->blobStream->geometry.chunkCount) {
+                CLOG_SOFT_ERROR("illegal expire range %u count %u", firstChunkId, chunkCount)
+                result = -3;
+            }
+            continue;
+        }
+        int expireErr = blobStreamInExpireChunks(self->blobStream, firstChunkId, chunkCount);
+        if (expireErr < 0) {
+            result = expireErr;
+            continue;
+        }
+        self->isAckPending = true;
+    }
+
+    return isForThisTransfer ? result : -1;
+}
+
+/// Reads one command. When not applying, the command is only validated and consumed, without changing any state.
+static int receiveCommand(BlobStreamLogicIn* self, uint8_t cmd, FldInStream* inStream, bool isApplying)
+{
+    switch (cmd) {
+        case BLOB_STREAM_LOGIC_CMD_SET_CHUNK:
+            return setChunk(self, inStream, false, isApplying);
+        case BLOB_STREAM_LOGIC_CMD_SET_CHUNK_ENCODED:
+            return setChunk(self, inStream, true, isApplying);
+        case BLOB_STREAM_LOGIC_CMD_CHUNK_HASHES:
+            return chunkHashes(self, inStream, isApplying);
+        case BLOB_STREAM_LOGIC_CMD_CHUNKS_EXPIRED:
+            return chunksExpired(self, inStream, isApplying);
+        case BLOB_STREAM_LOGIC_CMD_SET_CHUNKS_COMPACT:
+            return setChunksCompact(self, inStream, isApplying);
+        default:
+            CLOG_SOFT_ERROR("blobStreamLogicInReceive: Unknown command %02X", cmd)
+            return -2;
+    }
+}
+
 /// Receive a incoming blob stream command
-/// Only BLOB_STREAM_LOGIC_CMD_SET_CHUNK is supported.
+/// BLOB_STREAM_LOGIC_CMD_SET_CHUNK, BLOB_STREAM_LOGIC_CMD_SET_CHUNK_ENCODED,
+/// BLOB_STREAM_LOGIC_CMD_CHUNK_HASHES, BLOB_STREAM_LOGIC_CMD_CHUNKS_EXPIRED and
+/// BLOB_STREAM_LOGIC_CMD_SET_CHUNKS_COMPACT are supported.
 /// @param self incoming blob stream logic
 /// @param inStream stream to receive from
 /// @return negative on error
@@ -59,13 +614,46 @@ int blobStreamLogicInReceive(BlobStreamLogicIn* self, FldInStream* inStream)
 
     CLOG_VERBOSE("BlobStreamLogicIn ReceiveCmd: %02X %s", cmd, blobStreamCmdToString(cmd))
 
-    switch (cmd) {
-        case BLOB_STREAM_LOGIC_CMD_SET_CHUNK:
-            return setChunk(self, inStream);
-        default:
-            CLOG_ERROR("blobStreamLogicInReceive: Unknown command %02X", cmd)
-            // return -2;
+    return receiveCommand(self, cmd, inStream, true);
+}
+
+/// Receives a whole datagram with many incoming blob stream commands
+/// All commands are validated first, both bounds and contents, so a truncated, unknown or illegal command
+/// rejects the whole datagram before anything is applied. A command that still fails while it is applied,
+/// for example a chunk that can not be decoded, is skipped and the rest of the commands are applied.
+/// Suitable for datagrams received in batches, for example with recvmmsg().
+/// @param self incoming blob stream logic
+/// @param inStream stream with the datagram, it is fully consumed on success
+/// @return the number of commands applied, or negative on error
+int blobStreamLogicInReceiveDatagram(BlobStreamLogicIn* self, FldInStream* inStream)
+{
+    FldInStream validateStream = *inStream;
+    size_t commandCount = 0;
+    while (validateStream.pos < validateStream.size) {
+        uint8_t cmd;
+        fldInStreamReadUInt8(&validateStream, &cmd);
+        int validateErr = receiveCommand(self, cmd, &validateStream, false);
+        if (validateErr < 0) {
+            CLOG_SOFT_ERROR("rejecting datagram, command %zu (%02X) at %zu is illegal", commandCount, cmd,
+                            validateStream.pos)
+            return validateErr;
+        }
+        commandCount++;
+    }
+
+    // The reads can not fail anymore, every command consumes all of its octets even if it is rejected
+    size_t appliedCount = 0;
+    for (size_t i = 0; i < commandCount; ++i) {
+        uint8_t cmd;
+        fldInStreamReadUInt8(inStream, &cmd);
+        if (receiveCommand(self, cmd, inStream, true) < 0) {
+            CLOG_SOFT_ERROR("skipping command %zu (%02X) in datagram", i, cmd)
+            continue;
+        }
+        appliedCount++;
     }
+
+    return (int) appliedCount;
 }
 
 static void sendCommand(FldOutStream* outStream, uint8_t cmd)
@@ -75,20 +663,302 @@ static void sendCommand(FldOutStream* outStream, uint8_t cmd)
     fldOutStreamWriteUInt8(outStream, cmd);
 }
 
+static void sendAckChunkHashes(BlobStreamLogicIn* self, FldOutStream* outStream)
+{
+    const size_t headerOctetCount = 1 + 2 + 4 + 2;
+    const size_t ackChunkOctetCount = 1 + 2 + 4 + 8 + 4;
+    size_t octetsLeft = outStream->size - outStream->pos;
+    if (octetsLeft <= headerOctetCount + ackChunkOctetCount) {
+        return;
+    }
+
+    size_t chunkCount = self->pendingHashAnswerEndChunkId - self->pendingHashAnswerFirstChunkId;
+    size_t maxChunkCount = (octetsLeft - headerOctetCount - ackChunkOctetCount) * 8;
+    if (chunkCount > maxChunkCount) {
+        chunkCount = maxChunkCount;
+    }
+    if (chunkCount > UINT16_MAX) {
+        chunkCount = UINT16_MAX;
+    }
+
+    size_t firstChunkId = self->pendingHashAnswerFirstChunkId;
+    sendCommand(outStream, BLOB_STREAM_LOGIC_CMD_ACK_CHUNK_HASHES);
+    fldOutStreamWriteUInt16(outStream, self->transferId);
+    fldOutStreamWriteUInt32(outStream, (uint32_t) firstChunkId);
+    fldOutStreamWriteUInt16(outStream, (uint16_t) chunkCount);
+    for (size_t i = 0; i < chunkCount; i += 8) {
+        uint8_t bits = 0;
+        for (size_t bit = 0; bit < 8 && i + bit < chunkCount; ++bit) {
+            if (bitArrayIsSet(&self->blobStream->bitArray, firstChunkId + i + bit)) {
+                bits |= (uint8_t) (1 << bit);
+            }
+        }
+        fldOutStreamWriteUInt8(outStream, bits);
+    }
+
+    self->pendingHashAnswerFirstChunkId += chunkCount;
+}
+
 /// Writes the receive status to the outstream
+/// With the compact format, a BLOB_STREAM_LOGIC_CMD_ACK_CHUNK_COMPACT is written instead.
+/// If chunk hashes have been received, a BLOB_STREAM_LOGIC_CMD_ACK_CHUNK_HASHES with the chunks that
+/// are available is written first, as much of it as fits.
 /// @param self incoming blob stream logic
 /// @param outStream stream where the BLOB_STREAM_LOGIC_CMD_ACK_CHUNK will be written to
 /// @return the result code. if less than zero it indicates and error.
 int blobStreamLogicInSend(BlobStreamLogicIn* self, FldOutStream* outStream)
 {
+    if (self->pendingHashAnswerFirstChunkId != self->pendingHashAnswerEndChunkId) {
+        sendAckChunkHashes(self, outStream);
+    }
+
     size_t waitingForChunkId = bitArrayFirstUnset(&self->blobStream->bitArray);
     BitArrayAtom receiveMask = bitArrayGetAtomFrom(&self->blobStream->bitArray, waitingForChunkId + 1);
 
-    CLOG_VERBOSE("blobStreamLogicIn: send. We are waiting for %04zX, mask %" PRIx64, waitingForChunkId, receiveMask)
+    self->receiveWindowEndChunkId = receiveWindowEnd(self, waitingForChunkId);
+    self->unackedChunkCount = 0;
+    self->isAckPending = false;
+    self->isAckUrgent = false;
+    self->isAckDelayStarted = false;
+
+    CLOG_VERBOSE("blobStreamLogicIn: send. We are waiting for %04zX, mask %" PRIx64 ", window end %04zX",
+                 waitingForChunkId, receiveMask, self->receiveWindowEndChunkId)
+    if (self->isCompact) {
+        sendCommand(outStream, BLOB_STREAM_LOGIC_CMD_ACK_CHUNK_COMPACT);
+        if (!self->isTransferIdElided) {
+            fldOutStreamWriteUInt16(outStream, self->transferId);
+        }
+        blobStreamVarIntWrite(outStream, waitingForChunkId);
+        blobStreamVarIntWrite(outStream, receiveMask);
+        return blobStreamVarIntWrite(outStream, self->receiveWindowEndChunkId - waitingForChunkId);
+    }
+
     sendCommand(outStream, BLOB_STREAM_LOGIC_CMD_ACK_CHUNK);
+    fldOutStreamWriteUInt16(outStream, self->transferId);
     fldOutStreamWriteUInt32(outStream, (uint32_t) waitingForChunkId);
+    fldOutStreamWriteUInt64(outStream, receiveMask);
 
-    return fldOutStreamWriteUInt64(outStream, receiveMask);
+    return fldOutStreamWriteUInt32(outStream, (uint32_t) self->receiveWindowEndChunkId);
+}
+
+/// Checks if the receive state has changed since the last ack
+/// @param self incoming blob stream logic
+/// @return true if an ack would tell the sender something new
+bool blobStreamLogicInIsAckPending(const BlobStreamLogicIn* self)
+{
+    return self->isAckPending;
+}
+
+/// Checks if an ack should be sent now
+/// The delayed ack timer starts the first time a pending ack is seen, so call this regularly, for example
+/// after every received datagram and on the send cadence. See blobStreamLogicInSetAckFrequency().
+/// @param self incoming blob stream logic
+/// @param now the current time
+/// @return true if an ack should be sent
+bool blobStreamLogicInIsAckDue(BlobStreamLogicIn* self, MonotonicTimeMs now)
+{
+    if (!self->isAckPending) {
+        return false;
+    }
+
+    if (self->isAckUrgent || self->unackedChunkCount >= self->ackEveryChunkCount) {
+        return true;
+    }
+
+    if (!self->isAckDelayStarted) {
+        self->isAckDelayStarted = true;
+        self->ackDelayStartedAt = now;
+    }
+
+    return now - self->ackDelayStartedAt >= self->maxAckDelay;
+}
+
+/// Writes the receive status to the outstream, but only if an ack is due
+/// @param self incoming blob stream logic
+/// @param now the current time
+/// @param outStream stream where the BLOB_STREAM_LOGIC_CMD_ACK_CHUNK will be written to
+/// @return 1 if an ack was written, 0 if no ack was due, or negative on error
+int blobStreamLogicInSendIfDue(BlobStreamLogicIn* self, MonotonicTimeMs now, FldOutStream* outStream)
+{
+    if (!blobStreamLogicInIsAckDue(self, now)) {
+        return 0;
+    }
+
+    int err = blobStreamLogicInSend(self, outStream);
+    if (err < 0) {
+        return err;
+    }
+
+    return 1;
+}
+
+static bool nextReceivedRange(const BlobStreamIn* blobStream, size_t fromChunkId, size_t* firstChunkId,
+                              size_t* chunkCount)
+{
+    size_t totalChunkCount = blobStream->geometry.chunkCount;
+    size_t chunkId = fromChunkId;
+    while (chunkId < totalChunkCount && !bitArrayIsSet(&blobStream->bitArray, chunkId)) {
+        chunkId++;
+    }
+    if (chunkId == totalChunkCount) {
+        return false;
+    }
+
+    *firstChunkId = chunkId;
+    while (chunkId < totalChunkCount && bitArrayIsSet(&blobStream->bitArray, chunkId)) {
+        chunkId++;
+    }
+    *chunkCount = chunkId - *firstChunkId;
+
+    return true;
+}
+
+static bool nextMissingRange(const BlobStreamIn* blobStream, size_t fromChunkId, size_t maxChunkCount,
+                             size_t* firstChunkId, size_t* chunkCount)
+{
+    size_t totalChunkCount = blobStream->geometry.chunkCount;
+    size_t chunkId = fromChunkId;
+    while (chunkId < totalChunkCount && bitArrayIsSet(&blobStream->bitArray, chunkId)) {
+        chunkId++;
+    }
+    if (chunkId == totalChunkCount) {
+        return false;
+    }
+
+    *firstChunkId = chunkId;
+    while (chunkId < totalChunkCount && chunkId - *firstChunkId < maxChunkCount &&
+           !bitArrayIsSet(&blobStream->bitArray, chunkId)) {
+        chunkId++;
+    }
+    *chunkCount = chunkId - *firstChunkId;
+
+    return true;
+}
+
+/// Writes a BLOB_STREAM_LOGIC_CMD_REQUEST_CHUNKS with the next missing chunks, if it is time for a request
+/// Nothing is written if the blob stream is complete, if a request was sent less than requestInterval ago,
+/// or if the current pass is done and it started less than retryInterval ago.
+/// @param self incoming blob stream logic
+/// @param now the current time
+/// @param outStream stream to write to
+/// @return the number of ranges written, or negative on error
+int blobStreamLogicInSendRequest(BlobStreamLogicIn* self, MonotonicTimeMs now, FldOutStream* outStream)
+{
+    const size_t headerOctetCount = 1 + 2 + 2;
+    const size_t rangeOctetCount = 4 + 4;
+    const BlobStreamIn* blobStream = self->blobStream;
+    if (!self->isPullMode || blobStream->isComplete) {
+        return 0;
+    }
+
+    if (self->isRequestPassStarted && now - self->lastRequestAt < self->requestInterval) {
+        return 0;
+    }
+
+    size_t octetsLeft = outStream->size - outStream->pos;
+    if (octetsLeft < headerOctetCount + rangeOctetCount) {
+        CLOG_SOFT_ERROR("stream is too small for request chunks")
+        return -2;
+    }
+
+    size_t firstChunkId;
+    size_t chunkCount;
+    bool hasMissing = self->isRequestPassStarted &&
+                      nextMissingRange(blobStream, self->requestChunkId, SIZE_MAX, &firstChunkId, &chunkCount);
+    if (!hasMissing) {
+        if (self->isRequestPassStarted && now - self->requestPassStartedAt < self->retryInterval) {
+            return 0;
+        }
+        CLOG_VERBOSE("starting a new request pass")
+        self->isRequestPassStarted = true;
+        self->requestPassStartedAt = now;
+        self->requestChunkId = 0;
+    }
+
+    size_t maxRangeCount = (octetsLeft - headerOctetCount) / rangeOctetCount;
+    if (maxRangeCount > BLOB_STREAM_MAX_REQUEST_RANGE_COUNT) {
+        maxRangeCount = BLOB_STREAM_MAX_REQUEST_RANGE_COUNT;
+    }
+
+    size_t rangeCount = 0;
+    size_t requestedCount = 0;
+    size_t chunkId = self->requestChunkId;
+    while (rangeCount < maxRangeCount && requestedCount < self->maxChunksPerRequest &&
+           nextMissingRange(blobStream, chunkId, self->maxChunksPerRequest - requestedCount, &firstChunkId,
+                            &chunkCount)) {
+        chunkId = firstChunkId + chunkCount;
+        requestedCount += chunkCount;
+        rangeCount++;
+    }
+
+    sendCommand(outStream, BLOB_STREAM_LOGIC_CMD_REQUEST_CHUNKS);
+    fldOutStreamWriteUInt16(outStream, self->transferId);
+    fldOutStreamWriteUInt16(outStream, (uint16_t) rangeCount);
+    chunkId = self->requestChunkId;
+    requestedCount = 0;
+    for (size_t i = 0; i < rangeCount; ++i) {
+        nextMissingRange(blobStream, chunkId, self->maxChunksPerRequest - requestedCount, &firstChunkId,
+                         &chunkCount);
+        fldOutStreamWriteUInt32(outStream, (uint32_t) firstChunkId);
+        fldOutStreamWriteUInt32(outStream, (uint32_t) chunkCount);
+        chunkId = firstChunkId + chunkCount;
+        requestedCount += chunkCount;
+    }
+
+    CLOG_VERBOSE("requested %zu chunks in %zu ranges from %04zX", requestedCount, rangeCount, self->requestChunkId)
+    self->requestChunkId = chunkId;
+    self->lastRequestAt = now;
+
+    return (int) rangeCount;
+}
+
+/// Writes a BLOB_STREAM_LOGIC_CMD_RESUME_TRANSFER with the ranges of chunks that are already received
+/// Used after the blob stream is restored with blobStreamInReadState(), so the sender skips those chunks.
+/// As many ranges as fit in outStream are written, call again with the updated fromChunkId until it
+/// returns zero.
+/// @param self incoming blob stream logic
+/// @param outStream stream to write to
+/// @param fromChunkId the chunk to start from, updated to the chunk after the last written range
+/// @return the number of ranges written, or negative on error
+int blobStreamLogicInSendResume(const BlobStreamLogicIn* self, FldOutStream* outStream, size_t* fromChunkId)
+{
+    const size_t headerOctetCount = 1 + 2 + 2;
+    const size_t rangeOctetCount = 4 + 4;
+    size_t octetsLeft = outStream->size - outStream->pos;
+    if (octetsLeft < headerOctetCount + rangeOctetCount) {
+        CLOG_SOFT_ERROR("stream is too small for resume transfer")
+        return -2;
+    }
+
+    size_t maxRangeCount = (octetsLeft - headerOctetCount) / rangeOctetCount;
+    if (maxRangeCount > UINT16_MAX) {
+        maxRangeCount = UINT16_MAX;
+    }
+
+    size_t rangeCount = 0;
+    size_t chunkId = *fromChunkId;
+    size_t firstChunkId;
+    size_t chunkCount;
+    while (rangeCount < maxRangeCount && nextReceivedRange(self->blobStream, chunkId, &firstChunkId, &chunkCount)) {
+        chunkId = firstChunkId + chunkCount;
+        rangeCount++;
+    }
+
+    sendCommand(outStream, BLOB_STREAM_LOGIC_CMD_RESUME_TRANSFER);
+    fldOutStreamWriteUInt16(outStream, self->transferId);
+    fldOutStreamWriteUInt16(outStream, (uint16_t) rangeCount);
+    chunkId = *fromChunkId;
+    for (size_t i = 0; i < rangeCount; ++i) {
+        nextReceivedRange(self->blobStream, chunkId, &firstChunkId, &chunkCount);
+        fldOutStreamWriteUInt32(outStream, (uint32_t) firstChunkId);
+        fldOutStreamWriteUInt32(outStream, (uint32_t) chunkCount);
+        chunkId = firstChunkId + chunkCount;
+    }
+
+    CLOG_VERBOSE("resume transfer from %04zX, %zu ranges up to %04zX", *fromChunkId, rangeCount, chunkId)
+    *fromChunkId = chunkId;
+
+    return (int) rangeCount;
 }
 
 /// Clears the logic
@@ -96,8 +966,17 @@ int blobStreamLogicInSend(BlobStreamLogicIn* self, FldOutStream* outStream)
 /// @param self incoming blob stream logic
 void blobStreamLogicInClear(BlobStreamLogicIn* self)
 {
-    (void) self;
-    // blobStreamInClear(&self->blobStream);
+    self->pendingHashAnswerFirstChunkId = 0;
+    self->pendingHashAnswerEndChunkId = 0;
+    self->isRequestPassStarted = false;
+    self->requestChunkId = 0;
+    self->unackedChunkCount = 0;
+    self->expectedChunkId = 0;
+    self->isAckPending = false;
+    self->isAckUrgent = false;
+    self->isAckDelayStarted = false;
+    self->receiveWindowEndChunkId = receiveWindowEnd(self, 0);
+    blobStreamInReset(self->blobStream);
 }
 
 /// Frees up the memory for the logic
@@ -4,11 +4,14 @@
  *--------------------------------------------------------------------------------------------------------*/
 
 #include <blob-stream/blob_stream_logic_out.h>
+#include <blob-stream/chunk_cache.h>
 #include <blob-stream/commands.h>
 #include <blob-stream/debug.h>
+#include <blob-stream/var_int.h>
 #include <flood/in_stream.h>
 #include <flood/out_stream.h>
 #include <inttypes.h>
+#include <tiny-libc/tiny_libc.h>
 
 /// Initializes the logic for sending a blob stream.
 /// @param self outgoing stream logic
@@ -18,6 +21,24 @@ void blobStreamLogicOutInit(BlobStreamLogicOut* self, BlobStreamOut* blobStream,
     CLOG_VERBOSE("blobStreamLogicOutInit")
     self->blobStream = blobStream;
     self->transferId = transferId;
+    self->isCompactRequested = false;
+    self->isTransferIdElisionRequested = false;
+    self->isCompact = false;
+    self->isTransferIdElided = false;
+    self->isStartTransferAcked = false;
+}
+
+/// Requests the compact wire format in the start transfer
+/// If the receiver accepts it in the ack start transfer, chunks are sent with
+/// BLOB_STREAM_LOGIC_CMD_SET_CHUNKS_COMPACT by blobStreamLogicOutSendEntries() and acks are received as
+/// BLOB_STREAM_LOGIC_CMD_ACK_CHUNK_COMPACT.
+/// @param self outgoing stream logic
+/// @param isTransferIdElided true to leave out the transferId from the compact commands, only for channels with a
+/// single transfer
+void blobStreamLogicOutSetCompact(BlobStreamLogicOut* self, bool isTransferIdElided)
+{
+    self->isCompactRequested = true;
+    self->isTransferIdElisionRequested = isTransferIdElided;
 }
 
 /// Calculates which chunks (parts) that needs to be resent.
@@ -38,39 +59,382 @@ static void sendCommand(FldOutStream* outStream, uint8_t cmd)
     fldOutStreamWriteUInt8(outStream, cmd);
 }
 
-const static size_t BlobStreamLogicMaxEntryOctetSize = 1080;
-
+/// Writes a BLOB_STREAM_LOGIC_CMD_START_TRANSFER command
+/// The fixedChunkSize of the blob stream is the suggested chunk size, the receiver answers with the negotiated one.
+/// The smallest chunk size the blob stream has entries for is included, so the receiver never lowers the chunk size
+/// below what the sender can handle (see blobStreamOutMinChunkSize()).
+/// If the blob stream is a delta transfer, the baselineId is included.
+/// @param self outgoing stream logic
+/// @param tempStream the target stream
+/// @return negative on error
 int blobStreamLogicOutStartTransfer(BlobStreamLogicOut* self, FldOutStream* tempStream)
 {
+    const BlobStreamOut* blobStream = self->blobStream;
     sendCommand(tempStream, BLOB_STREAM_LOGIC_CMD_START_TRANSFER);
     fldOutStreamWriteUInt16(tempStream, self->transferId);
-    fldOutStreamWriteUInt32(tempStream, (uint32_t) self->blobStream->octetCount);
-    return fldOutStreamWriteUInt16(tempStream, (uint16_t) self->blobStream->fixedChunkSize);
+    fldOutStreamWriteUInt32(tempStream, (uint32_t) blobStream->octetCount);
+    fldOutStreamWriteUInt16(tempStream, (uint16_t) blobStream->fixedChunkSize);
+    fldOutStreamWriteUInt16(tempStream, (uint16_t) blobStreamOutMinChunkSize(blobStream));
+    uint8_t flags = 0;
+    if (blobStream->isDelta) {
+        flags |= BLOB_STREAM_START_TRANSFER_FLAG_DELTA;
+    }
+    if (self->isCompactRequested) {
+        flags |= BLOB_STREAM_START_TRANSFER_FLAG_COMPACT;
+        if (self->isTransferIdElisionRequested) {
+            flags |= BLOB_STREAM_START_TRANSFER_FLAG_NO_TRANSFER_ID;
+        }
+    }
+    int flagsErr = fldOutStreamWriteUInt8(tempStream, flags);
+    if (!blobStream->isDelta) {
+        return flagsErr;
+    }
+    return fldOutStreamWriteUInt32(tempStream, blobStream->baselineId);
+}
+
+/// Writes one datagram with the start transfer, until it is acked, followed by as many chunks as fit
+/// Sending chunks in the same datagram as the start transfer saves a round trip, a small blob can complete in a
+/// single flight if the receiver creates the incoming blob stream on first sight (see blobStreamMuxSetInPool()).
+/// If the receiver lowers the chunk size in its ack start transfer, the chunks already sent are dropped by the
+/// receiver and the whole blob is sent again with the lower chunk size.
+/// @param self outgoing stream logic
+/// @param now the current time
+/// @param tempStream the target stream, usually empty
+/// @param entries scratch entries for blobStreamLogicOutPrepareSend()
+/// @param maxEntriesCount maximum number of entries
+/// @return the number of chunks written, or negative on error
+int blobStreamLogicOutSendFlight(BlobStreamLogicOut* self, MonotonicTimeMs now, FldOutStream* tempStream,
+                                 const BlobStreamOutEntry* entries[], size_t maxEntriesCount)
+{
+    if (!self->isStartTransferAcked) {
+        int startErr = blobStreamLogicOutStartTransfer(self, tempStream);
+        if (startErr < 0) {
+            return startErr;
+        }
+    }
+
+    // Only prepare chunks that are certain to fit, since prepared chunks are marked as sent
+    size_t maxChunkOctetCount = BLOB_STREAM_SET_CHUNK_ENCODED_HEADER_OCTET_SIZE + self->blobStream->fixedChunkSize;
+    size_t fitCount = (tempStream->size - tempStream->pos) / maxChunkOctetCount;
+    if (fitCount > maxEntriesCount) {
+        fitCount = maxEntriesCount;
+    }
+    if (fitCount == 0) {
+        return 0;
+    }
+
+    int entryCount = blobStreamLogicOutPrepareSend(self, now, entries, fitCount);
+    if (entryCount <= 0) {
+        return entryCount;
+    }
+
+    return blobStreamLogicOutSendEntries(self, tempStream, entries, (size_t) entryCount);
+}
+
+/// Calculates the number of octets that blobStreamLogicOutSendEntry() writes for the entry
+/// @param entry the entry to send
+/// @return the octet count including the command header
+size_t blobStreamLogicOutEntryOctetCount(const BlobStreamOutEntry* entry)
+{
+    size_t headerOctetCount = entry->encoding == BLOB_STREAM_CHUNK_ENCODING_RAW
+                                  ? BLOB_STREAM_SET_CHUNK_HEADER_OCTET_SIZE
+                                  : BLOB_STREAM_SET_CHUNK_ENCODED_HEADER_OCTET_SIZE;
+    return headerOctetCount + entry->octetCount;
 }
 
 /// Serialize the specified entry to the target outStream.
+/// Compressed entries are sent as BLOB_STREAM_LOGIC_CMD_SET_CHUNK_ENCODED.
 /// @param tempStream the target stream
 /// @param entry specifies which chunk (part) of the blob stream to serialize
 /// @return if error occurred it returns a negative error code.
 int blobStreamLogicOutSendEntry(FldOutStream* tempStream, const BlobStreamOutEntry* entry,
                                 BlobStreamTransferId transferId)
 {
-    if (entry->octetCount > BlobStreamLogicMaxEntryOctetSize) {
+    size_t serializedOctetCount = blobStreamLogicOutEntryOctetCount(entry);
+    if (tempStream->pos + serializedOctetCount > tempStream->size) {
+        CLOG_SOFT_ERROR("stream is too small, needed room for a complete blob stream part (%zu), but has:%zu",
+                        serializedOctetCount, tempStream->size - tempStream->pos)
+        return -2;
     }
 
-    if (tempStream->pos + entry->octetCount + sizeof(uint32_t) + sizeof(uint16_t) > tempStream->size) {
-        CLOG_ERROR("stream is too small, needed room for a complete blob stream part (%zu), but has:%zu",
-                   BlobStreamLogicMaxEntryOctetSize, tempStream->size - tempStream->pos)
-        // return -2;
+    if (entry->encoding == BLOB_STREAM_CHUNK_ENCODING_RAW) {
+        sendCommand(tempStream, BLOB_STREAM_LOGIC_CMD_SET_CHUNK);
+        fldOutStreamWriteUInt16(tempStream, transferId);
+        fldOutStreamWriteUInt32(tempStream, entry->chunkId);
+    } else {
+        sendCommand(tempStream, BLOB_STREAM_LOGIC_CMD_SET_CHUNK_ENCODED);
+        fldOutStreamWriteUInt16(tempStream, transferId);
+        fldOutStreamWriteUInt32(tempStream, entry->chunkId);
+        fldOutStreamWriteUInt8(tempStream, entry->encoding);
     }
-
-    sendCommand(tempStream, BLOB_STREAM_LOGIC_CMD_SET_CHUNK);
-    fldOutStreamWriteUInt16(tempStream, transferId);
-    fldOutStreamWriteUInt32(tempStream, entry->chunkId);
     fldOutStreamWriteUInt16(tempStream, (uint16_t) entry->octetCount);
     return fldOutStreamWriteOctets(tempStream, entry->octets, entry->octetCount);
 }
 
+static size_t compactEntryOctetCount(const BlobStreamOutEntry* entry, BlobStreamChunkId expectedChunkId)
+{
+    int64_t delta = (int64_t) entry->chunkId - (int64_t) expectedChunkId;
+    size_t keyOctetCount = blobStreamVarIntOctetCount(blobStreamZigZagEncode(delta) << 1);
+    if (entry->encoding == BLOB_STREAM_CHUNK_ENCODING_RAW) {
+        return keyOctetCount + entry->octetCount;
+    }
+
+    return keyOctetCount + 1 + blobStreamVarIntOctetCount(entry->octetCount) + entry->octetCount;
+}
+
+static int sendEntriesCompact(BlobStreamLogicOut* self, FldOutStream* tempStream, const BlobStreamOutEntry* entries[],
+                              size_t entryCount)
+{
+    size_t headerOctetCount = 1 + (self->isTransferIdElided ? 0 : 2) + blobStreamVarIntOctetCount(entryCount);
+    size_t octetsLeft = tempStream->size - tempStream->pos;
+    size_t octetCount = headerOctetCount;
+    size_t fitCount = 0;
+    BlobStreamChunkId expectedChunkId = 0;
+    for (; fitCount < entryCount; ++fitCount) {
+        size_t entryOctetCount = compactEntryOctetCount(entries[fitCount], expectedChunkId);
+        if (octetCount + entryOctetCount > octetsLeft) {
+            break;
+        }
+        octetCount += entryOctetCount;
+        expectedChunkId = entries[fitCount]->chunkId + 1;
+    }
+
+    if (fitCount == 0) {
+        CLOG_SOFT_ERROR("stream is too small for a compact chunk, has:%zu", octetsLeft)
+        return -2;
+    }
+
+    sendCommand(tempStream, BLOB_STREAM_LOGIC_CMD_SET_CHUNKS_COMPACT);
+    if (!self->isTransferIdElided) {
+        fldOutStreamWriteUInt16(tempStream, self->transferId);
+    }
+    blobStreamVarIntWrite(tempStream, fitCount);
+    expectedChunkId = 0;
+    for (size_t i = 0; i < fitCount; ++i) {
+        const BlobStreamOutEntry* entry = entries[i];
+        int64_t delta = (int64_t) entry->chunkId - (int64_t) expectedChunkId;
+        bool isEncoded = entry->encoding != BLOB_STREAM_CHUNK_ENCODING_RAW;
+        blobStreamVarIntWrite(tempStream, (blobStreamZigZagEncode(delta) << 1) | (isEncoded ? 1 : 0));
+        if (isEncoded) {
+            fldOutStreamWriteUInt8(tempStream, entry->encoding);
+            blobStreamVarIntWrite(tempStream, entry->octetCount);
+        }
+        int err = fldOutStreamWriteOctets(tempStream, entry->octets, entry->octetCount);
+        if (err < 0) {
+            return err;
+        }
+        expectedChunkId = entry->chunkId + 1;
+    }
+
+    return (int) fitCount;
+}
+
+/// Serialize as many entries as fit into the target stream, usually one datagram
+/// With the compact format, all entries are written in one BLOB_STREAM_LOGIC_CMD_SET_CHUNKS_COMPACT, otherwise
+/// each entry is written as with blobStreamLogicOutSendEntry().
+/// @param self outgoing stream logic
+/// @param tempStream the target stream
+/// @param entries entries from blobStreamLogicOutPrepareSend()
+/// @param entryCount number of entries
+/// @return the number of entries written, or negative on error
+int blobStreamLogicOutSendEntries(BlobStreamLogicOut* self, FldOutStream* tempStream,
+                                  const BlobStreamOutEntry* entries[], size_t entryCount)
+{
+    if (entryCount == 0) {
+        return 0;
+    }
+
+    if (self->isCompact) {
+        return sendEntriesCompact(self, tempStream, entries, entryCount);
+    }
+
+    size_t writtenCount = 0;
+    for (; writtenCount < entryCount; ++writtenCount) {
+        const BlobStreamOutEntry* entry = entries[writtenCount];
+        if (tempStream->pos + blobStreamLogicOutEntryOctetCount(entry) > tempStream->size) {
+            break;
+        }
+        blobStreamLogicOutSendEntry(tempStream, entry, self->transferId);
+    }
+
+    if (writtenCount == 0) {
+        CLOG_SOFT_ERROR("stream is too small for a chunk, has:%zu", tempStream->size - tempStream->pos)
+        return -2;
+    }
+
+    return (int) writtenCount;
+}
+
+/// Serialize a run of entries back to back, suitable for UDP generic segmentation offload (GSO)
+/// Every command is exactly segmentOctetSize octets, except maybe the last one, so the
+/// whole tempStream can be sent with one system call using segmentOctetSize as the segment size (UDP_SEGMENT).
+/// The run stops after the first entry that is smaller than the first one, and before any entry that is larger.
+/// @param tempStream the target stream
+/// @param entries entries from blobStreamLogicOutPrepareSend()
+/// @param entryCount number of entries
+/// @param transferId the transfer id
+/// @param segmentOctetSize set to the octet size of each segment
+/// @return the number of entries written, or negative on error
+int blobStreamLogicOutSendEntryRun(FldOutStream* tempStream, const BlobStreamOutEntry* entries[], size_t entryCount,
+                                   BlobStreamTransferId transferId, size_t* segmentOctetSize)
+{
+    if (entryCount == 0) {
+        *segmentOctetSize = 0;
+        return 0;
+    }
+
+    *segmentOctetSize = blobStreamLogicOutEntryOctetCount(entries[0]);
+
+    size_t writtenCount = 0;
+    for (size_t i = 0; i < entryCount; ++i) {
+        const BlobStreamOutEntry* entry = entries[i];
+        size_t serializedOctetCount = blobStreamLogicOutEntryOctetCount(entry);
+        if (serializedOctetCount > *segmentOctetSize) {
+            break;
+        }
+        int err = blobStreamLogicOutSendEntry(tempStream, entry, transferId);
+        if (err < 0) {
+            if (writtenCount == 0) {
+                return err;
+            }
+            break;
+        }
+        writtenCount++;
+        if (serializedOctetCount < *segmentOctetSize) {
+            break;
+        }
+    }
+
+    return (int) writtenCount;
+}
+
+/// Writes a BLOB_STREAM_LOGIC_CMD_CHUNK_HASHES command with the content hashes of the chunks from firstChunkId
+/// As many hashes as fit in tempStream are written. The receiver answers with the chunks it already has in its
+/// chunk cache, and those chunks are never sent. Should be sent before the chunks, usually right after the
+/// start transfer.
+/// @param self outgoing stream logic
+/// @param tempStream the target stream
+/// @param firstChunkId the first chunk to write the hash for
+/// @return the number of hashes written, or negative on error
+int blobStreamLogicOutSendChunkHashes(BlobStreamLogicOut* self, FldOutStream* tempStream,
+                                      BlobStreamChunkId firstChunkId)
+{
+    const size_t headerOctetCount = 1 + 2 + 4 + 2;
+    const BlobStreamOut* blobStream = self->blobStream;
+    if (blobStream->blob == 0 || firstChunkId >= blobStream->chunkCount) {
+        CLOG_SOFT_ERROR("no chunk hashes to send from %04X", firstChunkId)
+        return -1;
+    }
+
+    size_t octetsLeft = tempStream->size - tempStream->pos;
+    if (octetsLeft < headerOctetCount + sizeof(BlobStreamChunkHash)) {
+        CLOG_SOFT_ERROR("stream is too small for chunk hashes")
+        return -2;
+    }
+
+    size_t hashCount = blobStream->chunkCount - firstChunkId;
+    size_t maxHashCount = (octetsLeft - headerOctetCount) / sizeof(BlobStreamChunkHash);
+    if (hashCount > maxHashCount) {
+        hashCount = maxHashCount;
+    }
+    if (hashCount > UINT16_MAX) {
+        hashCount = UINT16_MAX;
+    }
+
+    sendCommand(tempStream, BLOB_STREAM_LOGIC_CMD_CHUNK_HASHES);
+    fldOutStreamWriteUInt16(tempStream, self->transferId);
+    fldOutStreamWriteUInt32(tempStream, firstChunkId);
+    fldOutStreamWriteUInt16(tempStream, (uint16_t) hashCount);
+    for (size_t i = 0; i < hashCount; ++i) {
+        BlobStreamChunkId chunkId = firstChunkId + (BlobStreamChunkId) i;
+        const uint8_t* octets = blobStream->blob + blobStreamChunkGeometryOffset(&blobStream->geometry, chunkId);
+        size_t octetCount = blobStreamChunkGeometryOctetCount(&blobStream->geometry, chunkId);
+        fldOutStreamWriteUInt64(tempStream, blobStreamChunkHash(octets, octetCount));
+    }
+
+    return (int) hashCount;
+}
+
+static bool nextUnacknowledgedExpiredRange(const BlobStreamOut* blobStream, size_t fromChunkId,
+                                           size_t* firstChunkId, size_t* chunkCount)
+{
+    size_t chunkId = fromChunkId;
+    while (blobStreamOutNextExpiredRange(blobStream, chunkId, firstChunkId, chunkCount)) {
+        size_t endChunkId = *firstChunkId + *chunkCount;
+        chunkId = *firstChunkId;
+        while (chunkId < endChunkId && blobStream->entries[chunkId].isReceived) {
+            chunkId++;
+        }
+        if (chunkId == endChunkId) {
+            continue;
+        }
+        *firstChunkId = chunkId;
+        while (chunkId < endChunkId && !blobStream->entries[chunkId].isReceived) {
+            chunkId++;
+        }
+        *chunkCount = chunkId - *firstChunkId;
+        return true;
+    }
+
+    return false;
+}
+
+/// Writes a BLOB_STREAM_LOGIC_CMD_CHUNKS_EXPIRED with the ranges of expired chunks
+/// Only chunks that the receiver has not acknowledged yet are included, so it should be sent regularly until
+/// the blob stream is complete. As many ranges as fit in tempStream are written, call again with the updated
+/// fromChunkId until it returns zero.
+/// @param self outgoing stream logic
+/// @param tempStream the target stream
+/// @param fromChunkId the chunk to start from, updated to the chunk after the last written range
+/// @return the number of ranges written, or negative on error
+int blobStreamLogicOutSendExpired(BlobStreamLogicOut* self, FldOutStream* tempStream, size_t* fromChunkId)
+{
+    const size_t headerOctetCount = 1 + 2 + 2;
+    const size_t rangeOctetCount = 4 + 4;
+    const BlobStreamOut* blobStream = self->blobStream;
+    if (blobStream->pendingExpiredChunkCount == 0) {
+        return 0;
+    }
+
+    size_t octetsLeft = tempStream->size - tempStream->pos;
+    if (octetsLeft < headerOctetCount + rangeOctetCount) {
+        CLOG_SOFT_ERROR("stream is too small for chunks expired")
+        return -2;
+    }
+
+    size_t maxRangeCount = (octetsLeft - headerOctetCount) / rangeOctetCount;
+    if (maxRangeCount > UINT16_MAX) {
+        maxRangeCount = UINT16_MAX;
+    }
+
+    size_t rangeCount = 0;
+    size_t chunkId = *fromChunkId;
+    size_t firstChunkId;
+    size_t chunkCount;
+    while (rangeCount < maxRangeCount &&
+           nextUnacknowledgedExpiredRange(blobStream, chunkId, &firstChunkId, &chunkCount)) {
+        chunkId = firstChunkId + chunkCount;
+        rangeCount++;
+    }
+    if (rangeCount == 0) {
+        return 0;
+    }
+
+    sendCommand(tempStream, BLOB_STREAM_LOGIC_CMD_CHUNKS_EXPIRED);
+    fldOutStreamWriteUInt16(tempStream, self->transferId);
+    fldOutStreamWriteUInt16(tempStream, (uint16_t) rangeCount);
+    chunkId = *fromChunkId;
+    for (size_t i = 0; i < rangeCount; ++i) {
+        nextUnacknowledgedExpiredRange(blobStream, chunkId, &firstChunkId, &chunkCount);
+        fldOutStreamWriteUInt32(tempStream, (uint32_t) firstChunkId);
+        fldOutStreamWriteUInt32(tempStream, (uint32_t) chunkCount);
+        chunkId = firstChunkId + chunkCount;
+    }
+    *fromChunkId = chunkId;
+
+    return (int) rangeCount;
+}
+
 /// Checks if the blob stream is fully received by the receiver.
 /// @param self outgoing stream logic
 /// @return true if fully received
@@ -87,7 +451,50 @@ bool blobStreamLogicOutIsAllSent(BlobStreamLogicOut* self)
     return blobStreamOutIsAllSent(self->blobStream);
 }
 
-static int ackStart(BlobStreamLogicOut* self, FldInStream* inStream)
+// Reinitializes the blob stream with the negotiated chunk size. The baseline is set again and each priority range
+// is moved to the chunks that now hold its octets. A salvaged stream never gets here, see blobStreamOutMinChunkSize().
+static int changeChunkSize(BlobStreamOut* blobStream, size_t fixedChunkSize)
+{
+    const uint8_t* baseline = blobStream->baseline;
+    size_t baselineOctetCount = blobStream->baselineOctetCount;
+    uint8_t* deltaCache = blobStream->deltaCache;
+    size_t previousChunkSize = blobStream->fixedChunkSize;
+    size_t priorityRangeCount = blobStream->priorityRangeCount;
+    BlobStreamOutRange priorityRanges[BLOB_STREAM_OUT_MAX_RANGE_COUNT];
+    tc_memcpy_octets(priorityRanges, blobStream->priorityRanges, priorityRangeCount * sizeof(BlobStreamOutRange));
+
+    int reinitErr = blobStreamOutReinit(blobStream, blobStream->blob, blobStream->octetCount, fixedChunkSize);
+    if (reinitErr < 0) {
+        return reinitErr;
+    }
+
+    if (baseline != 0) {
+        int baselineErr = blobStreamOutSetBaseline(blobStream, blobStream->baselineId, baseline, baselineOctetCount,
+                                                   deltaCache);
+        if (baselineErr < 0) {
+            return baselineErr;
+        }
+    }
+
+    for (size_t i = 0; i < priorityRangeCount; ++i) {
+        size_t firstOctet = priorityRanges[i].firstChunkId * previousChunkSize;
+        size_t endOctet = priorityRanges[i].endChunkId * previousChunkSize;
+        if (endOctet > blobStream->octetCount) {
+            endOctet = blobStream->octetCount;
+        }
+        size_t firstChunkId = firstOctet / fixedChunkSize;
+        size_t endChunkId = (endOctet + fixedChunkSize - 1) / fixedChunkSize;
+        int rangeErr = blobStreamOutAddPriorityRange(blobStream, (BlobStreamChunkId) firstChunkId,
+                                                     endChunkId - firstChunkId);
+        if (rangeErr < 0) {
+            return rangeErr;
+        }
+    }
+
+    return 0;
+}
+
+static int ackStart(BlobStreamLogicOut* self, FldInStream* inStream, bool isApplying)
 {
     BlobStreamTransferId transferId;
 
@@ -96,15 +503,59 @@ static int ackStart(BlobStreamLogicOut* self, FldInStream* inStream)
         return transferErr;
     }
 
+    uint16_t fixedChunkSize;
+    int chunkSizeErr = fldInStreamReadUInt16(inStream, &fixedChunkSize);
+    if (chunkSizeErr < 0) {
+        return chunkSizeErr;
+    }
+
+    uint8_t acceptedFlags;
+    int flagsErr = fldInStreamReadUInt8(inStream, &acceptedFlags);
+    if (flagsErr < 0) {
+        return flagsErr;
+    }
+
     if (transferId != self->transferId) {
         CLOG_SOFT_ERROR("ack start for wrong transferId %04X vs %04X", transferId, self->transferId)
         return -1;
     }
 
+    BlobStreamOut* blobStream = self->blobStream;
+    bool isChunkSizeChanged = fixedChunkSize != blobStream->fixedChunkSize;
+    if (isChunkSizeChanged) {
+        if (fixedChunkSize < blobStreamOutMinChunkSize(blobStream) || fixedChunkSize > blobStream->fixedChunkSize) {
+            CLOG_SOFT_ERROR("receiver negotiated illegal chunk size %hu", fixedChunkSize)
+            return -2;
+        }
+        // Chunks sent before the first ack start are dropped by the receiver and sent again with the new size
+        if (self->isStartTransferAcked && blobStream->sentChunkEntryCount != 0) {
+            CLOG_SOFT_ERROR("chunk size can not change after chunks are sent")
+            return -3;
+        }
+    }
+
+    if (!isApplying) {
+        return 0;
+    }
+
+    if (isChunkSizeChanged) {
+        CLOG_VERBOSE("receiver negotiated chunk size %hu (suggested %zu)", fixedChunkSize, blobStream->fixedChunkSize)
+        int changeErr = changeChunkSize(blobStream, fixedChunkSize);
+        if (changeErr < 0) {
+            return changeErr;
+        }
+    }
+
+    self->isStartTransferAcked = true;
+
+    self->isCompact = self->isCompactRequested && (acceptedFlags & BLOB_STREAM_START_TRANSFER_FLAG_COMPACT);
+    self->isTransferIdElided = self->isCompact && self->isTransferIdElisionRequested &&
+                               (acceptedFlags & BLOB_STREAM_START_TRANSFER_FLAG_NO_TRANSFER_ID);
+
     return 0;
 }
 
-static int ackChunk(BlobStreamLogicOut* self, FldInStream* inStream)
+static int ackChunk(BlobStreamLogicOut* self, FldInStream* inStream, bool isApplying)
 {
     BlobStreamTransferId transferId;
 
@@ -125,20 +576,258 @@ static int ackChunk(BlobStreamLogicOut* self, FldInStream* inStream)
         return readLengthErr;
     }
 
+    uint32_t receiveWindowEndChunkId;
+    int windowErr = fldInStreamReadUInt32(inStream, &receiveWindowEndChunkId);
+    if (windowErr < 0) {
+        return windowErr;
+    }
+
     if (transferId != self->transferId) {
         CLOG_SOFT_ERROR("ack chunk for wrong transferId %04X vs %04X", transferId, self->transferId)
         return -1;
     }
 
-    CLOG_VERBOSE("ack chunk: %u mask:%" PRIx64, waitingForChunkId, receiveMask)
+    if (!isApplying) {
+        return 0;
+    }
+
+    CLOG_VERBOSE("ack chunk: %u mask:%" PRIx64 " window end: %u", waitingForChunkId, receiveMask,
+                 receiveWindowEndChunkId)
+
+    // The receiver has the blob stream, even if the ack start transfer was lost
+    self->isStartTransferAcked = true;
 
     blobStreamOutMarkReceived(self->blobStream, (BlobStreamChunkId) waitingForChunkId, receiveMask);
+    blobStreamOutSetReceiveWindow(self->blobStream, receiveWindowEndChunkId);
+
+    return 0;
+}
+
+static int ackChunkCompact(BlobStreamLogicOut* self, FldInStream* inStream, bool isApplying)
+{
+    BlobStreamTransferId transferId = self->transferId;
+    if (!self->isTransferIdElided) {
+        int transferErr = fldInStreamReadUInt16(inStream, &transferId);
+        if (transferErr < 0) {
+            return transferErr;
+        }
+    }
+
+    uint64_t waitingForChunkId;
+    uint64_t receiveMask;
+    uint64_t receiveWindowChunkCount;
+    int waitingErr = blobStreamVarIntRead(inStream, &waitingForChunkId);
+    if (waitingErr < 0) {
+        return waitingErr;
+    }
+    int maskErr = blobStreamVarIntRead(inStream, &receiveMask);
+    if (maskErr < 0) {
+        return maskErr;
+    }
+    int windowErr = blobStreamVarIntRead(inStream, &receiveWindowChunkCount);
+    if (windowErr < 0) {
+        return windowErr;
+    }
+
+    if (transferId != self->transferId) {
+        CLOG_SOFT_ERROR("ack chunk compact for wrong transferId %04X vs %04X", transferId, self->transferId)
+        return -1;
+    }
+
+    BlobStreamOut* blobStream = self->blobStream;
+    if (waitingForChunkId > blobStream->chunkCount || receiveWindowChunkCount > blobStream->chunkCount) {
+        CLOG_SOFT_ERROR("illegal ack chunk compact %" PRIu64 " window %" PRIu64, waitingForChunkId,
+                        receiveWindowChunkCount)
+        return -3;
+    }
+
+    if (!isApplying) {
+        return 0;
+    }
+
+    CLOG_VERBOSE("ack chunk compact: %" PRIu64 " mask:%" PRIx64, waitingForChunkId, receiveMask)
+
+    blobStreamOutMarkReceived(blobStream, (BlobStreamChunkId) waitingForChunkId, receiveMask);
+    blobStreamOutSetReceiveWindow(blobStream, (size_t) (waitingForChunkId + receiveWindowChunkCount));
 
     return 0;
 }
 
+static int ackChunkHashes(BlobStreamLogicOut* self, FldInStream* inStream, bool isApplying)
+{
+    BlobStreamTransferId transferId;
+    int transferErr = fldInStreamReadUInt16(inStream, &transferId);
+    if (transferErr < 0) {
+        return transferErr;
+    }
+
+    uint32_t firstChunkId;
+    int readErr = fldInStreamReadUInt32(inStream, &firstChunkId);
+    if (readErr < 0) {
+        return readErr;
+    }
+
+    uint16_t chunkCount;
+    int countErr = fldInStreamReadUInt16(inStream, &chunkCount);
+    if (countErr < 0) {
+        return countErr;
+    }
+
+    size_t bitmapOctetCount = ((size_t) chunkCount + 7) / 8;
+    if (inStream->pos + bitmapOctetCount > inStream->size) {
+        CLOG_SOFT_ERROR("ack chunk hashes is truncated %hu", chunkCount)
+        return -2;
+    }
+
+    const uint8_t* bitmap = inStream->p;
+    inStream->p += bitmapOctetCount;
+    inStream->pos += bitmapOctetCount;
+
+    if (transferId != self->transferId) {
+        CLOG_SOFT_ERROR("ack chunk hashes for wrong transferId %04X vs %04X", transferId, self->transferId)
+        return -1;
+    }
+
+    if ((size_t) firstChunkId + chunkCount > self->blobStream->chunkCount) {
+        CLOG_SOFT_ERROR("illegal ack chunk hashes range %u count %hu", firstChunkId, chunkCount)
+        return -3;
+    }
+
+    if (!isApplying) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < chunkCount; ++i) {
+        if (bitmap[i / 8] & (1 << (i % 8))) {
+            blobStreamOutMarkChunkReceived(self->blobStream, (BlobStreamChunkId) (firstChunkId + i));
+        }
+    }
+
+    return 0;
+}
+
+static int resumeTransfer(BlobStreamLogicOut* self, FldInStream* inStream, bool isApplying)
+{
+    BlobStreamTransferId transferId;
+    int transferErr = fldInStreamReadUInt16(inStream, &transferId);
+    if (transferErr < 0) {
+        return transferErr;
+    }
+
+    uint16_t rangeCount;
+    int countErr = fldInStreamReadUInt16(inStream, &rangeCount);
+    if (countErr < 0) {
+        return countErr;
+    }
+
+    if (inStream->pos + (size_t) rangeCount * (4 + 4) > inStream->size) {
+        CLOG_SOFT_ERROR("resume transfer is truncated %hu", rangeCount)
+        return -2;
+    }
+
+    bool isForThisTransfer = transferId == self->transferId;
+    if (!isForThisTransfer) {
+        CLOG_SOFT_ERROR("resume transfer for wrong transferId %04X vs %04X", transferId, self->transferId)
+    }
+
+    // Ranges must be ascending and not overlap, so at most chunkCount chunks are marked per command
+    BlobStreamOut* blobStream = self->blobStream;
+    size_t rangeStartMinimum = 0;
+    for (size_t i = 0; i < rangeCount; ++i) {
+        uint32_t firstChunkId;
+        uint32_t chunkCount;
+        fldInStreamReadUInt32(inStream, &firstChunkId);
+        fldInStreamReadUInt32(inStream, &chunkCount);
+        if (!isForThisTransfer) {
+            continue;
+        }
+        if ((size_t) firstChunkId + chunkCount > blobStream->chunkCount) {
+            CLOG_SOFT_ERROR("illegal resume range %u count %u", firstChunkId, chunkCount)
+            return -3;
+        }
+        if (firstChunkId < rangeStartMinimum) {
+            CLOG_SOFT_ERROR("resume range %u overlaps or is not ascending", firstChunkId)
+            return -4;
+        }
+        rangeStartMinimum = (size_t) firstChunkId + chunkCount;
+        if (!isApplying) {
+            continue;
+        }
+        for (size_t chunkId = firstChunkId; chunkId < (size_t) firstChunkId + chunkCount; ++chunkId) {
+            blobStreamOutMarkChunkReceived(blobStream, (BlobStreamChunkId) chunkId);
+        }
+    }
+
+    return isForThisTransfer ? 0 : -1;
+}
+
+static int requestChunks(BlobStreamLogicOut* self, FldInStream* inStream, bool isApplying)
+{
+    BlobStreamTransferId transferId;
+    int transferErr = fldInStreamReadUInt16(inStream, &transferId);
+    if (transferErr < 0) {
+        return transferErr;
+    }
+
+    uint16_t rangeCount;
+    int countErr = fldInStreamReadUInt16(inStream, &rangeCount);
+    if (countErr < 0) {
+        return countErr;
+    }
+
+    if (inStream->pos + (size_t) rangeCount * (4 + 4) > inStream->size) {
+        CLOG_SOFT_ERROR("request chunks is truncated %hu", rangeCount)
+        return -2;
+    }
+
+    bool isForThisTransfer = transferId == self->transferId;
+    if (!isForThisTransfer) {
+        CLOG_SOFT_ERROR("request chunks for wrong transferId %04X vs %04X", transferId, self->transferId)
+    } else if (isApplying) {
+        // The receiver drives the transfer from now on
+        blobStreamOutSetPullMode(self->blobStream, true);
+    }
+
+    for (size_t i = 0; i < rangeCount; ++i) {
+        uint32_t firstChunkId;
+        uint32_t chunkCount;
+        fldInStreamReadUInt32(inStream, &firstChunkId);
+        fldInStreamReadUInt32(inStream, &chunkCount);
+        if (isForThisTransfer && isApplying) {
+            // A request that does not fit is dropped, the receiver requests it again
+            blobStreamOutRequestChunks(self->blobStream, firstChunkId, chunkCount);
+        }
+    }
+
+    return isForThisTransfer ? 0 : -1;
+}
+
+/// Reads one command. When not applying, the command is only validated and consumed, without changing any state.
+static int receiveCommand(BlobStreamLogicOut* self, uint8_t cmd, FldInStream* inStream, bool isApplying)
+{
+    switch (cmd) {
+        case BLOB_STREAM_LOGIC_CMD_ACK_CHUNK:
+            return ackChunk(self, inStream, isApplying);
+        case BLOB_STREAM_LOGIC_CMD_ACK_START_TRANSFER:
+            return ackStart(self, inStream, isApplying);
+        case BLOB_STREAM_LOGIC_CMD_ACK_CHUNK_HASHES:
+            return ackChunkHashes(self, inStream, isApplying);
+        case BLOB_STREAM_LOGIC_CMD_RESUME_TRANSFER:
+            return resumeTransfer(self, inStream, isApplying);
+        case BLOB_STREAM_LOGIC_CMD_REQUEST_CHUNKS:
+            return requestChunks(self, inStream, isApplying);
+        case BLOB_STREAM_LOGIC_CMD_ACK_CHUNK_COMPACT:
+            return ackChunkCompact(self, inStream, isApplying);
+        default:
+            CLOG_SOFT_ERROR("blobStreamLogicOutReceive: Unknown command %02X", cmd)
+            return -2;
+    }
+}
+
 /// Receive a blob stream command
-/// Only BLOB_STREAM_LOGIC_CMD_ACK_CHUNK is supported.
+/// BLOB_STREAM_LOGIC_CMD_ACK_CHUNK, BLOB_STREAM_LOGIC_CMD_ACK_START_TRANSFER,
+/// BLOB_STREAM_LOGIC_CMD_ACK_CHUNK_HASHES, BLOB_STREAM_LOGIC_CMD_RESUME_TRANSFER,
+/// BLOB_STREAM_LOGIC_CMD_REQUEST_CHUNKS and BLOB_STREAM_LOGIC_CMD_ACK_CHUNK_COMPACT are supported.
 /// @param self outgoing stream logic
 /// @param inStream the stream to read from
 /// @return negative value if error was encountered.
@@ -150,14 +839,45 @@ int blobStreamLogicOutReceive(BlobStreamLogicOut* self, struct FldInStream* inSt
         return cmdResult;
     }
 
-    switch (cmd) {
-        case BLOB_STREAM_LOGIC_CMD_ACK_CHUNK:
-            return ackChunk(self, inStream);
-        case BLOB_STREAM_LOGIC_CMD_ACK_START_TRANSFER:
-            return ackStart(self, inStream);
-        default:
-            CLOG_ERROR("blobStreamLogicOutReceive: Unknown command %02X", cmd)
+    return receiveCommand(self, cmd, inStream, true);
+}
+
+/// Receives a whole datagram with many blob stream commands for the sender
+/// All commands are validated first, both bounds and contents, so a truncated, unknown or illegal command
+/// rejects the whole datagram before anything is applied. A command that still fails while it is applied
+/// is skipped and the rest of the commands are applied.
+/// @param self outgoing stream logic
+/// @param inStream stream with the datagram, it is fully consumed on success
+/// @return the number of commands applied, or negative on error
+int blobStreamLogicOutReceiveDatagram(BlobStreamLogicOut* self, struct FldInStream* inStream)
+{
+    FldInStream validateStream = *inStream;
+    size_t commandCount = 0;
+    while (validateStream.pos < validateStream.size) {
+        uint8_t cmd;
+        fldInStreamReadUInt8(&validateStream, &cmd);
+        int validateErr = receiveCommand(self, cmd, &validateStream, false);
+        if (validateErr < 0) {
+            CLOG_SOFT_ERROR("rejecting datagram, command %zu (%02X) at %zu is illegal", commandCount, cmd,
+                            validateStream.pos)
+            return validateErr;
+        }
+        commandCount++;
     }
+
+    // The reads can not fail anymore, every command consumes all of its octets even if it is rejected
+    size_t appliedCount = 0;
+    for (size_t i = 0; i < commandCount; ++i) {
+        uint8_t cmd;
+        fldInStreamReadUInt8(inStream, &cmd);
+        if (receiveCommand(self, cmd, inStream, true) < 0) {
+            CLOG_SOFT_ERROR("skipping command %zu (%02X) in datagram", i, cmd)
+            continue;
+        }
+        appliedCount++;
+    }
+
+    return (int) appliedCount;
 }
 
 /// Frees up the memory for the outgoing logic
@@ -0,0 +1,290 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/blob-stream
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include <blob-stream/blob_stream_multi_source.h>
+#include <blob-stream/blob_stream_out.h>
+#include <blob-stream/commands.h>
+#include <flood/in_stream.h>
+#include <flood/out_stream.h>
+#include <imprint/allocator.h>
+#include <tiny-libc/tiny_libc.h>
+
+#define BLOB_STREAM_MULTI_SOURCE_INITIAL_WINDOW (4)
+#define BLOB_STREAM_MULTI_SOURCE_MIN_TIMEOUT (20)
+
+/// Initializes a receiver that downloads one blob from several senders in parallel
+/// Each source is a sender of the same blob in pull mode (see blobStreamOutSetPullMode()). The missing chunks
+/// are split between the sources, each with a window of outstanding chunks that grows when the source delivers
+/// and is halved when a request times out, so slow and lossy sources get less work.
+/// @param self multi source receiver
+/// @param memory allocator for the per chunk book keeping
+/// @param blobStream the blob stream to receive to
+/// @param maxWindow the maximum number of outstanding chunks for a source
+/// @param initialTimeout the request timeout until the round trip time of a source is known
+/// @param log the log to use
+void blobStreamMultiSourceInit(BlobStreamMultiSource* self, struct ImprintAllocator* memory, BlobStreamIn* blobStream,
+                               size_t maxWindow, MonotonicTimeMs initialTimeout, Clog log)
+{
+    size_t chunkCount = blobStream->geometry.chunkCount;
+    self->log = log;
+    self->blobStream = blobStream;
+    self->sourceCount = 0;
+    self->nextChunkId = 0;
+    self->maxWindow = maxWindow;
+    self->initialTimeout = initialTimeout;
+    self->chunkSources = IMPRINT_ALLOC_TYPE_COUNT(memory, uint8_t, chunkCount);
+    self->chunkRequestedAt = IMPRINT_ALLOC_TYPE_COUNT(memory, MonotonicTimeMs, chunkCount);
+    for (size_t i = 0; i < chunkCount; ++i) {
+        self->chunkSources[i] = BLOB_STREAM_MULTI_SOURCE_NO_SOURCE;
+        self->chunkRequestedAt[i] = 0;
+    }
+}
+
+/// Adds a sender of the blob
+/// The start transfer from the source must describe the same blob as the blob stream.
+/// @param self multi source receiver
+/// @param startTransfer the start transfer received from the source
+/// @return the source index, or negative on error
+int blobStreamMultiSourceAddSource(BlobStreamMultiSource* self, const BlobStreamStartTransfer* startTransfer)
+{
+    if (self->sourceCount == BLOB_STREAM_MULTI_SOURCE_MAX_SOURCE_COUNT) {
+        CLOG_C_SOFT_ERROR(&self->log, "too many sources")
+        return -1;
+    }
+
+    if (startTransfer->octetCount != self->blobStream->octetCount ||
+        startTransfer->fixedChunkSize != self->blobStream->fixedChunkSize) {
+        CLOG_C_SOFT_ERROR(&self->log, "source %04X has a different blob, %zu octets in chunks of %zu",
+                          startTransfer->transferId, startTransfer->octetCount, startTransfer->fixedChunkSize)
+        return -2;
+    }
+
+    size_t sourceIndex = self->sourceCount++;
+    BlobStreamSource* source = &self->sources[sourceIndex];
+    blobStreamLogicInInit(&source->logicIn, self->blobStream, startTransfer->transferId);
+    source->smoothedRtt = 0;
+    source->hasRtt = false;
+    source->window = BLOB_STREAM_MULTI_SOURCE_INITIAL_WINDOW < self->maxWindow
+                         ? BLOB_STREAM_MULTI_SOURCE_INITIAL_WINDOW
+                         : self->maxWindow;
+    source->outstandingCount = 0;
+    source->deliveredChunkCount = 0;
+    source->timedOutChunkCount = 0;
+    source->isEnabled = true;
+
+    return (int) sourceIndex;
+}
+
+static MonotonicTimeMs requestTimeout(const BlobStreamMultiSource* self, const BlobStreamSource* source)
+{
+    if (!source->hasRtt) {
+        return self->initialTimeout;
+    }
+
+    MonotonicTimeMs timeout = 2 * source->smoothedRtt;
+    return timeout > BLOB_STREAM_MULTI_SOURCE_MIN_TIMEOUT ? timeout : BLOB_STREAM_MULTI_SOURCE_MIN_TIMEOUT;
+}
+
+static void timeOutChunk(BlobStreamMultiSource* self, size_t chunkId)
+{
+    BlobStreamSource* owner = &self->sources[self->chunkSources[chunkId]];
+    owner->outstandingCount--;
+    owner->timedOutChunkCount++;
+    owner->window = owner->window > 1 ? owner->window / 2 : 1;
+    self->chunkSources[chunkId] = BLOB_STREAM_MULTI_SOURCE_NO_SOURCE;
+}
+
+/// Writes a BLOB_STREAM_LOGIC_CMD_REQUEST_CHUNKS to a source, if it has room in its window
+/// Missing chunks that are not requested from any source, or whose request has timed out, are assigned to the
+/// source. The chunks are visited round robin, so the sources share the work from the same cursor.
+/// @param self multi source receiver
+/// @param sourceIndex the source to request from
+/// @param now the current time
+/// @param outStream stream to write to, sent to the source
+/// @return the number of chunks requested, or negative on error
+int blobStreamMultiSourceSendRequest(BlobStreamMultiSource* self, size_t sourceIndex, MonotonicTimeMs now,
+                                     FldOutStream* outStream)
+{
+    const size_t headerOctetCount = 1 + 2 + 2;
+    const size_t rangeOctetCount = 4 + 4;
+    BlobStreamSource* source = &self->sources[sourceIndex];
+    const BlobStreamIn* blobStream = self->blobStream;
+    if (!source->isEnabled || blobStream->isComplete) {
+        return 0;
+    }
+
+    size_t octetsLeft = outStream->size - outStream->pos;
+    if (octetsLeft < headerOctetCount + rangeOctetCount) {
+        CLOG_C_SOFT_ERROR(&self->log, "stream is too small for request chunks")
+        return -2;
+    }
+    size_t maxRangeCount = (octetsLeft - headerOctetCount) / rangeOctetCount;
+    if (maxRangeCount > BLOB_STREAM_MAX_REQUEST_RANGE_COUNT) {
+        maxRangeCount = BLOB_STREAM_MAX_REQUEST_RANGE_COUNT;
+    }
+
+    BlobStreamOutRange ranges[BLOB_STREAM_OUT_MAX_RANGE_COUNT];
+    size_t rangeCount = 0;
+    size_t requestedCount = 0;
+    size_t chunkCount = blobStream->geometry.chunkCount;
+    for (size_t scannedCount = 0; scannedCount < chunkCount; ++scannedCount) {
+        size_t chunkId = self->nextChunkId;
+        if (bitArrayIsSet(&blobStream->bitArray, chunkId)) {
+            self->nextChunkId = (chunkId + 1) % chunkCount;
+            continue;
+        }
+
+        uint8_t ownerIndex = self->chunkSources[chunkId];
+        if (ownerIndex != BLOB_STREAM_MULTI_SOURCE_NO_SOURCE) {
+            if (now - self->chunkRequestedAt[chunkId] <= requestTimeout(self, &self->sources[ownerIndex])) {
+                self->nextChunkId = (chunkId + 1) % chunkCount;
+                continue;
+            }
+            CLOG_C_VERBOSE(&self->log, "request for chunk %04zX timed out on source %hhu", chunkId, ownerIndex)
+            timeOutChunk(self, chunkId);
+        }
+
+        if (source->outstandingCount >= source->window) {
+            break;
+        }
+
+        bool isContinuation = rangeCount > 0 &&
+                              ranges[rangeCount - 1].endChunkId == (BlobStreamChunkId) chunkId;
+        if (!isContinuation) {
+            if (rangeCount == maxRangeCount) {
+                break;
+            }
+            ranges[rangeCount].firstChunkId = (BlobStreamChunkId) chunkId;
+            ranges[rangeCount].endChunkId = (BlobStreamChunkId) chunkId;
+            rangeCount++;
+        }
+        ranges[rangeCount - 1].endChunkId++;
+        self->chunkSources[chunkId] = (uint8_t) sourceIndex;
+        self->chunkRequestedAt[chunkId] = now;
+        source->outstandingCount++;
+        requestedCount++;
+        self->nextChunkId = (chunkId + 1) % chunkCount;
+    }
+
+    if (requestedCount == 0) {
+        return 0;
+    }
+
+    fldOutStreamWriteUInt8(outStream, BLOB_STREAM_LOGIC_CMD_REQUEST_CHUNKS);
+    fldOutStreamWriteUInt16(outStream, source->logicIn.transferId);
+    fldOutStreamWriteUInt16(outStream, (uint16_t) rangeCount);
+    for (size_t i = 0; i < rangeCount; ++i) {
+        fldOutStreamWriteUInt32(outStream, ranges[i].firstChunkId);
+        fldOutStreamWriteUInt32(outStream, ranges[i].endChunkId - ranges[i].firstChunkId);
+    }
+
+    CLOG_C_VERBOSE(&self->log, "requested %zu chunks from source %zu (window %zu)", requestedCount, sourceIndex,
+                   source->window)
+
+    return (int) requestedCount;
+}
+
+static void disableSource(BlobStreamMultiSource* self, size_t sourceIndex)
+{
+    BlobStreamSource* source = &self->sources[sourceIndex];
+    source->isEnabled = false;
+    for (size_t i = 0; i < self->blobStream->geometry.chunkCount; ++i) {
+        if (self->chunkSources[i] == sourceIndex) {
+            self->chunkSources[i] = BLOB_STREAM_MULTI_SOURCE_NO_SOURCE;
+        }
+    }
+    source->outstandingCount = 0;
+}
+
+static void onChunkDelivered(BlobStreamMultiSource* self, size_t sourceIndex, size_t chunkId, MonotonicTimeMs now)
+{
+    self->sources[sourceIndex].deliveredChunkCount++;
+
+    uint8_t ownerIndex = self->chunkSources[chunkId];
+    if (ownerIndex == BLOB_STREAM_MULTI_SOURCE_NO_SOURCE) {
+        return;
+    }
+    self->chunkSources[chunkId] = BLOB_STREAM_MULTI_SOURCE_NO_SOURCE;
+
+    BlobStreamSource* owner = &self->sources[ownerIndex];
+    owner->outstandingCount--;
+    if (ownerIndex != sourceIndex) {
+        return;
+    }
+
+    MonotonicTimeMs rtt = now - self->chunkRequestedAt[chunkId];
+    owner->smoothedRtt = owner->hasRtt ? (7 * owner->smoothedRtt + rtt) / 8 : rtt;
+    owner->hasRtt = true;
+    if (owner->window < self->maxWindow) {
+        owner->window++;
+    }
+}
+
+/// Receives a command from a source
+/// Chunks that are already received from another source are compared with the received chunk, and a source
+/// that sends different content is disabled. Only chunks that are sent raw are compared.
+/// @param self multi source receiver
+/// @param sourceIndex the source that sent the command
+/// @param now the current time
+/// @param inStream stream to read from
+/// @return negative on error, -4 if the source is inconsistent
+int blobStreamMultiSourceReceive(BlobStreamMultiSource* self, size_t sourceIndex, MonotonicTimeMs now,
+                                 FldInStream* inStream)
+{
+    BlobStreamSource* source = &self->sources[sourceIndex];
+    BlobStreamIn* blobStream = self->blobStream;
+
+    FldInStream peekStream = *inStream;
+    uint8_t cmd;
+    uint16_t transferId;
+    uint32_t chunkId = 0;
+    fldInStreamReadUInt8(&peekStream, &cmd);
+    fldInStreamReadUInt16(&peekStream, &transferId);
+    bool isSetChunk = cmd == BLOB_STREAM_LOGIC_CMD_SET_CHUNK || cmd == BLOB_STREAM_LOGIC_CMD_SET_CHUNK_ENCODED;
+    if (isSetChunk) {
+        int chunkIdErr = fldInStreamReadUInt32(&peekStream, &chunkId);
+        if (chunkIdErr < 0) {
+            return chunkIdErr;
+        }
+    }
+
+    bool isKnownChunk = isSetChunk && transferId == source->logicIn.transferId &&
+                        chunkId < blobStream->geometry.chunkCount;
+    bool wasReceived = isKnownChunk && bitArrayIsSet(&blobStream->bitArray, chunkId);
+    if (wasReceived && cmd == BLOB_STREAM_LOGIC_CMD_SET_CHUNK) {
+        uint16_t octetLength;
+        fldInStreamReadUInt16(&peekStream, &octetLength);
+        const uint8_t* existing = blobStreamInGetChunk(blobStream, chunkId);
+        bool isSame = octetLength == blobStreamChunkGeometryOctetCount(&blobStream->geometry, chunkId) &&
+                      peekStream.pos + octetLength <= peekStream.size && existing != 0 &&
+                      tc_memcmp(existing, peekStream.p, octetLength) == 0;
+        if (!isSame) {
+            CLOG_C_SOFT_ERROR(&self->log, "source %zu sent different content for chunk %04X, disabling it",
+                              sourceIndex, chunkId)
+            disableSource(self, sourceIndex);
+            blobStreamLogicInReceive(&source->logicIn, inStream);
+            return -4;
+        }
+    }
+
+    int result = blobStreamLogicInReceive(&source->logicIn, inStream);
+    if (result < 0) {
+        return result;
+    }
+
+    if (isKnownChunk && !wasReceived && bitArrayIsSet(&blobStream->bitArray, chunkId)) {
+        onChunkDelivered(self, sourceIndex, chunkId, now);
+    }
+
+    return result;
+}
+
+/// Checks if the blob is completely received
+/// @param self multi source receiver
+/// @return true if complete
+bool blobStreamMultiSourceIsComplete(const BlobStreamMultiSource* self)
+{
+    return self->blobStream->isComplete;
+}
@@ -0,0 +1,470 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/blob-stream
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include <blob-stream/blob_stream_mux.h>
+#include <blob-stream/commands.h>
+#include <blob-stream/debug.h>
+#include <flood/in_stream.h>
+#include <flood/out_stream.h>
+#include <imprint/allocator.h>
+#include <stdbool.h>
+
+#define BLOB_STREAM_MUX_NONE (UINT32_MAX)
+#define BLOB_STREAM_MUX_INCOMING_KEY (0x10000)
+#define BLOB_STREAM_MUX_ACK_START_OCTET_SIZE (1 + 2 + 2 + 1)
+#define BLOB_STREAM_MUX_ACK_CHUNK_OCTET_SIZE (1 + 2 + 4 + 8 + 4)
+
+// Incoming and outgoing transfers have separate transferId spaces, since the ids of incoming
+// transfers are chosen by the remote.
+static uint32_t outKey(BlobStreamTransferId transferId)
+{
+    return transferId;
+}
+
+static uint32_t inKey(BlobStreamTransferId transferId)
+{
+    return BLOB_STREAM_MUX_INCOMING_KEY | transferId;
+}
+
+static size_t homeSlot(const BlobStreamMux* self, uint32_t key)
+{
+    return (uint32_t) (key * 2654435761u) >> self->tableShift;
+}
+
+static size_t findSlot(const BlobStreamMux* self, uint32_t key)
+{
+    size_t slot = homeSlot(self, key);
+    while (self->table[slot] != BLOB_STREAM_MUX_NONE && self->entries[self->table[slot]].key != key) {
+        slot = (slot + 1) & self->tableMask;
+    }
+    return slot;
+}
+
+static void removeSlot(BlobStreamMux* self, size_t slot)
+{
+    // Backward shift deletion, keeps all probe sequences intact without tombstones
+    size_t hole = slot;
+    size_t next = slot;
+    for (;;) {
+        next = (next + 1) & self->tableMask;
+        uint32_t index = self->table[next];
+        if (index == BLOB_STREAM_MUX_NONE) {
+            break;
+        }
+        size_t home = homeSlot(self, self->entries[index].key);
+        bool isBetween = hole <= next ? (hole < home && home <= next) : (hole < home || home <= next);
+        if (!isBetween) {
+            self->table[hole] = index;
+            hole = next;
+        }
+    }
+    self->table[hole] = BLOB_STREAM_MUX_NONE;
+}
+
+/// Initializes a multiplexer for many concurrent incoming and outgoing transfers
+/// Incoming commands are routed to the right logic through an open addressed table on the transferId,
+/// so the cost per datagram does not depend on the number of transfers. All memory is allocated up front.
+/// @param self multiplexer
+/// @param memory allocator for the entries and the table
+/// @param capacity maximum number of concurrent transfers, incoming and outgoing combined
+/// @param log the log to use
+void blobStreamMuxInit(BlobStreamMux* self, struct ImprintAllocator* memory, size_t capacity, Clog log)
+{
+    CLOG_ASSERT(capacity > 0 && capacity < UINT16_MAX, "illegal mux capacity %zu", capacity)
+
+    size_t tableSize = 1;
+    uint8_t tableBits = 0;
+    while (tableSize < capacity * 2) {
+        tableSize <<= 1;
+        tableBits++;
+    }
+
+    self->log = log;
+    self->capacity = capacity;
+    self->tableMask = tableSize - 1;
+    self->tableShift = (uint8_t) (32 - tableBits);
+    self->entries = IMPRINT_ALLOC_TYPE_COUNT(memory, BlobStreamMuxEntry, capacity);
+    self->freeEntries = IMPRINT_ALLOC_TYPE_COUNT(memory, uint32_t, capacity);
+    self->activeEntries = IMPRINT_ALLOC_TYPE_COUNT(memory, uint32_t, capacity);
+    self->table = IMPRINT_ALLOC_TYPE_COUNT(memory, uint32_t, tableSize);
+    for (size_t i = 0; i < tableSize; ++i) {
+        self->table[i] = BLOB_STREAM_MUX_NONE;
+    }
+    for (size_t i = 0; i < capacity; ++i) {
+        self->freeEntries[i] = (uint32_t) (capacity - 1 - i);
+    }
+    self->freeCount = capacity;
+    self->activeCount = 0;
+    self->pendingAckHead = BLOB_STREAM_MUX_NONE;
+    self->pendingAckTail = BLOB_STREAM_MUX_NONE;
+    self->pendingAckCount = 0;
+    self->nextTransferId = 1;
+    self->inPool = 0;
+    self->maxChunkSize = 0;
+
+    CLOG_C_VERBOSE(&self->log, "mux initialized with capacity %zu", capacity)
+}
+
+/// Lets the mux create incoming transfers by itself when it receives a start transfer
+/// The blob stream is acquired from the pool on the first start transfer, so the chunks that the sender puts in the
+/// same datagram (see blobStreamLogicOutSendFlight()) are received right away, and a small blob completes without
+/// waiting a round trip for the ack start transfer. The acks are written by blobStreamMuxSendIn().
+/// @param self multiplexer
+/// @param inPool pool to acquire incoming blob streams from
+/// @param maxChunkSize the largest chunk size that the pool streams accept
+void blobStreamMuxSetInPool(BlobStreamMux* self, BlobStreamInPool* inPool, size_t maxChunkSize)
+{
+    self->inPool = inPool;
+    self->maxChunkSize = maxChunkSize;
+}
+
+static BlobStreamMuxEntry* addEntry(BlobStreamMux* self, uint32_t key)
+{
+    if (self->freeCount == 0) {
+        CLOG_C_SOFT_ERROR(&self->log, "mux is full (%zu transfers)", self->capacity)
+        return 0;
+    }
+
+    size_t slot = findSlot(self, key);
+    if (self->table[slot] != BLOB_STREAM_MUX_NONE) {
+        CLOG_C_SOFT_ERROR(&self->log, "transfer %05X is already in the mux", key)
+        return 0;
+    }
+
+    uint32_t index = self->freeEntries[--self->freeCount];
+    BlobStreamMuxEntry* entry = &self->entries[index];
+    entry->key = key;
+    entry->isFromInPool = false;
+    entry->isAckStartPending = false;
+    entry->isPendingAck = false;
+    entry->activeIndex = self->activeCount;
+    self->activeEntries[self->activeCount++] = index;
+    self->table[slot] = index;
+
+    return entry;
+}
+
+// Only the incoming transfers that have something to ack are in the pending ack list, so
+// blobStreamMuxSendIn() does not scan the transfers that are idle or outgoing. The list is first in, first out,
+// and a transfer that is visited but still has an ack pending is moved to the tail.
+static void addPendingAck(BlobStreamMux* self, BlobStreamMuxEntry* entry)
+{
+    if (entry->isPendingAck) {
+        return;
+    }
+
+    uint32_t index = (uint32_t) (entry - self->entries);
+    entry->isPendingAck = true;
+    entry->previousPendingAck = self->pendingAckTail;
+    entry->nextPendingAck = BLOB_STREAM_MUX_NONE;
+    if (self->pendingAckTail != BLOB_STREAM_MUX_NONE) {
+        self->entries[self->pendingAckTail].nextPendingAck = index;
+    } else {
+        self->pendingAckHead = index;
+    }
+    self->pendingAckTail = index;
+    self->pendingAckCount++;
+}
+
+static void removePendingAck(BlobStreamMux* self, BlobStreamMuxEntry* entry)
+{
+    if (entry->previousPendingAck != BLOB_STREAM_MUX_NONE) {
+        self->entries[entry->previousPendingAck].nextPendingAck = entry->nextPendingAck;
+    } else {
+        self->pendingAckHead = entry->nextPendingAck;
+    }
+    if (entry->nextPendingAck != BLOB_STREAM_MUX_NONE) {
+        self->entries[entry->nextPendingAck].previousPendingAck = entry->previousPendingAck;
+    } else {
+        self->pendingAckTail = entry->previousPendingAck;
+    }
+    entry->isPendingAck = false;
+    self->pendingAckCount--;
+}
+
+static BlobStreamMuxEntry* findEntry(const BlobStreamMux* self, uint32_t key)
+{
+    uint32_t index = self->table[findSlot(self, key)];
+    if (index == BLOB_STREAM_MUX_NONE) {
+        return 0;
+    }
+
+    return &self->entries[index];
+}
+
+static int removeEntry(BlobStreamMux* self, uint32_t key)
+{
+    size_t slot = findSlot(self, key);
+    uint32_t index = self->table[slot];
+    if (index == BLOB_STREAM_MUX_NONE) {
+        CLOG_C_SOFT_ERROR(&self->log, "transfer %05X is not in the mux", key)
+        return -1;
+    }
+
+    removeSlot(self, slot);
+
+    BlobStreamMuxEntry* entry = &self->entries[index];
+    if (entry->isFromInPool) {
+        blobStreamInPoolRelease(self->inPool, entry->logicIn.blobStream);
+    }
+    if (entry->isPendingAck) {
+        removePendingAck(self, entry);
+    }
+
+    size_t activeIndex = self->entries[index].activeIndex;
+    uint32_t lastIndex = self->activeEntries[--self->activeCount];
+    self->activeEntries[activeIndex] = lastIndex;
+    self->entries[lastIndex].activeIndex = activeIndex;
+
+    self->freeEntries[self->freeCount++] = index;
+
+    return 0;
+}
+
+/// Adds an outgoing transfer and assigns a transferId to it
+/// TransferIds are handed out in increasing order, skipping the ones that are in use, so a released id is
+/// not reused until all other ids have been used. Late datagrams for a finished transfer are then not
+/// routed to a new transfer.
+/// @param self multiplexer
+/// @param blobStream the blob stream to send
+/// @return the logic, with the assigned transferId, or NULL if the mux is full
+BlobStreamLogicOut* blobStreamMuxAddOut(BlobStreamMux* self, BlobStreamOut* blobStream)
+{
+    if (self->freeCount == 0) {
+        CLOG_C_SOFT_ERROR(&self->log, "mux is full (%zu transfers)", self->capacity)
+        return 0;
+    }
+
+    BlobStreamTransferId transferId;
+    do {
+        transferId = self->nextTransferId++;
+        if (self->nextTransferId == 0) {
+            self->nextTransferId = 1;
+        }
+    } while (findEntry(self, outKey(transferId)) != 0);
+
+    BlobStreamMuxEntry* entry = addEntry(self, outKey(transferId));
+    blobStreamLogicOutInit(&entry->logicOut, blobStream, transferId);
+
+    return &entry->logicOut;
+}
+
+/// Adds an incoming transfer
+/// The transferId is usually taken from the start transfer, see blobStreamLogicInReadStartTransfer().
+/// @param self multiplexer
+/// @param blobStream the blob stream to receive to
+/// @param transferId the transferId chosen by the sender
+/// @return the logic, or NULL if the mux is full or the transferId is already in use
+BlobStreamLogicIn* blobStreamMuxAddIn(BlobStreamMux* self, BlobStreamIn* blobStream, BlobStreamTransferId transferId)
+{
+    BlobStreamMuxEntry* entry = addEntry(self, inKey(transferId));
+    if (entry == 0) {
+        return 0;
+    }
+
+    blobStreamLogicInInit(&entry->logicIn, blobStream, transferId);
+
+    return &entry->logicIn;
+}
+
+/// Looks up an outgoing transfer
+/// @param self multiplexer
+/// @param transferId the transferId
+/// @return the logic, or NULL if not found
+BlobStreamLogicOut* blobStreamMuxFindOut(const BlobStreamMux* self, BlobStreamTransferId transferId)
+{
+    BlobStreamMuxEntry* entry = findEntry(self, outKey(transferId));
+    return entry != 0 ? &entry->logicOut : 0;
+}
+
+/// Looks up an incoming transfer
+/// @param self multiplexer
+/// @param transferId the transferId
+/// @return the logic, or NULL if not found
+BlobStreamLogicIn* blobStreamMuxFindIn(const BlobStreamMux* self, BlobStreamTransferId transferId)
+{
+    BlobStreamMuxEntry* entry = findEntry(self, inKey(transferId));
+    return entry != 0 ? &entry->logicIn : 0;
+}
+
+/// Removes an outgoing transfer
+/// The blob stream is not destroyed.
+/// @param self multiplexer
+/// @param transferId the transferId
+/// @return negative if not found
+int blobStreamMuxRemoveOut(BlobStreamMux* self, BlobStreamTransferId transferId)
+{
+    return removeEntry(self, outKey(transferId));
+}
+
+/// Removes an incoming transfer
+/// The blob stream is not destroyed. If the mux acquired it from the incoming pool, it is released to the pool.
+/// @param self multiplexer
+/// @param transferId the transferId
+/// @return negative if not found
+int blobStreamMuxRemoveIn(BlobStreamMux* self, BlobStreamTransferId transferId)
+{
+    return removeEntry(self, inKey(transferId));
+}
+
+static int startTransfer(BlobStreamMux* self, FldInStream* inStream)
+{
+    BlobStreamStartTransfer start;
+    int readErr = blobStreamLogicInReadStartTransfer(inStream, self->maxChunkSize, &start);
+    if (readErr < 0) {
+        return readErr;
+    }
+
+    BlobStreamMuxEntry* entry = findEntry(self, inKey(start.transferId));
+    if (entry != 0) {
+        // The ack start transfer was lost, or the sender has not received it yet
+        start.fixedChunkSize = entry->logicIn.blobStream->fixedChunkSize;
+        start.isCompact = entry->logicIn.isCompact;
+        start.isTransferIdElided = entry->logicIn.isTransferIdElided;
+        entry->startTransfer = start;
+        entry->isAckStartPending = true;
+        addPendingAck(self, entry);
+        return 0;
+    }
+
+    if (start.isDelta) {
+        CLOG_C_SOFT_ERROR(&self->log, "can not start delta transfer %04X without a baseline", start.transferId)
+        return -4;
+    }
+
+    if (self->freeCount == 0) {
+        CLOG_C_SOFT_ERROR(&self->log, "mux is full (%zu transfers)", self->capacity)
+        return -5;
+    }
+
+    BlobStreamIn* blobStream = blobStreamInPoolAcquire(self->inPool, start.octetCount, start.fixedChunkSize);
+    if (blobStream == 0) {
+        return -5;
+    }
+
+    entry = addEntry(self, inKey(start.transferId));
+    blobStreamLogicInInit(&entry->logicIn, blobStream, start.transferId);
+    if (start.isCompact) {
+        blobStreamLogicInSetCompact(&entry->logicIn, start.isTransferIdElided);
+    }
+    entry->isFromInPool = true;
+    entry->isAckStartPending = true;
+    entry->startTransfer = start;
+    addPendingAck(self, entry);
+
+    CLOG_C_VERBOSE(&self->log, "created incoming transfer %04X on first sight", start.transferId)
+
+    return 0;
+}
+
+/// Receives a blob stream command and routes it to the transfer with the transferId in the command
+/// BLOB_STREAM_LOGIC_CMD_START_TRANSFER is only handled if an incoming pool is set with blobStreamMuxSetInPool(),
+/// otherwise the application must read it with blobStreamLogicInReadStartTransfer() and add the incoming transfer.
+/// Compact commands can only be routed if the transferId is not left out. Commands for incoming transfers must be
+/// received through the mux, so that their acks are written by blobStreamMuxSendIn().
+/// @param self multiplexer
+/// @param inStream stream to read from, including the command octet
+/// @return negative on error, or if the transfer is unknown
+int blobStreamMuxReceive(BlobStreamMux* self, struct FldInStream* inStream)
+{
+    FldInStream peekStream = *inStream;
+    uint8_t cmd;
+    uint16_t transferId;
+    fldInStreamReadUInt8(&peekStream, &cmd);
+    int peekErr = fldInStreamReadUInt16(&peekStream, &transferId);
+    if (peekErr < 0) {
+        return peekErr;
+    }
+
+    switch (cmd) {
+        case BLOB_STREAM_LOGIC_CMD_START_TRANSFER:
+            if (self->inPool == 0) {
+                CLOG_C_SOFT_ERROR(&self->log, "mux has no incoming pool for start transfer %04X", transferId)
+                return -2;
+            }
+            return startTransfer(self, inStream);
+        case BLOB_STREAM_LOGIC_CMD_SET_CHUNK:
+        case BLOB_STREAM_LOGIC_CMD_SET_CHUNK_ENCODED:
+        case BLOB_STREAM_LOGIC_CMD_CHUNK_HASHES:
+        case BLOB_STREAM_LOGIC_CMD_CHUNKS_EXPIRED:
+        case BLOB_STREAM_LOGIC_CMD_SET_CHUNKS_COMPACT: {
+            BlobStreamMuxEntry* entry = findEntry(self, inKey(transferId));
+            if (entry == 0) {
+                CLOG_C_NOTICE(&self->log, "%s for unknown incoming transfer %04X", blobStreamCmdToString(cmd),
+                              transferId)
+                return -3;
+            }
+            int receiveResult = blobStreamLogicInReceive(&entry->logicIn, inStream);
+            if (blobStreamLogicInIsAckPending(&entry->logicIn)) {
+                addPendingAck(self, entry);
+            }
+            return receiveResult;
+        }
+        case BLOB_STREAM_LOGIC_CMD_ACK_START_TRANSFER:
+        case BLOB_STREAM_LOGIC_CMD_ACK_CHUNK:
+        case BLOB_STREAM_LOGIC_CMD_ACK_CHUNK_HASHES:
+        case BLOB_STREAM_LOGIC_CMD_RESUME_TRANSFER:
+        case BLOB_STREAM_LOGIC_CMD_REQUEST_CHUNKS:
+        case BLOB_STREAM_LOGIC_CMD_ACK_CHUNK_COMPACT: {
+            BlobStreamMuxEntry* entry = findEntry(self, outKey(transferId));
+            if (entry == 0) {
+                CLOG_C_NOTICE(&self->log, "%s for unknown outgoing transfer %04X", blobStreamCmdToString(cmd),
+                              transferId)
+                return -3;
+            }
+            return blobStreamLogicOutReceive(&entry->logicOut, inStream);
+        }
+        default:
+            CLOG_C_SOFT_ERROR(&self->log, "mux can not route command %02X", cmd)
+            return -2;
+    }
+}
+
+/// Writes the pending ack start transfers and the due acks for the incoming transfers
+/// Only the transfers with something to ack are visited, in the order their acks became pending. A transfer whose
+/// ack is delayed goes to the back of the line, so every transfer gets its turn even if outStream is too small for
+/// all of them. Stops when the next ack might not fit in outStream, the rest is written first in the next call.
+/// @param self multiplexer
+/// @param now the current time, for the ack delay
+/// @param outStream stream to write to
+/// @return the number of commands written, or negative on error
+int blobStreamMuxSendIn(BlobStreamMux* self, MonotonicTimeMs now, FldOutStream* outStream)
+{
+    int commandCount = 0;
+
+    size_t visitCount = self->pendingAckCount;
+    for (size_t i = 0; i < visitCount; ++i) {
+        BlobStreamMuxEntry* entry = &self->entries[self->pendingAckHead];
+
+        if (entry->isAckStartPending) {
+            if (outStream->pos + BLOB_STREAM_MUX_ACK_START_OCTET_SIZE > outStream->size) {
+                break;
+            }
+            int ackStartErr = blobStreamLogicInSendAckStartTransfer(&entry->startTransfer, outStream);
+            if (ackStartErr < 0) {
+                return ackStartErr;
+            }
+            entry->isAckStartPending = false;
+            commandCount++;
+        }
+
+        if (outStream->pos + BLOB_STREAM_MUX_ACK_CHUNK_OCTET_SIZE > outStream->size) {
+            break;
+        }
+        int ackResult = blobStreamLogicInSendIfDue(&entry->logicIn, now, outStream);
+        if (ackResult < 0) {
+            return ackResult;
+        }
+        commandCount += ackResult;
+
+        removePendingAck(self, entry);
+        if (blobStreamLogicInIsAckPending(&entry->logicIn)) {
+            // The ack is delayed, check it again after the others
+            addPendingAck(self, entry);
+        }
+    }
+
+    return commandCount;
+}
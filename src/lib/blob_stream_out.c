@@ -4,59 +4,464 @@
  *--------------------------------------------------------------------------------------------------------*/
 
 #include <blob-stream/blob_stream_out.h>
+#include <blob-stream/commands.h>
+#include <blob-stream/compress.h>
+#include <blob-stream/delta.h>
 #include <imprint/allocator.h>
 #include <stdbool.h>
 #include <inttypes.h>
 
+static void initEntries(BlobStreamOut* self)
+{
+    const BlobStreamChunkGeometry* geometry = &self->geometry;
+    const uint8_t* octets = self->blob;
+    for (size_t i = 0; i < self->chunkCount; ++i) {
+        BlobStreamOutEntry* entry = &self->entries[i];
+        entry->octets = octets;
+        entry->octetCount = self->fixedChunkSize;
+        entry->chunkId = (BlobStreamChunkId) i;
+        entry->lastSentAtTime = 0;
+        entry->sendCount = 0;
+        entry->deadline = 0;
+        entry->previousInFlight = BLOB_STREAM_OUT_NO_CHUNK;
+        entry->nextInFlight = BLOB_STREAM_OUT_NO_CHUNK;
+        entry->isInFlight = false;
+        entry->isReceived = false;
+        entry->isExpired = false;
+        entry->isPrepared = false;
+        entry->encoding = BLOB_STREAM_CHUNK_ENCODING_RAW;
+        if (octets != 0) {
+            octets += geometry->fixedChunkSize;
+        }
+    }
+    if (self->chunkCount > 0) {
+        self->entries[self->chunkCount - 1].octetCount = geometry->lastChunkOctetCount;
+    }
+}
+
+static size_t greatestCommonDivisor(size_t a, size_t b)
+{
+    while (b != 0) {
+        size_t rest = a % b;
+        a = b;
+        b = rest;
+    }
+    return a;
+}
+
+// Smallest stride of at least the square root of the chunk count that visits every chunk
+static size_t interleaveStrideForChunkCount(size_t chunkCount)
+{
+    size_t stride = 1;
+    while (stride * stride < chunkCount) {
+        stride++;
+    }
+    while (greatestCommonDivisor(stride, chunkCount) != 1) {
+        stride++;
+    }
+    return stride;
+}
+
+static void setGeometry(BlobStreamOut* self, size_t octetCount, size_t fixedChunkSize)
+{
+    self->octetCount = octetCount;
+    self->fixedChunkSize = fixedChunkSize;
+    blobStreamChunkGeometryInit(&self->geometry, octetCount, fixedChunkSize);
+    self->chunkCount = self->geometry.chunkCount;
+}
+
+static void resetSendOrder(BlobStreamOut* self)
+{
+    self->receivedBeforeChunkId = 0;
+    self->inFlightHead = BLOB_STREAM_OUT_NO_CHUNK;
+    self->inFlightTail = BLOB_STREAM_OUT_NO_CHUNK;
+    self->nextOrderIndex = 0;
+    self->orderBlockFirstChunkId = 0;
+    self->orderBlockChunkCount = 0;
+    self->priorityRangeIndex = 0;
+    self->priorityChunkId = self->priorityRangeCount > 0 ? self->priorityRanges[0].firstChunkId : 0;
+    self->requestedRanges.head = 0;
+    self->requestedRanges.count = 0;
+    self->receiveWindowEndChunkId = self->chunkCount;
+    self->isRttSamplePending = false;
+    self->tailProbeCount = 0;
+    self->tailProbeReceivedChunkCount = 0;
+}
+
+static void initCommon(BlobStreamOut* self, const uint8_t* data, size_t octetCount, size_t fixedChunkSize, Clog log)
+{
+    CLOG_ASSERT(fixedChunkSize > 0 && fixedChunkSize <= BLOB_STREAM_MAX_CHUNK_SIZE, "illegal chunk size %zu",
+                fixedChunkSize)
+    self->log = log;
+    self->blob = data;
+    setGeometry(self, octetCount, fixedChunkSize);
+    self->isComplete = false;
+    self->chunkCapacity = self->chunkCount;
+    self->sentChunkEntryCount = 0;
+    self->receivedChunkCount = 0;
+    self->expiredChunkCount = 0;
+    self->pendingExpiredChunkCount = 0;
+    self->earliestDeadline = 0;
+    self->order = BlobStreamOutOrderSequential;
+    self->isPullMode = false;
+    self->priorityRangeCount = 0;
+    resetSendOrder(self);
+    self->ticksPerSecond = BLOB_STREAM_TIME_BASE_MILLISECONDS;
+    self->thresholdForRedundancy = 50;
+    self->pacingOctetsPerSecond = 0;
+    self->pacingCredit = 0;
+    self->pacedAt = 0;
+    self->smoothedRtt = 0;
+    self->hasRtt = false;
+    self->minProbeTimeout = 0;
+    self->tailLossProbeCount = 0;
+    self->maxChunksPerSend = 5;
+    self->compressionCache = 0;
+    self->compressionCacheOctetCount = 0;
+    self->baseline = 0;
+    self->baselineOctetCount = 0;
+    self->baselineId = 0;
+    self->isDelta = false;
+    self->deltaCache = 0;
+}
+
 /// Initializes a blobStream for sending
 /// @param self outgoing blob stream
 /// @param allocator allocator for internal book keeping entries
 /// @param blobAllocator not really used
 /// @param data the payload to send out
 /// @param octetCount the number of octets in the data payload
-/// @param fixedChunkSize the size of each chunk to send out (except the last one). Usually 1024.
+/// @param fixedChunkSize the size of each chunk to send out (except the last one). Usually 1024, but can be up to
+/// BLOB_STREAM_MAX_CHUNK_SIZE for jumbo frames or UDP generic segmentation offload.
 void blobStreamOutInit(BlobStreamOut* self, ImprintAllocator* allocator, ImprintAllocatorWithFree* blobAllocator,
                        const uint8_t* data, size_t octetCount, size_t fixedChunkSize, Clog log)
 {
-    self->log = log;
-    self->blob = data;
-    self->octetCount = octetCount;
-    self->fixedChunkSize = fixedChunkSize;
-    CLOG_ASSERT(fixedChunkSize <= 1024, "only chunks up to 1024 is supported")
-    self->isComplete = false;
-    self->chunkCount = (octetCount + self->fixedChunkSize - 1) / self->fixedChunkSize;
+    initCommon(self, data, octetCount, fixedChunkSize, log);
     self->entries = IMPRINT_ALLOC_TYPE_COUNT(allocator, BlobStreamOutEntry, self->chunkCount);
     self->blobAllocator = blobAllocator;
-    self->sentChunkEntryCount = 0;
-    self->thresholdForRedundancy = 50;
+
+    initEntries(self);
+
+    CLOG_C_VERBOSE(&self->log, "blobStreamOutInit octetCount: %zu chunkCount: %zu fixedChunkSize %zu", octetCount,
+                   self->chunkCount, self->fixedChunkSize)
+}
+
+/// Calculates the number of octets needed for blobStreamOutInitWithStorage()
+/// @param octetCount the number of octets in the data payload
+/// @param fixedChunkSize the size of each chunk to send out (except the last one).
+/// @return the number of octets needed for the storage
+size_t blobStreamOutStorageSize(size_t octetCount, size_t fixedChunkSize)
+{
+    size_t chunkCount = (octetCount + fixedChunkSize - 1) / fixedChunkSize;
+    size_t alignmentMask = BLOB_STREAM_STORAGE_ALIGNMENT - 1;
+    return (chunkCount * sizeof(BlobStreamOutEntry) + alignmentMask) & ~alignmentMask;
+}
+
+/// Initializes a blobStream for sending where the book keeping entries are placed in caller provided storage
+/// Nothing is allocated and nothing is freed in blobStreamOutDestroy().
+/// @param self outgoing blob stream
+/// @param storage storage aligned to BLOB_STREAM_STORAGE_ALIGNMENT
+/// @param storageSize size of storage, must be at least blobStreamOutStorageSize()
+/// @param data the payload to send out
+/// @param octetCount the number of octets in the data payload
+/// @param fixedChunkSize the size of each chunk to send out (except the last one).
+void blobStreamOutInitWithStorage(BlobStreamOut* self, void* storage, size_t storageSize, const uint8_t* data,
+                                  size_t octetCount, size_t fixedChunkSize, Clog log)
+{
+    CLOG_ASSERT(((uintptr_t) storage & (BLOB_STREAM_STORAGE_ALIGNMENT - 1)) == 0, "storage must be aligned")
+    CLOG_ASSERT(storageSize >= blobStreamOutStorageSize(octetCount, fixedChunkSize), "storage is too small %zu",
+                storageSize)
+
+    initCommon(self, data, octetCount, fixedChunkSize, log);
+    self->entries = (BlobStreamOutEntry*) storage;
+    self->blobAllocator = 0;
+
+    initEntries(self);
+
+    CLOG_C_VERBOSE(&self->log, "blobStreamOutInitWithStorage octetCount: %zu chunkCount: %zu", octetCount,
+                   self->chunkCount)
+}
+
+/// Destroys the outgoing blob stream, the entries are not freed
+/// @param self outgoing blob stream
+void blobStreamOutDestroy(BlobStreamOut* self)
+{
+    // The entries are owned by the allocator passed to blobStreamOutInit(), or by the caller provided storage
+    self->entries = 0;
+    self->blob = 0;
+}
+
+static void setUnchangedRun(BlobStreamOutEntry* runStart, uint32_t runCount)
+{
+    runStart->unchangedRunOctets[0] = (uint8_t) (runCount >> 24);
+    runStart->unchangedRunOctets[1] = (uint8_t) (runCount >> 16);
+    runStart->unchangedRunOctets[2] = (uint8_t) (runCount >> 8);
+    runStart->unchangedRunOctets[3] = (uint8_t) runCount;
+    runStart->octets = runStart->unchangedRunOctets;
+    runStart->octetCount = sizeof(runStart->unchangedRunOctets);
+    runStart->encoding = BLOB_STREAM_CHUNK_ENCODING_UNCHANGED;
+    runStart->isPrepared = true;
+}
+
+static bool isReceivedInPrevious(const BlobStreamOut* previous, BlobStreamChunkId chunkId)
+{
+    return previous == 0 || (chunkId < previous->chunkCount && previous->entries[chunkId].isReceived);
+}
+
+// If previous is set, only chunks that the receiver has acknowledged in the previous transfer are used
+static void applyBaseline(BlobStreamOut* self, const BlobStreamOut* previous)
+{
+    BlobStreamOutEntry* runStart = 0;
+    uint32_t runCount = 0;
+    size_t unchangedCount = 0;
 
     for (size_t i = 0; i < self->chunkCount; ++i) {
         BlobStreamOutEntry* entry = &self->entries[i];
-        entry->octets = data + i * self->fixedChunkSize;
-        if (i == self->chunkCount - 1) {
-            size_t expectedLastChunkSize = (self->octetCount % self->fixedChunkSize);
-            if (expectedLastChunkSize == 0) {
-                expectedLastChunkSize = self->fixedChunkSize;
+        size_t offset = blobStreamChunkGeometryOffset(&self->geometry, entry->chunkId);
+        bool isUnchanged = offset + entry->octetCount <= self->baselineOctetCount &&
+                           isReceivedInPrevious(previous, entry->chunkId) &&
+                           blobStreamOctetsAreEqual(entry->octets, self->baseline + offset, entry->octetCount);
+        if (!isUnchanged) {
+            if (runStart != 0) {
+                setUnchangedRun(runStart, runCount);
+                runStart = 0;
             }
-            entry->octetCount = expectedLastChunkSize;
-        } else {
-            entry->octetCount = self->fixedChunkSize;
+            continue;
         }
-        entry->chunkId = (BlobStreamChunkId) i;
-        entry->lastSentAtTime = 0;
-        entry->sendCount = 0;
-        entry->isReceived = false;
+
+        unchangedCount++;
+        if (runStart == 0) {
+            runStart = entry;
+            runCount = 1;
+            continue;
+        }
+
+        // Only the first chunk in a run is sent, the receiver fills in the rest of the run from the baseline
+        runCount++;
+        entry->isPrepared = true;
+        entry->isReceived = true;
+        self->sentChunkEntryCount++;
+        self->receivedChunkCount++;
     }
-    CLOG_C_VERBOSE(&self->log, "blobStreamOutInit octetCount: %zu chunkCount: %zu fixedChunkSize %zu", octetCount,
-                   self->chunkCount, self->fixedChunkSize)
+
+    if (runStart != 0) {
+        setUnchangedRun(runStart, runCount);
+    }
+
+    CLOG_C_VERBOSE(&self->log, "baseline %08X: %zu of %zu chunks are unchanged", self->baselineId, unchangedCount,
+                   self->chunkCount)
 }
 
-/// Frees up the memory of the outgoing blob stream
+/// Restarts the transfer of the same payload
+/// Nothing is allocated, all entries are marked as not sent and not received. Deadlines are cleared.
 /// @param self outgoing blob stream
-void blobStreamOutDestroy(BlobStreamOut* self)
+void blobStreamOutReset(BlobStreamOut* self)
 {
-    // IMPRINT_FREE(self->blobAllocator, self->entries);
-    self->blob = 0;
+    self->isComplete = false;
+    self->sentChunkEntryCount = 0;
+    self->receivedChunkCount = 0;
+    self->expiredChunkCount = 0;
+    self->pendingExpiredChunkCount = 0;
+    self->earliestDeadline = 0;
+    resetSendOrder(self);
+    initEntries(self);
+    if (self->baseline != 0) {
+        applyBaseline(self, 0);
+    }
+}
+
+/// Reuses the outgoing blob stream for a new payload of the same or smaller chunk count
+/// The entries from the original init are reused. A previously set baseline and priority ranges are cleared.
+/// @param self outgoing blob stream
+/// @param data the payload to send out
+/// @param octetCount the number of octets in the data payload
+/// @param fixedChunkSize the size of each chunk to send out (except the last one).
+/// @return negative if the payload needs more entries than the original allocation
+int blobStreamOutReinit(BlobStreamOut* self, const uint8_t* data, size_t octetCount, size_t fixedChunkSize)
+{
+    size_t chunkCount = (octetCount + fixedChunkSize - 1) / fixedChunkSize;
+    if (chunkCount > self->chunkCapacity) {
+        CLOG_C_SOFT_ERROR(&self->log, "can not reinit to %zu chunks, capacity is %zu", chunkCount,
+                          self->chunkCapacity)
+        return -1;
+    }
+
+    self->blob = data;
+    self->baseline = 0;
+    self->baselineOctetCount = 0;
+    self->isDelta = false;
+    self->deltaCache = 0;
+    self->priorityRangeCount = 0;
+    setGeometry(self, octetCount, fixedChunkSize);
+    if (self->compressionCache != 0 && self->compressionCacheOctetCount < octetCount) {
+        CLOG_C_NOTICE(&self->log, "compression cache is too small for %zu octets, disabling compression", octetCount)
+        self->compressionCache = 0;
+        self->compressionCacheOctetCount = 0;
+    }
+    blobStreamOutReset(self);
+
+    CLOG_C_VERBOSE(&self->log, "blobStreamOutReinit octetCount: %zu chunkCount: %zu", octetCount, chunkCount)
+
+    return 0;
+}
+
+/// Returns the smallest chunk size the outgoing blob stream can be reinitialized with
+/// A smaller chunk size needs more entries than the ones allocated at init, see blobStreamOutReinit().
+/// A salvaged stream can not change chunk size, since the previous transfer is not kept to salvage from again.
+/// @param self outgoing blob stream
+/// @return the smallest chunk size, never larger than fixedChunkSize
+size_t blobStreamOutMinChunkSize(const BlobStreamOut* self)
+{
+    bool isSalvaged = self->isDelta && self->baseline == 0;
+    if (self->chunkCapacity == 0 || isSalvaged) {
+        return self->fixedChunkSize;
+    }
+
+    size_t minChunkSize = (self->octetCount + self->chunkCapacity - 1) / self->chunkCapacity;
+    if (minChunkSize == 0) {
+        return 1;
+    }
+
+    return minChunkSize < self->fixedChunkSize ? minChunkSize : self->fixedChunkSize;
+}
+
+/// Enables per chunk compression
+/// Each chunk is compressed independently the first time it is sent and the result is kept in the cache,
+/// so resends do not compress again. Chunks that do not compress are sent raw.
+/// @param self outgoing blob stream
+/// @param cache target for the compressed chunks. Must be valid until the stream is destroyed.
+/// @param cacheOctetCount size of cache, must be at least the octetCount of the blob stream
+/// @return negative if the cache is too small
+int blobStreamOutSetCompressionCache(BlobStreamOut* self, uint8_t* cache, size_t cacheOctetCount)
+{
+    if (cacheOctetCount < self->octetCount) {
+        CLOG_C_SOFT_ERROR(&self->log, "compression cache must be at least %zu octets", self->octetCount)
+        return -1;
+    }
+
+    self->compressionCache = cache;
+    self->compressionCacheOctetCount = cacheOctetCount;
+
+    return 0;
+}
+
+/// Sends the payload as a delta against a baseline blob that the receiver already holds
+/// Unchanged chunks are found up front and each run of them is replaced by a single small
+/// BLOB_STREAM_CHUNK_ENCODING_UNCHANGED chunk. If compression is enabled and deltaCache is set, changed
+/// chunks are XOR:ed with the baseline before they are compressed, which compresses well when only a few
+/// octets in the chunk have changed.
+/// Must be called before anything is sent.
+/// @param self outgoing blob stream
+/// @param baselineId application defined id of the baseline, sent to the receiver in the start transfer
+/// @param baseline the baseline payload. Must be valid until the stream is destroyed.
+/// @param baselineOctetCount the number of octets in the baseline, can differ from the payload
+/// @param deltaCache optional target for the XOR:ed chunks, at least the octetCount of the blob stream
+/// @return negative on error
+int blobStreamOutSetBaseline(BlobStreamOut* self, BlobStreamBaselineId baselineId, const uint8_t* baseline,
+                             size_t baselineOctetCount, uint8_t* deltaCache)
+{
+    if (self->sentChunkEntryCount != 0) {
+        CLOG_C_SOFT_ERROR(&self->log, "baseline can not be set after chunks are sent")
+        return -1;
+    }
+
+    if (self->blob == 0 || baseline == 0) {
+        CLOG_C_SOFT_ERROR(&self->log, "both payload and baseline are needed for delta transfer")
+        return -2;
+    }
+
+    self->baseline = baseline;
+    self->baselineOctetCount = baselineOctetCount;
+    self->baselineId = baselineId;
+    self->isDelta = true;
+    self->deltaCache = deltaCache;
+
+    blobStreamOutReset(self);
+
+    return 0;
+}
+
+/// Salvages the chunks that the receiver already has from a previous, superseded, transfer
+/// Chunks that are identical to an acknowledged chunk at the same position in the previous transfer are
+/// sent as BLOB_STREAM_CHUNK_ENCODING_UNCHANGED and the receiver copies them from its partial blob stream of the
+/// previous transfer. The previous blob stream is only used during this call.
+/// Must be called before anything is sent.
+/// @param self outgoing blob stream
+/// @param previousTransferId the transferId of the previous transfer, sent to the receiver as the baselineId
+/// @param previous the blob stream of the previous transfer
+/// @return negative on error
+int blobStreamOutSalvage(BlobStreamOut* self, BlobStreamTransferId previousTransferId, const BlobStreamOut* previous)
+{
+    if (self->sentChunkEntryCount != 0) {
+        CLOG_C_SOFT_ERROR(&self->log, "can not salvage after chunks are sent")
+        return -1;
+    }
+
+    if (self->blob == 0 || previous->blob == 0 || previous->fixedChunkSize != self->fixedChunkSize) {
+        CLOG_C_SOFT_ERROR(&self->log, "can not salvage from transfer %04X", previousTransferId)
+        return -2;
+    }
+
+    self->baseline = 0;
+    self->baselineOctetCount = 0;
+    self->deltaCache = 0;
+    blobStreamOutReset(self);
+
+    // The baseline is only kept during the call, since the previous blob stream is usually released after it
+    self->baseline = previous->blob;
+    self->baselineOctetCount = previous->octetCount;
+    self->baselineId = previousTransferId;
+    applyBaseline(self, previous);
+    self->baseline = 0;
+    self->baselineOctetCount = 0;
+    self->isDelta = true;
+
+    return 0;
+}
+
+static void prepareEntry(BlobStreamOut* self, BlobStreamOutEntry* entry)
+{
+    entry->isPrepared = true;
+    if (self->compressionCache == 0) {
+        return;
+    }
+
+    size_t offset = blobStreamChunkGeometryOffset(&self->geometry, entry->chunkId);
+    uint8_t* target = self->compressionCache + offset;
+    if (self->deltaCache != 0 && offset + entry->octetCount <= self->baselineOctetCount) {
+        uint8_t* delta = self->deltaCache + offset;
+        blobStreamXorOctets(delta, entry->octets, self->baseline + offset, entry->octetCount);
+        int deltaOctetCount = blobStreamCompress(delta, entry->octetCount, target, entry->octetCount - 1);
+        if (deltaOctetCount >= 0) {
+            entry->octets = target;
+            entry->octetCount = (size_t) deltaOctetCount;
+            entry->encoding = BLOB_STREAM_CHUNK_ENCODING_XOR | BLOB_STREAM_CHUNK_ENCODING_LZ;
+            return;
+        }
+    }
+
+    int compressedOctetCount = blobStreamCompress(entry->octets, entry->octetCount, target, entry->octetCount - 1);
+    if (compressedOctetCount < 0) {
+        CLOG_C_VERBOSE(&self->log, "chunk %04X is incompressible, sending it raw", entry->chunkId)
+        return;
+    }
+
+    entry->octets = target;
+    entry->octetCount = (size_t) compressedOctetCount;
+    entry->encoding = BLOB_STREAM_CHUNK_ENCODING_LZ;
+}
+
+/// Compresses all chunks up front
+/// Optional, otherwise each chunk is compressed the first time it is sent.
+/// @param self outgoing blob stream
+void blobStreamOutPrecompress(BlobStreamOut* self)
+{
+    for (size_t i = 0; i < self->chunkCount; ++i) {
+        BlobStreamOutEntry* entry = &self->entries[i];
+        if (!entry->isPrepared) {
+            prepareEntry(self, entry);
+        }
+    }
 }
 
 /// Checks if the blobStream is fully received by the receiver.
@@ -75,6 +480,143 @@ bool blobStreamOutIsAllSent(const BlobStreamOut* self)
     return self->sentChunkEntryCount == self->chunkCount;
 }
 
+/// Sets a deadline for a range of chunks
+/// Chunks that are not acknowledged by the receiver when the deadline has passed are never sent or resent
+/// again, see blobStreamOutNextExpiredRange(). The receiver is told about them with
+/// blobStreamLogicOutSendExpired(), and the transfer completes when it has acknowledged them.
+/// @param self outgoing blob stream
+/// @param firstChunkId the first chunk in the range
+/// @param chunkCount the number of chunks in the range, use chunkCount of the blob stream for the whole transfer
+/// @param deadline the time when the chunks are no longer useful
+/// @return negative on error
+int blobStreamOutSetDeadline(BlobStreamOut* self, BlobStreamChunkId firstChunkId, size_t chunkCount,
+                             MonotonicTimeMs deadline)
+{
+    if ((size_t) firstChunkId + chunkCount > self->chunkCount) {
+        CLOG_C_SOFT_ERROR(&self->log, "illegal deadline range %04X count %zu", firstChunkId, chunkCount)
+        return -1;
+    }
+
+    for (size_t i = firstChunkId; i < (size_t) firstChunkId + chunkCount; ++i) {
+        self->entries[i].deadline = deadline;
+    }
+    if (self->earliestDeadline == 0 || deadline < self->earliestDeadline) {
+        self->earliestDeadline = deadline;
+    }
+
+    return 0;
+}
+
+static void unlinkInFlight(BlobStreamOut* self, BlobStreamOutEntry* entry)
+{
+    if (!entry->isInFlight) {
+        return;
+    }
+
+    if (entry->previousInFlight != BLOB_STREAM_OUT_NO_CHUNK) {
+        self->entries[entry->previousInFlight].nextInFlight = entry->nextInFlight;
+    } else {
+        self->inFlightHead = entry->nextInFlight;
+    }
+    if (entry->nextInFlight != BLOB_STREAM_OUT_NO_CHUNK) {
+        self->entries[entry->nextInFlight].previousInFlight = entry->previousInFlight;
+    } else {
+        self->inFlightTail = entry->previousInFlight;
+    }
+    entry->previousInFlight = BLOB_STREAM_OUT_NO_CHUNK;
+    entry->nextInFlight = BLOB_STREAM_OUT_NO_CHUNK;
+    entry->isInFlight = false;
+}
+
+// The in flight list is ordered by lastSentAtTime, so the chunks that are due for a resend are at the head
+static void appendInFlight(BlobStreamOut* self, BlobStreamOutEntry* entry)
+{
+    entry->previousInFlight = self->inFlightTail;
+    entry->nextInFlight = BLOB_STREAM_OUT_NO_CHUNK;
+    if (self->inFlightTail != BLOB_STREAM_OUT_NO_CHUNK) {
+        self->entries[self->inFlightTail].nextInFlight = entry->chunkId;
+    } else {
+        self->inFlightHead = entry->chunkId;
+    }
+    self->inFlightTail = entry->chunkId;
+    entry->isInFlight = true;
+}
+
+static void expireEntries(BlobStreamOut* self, MonotonicTimeMs now)
+{
+    MonotonicTimeMs earliestDeadline = 0;
+    for (size_t i = 0; i < self->chunkCount; ++i) {
+        BlobStreamOutEntry* entry = &self->entries[i];
+        if (entry->deadline == 0 || entry->isReceived || entry->isExpired) {
+            continue;
+        }
+        if (now < entry->deadline) {
+            if (earliestDeadline == 0 || entry->deadline < earliestDeadline) {
+                earliestDeadline = entry->deadline;
+            }
+            continue;
+        }
+        if (entry->sendCount == 0) {
+            // Will never be sent
+            self->sentChunkEntryCount++;
+        }
+        unlinkInFlight(self, entry);
+        entry->isExpired = true;
+        self->expiredChunkCount++;
+        self->pendingExpiredChunkCount++;
+        CLOG_C_VERBOSE(&self->log, "chunk %04X expired after %zu sends", entry->chunkId, entry->sendCount)
+    }
+    self->earliestDeadline = earliestDeadline;
+}
+
+/// Finds the next range of expired chunks
+/// @param self outgoing blob stream
+/// @param fromChunkId the chunk to start searching from
+/// @param firstChunkId set to the first chunk in the range
+/// @param chunkCount set to the number of chunks in the range
+/// @return false if there are no more expired chunks
+bool blobStreamOutNextExpiredRange(const BlobStreamOut* self, size_t fromChunkId, size_t* firstChunkId,
+                                   size_t* chunkCount)
+{
+    size_t chunkId = fromChunkId;
+    while (chunkId < self->chunkCount && !self->entries[chunkId].isExpired) {
+        chunkId++;
+    }
+    if (chunkId >= self->chunkCount) {
+        return false;
+    }
+
+    *firstChunkId = chunkId;
+    while (chunkId < self->chunkCount && self->entries[chunkId].isExpired) {
+        chunkId++;
+    }
+    *chunkCount = chunkId - *firstChunkId;
+
+    return true;
+}
+
+static void markEntryReceived(BlobStreamOut* self, BlobStreamOutEntry* entry)
+{
+    if (entry->isReceived) {
+        return;
+    }
+    unlinkInFlight(self, entry);
+    if (entry->isExpired) {
+        // The receiver has acknowledged the hole
+        self->pendingExpiredChunkCount--;
+    } else if (entry->sendCount == 0) {
+        // Never sent, but the receiver has it anyway
+        self->sentChunkEntryCount++;
+    } else if (entry->sendCount == 1 &&
+               (!self->isRttSamplePending || entry->lastSentAtTime > self->rttSampleSentAt)) {
+        // Only chunks that are sent once give an unambiguous round trip time
+        self->rttSampleSentAt = entry->lastSentAtTime;
+        self->isRttSamplePending = true;
+    }
+    entry->isReceived = true;
+    self->receivedChunkCount++;
+}
+
 /// Marks chunks as received.
 /// @param self outgoing blob stream
 /// @param everythingBeforeThis all chunks before this index should be marked
@@ -84,7 +626,8 @@ bool blobStreamOutIsAllSent(const BlobStreamOut* self)
 void blobStreamOutMarkReceived(BlobStreamOut* self, BlobStreamChunkId everythingBeforeThis, BitArrayAtom maskReceived)
 {
     if (everythingBeforeThis > self->chunkCount) {
-        CLOG_C_ERROR(&self->log, "strange everythingBeforeThis")
+        CLOG_C_SOFT_ERROR(&self->log, "strange everythingBeforeThis %04X", everythingBeforeThis)
+        return;
     }
 
     CLOG_C_VERBOSE(&self->log, "markReceived remote expecting %04X mask %" PRIx64,  everythingBeforeThis, maskReceived)
@@ -95,9 +638,12 @@ void blobStreamOutMarkReceived(BlobStreamOut* self, BlobStreamChunkId everything
 
     // CLOG_OUTPUT_STDERR("blobStreamOut: remote has received everything before
     // %04X", everythingBeforeThis)
-    for (size_t i = 0; i < everythingBeforeThis; ++i) {
-        BlobStreamOutEntry* entry = &self->entries[i];
-        entry->isReceived = true;
+    // Everything before the low water mark is already marked
+    for (size_t i = self->receivedBeforeChunkId; i < everythingBeforeThis; ++i) {
+        markEntryReceived(self, &self->entries[i]);
+    }
+    if (everythingBeforeThis > self->receivedBeforeChunkId) {
+        self->receivedBeforeChunkId = everythingBeforeThis;
     }
     if (everythingBeforeThis == self->chunkCount) {
         self->isComplete = true;
@@ -113,14 +659,39 @@ void blobStreamOutMarkReceived(BlobStreamOut* self, BlobStreamChunkId everything
             return;
         }
         if (accumulator & 0x1) {
-            BlobStreamOutEntry* entry = &self->entries[index];
-            entry->isReceived = true;
+            markEntryReceived(self, &self->entries[index]);
             CLOG_C_VERBOSE(&self->log, "remote has received chunkId %04zX", index)
         }
         accumulator = accumulator >> 1;
     }
 }
 
+/// Marks a single chunk as received
+/// Used when the receiver already has the chunk, e.g. from its chunk cache. The chunk will never be sent.
+/// @param self outgoing blob stream
+/// @param chunkId the zero based index of the chunk
+void blobStreamOutMarkChunkReceived(BlobStreamOut* self, BlobStreamChunkId chunkId)
+{
+    if (chunkId >= self->chunkCount) {
+        CLOG_C_SOFT_ERROR(&self->log, "received chunkId %04X is out of range", chunkId)
+        return;
+    }
+
+    markEntryReceived(self, &self->entries[chunkId]);
+    if (self->receivedChunkCount == self->chunkCount) {
+        self->isComplete = true;
+    }
+}
+
+/// Gets the number of chunks that are sent, but not yet acknowledged by the receiver
+/// Expired chunks are not in flight, since they are never resent.
+/// @param self outgoing blob stream
+/// @return the number of chunks in flight
+size_t blobStreamOutInFlightCount(const BlobStreamOut* self)
+{
+    return self->sentChunkEntryCount - self->receivedChunkCount - self->pendingExpiredChunkCount;
+}
+
 /// Calculates which chunks that needs to be sent
 /// @param self outgoing blob stream
 /// @param now current time
@@ -130,42 +701,438 @@ void blobStreamOutMarkReceived(BlobStreamOut* self, BlobStreamChunkId everything
 int blobStreamOutGetChunksToSend(BlobStreamOut* self, MonotonicTimeMs now, const BlobStreamOutEntry** resultEntries,
                                  size_t maxEntriesCount)
 {
-    if (maxEntriesCount == 0) {
-        return 0;
+    return blobStreamOutGetChunksToSendLimited(self, now, resultEntries, maxEntriesCount, SIZE_MAX);
+}
+
+/// Sets pull mode, where only the chunks that the receiver requests are sent
+/// No chunks are sent on timers, see blobStreamOutRequestChunks(). Usually set when the first
+/// BLOB_STREAM_LOGIC_CMD_REQUEST_CHUNKS is received.
+/// @param self outgoing blob stream
+/// @param isPullMode true for pull mode
+void blobStreamOutSetPullMode(BlobStreamOut* self, bool isPullMode)
+{
+    self->isPullMode = isPullMode;
+}
+
+/// Sets the receive window advertised by the receiver
+/// Chunks from endChunkId and up are not sent, except if they are requested. New chunks are sent in blocks that end
+/// at the window, and in interleaved order the chunks are only spread within a block, so chunks outside the window
+/// are never visited. A window that shrinks below the current block starts the block again within the window.
+/// @param self outgoing blob stream
+/// @param endChunkId the first chunk that the receiver does not accept
+void blobStreamOutSetReceiveWindow(BlobStreamOut* self, size_t endChunkId)
+{
+    self->receiveWindowEndChunkId = endChunkId < self->chunkCount ? endChunkId : self->chunkCount;
+}
+
+/// Sets the unit of all time values that are passed to and stored in the blob stream
+/// The blob stream never reads a clock, so the time base only has to match the now values passed to
+/// blobStreamOutGetChunksToSend(). A microsecond or nanosecond time base gives resend timers, round trip times and
+/// pacing the resolution needed on local networks, where a round trip is well below a millisecond.
+/// thresholdForRedundancy is reset to 50 ms in the new time base and the round trip time is cleared, so set the time
+/// base before anything is sent.
+/// @param self outgoing blob stream
+/// @param ticksPerSecond BLOB_STREAM_TIME_BASE_MILLISECONDS (default), BLOB_STREAM_TIME_BASE_MICROSECONDS or
+/// BLOB_STREAM_TIME_BASE_NANOSECONDS
+void blobStreamOutSetTimeBase(BlobStreamOut* self, uint64_t ticksPerSecond)
+{
+    CLOG_ASSERT(ticksPerSecond >= BLOB_STREAM_TIME_BASE_MILLISECONDS, "illegal time base %" PRIu64, ticksPerSecond)
+    self->ticksPerSecond = ticksPerSecond;
+    self->thresholdForRedundancy = (MonotonicTimeMs) (50 * ticksPerSecond / BLOB_STREAM_TIME_BASE_MILLISECONDS);
+    self->smoothedRtt = 0;
+    self->hasRtt = false;
+    self->isRttSamplePending = false;
+    self->pacingCredit = (uint64_t) self->maxChunksPerSend * self->fixedChunkSize * ticksPerSecond;
+}
+
+/// Limits the rate that chunks are sent at
+/// Credit is earned for the time between calls to blobStreamOutGetChunksToSend(), up to maxChunksPerSend chunks, and
+/// a chunk is only returned when there is credit for a full chunk. With a fine time base (see
+/// blobStreamOutSetTimeBase()) the chunks are spread out evenly instead of being sent in bursts.
+/// @param self outgoing blob stream
+/// @param octetsPerSecond chunk payload octets per second, zero for no pacing
+void blobStreamOutSetPacingRate(BlobStreamOut* self, uint64_t octetsPerSecond)
+{
+    self->pacingOctetsPerSecond = octetsPerSecond;
+    self->pacingCredit = (uint64_t) self->maxChunksPerSend * self->fixedChunkSize * self->ticksPerSecond;
+    self->pacedAt = 0;
+}
+
+static size_t pacedEntryCount(BlobStreamOut* self, MonotonicTimeMs now)
+{
+    // The credit is kept in octets times ticks per second, so no fraction of an octet is lost between calls
+    uint64_t chunkCredit = (uint64_t) self->fixedChunkSize * self->ticksPerSecond;
+    uint64_t maxCredit = self->maxChunksPerSend * chunkCredit;
+    if (now > self->pacedAt) {
+        // Capped to a second so the multiplication can not overflow for rates up to 18 GB/s
+        uint64_t elapsed = (uint64_t) (now - self->pacedAt);
+        if (elapsed > self->ticksPerSecond) {
+            elapsed = self->ticksPerSecond;
+        }
+        uint64_t earned = elapsed * self->pacingOctetsPerSecond;
+        bool isFull = self->pacingCredit >= maxCredit || earned >= maxCredit - self->pacingCredit;
+        self->pacingCredit = isFull ? maxCredit : self->pacingCredit + earned;
+        self->pacedAt = now;
+    }
+
+    return (size_t) (self->pacingCredit / chunkCredit);
+}
+
+/// Enables tail loss probes
+/// When all chunks are sent and no ack has made progress for a probe timeout, the chunks in flight are resent
+/// without waiting for thresholdForRedundancy. Otherwise a lost chunk at the end of the transfer, with no later
+/// chunks whose acks could reveal the hole, delays the completion by a full thresholdForRedundancy. At most
+/// BLOB_STREAM_OUT_MAX_TAIL_LOSS_PROBE_COUNT probes are sent in a row, each one waiting twice as long as the
+/// previous one, until an ack makes progress. No probes are sent before the first round trip time sample, since
+/// the chunks might still be on their way.
+/// @param self outgoing blob stream
+/// @param minProbeTimeout the lowest probe timeout. Zero disables the probes.
+void blobStreamOutSetTailLossProbe(BlobStreamOut* self, MonotonicTimeMs minProbeTimeout)
+{
+    self->minProbeTimeout = minProbeTimeout;
+}
+
+/// Calculates the tail loss probe timeout
+/// Twice the smoothed round trip time, which is sampled from acks of chunks that were only sent once. The ack is
+/// timed when it is handled by the next blobStreamOutGetChunksToSend(), so the poll interval is included.
+/// @param self outgoing blob stream
+/// @return the probe timeout, or thresholdForRedundancy if there is no round trip time yet
+MonotonicTimeMs blobStreamOutProbeTimeout(const BlobStreamOut* self)
+{
+    if (!self->hasRtt) {
+        return self->thresholdForRedundancy;
     }
 
-    if (maxEntriesCount > 5) {
-        maxEntriesCount = 5;
+    MonotonicTimeMs timeout = 2 * self->smoothedRtt;
+    return timeout > self->minProbeTimeout ? timeout : self->minProbeTimeout;
+}
+
+/// Sets the order that chunks are sent in for the first time
+/// Resends are always in the order the chunks were sent. BlobStreamOutOrderInterleaved spreads consecutive
+/// chunks far apart in the blob, so a burst of lost datagrams leaves small holes in many places instead of one
+/// large hole.
+/// @param self outgoing blob stream
+/// @param order the order
+void blobStreamOutSetOrder(BlobStreamOut* self, BlobStreamOutOrder order)
+{
+    self->order = order;
+    self->nextOrderIndex = 0;
+    self->orderBlockFirstChunkId = 0;
+    self->orderBlockChunkCount = 0;
+}
+
+/// Adds a range of chunks that is sent before the rest, e.g. the header or index of the blob
+/// Priority ranges are sent in the order they are added. They are kept over a blobStreamOutReset().
+/// @param self outgoing blob stream
+/// @param firstChunkId the first chunk in the range
+/// @param chunkCount the number of chunks in the range
+/// @return negative on error
+int blobStreamOutAddPriorityRange(BlobStreamOut* self, BlobStreamChunkId firstChunkId, size_t chunkCount)
+{
+    if ((size_t) firstChunkId + chunkCount > self->chunkCount || chunkCount == 0) {
+        CLOG_C_SOFT_ERROR(&self->log, "illegal priority range %04X count %zu", firstChunkId, chunkCount)
+        return -1;
     }
 
-    size_t resultCount = 0;
+    if (self->priorityRangeCount == BLOB_STREAM_OUT_MAX_RANGE_COUNT) {
+        CLOG_C_SOFT_ERROR(&self->log, "too many priority ranges")
+        return -2;
+    }
 
-    for (size_t i = 0; i < self->chunkCount; ++i) {
-        BlobStreamOutEntry* entry = &self->entries[i];
-        if (!entry->isReceived &&
-            (((now - entry->lastSentAtTime > self->thresholdForRedundancy) && entry->octetCount != 0) ||
-             entry->sendCount == 0)) {
-            resultEntries[resultCount] = entry;
-            entry->lastSentAtTime = now;
-            resultCount++;
-            if (!entry->sendCount) {
-                // First time we sent it
-                self->sentChunkEntryCount++;
+    BlobStreamOutRange* range = &self->priorityRanges[self->priorityRangeCount];
+    range->firstChunkId = firstChunkId;
+    range->endChunkId = firstChunkId + (BlobStreamChunkId) chunkCount;
+    if (self->priorityRangeIndex == self->priorityRangeCount) {
+        self->priorityChunkId = firstChunkId;
+    }
+    self->priorityRangeCount++;
+
+    return 0;
+}
+
+/// Requests a range of chunks that the receiver needs right away
+/// The chunks are sent before anything else on the next send, even if they were sent recently.
+/// @param self outgoing blob stream
+/// @param firstChunkId the first chunk in the range
+/// @param chunkCount the number of chunks in the range
+/// @return negative on error
+int blobStreamOutRequestChunks(BlobStreamOut* self, BlobStreamChunkId firstChunkId, size_t chunkCount)
+{
+    if ((size_t) firstChunkId + chunkCount > self->chunkCount || chunkCount == 0) {
+        CLOG_C_SOFT_ERROR(&self->log, "illegal requested range %04X count %zu", firstChunkId, chunkCount)
+        return -1;
+    }
+
+    BlobStreamOutRangeQueue* queue = &self->requestedRanges;
+    if (queue->count == BLOB_STREAM_OUT_MAX_RANGE_COUNT) {
+        CLOG_C_NOTICE(&self->log, "too many requested ranges, ignoring %04X", firstChunkId)
+        return -2;
+    }
+
+    BlobStreamOutRange* range = &queue->ranges[(queue->head + queue->count) % BLOB_STREAM_OUT_MAX_RANGE_COUNT];
+    range->firstChunkId = firstChunkId;
+    range->endChunkId = firstChunkId + (BlobStreamChunkId) chunkCount;
+    queue->count++;
+
+    return 0;
+}
+
+static bool isPending(const BlobStreamOutEntry* entry)
+{
+    return !entry->isReceived && !entry->isExpired;
+}
+
+static bool isNew(const BlobStreamOutEntry* entry)
+{
+    return entry->sendCount == 0 && isPending(entry);
+}
+
+static BlobStreamChunkId chunkIdFromOrderIndex(const BlobStreamOut* self, size_t orderIndex)
+{
+    if (self->order == BlobStreamOutOrderInterleaved) {
+        return (BlobStreamChunkId) (self->orderBlockFirstChunkId +
+                                    ((uint64_t) orderIndex * self->interleaveStride) % self->orderBlockChunkCount);
+    }
+
+    return (BlobStreamChunkId) (self->orderBlockFirstChunkId + orderIndex);
+}
+
+// The order is walked in blocks that end at the receive window, so each chunk is visited once
+static bool startOrderBlock(BlobStreamOut* self, size_t firstChunkId)
+{
+    self->orderBlockFirstChunkId = firstChunkId;
+    self->orderBlockChunkCount = firstChunkId < self->receiveWindowEndChunkId
+                                     ? self->receiveWindowEndChunkId - firstChunkId
+                                     : 0;
+    self->nextOrderIndex = 0;
+    if (self->order == BlobStreamOutOrderInterleaved) {
+        self->interleaveStride = interleaveStrideForChunkCount(self->orderBlockChunkCount);
+    }
+
+    return self->orderBlockChunkCount != 0;
+}
+
+typedef struct SendTarget {
+    const BlobStreamOutEntry** resultEntries;
+    size_t resultCount;
+    size_t maxEntriesCount;
+    size_t maxNewEntriesCount;
+    MonotonicTimeMs now;
+} SendTarget;
+
+static bool isFull(const SendTarget* target)
+{
+    return target->resultCount == target->maxEntriesCount;
+}
+
+static void sendEntry(BlobStreamOut* self, BlobStreamOutEntry* entry, SendTarget* target)
+{
+    if (!entry->isPrepared) {
+        prepareEntry(self, entry);
+    }
+    target->resultEntries[target->resultCount++] = entry;
+    entry->lastSentAtTime = target->now;
+    if (!entry->sendCount) {
+        // First time we sent it
+        self->sentChunkEntryCount++;
+        target->maxNewEntriesCount--;
+    }
+    entry->sendCount++;
+    unlinkInFlight(self, entry);
+    appendInFlight(self, entry);
+
+    CLOG_C_VERBOSE(&self->log, "send chunkIndex %04X", entry->chunkId)
+}
+
+static void sendRequested(BlobStreamOut* self, SendTarget* target)
+{
+    BlobStreamOutRangeQueue* queue = &self->requestedRanges;
+    while (queue->count > 0 && !isFull(target)) {
+        BlobStreamOutRange* range = &queue->ranges[queue->head];
+        while (range->firstChunkId < range->endChunkId && !isFull(target)) {
+            BlobStreamOutEntry* entry = &self->entries[range->firstChunkId];
+            bool isSentNow = entry->sendCount > 0 && entry->lastSentAtTime == target->now;
+            if (isPending(entry) && !isSentNow) {
+                if (entry->sendCount == 0 && target->maxNewEntriesCount == 0) {
+                    return;
+                }
+                sendEntry(self, entry, target);
             }
-            entry->sendCount++;
+            range->firstChunkId++;
+        }
+        if (range->firstChunkId == range->endChunkId) {
+            queue->head = (queue->head + 1) % BLOB_STREAM_OUT_MAX_RANGE_COUNT;
+            queue->count--;
+        }
+    }
+}
 
-            CLOG_C_VERBOSE(&self->log, "send chunkIndex %04X", entry->chunkId)
+static void sendDueForResend(BlobStreamOut* self, SendTarget* target)
+{
+    BlobStreamChunkId chunkId = self->inFlightHead;
+    while (chunkId != BLOB_STREAM_OUT_NO_CHUNK && !isFull(target)) {
+        BlobStreamOutEntry* entry = &self->entries[chunkId];
+        if (target->now - entry->lastSentAtTime <= self->thresholdForRedundancy) {
+            // The rest of the list is sent even more recently
+            return;
+        }
+        chunkId = entry->nextInFlight;
+        if (entry->octetCount != 0 && entry->chunkId < self->receiveWindowEndChunkId) {
+            sendEntry(self, entry, target);
+        }
+    }
+}
+
+static void sendTailLossProbe(BlobStreamOut* self, SendTarget* target)
+{
+    if (self->minProbeTimeout == 0 || !self->hasRtt || target->resultCount != 0 ||
+        self->inFlightHead == BLOB_STREAM_OUT_NO_CHUNK || !blobStreamOutIsAllSent(self)) {
+        return;
+    }
+
+    if (self->receivedChunkCount != self->tailProbeReceivedChunkCount) {
+        self->tailProbeReceivedChunkCount = self->receivedChunkCount;
+        self->tailProbeCount = 0;
+    }
+    if (self->tailProbeCount == BLOB_STREAM_OUT_MAX_TAIL_LOSS_PROBE_COUNT) {
+        return;
+    }
 
-            if (resultCount == maxEntriesCount) {
-                return (int) resultCount;
+    // The tail of the in flight list is the most recently sent chunk, so nothing has been sent since then
+    MonotonicTimeMs probeTimeout = blobStreamOutProbeTimeout(self) << self->tailProbeCount;
+    if (target->now - self->entries[self->inFlightTail].lastSentAtTime < probeTimeout) {
+        return;
+    }
+
+    self->tailProbeCount++;
+    self->tailLossProbeCount++;
+    CLOG_C_VERBOSE(&self->log, "tail loss probe %zu after %" PRId64 " ms", self->tailProbeCount, probeTimeout)
+
+    // Probe the most recently sent chunks, the ones that no later ack can reveal as lost. A resent entry moves to
+    // the tail, but its previous entry is fetched before that, so the walk still ends at the original head.
+    BlobStreamChunkId chunkId = self->inFlightTail;
+    while (chunkId != BLOB_STREAM_OUT_NO_CHUNK && !isFull(target)) {
+        BlobStreamOutEntry* entry = &self->entries[chunkId];
+        chunkId = entry->previousInFlight;
+        if (entry->octetCount != 0 && entry->chunkId < self->receiveWindowEndChunkId) {
+            sendEntry(self, entry, target);
+        }
+    }
+}
+
+static void sendPriorityRanges(BlobStreamOut* self, SendTarget* target)
+{
+    while (self->priorityRangeIndex < self->priorityRangeCount && !isFull(target)) {
+        const BlobStreamOutRange* range = &self->priorityRanges[self->priorityRangeIndex];
+        while (self->priorityChunkId < range->endChunkId) {
+            BlobStreamOutEntry* entry = &self->entries[self->priorityChunkId];
+            if (isNew(entry)) {
+                if (isFull(target) || target->maxNewEntriesCount == 0 ||
+                    self->priorityChunkId >= self->receiveWindowEndChunkId) {
+                    return;
+                }
+                sendEntry(self, entry, target);
             }
-        } else {
-            // CLOG_OUTPUT_STDERR("blobStreamOut: not sending: %zu (%zu) %zu %d",
-            // entry->lastSentAtTime, now, entry->octetCount, entry->isReceived)
+            self->priorityChunkId++;
+        }
+        self->priorityRangeIndex++;
+        if (self->priorityRangeIndex < self->priorityRangeCount) {
+            self->priorityChunkId = self->priorityRanges[self->priorityRangeIndex].firstChunkId;
+        }
+    }
+}
+
+static void sendInOrder(BlobStreamOut* self, SendTarget* target)
+{
+    if (self->orderBlockFirstChunkId + self->orderBlockChunkCount > self->receiveWindowEndChunkId) {
+        // All chunks before receivedBeforeChunkId are received, so no new chunk is left behind
+        startOrderBlock(self, self->receivedBeforeChunkId);
+    }
+
+    while (!isFull(target) && target->maxNewEntriesCount > 0) {
+        if (self->nextOrderIndex == self->orderBlockChunkCount &&
+            !startOrderBlock(self, self->orderBlockFirstChunkId + self->orderBlockChunkCount)) {
+            return;
+        }
+        BlobStreamOutEntry* entry = &self->entries[chunkIdFromOrderIndex(self, self->nextOrderIndex)];
+        if (isNew(entry)) {
+            sendEntry(self, entry, target);
+        }
+        self->nextOrderIndex++;
+    }
+}
+
+/// Calculates which chunks that needs to be sent, with a limit on chunks that are sent for the first time
+/// Resends are not limited, so chunks that are in flight can always be recovered. Chunks with a passed
+/// deadline are expired first, so they are never returned.
+/// Requested chunks come first, then resends, then priority ranges and last the chunks in the order set with
+/// blobStreamOutSetOrder(). All steps continue from where they left off, so each chunk is visited once in the order,
+/// except when the receive window shrinks, see blobStreamOutSetReceiveWindow(). In pull mode,
+/// only requested chunks are returned. Only requested chunks are sent outside the receive window. If nothing else
+/// is sent, a tail loss probe can be sent, see blobStreamOutSetTailLossProbe(). With a pacing rate, fewer chunks are
+/// returned when the credit is used up, see blobStreamOutSetPacingRate().
+/// @param self outgoing blob stream
+/// @param now current time
+/// @param resultEntries the resulting entries that needs to be sent/resent.
+/// @param maxEntriesCount the maximum size of the resultEntries
+/// @param maxNewEntriesCount the maximum number of chunks that are sent for the first time
+/// @return the number of resultEntries filled, or if negative: the error code.
+int blobStreamOutGetChunksToSendLimited(BlobStreamOut* self, MonotonicTimeMs now,
+                                        const BlobStreamOutEntry** resultEntries, size_t maxEntriesCount,
+                                        size_t maxNewEntriesCount)
+{
+    if (maxEntriesCount == 0) {
+        return 0;
+    }
+
+    if (maxEntriesCount > self->maxChunksPerSend) {
+        maxEntriesCount = self->maxChunksPerSend;
+    }
+
+    if (self->earliestDeadline != 0 && now >= self->earliestDeadline) {
+        expireEntries(self, now);
+    }
+
+    if (self->isRttSamplePending) {
+        MonotonicTimeMs rtt = now - self->rttSampleSentAt;
+        self->smoothedRtt = self->hasRtt ? (7 * self->smoothedRtt + rtt) / 8 : rtt;
+        self->hasRtt = true;
+        self->isRttSamplePending = false;
+    }
+
+    if (self->pacingOctetsPerSecond != 0) {
+        size_t pacedCount = pacedEntryCount(self, now);
+        if (pacedCount < maxEntriesCount) {
+            maxEntriesCount = pacedCount;
+        }
+        if (maxEntriesCount == 0) {
+            return 0;
+        }
+    }
+
+    SendTarget target;
+    target.resultEntries = resultEntries;
+    target.resultCount = 0;
+    target.maxEntriesCount = maxEntriesCount;
+    target.maxNewEntriesCount = maxNewEntriesCount;
+    target.now = now;
+
+    sendRequested(self, &target);
+    if (!self->isPullMode) {
+        sendDueForResend(self, &target);
+        sendPriorityRanges(self, &target);
+        sendInOrder(self, &target);
+        sendTailLossProbe(self, &target);
+    }
+
+    if (self->pacingOctetsPerSecond != 0) {
+        for (size_t i = 0; i < target.resultCount; ++i) {
+            uint64_t octetCredit = (uint64_t) resultEntries[i]->octetCount * self->ticksPerSecond;
+            self->pacingCredit = self->pacingCredit > octetCredit ? self->pacingCredit - octetCredit : 0;
         }
     }
 
-    return (int) resultCount;
+    return (int) target.resultCount;
 }
 
 /// Returns a string describing the internal state of the outgoing blob stream.
@@ -0,0 +1,219 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/blob-stream
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include <blob-stream/blob_stream_pipeline.h>
+#include <flood/in_stream.h>
+#include <imprint/allocator.h>
+
+/// Initializes a queue of outgoing transfers that are sent back to back on the same channel
+/// The chunks of the next transfer are sent while the tail of the previous one is still waiting for acks,
+/// as long as the total number of octets in flight is within maxInFlightOctetCount.
+/// @param self pipeline
+/// @param memory allocator for the transfer queue
+/// @param capacity maximum number of queued transfers
+/// @param firstTransferId the transferId of the first transfer, the following ones are increasing
+/// @param maxInFlightOctetCount maximum number of sent, but not acknowledged, octets for all transfers
+/// @param log the log to use
+void blobStreamPipelineInit(BlobStreamPipeline* self, struct ImprintAllocator* memory, size_t capacity,
+                            BlobStreamTransferId firstTransferId, size_t maxInFlightOctetCount, Clog log)
+{
+    self->log = log;
+    self->transfers = IMPRINT_ALLOC_TYPE_COUNT(memory, BlobStreamPipelineTransfer, capacity);
+    self->capacity = capacity;
+    self->head = 0;
+    self->count = 0;
+    self->nextTransferId = firstTransferId;
+    self->maxInFlightOctetCount = maxInFlightOctetCount;
+    self->isLatestWins = false;
+    self->isSalvageEnabled = false;
+}
+
+/// Switches to latest wins mode, for periodic snapshots
+/// Enqueuing a transfer supersedes all the queued ones, so their chunks are never sent or resent again and
+/// all bandwidth goes to the newest transfer. Their callbacks are called with wasSuperseded set.
+/// @param self pipeline
+/// @param isSalvageEnabled if set, chunks that the receiver has already acknowledged in the superseded transfer
+/// are not sent again if they are unchanged, see blobStreamOutSalvage(). The receiver must then keep the
+/// superseded blob stream as the baseline for the new one.
+void blobStreamPipelineSetLatestWins(BlobStreamPipeline* self, bool isSalvageEnabled)
+{
+    self->isLatestWins = true;
+    self->isSalvageEnabled = isSalvageEnabled;
+}
+
+static BlobStreamPipelineTransfer* transferAt(BlobStreamPipeline* self, size_t index)
+{
+    return &self->transfers[(self->head + index) % self->capacity];
+}
+
+static void supersedeAll(BlobStreamPipeline* self, BlobStreamOut* newBlobStream)
+{
+    if (self->count == 0) {
+        return;
+    }
+
+    BlobStreamPipelineTransfer* newest = transferAt(self, self->count - 1);
+    if (self->isSalvageEnabled && newBlobStream->blob != 0) {
+        blobStreamOutSalvage(newBlobStream, newest->logic.transferId, newest->logic.blobStream);
+    }
+
+    for (size_t i = 0; i < self->count; ++i) {
+        BlobStreamPipelineTransfer* transfer = transferAt(self, i);
+        if (transfer->isCompleteNotified) {
+            continue;
+        }
+        CLOG_C_VERBOSE(&self->log, "transfer %04X is superseded", transfer->logic.transferId)
+        if (transfer->onComplete != 0) {
+            transfer->onComplete(transfer->userData, transfer->logic.transferId, transfer->logic.blobStream, true);
+        }
+    }
+
+    self->head = 0;
+    self->count = 0;
+}
+
+/// Adds a blob stream to the end of the queue
+/// The application is expected to send the start transfer for the returned logic, see
+/// blobStreamLogicOutStartTransfer(). The blob stream must be valid until onComplete is called.
+/// In latest wins mode, all queued transfers are superseded.
+/// @param self pipeline
+/// @param blobStream the blob stream to send
+/// @param onComplete called when the receiver has acknowledged all chunks, or when the transfer is superseded.
+/// Can be NULL.
+/// @param userData passed to onComplete
+/// @return the logic with the assigned transferId, or NULL if the queue is full
+BlobStreamLogicOut* blobStreamPipelineEnqueue(BlobStreamPipeline* self, BlobStreamOut* blobStream,
+                                              BlobStreamPipelineCompleteFn onComplete, void* userData)
+{
+    if (self->isLatestWins) {
+        supersedeAll(self, blobStream);
+    }
+
+    if (self->count == self->capacity) {
+        CLOG_C_SOFT_ERROR(&self->log, "pipeline is full (%zu transfers)", self->capacity)
+        return 0;
+    }
+
+    BlobStreamPipelineTransfer* transfer = transferAt(self, self->count++);
+    blobStreamLogicOutInit(&transfer->logic, blobStream, self->nextTransferId++);
+    transfer->onComplete = onComplete;
+    transfer->userData = userData;
+    transfer->isCompleteNotified = false;
+
+    CLOG_C_VERBOSE(&self->log, "enqueued transfer %04X, %zu in queue", transfer->logic.transferId, self->count)
+
+    return &transfer->logic;
+}
+
+/// Calculates the number of sent, but not acknowledged, octets for all queued transfers
+/// @param self pipeline
+/// @return the number of octets in flight
+size_t blobStreamPipelineInFlightOctetCount(const BlobStreamPipeline* self)
+{
+    size_t octetCount = 0;
+    for (size_t i = 0; i < self->count; ++i) {
+        const BlobStreamOut* blobStream = self->transfers[(self->head + i) % self->capacity].logic.blobStream;
+        octetCount += blobStreamOutInFlightCount(blobStream) * blobStream->fixedChunkSize;
+    }
+
+    return octetCount;
+}
+
+static void notifyCompleted(BlobStreamPipeline* self)
+{
+    for (size_t i = 0; i < self->count; ++i) {
+        BlobStreamPipelineTransfer* transfer = transferAt(self, i);
+        if (transfer->isCompleteNotified || !blobStreamOutIsComplete(transfer->logic.blobStream)) {
+            continue;
+        }
+        transfer->isCompleteNotified = true;
+        CLOG_C_VERBOSE(&self->log, "transfer %04X is complete", transfer->logic.transferId)
+        if (transfer->onComplete != 0) {
+            transfer->onComplete(transfer->userData, transfer->logic.transferId, transfer->logic.blobStream, false);
+        }
+    }
+
+    while (self->count > 0 && transferAt(self, 0)->isCompleteNotified) {
+        self->head = (self->head + 1) % self->capacity;
+        self->count--;
+    }
+}
+
+/// Calculates which chunks to send for all the queued transfers
+/// The oldest transfer is served first, so its resends are never delayed by later transfers.
+/// Each result entry should be written with blobStreamLogicOutSendEntry() using the transferId of its logic.
+/// @param self pipeline
+/// @param now current time
+/// @param results target for the chunks to send
+/// @param maxResultCount maximum number of results
+/// @return the number of results filled in
+int blobStreamPipelinePrepareSend(BlobStreamPipeline* self, MonotonicTimeMs now, BlobStreamScheduledEntry* results,
+                                  size_t maxResultCount)
+{
+    size_t inFlightOctetCount = blobStreamPipelineInFlightOctetCount(self);
+    size_t resultCount = 0;
+
+    for (size_t i = 0; i < self->count && resultCount < maxResultCount; ++i) {
+        BlobStreamPipelineTransfer* transfer = transferAt(self, i);
+        BlobStreamOut* blobStream = transfer->logic.blobStream;
+        size_t octetsLeft = inFlightOctetCount < self->maxInFlightOctetCount
+                                ? self->maxInFlightOctetCount - inFlightOctetCount
+                                : 0;
+        size_t maxNewCount = octetsLeft / blobStream->fixedChunkSize;
+
+        const BlobStreamOutEntry* entries[16];
+        size_t maxCount = maxResultCount - resultCount;
+        if (maxCount > sizeof(entries) / sizeof(entries[0])) {
+            maxCount = sizeof(entries) / sizeof(entries[0]);
+        }
+
+        size_t sentCountBefore = blobStream->sentChunkEntryCount;
+        int count = blobStreamOutGetChunksToSendLimited(blobStream, now, entries, maxCount, maxNewCount);
+        if (count < 0) {
+            return count;
+        }
+        inFlightOctetCount += (blobStream->sentChunkEntryCount - sentCountBefore) * blobStream->fixedChunkSize;
+
+        for (int j = 0; j < count; ++j) {
+            results[resultCount].logic = &transfer->logic;
+            results[resultCount].entry = entries[j];
+            resultCount++;
+        }
+    }
+
+    return (int) resultCount;
+}
+
+/// Receives a command for one of the queued transfers
+/// Completion callbacks are called from here. Commands for transfers that are no longer in the queue are
+/// usually late acks and can be dropped.
+/// @param self pipeline
+/// @param inStream stream to read from, including the command octet
+/// @return negative on error, or if the transfer is not in the queue
+int blobStreamPipelineReceive(BlobStreamPipeline* self, struct FldInStream* inStream)
+{
+    FldInStream peekStream = *inStream;
+    uint8_t cmd;
+    uint16_t transferId;
+    fldInStreamReadUInt8(&peekStream, &cmd);
+    int peekErr = fldInStreamReadUInt16(&peekStream, &transferId);
+    if (peekErr < 0) {
+        return peekErr;
+    }
+
+    for (size_t i = 0; i < self->count; ++i) {
+        BlobStreamPipelineTransfer* transfer = transferAt(self, i);
+        if (transfer->logic.transferId != transferId) {
+            continue;
+        }
+        int result = blobStreamLogicOutReceive(&transfer->logic, inStream);
+        notifyCompleted(self);
+        return result;
+    }
+
+    CLOG_C_VERBOSE(&self->log, "command %02X for transfer %04X that is not queued", cmd, transferId)
+
+    return -3;
+}
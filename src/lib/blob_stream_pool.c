@@ -0,0 +1,141 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/blob-stream
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include <blob-stream/blob_stream_pool.h>
+#include <imprint/allocator.h>
+
+/// Initializes a pool of incoming blob streams
+/// All streams are allocated up front with room for maxOctetCount, so acquiring and releasing
+/// streams does not allocate any memory.
+/// @param self incoming blob stream pool
+/// @param memory allocator for the streams and their bit arrays
+/// @param blobAllocator allocator for the payloads
+/// @param streamCount number of streams in the pool
+/// @param maxOctetCount the maximum size of a blob
+/// @param fixedChunkSize the smallest chunk size that will be used
+/// @param log the log to use
+void blobStreamInPoolInit(BlobStreamInPool* self, struct ImprintAllocator* memory,
+                          struct ImprintAllocatorWithFree* blobAllocator, size_t streamCount, size_t maxOctetCount,
+                          size_t fixedChunkSize, Clog log)
+{
+    self->log = log;
+    self->capacity = streamCount;
+    self->streams = IMPRINT_ALLOC_TYPE_COUNT(memory, BlobStreamIn, streamCount);
+    self->freeStreams = IMPRINT_ALLOC_TYPE_COUNT(memory, BlobStreamIn*, streamCount);
+    for (size_t i = 0; i < streamCount; ++i) {
+        blobStreamInInit(&self->streams[i], memory, blobAllocator, maxOctetCount, fixedChunkSize, log);
+        self->freeStreams[i] = &self->streams[streamCount - 1 - i];
+    }
+    self->freeCount = streamCount;
+}
+
+/// Frees the payloads of all the streams in the pool
+/// @param self incoming blob stream pool
+void blobStreamInPoolDestroy(BlobStreamInPool* self)
+{
+    for (size_t i = 0; i < self->capacity; ++i) {
+        blobStreamInDestroy(&self->streams[i]);
+    }
+    self->freeCount = 0;
+}
+
+/// Takes a stream from the pool and prepares it for a new transfer
+/// @param self incoming blob stream pool
+/// @param octetCount the total size of the blob to be received
+/// @param fixedChunkSize the size of each chunk
+/// @return the stream or NULL if no stream is available or big enough
+BlobStreamIn* blobStreamInPoolAcquire(BlobStreamInPool* self, size_t octetCount, size_t fixedChunkSize)
+{
+    if (self->freeCount == 0) {
+        CLOG_C_SOFT_ERROR(&self->log, "no free incoming blob streams (%zu)", self->capacity)
+        return 0;
+    }
+
+    BlobStreamIn* stream = self->freeStreams[self->freeCount - 1];
+    if (blobStreamInReinit(stream, octetCount, fixedChunkSize) < 0) {
+        return 0;
+    }
+    self->freeCount--;
+
+    return stream;
+}
+
+/// Returns a stream to the pool
+/// @param self incoming blob stream pool
+/// @param stream stream previously returned from blobStreamInPoolAcquire()
+void blobStreamInPoolRelease(BlobStreamInPool* self, BlobStreamIn* stream)
+{
+    CLOG_ASSERT(self->freeCount < self->capacity, "incoming blob stream pool release overflow")
+    self->freeStreams[self->freeCount++] = stream;
+}
+
+/// Initializes a pool of outgoing blob streams
+/// All entries are allocated up front with room for maxOctetCount, so acquiring and releasing
+/// streams does not allocate any memory.
+/// @param self outgoing blob stream pool
+/// @param memory allocator for the streams and their entries
+/// @param blobAllocator passed on to blobStreamOutInit()
+/// @param streamCount number of streams in the pool
+/// @param maxOctetCount the maximum size of a blob
+/// @param fixedChunkSize the smallest chunk size that will be used
+/// @param log the log to use
+void blobStreamOutPoolInit(BlobStreamOutPool* self, struct ImprintAllocator* memory,
+                           struct ImprintAllocatorWithFree* blobAllocator, size_t streamCount, size_t maxOctetCount,
+                           size_t fixedChunkSize, Clog log)
+{
+    self->log = log;
+    self->capacity = streamCount;
+    self->streams = IMPRINT_ALLOC_TYPE_COUNT(memory, BlobStreamOut, streamCount);
+    self->freeStreams = IMPRINT_ALLOC_TYPE_COUNT(memory, BlobStreamOut*, streamCount);
+    for (size_t i = 0; i < streamCount; ++i) {
+        blobStreamOutInit(&self->streams[i], memory, blobAllocator, 0, maxOctetCount, fixedChunkSize, log);
+        self->freeStreams[i] = &self->streams[streamCount - 1 - i];
+    }
+    self->freeCount = streamCount;
+}
+
+/// Destroys all the streams in the pool
+/// The entries are owned by the memory passed to blobStreamOutPoolInit().
+/// @param self outgoing blob stream pool
+void blobStreamOutPoolDestroy(BlobStreamOutPool* self)
+{
+    for (size_t i = 0; i < self->capacity; ++i) {
+        blobStreamOutDestroy(&self->streams[i]);
+    }
+    self->freeCount = 0;
+}
+
+/// Takes a stream from the pool and prepares it for sending octets
+/// @param self outgoing blob stream pool
+/// @param octets the payload to send out. Must be valid until the stream is released.
+/// @param octetCount the number of octets in the payload
+/// @param fixedChunkSize the size of each chunk
+/// @return the stream or NULL if no stream is available or big enough
+BlobStreamOut* blobStreamOutPoolAcquire(BlobStreamOutPool* self, const uint8_t* octets, size_t octetCount,
+                                        size_t fixedChunkSize)
+{
+    if (self->freeCount == 0) {
+        CLOG_C_SOFT_ERROR(&self->log, "no free outgoing blob streams (%zu)", self->capacity)
+        return 0;
+    }
+
+    BlobStreamOut* stream = self->freeStreams[self->freeCount - 1];
+    if (blobStreamOutReinit(stream, octets, octetCount, fixedChunkSize) < 0) {
+        return 0;
+    }
+    self->freeCount--;
+
+    return stream;
+}
+
+/// Returns a stream to the pool
+/// @param self outgoing blob stream pool
+/// @param stream stream previously returned from blobStreamOutPoolAcquire()
+void blobStreamOutPoolRelease(BlobStreamOutPool* self, BlobStreamOut* stream)
+{
+    CLOG_ASSERT(self->freeCount < self->capacity, "outgoing blob stream pool release overflow")
+    stream->blob = 0;
+    self->freeStreams[self->freeCount++] = stream;
+}
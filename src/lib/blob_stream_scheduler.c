@@ -0,0 +1,164 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/blob-stream
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include <blob-stream/blob_stream_scheduler.h>
+#include <blob-stream/types.h>
+#include <imprint/allocator.h>
+#include <stdbool.h>
+
+/// Initializes a scheduler for outgoing transfers that share one connection
+/// Streams with a lower priority value are always served first. Streams with the same priority share
+/// the budget with deficit round robin, in proportion to their weight.
+/// @param self scheduler
+/// @param memory allocator for the stream table
+/// @param capacity maximum number of streams
+/// @param quantumOctetCount the number of octets a stream with weight 1 may send each round, usually the
+/// fixedChunkSize plus the chunk header. Must not be zero.
+/// @param log the log to use
+void blobStreamSchedulerInit(BlobStreamScheduler* self, struct ImprintAllocator* memory, size_t capacity,
+                             size_t quantumOctetCount, Clog log)
+{
+    CLOG_ASSERT(quantumOctetCount > 0, "quantum must be at least one octet")
+
+    self->log = log;
+    self->streams = IMPRINT_ALLOC_TYPE_COUNT(memory, BlobStreamSchedulerStream, capacity);
+    self->streamCount = 0;
+    self->capacity = capacity;
+    self->quantumOctetCount = quantumOctetCount;
+    self->nextStreamIndex = 0;
+}
+
+/// Adds an outgoing transfer to the scheduler
+/// @param self scheduler
+/// @param logic the outgoing logic
+/// @param priority lower values are served first, usually zero for small control blobs
+/// @param weight the share of the budget compared to other streams with the same priority
+/// @return negative if the scheduler is full
+int blobStreamSchedulerAdd(BlobStreamScheduler* self, BlobStreamLogicOut* logic, uint8_t priority, size_t weight)
+{
+    if (self->streamCount == self->capacity) {
+        CLOG_C_SOFT_ERROR(&self->log, "scheduler is full (%zu streams)", self->capacity)
+        return -1;
+    }
+
+    BlobStreamSchedulerStream* stream = &self->streams[self->streamCount++];
+    stream->logic = logic;
+    stream->priority = priority;
+    stream->weight = weight > 0 ? weight : 1;
+    stream->deficit = 0;
+
+    return 0;
+}
+
+/// Removes an outgoing transfer from the scheduler
+/// @param self scheduler
+/// @param logic the outgoing logic
+/// @return negative if not found
+int blobStreamSchedulerRemove(BlobStreamScheduler* self, const BlobStreamLogicOut* logic)
+{
+    for (size_t i = 0; i < self->streamCount; ++i) {
+        if (self->streams[i].logic == logic) {
+            self->streams[i] = self->streams[--self->streamCount];
+            if (self->nextStreamIndex >= self->streamCount) {
+                self->nextStreamIndex = 0;
+            }
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+static size_t maxEntryOctetCount(const BlobStreamSchedulerStream* stream)
+{
+    return stream->logic->blobStream->fixedChunkSize + BLOB_STREAM_SET_CHUNK_ENCODED_HEADER_OCTET_SIZE;
+}
+
+// Serves all streams with the specified priority, round by round, until they have nothing more to send
+// or the budget is used up. The deficit is allowed to go negative by at most one chunk, since the size of a chunk
+// is only known after it has been taken from the blob stream.
+static size_t servePriority(BlobStreamScheduler* self, uint8_t priority, MonotonicTimeMs now, size_t* octetBudget,
+                            BlobStreamScheduledEntry* results, size_t maxResultCount)
+{
+    size_t resultCount = 0;
+    bool hasPendingStreams = true;
+
+    while (hasPendingStreams && resultCount < maxResultCount) {
+        hasPendingStreams = false;
+        for (size_t i = 0; i < self->streamCount && resultCount < maxResultCount; ++i) {
+            size_t streamIndex = (self->nextStreamIndex + i) % self->streamCount;
+            BlobStreamSchedulerStream* stream = &self->streams[streamIndex];
+            if (stream->priority != priority) {
+                continue;
+            }
+
+            bool isIdle = false;
+            stream->deficit += (int64_t) (stream->weight * self->quantumOctetCount);
+            while (stream->deficit > 0 && resultCount < maxResultCount) {
+                if (*octetBudget < maxEntryOctetCount(stream)) {
+                    return resultCount;
+                }
+                const BlobStreamOutEntry* entry;
+                int count = blobStreamLogicOutPrepareSend(stream->logic, now, &entry, 1);
+                if (count <= 0) {
+                    stream->deficit = 0;
+                    isIdle = true;
+                    break;
+                }
+                size_t entryOctetCount = blobStreamLogicOutEntryOctetCount(entry);
+                stream->deficit -= (int64_t) entryOctetCount;
+                *octetBudget -= entryOctetCount;
+                results[resultCount].logic = stream->logic;
+                results[resultCount].entry = entry;
+                resultCount++;
+            }
+
+            if (!isIdle) {
+                hasPendingStreams = true;
+            }
+        }
+    }
+
+    return resultCount;
+}
+
+/// Decides which chunks to send from all the streams, within the budget of the connection
+/// Each result entry should be written with blobStreamLogicOutSendEntry() using the transferId of its logic.
+/// The maxChunksPerSend of the individual blob streams is not used, the octetBudget limits the send rate instead.
+/// @param self scheduler
+/// @param now current time
+/// @param octetBudget the maximum number of octets to send, including the chunk headers
+/// @param results target for the chunks to send
+/// @param maxResultCount maximum number of results
+/// @return the number of results filled in
+int blobStreamSchedulerPrepareSend(BlobStreamScheduler* self, MonotonicTimeMs now, size_t octetBudget,
+                                   BlobStreamScheduledEntry* results, size_t maxResultCount)
+{
+    size_t resultCount = 0;
+    int lastPriority = -1;
+
+    for (;;) {
+        int priority = -1;
+        for (size_t i = 0; i < self->streamCount; ++i) {
+            int streamPriority = self->streams[i].priority;
+            if (streamPriority > lastPriority && (priority < 0 || streamPriority < priority)) {
+                priority = streamPriority;
+            }
+        }
+        if (priority < 0 || resultCount == maxResultCount) {
+            break;
+        }
+
+        resultCount += servePriority(self, (uint8_t) priority, now, &octetBudget, results + resultCount,
+                                     maxResultCount - resultCount);
+        lastPriority = priority;
+    }
+
+    if (self->streamCount > 0) {
+        self->nextStreamIndex = (self->nextStreamIndex + 1) % self->streamCount;
+    }
+
+    return (int) resultCount;
+}
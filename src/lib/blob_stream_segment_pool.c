@@ -0,0 +1,53 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/blob-stream
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include <blob-stream/blob_stream_segment_pool.h>
+#include <imprint/allocator.h>
+
+/// Initializes a pool of fixed size segments
+/// All segments are allocated up front, one allocation per segment, so the largest
+/// contiguous allocation is bounded by segmentOctetSize.
+/// @param self segment pool
+/// @param allocator allocator for the segments and the free list
+/// @param segmentOctetSize the octet size of each segment. Should be a multiple of the chunk size.
+/// @param segmentCount the number of segments in the pool
+/// @param log the log to use
+void blobStreamSegmentPoolInit(BlobStreamSegmentPool* self, struct ImprintAllocator* allocator,
+                               size_t segmentOctetSize, size_t segmentCount, Clog log)
+{
+    self->log = log;
+    self->segmentOctetSize = segmentOctetSize;
+    self->segmentCount = segmentCount;
+    self->freeSegments = IMPRINT_ALLOC_TYPE_COUNT(allocator, uint8_t*, segmentCount);
+    for (size_t i = 0; i < segmentCount; ++i) {
+        self->freeSegments[i] = IMPRINT_ALLOC(allocator, segmentOctetSize, "blob stream segment");
+    }
+    self->freeCount = segmentCount;
+
+    CLOG_C_VERBOSE(&self->log, "segment pool initialized. %zu segments of %zu octets", segmentCount,
+                   segmentOctetSize)
+}
+
+/// Takes a segment from the pool
+/// @param self segment pool
+/// @return the segment, or NULL if the pool is exhausted
+uint8_t* blobStreamSegmentPoolAlloc(BlobStreamSegmentPool* self)
+{
+    if (self->freeCount == 0) {
+        CLOG_C_SOFT_ERROR(&self->log, "segment pool is exhausted (%zu segments)", self->segmentCount)
+        return 0;
+    }
+
+    return self->freeSegments[--self->freeCount];
+}
+
+/// Returns a segment to the pool
+/// @param self segment pool
+/// @param segment segment previously returned from blobStreamSegmentPoolAlloc()
+void blobStreamSegmentPoolFree(BlobStreamSegmentPool* self, uint8_t* segment)
+{
+    CLOG_ASSERT(self->freeCount < self->segmentCount, "segment pool free overflow")
+    self->freeSegments[self->freeCount++] = segment;
+}
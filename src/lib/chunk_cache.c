@@ -0,0 +1,215 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/blob-stream
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include <blob-stream/chunk_cache.h>
+#include <imprint/allocator.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <tiny-libc/tiny_libc.h>
+
+#define BLOB_STREAM_CHUNK_CACHE_NONE (UINT32_MAX)
+
+static uint64_t rotateLeft(uint64_t x, unsigned int count)
+{
+    return (x << count) | (x >> (64 - count));
+}
+
+static uint64_t finalMix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/// Calculates the content hash of a chunk
+/// A fast, non cryptographic, 64-bit hash. Chunks with the same hash are considered identical.
+/// @param octets the chunk octets
+/// @param octetCount the number of octets in the chunk
+/// @return the hash
+BlobStreamChunkHash blobStreamChunkHash(const uint8_t* octets, size_t octetCount)
+{
+    const uint64_t prime1 = 0x9e3779b185ebca87ULL;
+    const uint64_t prime2 = 0xc2b2ae3d27d4eb4fULL;
+
+    uint64_t h = prime1 ^ (octetCount * prime2);
+    size_t pos = 0;
+    for (; pos + sizeof(uint64_t) <= octetCount; pos += sizeof(uint64_t)) {
+        uint64_t word;
+        tc_memcpy_octets(&word, octets + pos, sizeof(word));
+        h ^= rotateLeft(word * prime2, 31) * prime1;
+        h = rotateLeft(h, 27) * prime1 + prime2;
+    }
+
+    uint64_t tail = 0;
+    for (size_t i = 0; pos + i < octetCount; ++i) {
+        tail |= (uint64_t) octets[pos + i] << (i * 8);
+    }
+    h ^= rotateLeft(tail * prime2, 31) * prime1;
+
+    return finalMix(h);
+}
+
+/// Initializes a bounded, least recently used, content addressed chunk cache
+/// Lookup is O(1) through an open addressed hash table, and the least recently used chunk
+/// is evicted when the cache is full. All memory is allocated up front.
+/// @param self chunk cache
+/// @param memory allocator for the entries, hash table and chunk octets
+/// @param capacity maximum number of chunks in the cache
+/// @param maxChunkOctetCount the largest chunk that can be cached, usually the fixed chunk size
+/// @param log the log to use
+void blobStreamChunkCacheInit(BlobStreamChunkCache* self, struct ImprintAllocator* memory, size_t capacity,
+                              size_t maxChunkOctetCount, Clog log)
+{
+    CLOG_ASSERT(capacity > 0 && capacity < BLOB_STREAM_CHUNK_CACHE_NONE, "illegal chunk cache capacity %zu",
+                capacity)
+
+    size_t tableSize = 1;
+    while (tableSize < capacity * 2) {
+        tableSize <<= 1;
+    }
+
+    self->log = log;
+    self->capacity = capacity;
+    self->maxChunkOctetCount = maxChunkOctetCount;
+    self->tableMask = tableSize - 1;
+    self->entries = IMPRINT_ALLOC_TYPE_COUNT(memory, BlobStreamChunkCacheEntry, capacity);
+    self->table = IMPRINT_ALLOC_TYPE_COUNT(memory, uint32_t, tableSize);
+    uint8_t* octets = IMPRINT_ALLOC(memory, capacity * maxChunkOctetCount, "chunk cache octets");
+    for (size_t i = 0; i < capacity; ++i) {
+        self->entries[i].octets = octets + i * maxChunkOctetCount;
+    }
+
+    blobStreamChunkCacheClear(self);
+
+    CLOG_C_VERBOSE(&self->log, "chunk cache initialized. %zu chunks of %zu octets", capacity, maxChunkOctetCount)
+}
+
+/// Removes all chunks from the cache
+/// @param self chunk cache
+void blobStreamChunkCacheClear(BlobStreamChunkCache* self)
+{
+    for (size_t i = 0; i <= self->tableMask; ++i) {
+        self->table[i] = BLOB_STREAM_CHUNK_CACHE_NONE;
+    }
+    self->count = 0;
+    self->mostRecent = BLOB_STREAM_CHUNK_CACHE_NONE;
+    self->leastRecent = BLOB_STREAM_CHUNK_CACHE_NONE;
+}
+
+static size_t findSlot(const BlobStreamChunkCache* self, BlobStreamChunkHash hash)
+{
+    size_t slot = (size_t) hash & self->tableMask;
+    while (self->table[slot] != BLOB_STREAM_CHUNK_CACHE_NONE && self->entries[self->table[slot]].hash != hash) {
+        slot = (slot + 1) & self->tableMask;
+    }
+    return slot;
+}
+
+static void removeSlot(BlobStreamChunkCache* self, size_t slot)
+{
+    // Backward shift deletion, keeps all probe sequences intact without tombstones
+    size_t hole = slot;
+    size_t next = slot;
+    for (;;) {
+        next = (next + 1) & self->tableMask;
+        uint32_t index = self->table[next];
+        if (index == BLOB_STREAM_CHUNK_CACHE_NONE) {
+            break;
+        }
+        size_t home = (size_t) self->entries[index].hash & self->tableMask;
+        bool isBetween = hole <= next ? (hole < home && home <= next) : (hole < home || home <= next);
+        if (!isBetween) {
+            self->table[hole] = index;
+            hole = next;
+        }
+    }
+    self->table[hole] = BLOB_STREAM_CHUNK_CACHE_NONE;
+}
+
+static void unlinkEntry(BlobStreamChunkCache* self, uint32_t index)
+{
+    BlobStreamChunkCacheEntry* entry = &self->entries[index];
+    if (entry->moreRecent != BLOB_STREAM_CHUNK_CACHE_NONE) {
+        self->entries[entry->moreRecent].lessRecent = entry->lessRecent;
+    } else {
+        self->mostRecent = entry->lessRecent;
+    }
+    if (entry->lessRecent != BLOB_STREAM_CHUNK_CACHE_NONE) {
+        self->entries[entry->lessRecent].moreRecent = entry->moreRecent;
+    } else {
+        self->leastRecent = entry->moreRecent;
+    }
+}
+
+static void linkAsMostRecent(BlobStreamChunkCache* self, uint32_t index)
+{
+    BlobStreamChunkCacheEntry* entry = &self->entries[index];
+    entry->moreRecent = BLOB_STREAM_CHUNK_CACHE_NONE;
+    entry->lessRecent = self->mostRecent;
+    if (self->mostRecent != BLOB_STREAM_CHUNK_CACHE_NONE) {
+        self->entries[self->mostRecent].moreRecent = index;
+    } else {
+        self->leastRecent = index;
+    }
+    self->mostRecent = index;
+}
+
+/// Looks up a chunk by its content hash
+/// A found chunk becomes the most recently used.
+/// @param self chunk cache
+/// @param hash the content hash from blobStreamChunkHash()
+/// @return the entry, or NULL if it is not in the cache
+const BlobStreamChunkCacheEntry* blobStreamChunkCacheFind(BlobStreamChunkCache* self, BlobStreamChunkHash hash)
+{
+    uint32_t index = self->table[findSlot(self, hash)];
+    if (index == BLOB_STREAM_CHUNK_CACHE_NONE) {
+        return 0;
+    }
+
+    if (index != self->mostRecent) {
+        unlinkEntry(self, index);
+        linkAsMostRecent(self, index);
+    }
+
+    return &self->entries[index];
+}
+
+/// Inserts a chunk into the cache
+/// If the cache is full, the least recently used chunk is evicted.
+/// @param self chunk cache
+/// @param hash the content hash from blobStreamChunkHash()
+/// @param octets the chunk octets, they are copied
+/// @param octetCount the number of octets. Chunks larger than maxChunkOctetCount are not cached.
+void blobStreamChunkCacheInsert(BlobStreamChunkCache* self, BlobStreamChunkHash hash, const uint8_t* octets,
+                                size_t octetCount)
+{
+    if (octetCount > self->maxChunkOctetCount) {
+        return;
+    }
+
+    if (blobStreamChunkCacheFind(self, hash) != 0) {
+        return;
+    }
+
+    uint32_t index;
+    if (self->count < self->capacity) {
+        index = (uint32_t) self->count++;
+    } else {
+        index = self->leastRecent;
+        CLOG_C_VERBOSE(&self->log, "evicting chunk %016" PRIX64, self->entries[index].hash)
+        removeSlot(self, findSlot(self, self->entries[index].hash));
+        unlinkEntry(self, index);
+    }
+
+    BlobStreamChunkCacheEntry* entry = &self->entries[index];
+    entry->hash = hash;
+    entry->octetCount = octetCount;
+    tc_memcpy_octets(entry->octets, octets, octetCount);
+    self->table[findSlot(self, hash)] = index;
+    linkAsMostRecent(self, index);
+}
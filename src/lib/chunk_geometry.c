@@ -0,0 +1,51 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/blob-stream
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include <blob-stream/chunk_geometry.h>
+
+/// Checks if value is a power of two
+/// @param value value to check
+/// @return true if power of two
+bool blobStreamIsPowerOfTwo(size_t value)
+{
+    return value != 0 && (value & (value - 1)) == 0;
+}
+
+/// Calculates the base two logarithm of a power of two
+/// @param powerOfTwo a value that is a power of two
+/// @return number of bits to shift to multiply or divide by powerOfTwo
+uint8_t blobStreamLog2(size_t powerOfTwo)
+{
+    uint8_t shift = 0;
+    while (((size_t) 1 << shift) < powerOfTwo) {
+        shift++;
+    }
+    return shift;
+}
+
+/// Calculates the chunk layout for a blob
+/// Power of two chunk sizes use shifts and masks, other sizes are divided once here.
+/// @param self chunk geometry
+/// @param octetCount the total number of octets in the blob
+/// @param fixedChunkSize the size of each chunk, except maybe the last one
+void blobStreamChunkGeometryInit(BlobStreamChunkGeometry* self, size_t octetCount, size_t fixedChunkSize)
+{
+    self->fixedChunkSize = fixedChunkSize;
+    self->octetCount = octetCount;
+    self->isPowerOfTwo = blobStreamIsPowerOfTwo(fixedChunkSize);
+
+    size_t remainder;
+    if (self->isPowerOfTwo) {
+        self->chunkShift = blobStreamLog2(fixedChunkSize);
+        self->chunkCount = (octetCount + fixedChunkSize - 1) >> self->chunkShift;
+        remainder = octetCount & (fixedChunkSize - 1);
+    } else {
+        self->chunkShift = 0;
+        self->chunkCount = (octetCount + fixedChunkSize - 1) / fixedChunkSize;
+        remainder = octetCount % fixedChunkSize;
+    }
+
+    self->lastChunkOctetCount = remainder == 0 ? fixedChunkSize : remainder;
+}
@@ -0,0 +1,199 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/blob-stream
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include <blob-stream/compress.h>
+#include <tiny-libc/tiny_libc.h>
+
+// A small LZ77 codec in the style of LZ4, intended for chunks up to 64 KB.
+// Each sequence is a token octet (high nibble literal count, low nibble match length - 4),
+// optional extra literal count octets, the literals, a little endian uint16 match offset,
+// and optional extra match length octets. The last sequence only has literals.
+
+#define BLOB_STREAM_COMPRESS_HASH_BITS (12)
+#define BLOB_STREAM_COMPRESS_MIN_MATCH (4)
+#define BLOB_STREAM_COMPRESS_MAX_OFFSET (65535)
+
+static uint32_t read32(const uint8_t* p)
+{
+    uint32_t v;
+    tc_memcpy_octets(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash32(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - BLOB_STREAM_COMPRESS_HASH_BITS);
+}
+
+static int writeLength(uint8_t** target, const uint8_t* targetEnd, size_t length)
+{
+    while (length >= 255) {
+        if (*target >= targetEnd) {
+            return -1;
+        }
+        *(*target)++ = 255;
+        length -= 255;
+    }
+    if (*target >= targetEnd) {
+        return -1;
+    }
+    *(*target)++ = (uint8_t) length;
+    return 0;
+}
+
+static int writeSequence(uint8_t** target, const uint8_t* targetEnd, const uint8_t* literals, size_t literalCount,
+                         size_t matchLength, size_t offset)
+{
+    if (*target >= targetEnd) {
+        return -1;
+    }
+
+    size_t matchCode = matchLength >= BLOB_STREAM_COMPRESS_MIN_MATCH ? matchLength - BLOB_STREAM_COMPRESS_MIN_MATCH
+                                                                      : 0;
+    uint8_t* token = (*target)++;
+    *token = (uint8_t) (((literalCount < 15 ? literalCount : 15) << 4) | (matchCode < 15 ? matchCode : 15));
+
+    if (literalCount >= 15 && writeLength(target, targetEnd, literalCount - 15) < 0) {
+        return -1;
+    }
+
+    if (*target + literalCount > targetEnd) {
+        return -1;
+    }
+    tc_memcpy_octets(*target, literals, literalCount);
+    *target += literalCount;
+
+    if (matchLength == 0) {
+        return 0;
+    }
+
+    if (*target + 2 > targetEnd) {
+        return -1;
+    }
+    *(*target)++ = (uint8_t) (offset & 0xff);
+    *(*target)++ = (uint8_t) (offset >> 8);
+
+    if (matchCode >= 15 && writeLength(target, targetEnd, matchCode - 15) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/// Compresses octets
+/// @param source octets to compress
+/// @param sourceOctetCount number of octets in source
+/// @param target target buffer
+/// @param targetMaxOctetCount maximum number of octets to write to target
+/// @return the compressed octet count, or negative if it did not fit in target (incompressible)
+int blobStreamCompress(const uint8_t* source, size_t sourceOctetCount, uint8_t* target, size_t targetMaxOctetCount)
+{
+    uint16_t table[1 << BLOB_STREAM_COMPRESS_HASH_BITS];
+    tc_mem_clear_type_n(table, 1 << BLOB_STREAM_COMPRESS_HASH_BITS);
+
+    uint8_t* p = target;
+    const uint8_t* targetEnd = target + targetMaxOctetCount;
+    size_t anchor = 0;
+    size_t pos = 0;
+
+    while (pos + BLOB_STREAM_COMPRESS_MIN_MATCH <= sourceOctetCount) {
+        uint32_t sequence = read32(source + pos);
+        uint32_t hash = hash32(sequence);
+        size_t candidate = table[hash];
+        table[hash] = (uint16_t) pos;
+
+        if (candidate < pos && pos - candidate <= BLOB_STREAM_COMPRESS_MAX_OFFSET &&
+            read32(source + candidate) == sequence) {
+            size_t matchLength = BLOB_STREAM_COMPRESS_MIN_MATCH;
+            size_t maxMatchLength = sourceOctetCount - pos;
+            while (matchLength < maxMatchLength && source[candidate + matchLength] == source[pos + matchLength]) {
+                matchLength++;
+            }
+            if (writeSequence(&p, targetEnd, source + anchor, pos - anchor, matchLength, pos - candidate) < 0) {
+                return -1;
+            }
+            pos += matchLength;
+            anchor = pos;
+        } else {
+            pos++;
+        }
+    }
+
+    if (writeSequence(&p, targetEnd, source + anchor, sourceOctetCount - anchor, 0, 0) < 0) {
+        return -1;
+    }
+
+    return (int) (p - target);
+}
+
+static int readLength(const uint8_t** source, const uint8_t* sourceEnd, size_t* length)
+{
+    uint8_t v;
+    do {
+        if (*source >= sourceEnd) {
+            return -1;
+        }
+        v = *(*source)++;
+        *length += v;
+    } while (v == 255);
+
+    return 0;
+}
+
+/// Decompresses octets that were compressed with blobStreamCompress()
+/// @param source compressed octets
+/// @param sourceOctetCount number of compressed octets
+/// @param target target buffer
+/// @param targetMaxOctetCount maximum number of octets to write to target
+/// @return the decompressed octet count, or negative if source is malformed or target is too small
+int blobStreamDecompress(const uint8_t* source, size_t sourceOctetCount, uint8_t* target, size_t targetMaxOctetCount)
+{
+    const uint8_t* p = source;
+    const uint8_t* sourceEnd = source + sourceOctetCount;
+    size_t pos = 0;
+
+    while (p < sourceEnd) {
+        uint8_t token = *p++;
+
+        size_t literalCount = (size_t) (token >> 4);
+        if (literalCount == 15 && readLength(&p, sourceEnd, &literalCount) < 0) {
+            return -1;
+        }
+        if (literalCount > (size_t) (sourceEnd - p) || pos + literalCount > targetMaxOctetCount) {
+            return -2;
+        }
+        tc_memcpy_octets(target + pos, p, literalCount);
+        p += literalCount;
+        pos += literalCount;
+
+        if (p == sourceEnd) {
+            break;
+        }
+
+        if (p + 2 > sourceEnd) {
+            return -3;
+        }
+        size_t offset = (size_t) p[0] | ((size_t) p[1] << 8);
+        p += 2;
+
+        size_t matchLength = (size_t) (token & 0x0f);
+        if (matchLength == 15 && readLength(&p, sourceEnd, &matchLength) < 0) {
+            return -4;
+        }
+        matchLength += BLOB_STREAM_COMPRESS_MIN_MATCH;
+
+        if (offset == 0 || offset > pos || pos + matchLength > targetMaxOctetCount) {
+            return -5;
+        }
+
+        const uint8_t* match = target + pos - offset;
+        for (size_t i = 0; i < matchLength; ++i) {
+            target[pos + i] = match[i];
+        }
+        pos += matchLength;
+    }
+
+    return (int) pos;
+}
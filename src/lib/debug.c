@@ -18,11 +18,19 @@ const char* blobStreamCmdToString(uint8_t cmd)
         "StartTransfer",
         "AckStartTransfer",
         "AckChunk",
+        "SetChunkEncoded",
+        "ChunkHashes",
+        "AckChunkHashes",
+        "ResumeTransfer",
+        "ChunksExpired",
+        "RequestChunks",
+        "SetChunksCompact",
+        "AckChunkCompact",
     };
 
     if (cmd >= sizeof(lookup) / sizeof(lookup[0])) {
-        CLOG_ERROR("Unknown blob stream cmd: %02X", cmd)
-        // return 0;
+        CLOG_SOFT_ERROR("Unknown blob stream cmd: %02X", cmd)
+        return "Unknown";
     }
 
     return lookup[cmd];
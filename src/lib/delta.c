@@ -0,0 +1,69 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/blob-stream
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include <blob-stream/delta.h>
+#include <tiny-libc/tiny_libc.h>
+
+// Both functions work on blocks of 64 octets with independent 64-bit lanes and no early exit
+// inside a block, so the compilers can vectorize the inner loops.
+
+#define BLOB_STREAM_DELTA_BLOCK_SIZE (64)
+#define BLOB_STREAM_DELTA_LANE_COUNT (BLOB_STREAM_DELTA_BLOCK_SIZE / sizeof(uint64_t))
+
+/// Compares two octet buffers
+/// @param a first buffer
+/// @param b second buffer
+/// @param octetCount number of octets to compare
+/// @return true if all octets are equal
+bool blobStreamOctetsAreEqual(const uint8_t* a, const uint8_t* b, size_t octetCount)
+{
+    size_t pos = 0;
+    for (; pos + BLOB_STREAM_DELTA_BLOCK_SIZE <= octetCount; pos += BLOB_STREAM_DELTA_BLOCK_SIZE) {
+        uint64_t laneA[BLOB_STREAM_DELTA_LANE_COUNT];
+        uint64_t laneB[BLOB_STREAM_DELTA_LANE_COUNT];
+        tc_memcpy_octets(laneA, a + pos, BLOB_STREAM_DELTA_BLOCK_SIZE);
+        tc_memcpy_octets(laneB, b + pos, BLOB_STREAM_DELTA_BLOCK_SIZE);
+        uint64_t diff = 0;
+        for (size_t i = 0; i < BLOB_STREAM_DELTA_LANE_COUNT; ++i) {
+            diff |= laneA[i] ^ laneB[i];
+        }
+        if (diff != 0) {
+            return false;
+        }
+    }
+
+    for (; pos < octetCount; ++pos) {
+        if (a[pos] != b[pos]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/// Calculates target = a ^ b
+/// target is allowed to be the same buffer as a or b.
+/// @param target target buffer
+/// @param a first buffer
+/// @param b second buffer
+/// @param octetCount number of octets
+void blobStreamXorOctets(uint8_t* target, const uint8_t* a, const uint8_t* b, size_t octetCount)
+{
+    size_t pos = 0;
+    for (; pos + BLOB_STREAM_DELTA_BLOCK_SIZE <= octetCount; pos += BLOB_STREAM_DELTA_BLOCK_SIZE) {
+        uint64_t laneA[BLOB_STREAM_DELTA_LANE_COUNT];
+        uint64_t laneB[BLOB_STREAM_DELTA_LANE_COUNT];
+        tc_memcpy_octets(laneA, a + pos, BLOB_STREAM_DELTA_BLOCK_SIZE);
+        tc_memcpy_octets(laneB, b + pos, BLOB_STREAM_DELTA_BLOCK_SIZE);
+        for (size_t i = 0; i < BLOB_STREAM_DELTA_LANE_COUNT; ++i) {
+            laneA[i] ^= laneB[i];
+        }
+        tc_memcpy_octets(target + pos, laneA, BLOB_STREAM_DELTA_BLOCK_SIZE);
+    }
+
+    for (; pos < octetCount; ++pos) {
+        target[pos] = (uint8_t) (a[pos] ^ b[pos]);
+    }
+}
@@ -0,0 +1,81 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/blob-stream
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include <blob-stream/var_int.h>
+#include <clog/clog.h>
+#include <flood/in_stream.h>
+#include <flood/out_stream.h>
+
+/// Calculates the number of octets that blobStreamVarIntWrite() writes for value
+/// @param value the value to write
+/// @return the octet count, from 1 to BLOB_STREAM_VAR_INT_MAX_OCTET_SIZE
+size_t blobStreamVarIntOctetCount(uint64_t value)
+{
+    size_t octetCount = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        octetCount++;
+    }
+
+    return octetCount;
+}
+
+/// Writes value as a variable length integer
+/// Seven bits are stored in each octet, least significant bits first. The high bit is set if more octets follow.
+/// @param outStream stream to write to
+/// @param value the value to write
+/// @return negative on error
+int blobStreamVarIntWrite(FldOutStream* outStream, uint64_t value)
+{
+    while (value >= 0x80) {
+        int err = fldOutStreamWriteUInt8(outStream, (uint8_t) (value | 0x80));
+        if (err < 0) {
+            return err;
+        }
+        value >>= 7;
+    }
+
+    return fldOutStreamWriteUInt8(outStream, (uint8_t) value);
+}
+
+/// Reads a variable length integer written with blobStreamVarIntWrite()
+/// @param inStream stream to read from
+/// @param value the read value
+/// @return negative on error
+int blobStreamVarIntRead(FldInStream* inStream, uint64_t* value)
+{
+    uint64_t result = 0;
+    for (size_t shift = 0; shift < 64; shift += 7) {
+        uint8_t octet;
+        int err = fldInStreamReadUInt8(inStream, &octet);
+        if (err < 0) {
+            return err;
+        }
+        result |= (uint64_t) (octet & 0x7f) << shift;
+        if ((octet & 0x80) == 0) {
+            *value = result;
+            return 0;
+        }
+    }
+
+    CLOG_SOFT_ERROR("var int is too long")
+    return -2;
+}
+
+/// Maps a signed value to an unsigned one, so values close to zero are written with few octets
+/// @param value signed value
+/// @return 0, -1, 1, -2, 2... are mapped to 0, 1, 2, 3, 4...
+uint64_t blobStreamZigZagEncode(int64_t value)
+{
+    return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+}
+
+/// Reverses blobStreamZigZagEncode()
+/// @param value unsigned value
+/// @return the signed value
+int64_t blobStreamZigZagDecode(uint64_t value)
+{
+    return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+}
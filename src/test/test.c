@@ -4,8 +4,24 @@
  *--------------------------------------------------------------------------------------------------------*/
 
 #include "utest.h"
+#include <blob-stream/blob_stream_fan_out.h>
 #include <blob-stream/blob_stream_in.h>
+#include <blob-stream/blob_stream_logic_in.h>
+#include <blob-stream/blob_stream_logic_out.h>
+#include <blob-stream/blob_stream_multi_source.h>
+#include <blob-stream/blob_stream_mux.h>
 #include <blob-stream/blob_stream_out.h>
+#include <blob-stream/blob_stream_pipeline.h>
+#include <blob-stream/blob_stream_pool.h>
+#include <blob-stream/blob_stream_scheduler.h>
+#include <blob-stream/blob_stream_segment_pool.h>
+#include <blob-stream/chunk_cache.h>
+#include <blob-stream/commands.h>
+#include <blob-stream/compress.h>
+#include <blob-stream/debug.h>
+#include <blob-stream/var_int.h>
+#include <flood/in_stream.h>
+#include <flood/out_stream.h>
 #include <imprint/linear_allocator.h>
 #include <imprint/slab_allocator.h>
 
@@ -111,3 +127,2459 @@ UTEST(BlobStreamOut, verifySentAll)
 
     blobStreamOutDestroy(&outStream);
 }
+
+UTEST(BlobStreamIn, segmented)
+{
+    Mem memory;
+    createMemory(&memory);
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "test";
+
+    BlobStreamSegmentPool pool;
+    blobStreamSegmentPoolInit(&pool, &memory.linearAllocator.info, 2 * 512, 4, log);
+
+    BlobStreamIn inStream;
+#define TESTC_BLOB_SIZE (2500)
+    blobStreamInInitSegmented(&inStream, &memory.linearAllocator.info, &pool, 0, TESTC_BLOB_SIZE, 512, log);
+    ASSERT_EQ(inStream.segmentCount, 3);
+
+    static uint8_t chunk[512];
+    for (size_t i = 0; i < 5; ++i) {
+        tc_memset_octets(chunk, (int) i + 1, sizeof(chunk));
+        size_t chunkId = 4 - i;
+        blobStreamInSetChunk(&inStream, (BlobStreamChunkId) chunkId, chunk,
+                             chunkId == 4 ? TESTC_BLOB_SIZE - 4 * 512 : 512);
+    }
+    ASSERT_TRUE(blobStreamInIsComplete(&inStream));
+    ASSERT_EQ(pool.freeCount, 1);
+
+    BlobStreamInSegmentView views[4];
+    size_t viewCount = blobStreamInGetSegmentViews(&inStream, views, 4);
+    ASSERT_EQ(viewCount, 3);
+    ASSERT_EQ(views[2].octetCount, TESTC_BLOB_SIZE - 4 * 512);
+    ASSERT_EQ(views[0].octets[0], 5);
+    ASSERT_EQ(views[0].octets[512], 4);
+    ASSERT_EQ(views[2].octets[0], 1);
+
+    ASSERT_EQ(blobStreamInLinearize(&inStream, &memory.slabAllocator.info), 0);
+    ASSERT_EQ(pool.freeCount, 4);
+    ASSERT_EQ(inStream.blob[0], 5);
+    ASSERT_EQ(inStream.blob[4 * 512], 1);
+
+    blobStreamInDestroy(&inStream);
+}
+
+UTEST(BlobStreamInPool, reuse)
+{
+    Mem memory;
+    createMemory(&memory);
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "test";
+
+    BlobStreamInPool pool;
+    blobStreamInPoolInit(&pool, &memory.linearAllocator.info, &memory.slabAllocator.info, 2, 2048, 512, log);
+
+    static uint8_t chunk[512];
+
+    BlobStreamIn* first = blobStreamInPoolAcquire(&pool, 1024, 512);
+    ASSERT_TRUE(first != 0);
+    blobStreamInSetChunk(first, 0, chunk, 512);
+    blobStreamInSetChunk(first, 1, chunk, 512);
+    ASSERT_TRUE(blobStreamInIsComplete(first));
+    blobStreamInPoolRelease(&pool, first);
+
+    ASSERT_TRUE(blobStreamInPoolAcquire(&pool, 4096, 512) == 0);
+
+    BlobStreamIn* second = blobStreamInPoolAcquire(&pool, 700, 512);
+    ASSERT_TRUE(second == first);
+    ASSERT_FALSE(blobStreamInIsComplete(second));
+    blobStreamInSetChunk(second, 1, chunk, 700 - 512);
+    ASSERT_FALSE(blobStreamInIsComplete(second));
+    blobStreamInSetChunk(second, 0, chunk, 512);
+    ASSERT_TRUE(blobStreamInIsComplete(second));
+    blobStreamInPoolRelease(&pool, second);
+
+    blobStreamInPoolDestroy(&pool);
+}
+
+UTEST(BlobStreamOut, reinit)
+{
+    Mem memory;
+    createMemory(&memory);
+
+    BlobStreamOut outStream;
+    static uint8_t blob[TESTB_BLOB_SIZE];
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "test";
+
+    blobStreamOutInit(&outStream, &memory.linearAllocator.info, &memory.slabAllocator.info, blob, TESTB_BLOB_SIZE,
+                      BLOB_STREAM_CHUNK_SIZE, log);
+    blobStreamOutMarkReceived(&outStream, 3, 0x00000000);
+    ASSERT_TRUE(blobStreamOutIsComplete(&outStream));
+
+    ASSERT_EQ(blobStreamOutReinit(&outStream, blob, 1500, BLOB_STREAM_CHUNK_SIZE), 0);
+    ASSERT_FALSE(blobStreamOutIsComplete(&outStream));
+    ASSERT_EQ(outStream.chunkCount, 2);
+    ASSERT_EQ(outStream.entries[1].octetCount, 1500 - BLOB_STREAM_CHUNK_SIZE);
+    ASSERT_TRUE(blobStreamOutReinit(&outStream, blob, TESTB_BLOB_SIZE * 2, BLOB_STREAM_CHUNK_SIZE) < 0);
+
+    blobStreamOutDestroy(&outStream);
+}
+
+UTEST(BlobStreamIn, initWithStorage)
+{
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "test";
+
+    static uint8_t storageBuffer[4096 + BLOB_STREAM_STORAGE_ALIGNMENT];
+    uint8_t* storage = storageBuffer + (BLOB_STREAM_STORAGE_ALIGNMENT - ((uintptr_t) storageBuffer & 63)) % 64;
+
+    size_t storageSize = blobStreamInStorageSize(TESTA_BLOB_SIZE, BLOB_STREAM_CHUNK_SIZE);
+    ASSERT_TRUE(storageSize >= TESTA_BLOB_SIZE);
+    ASSERT_TRUE(storageSize <= 4096);
+    size_t alignmentRemainder = storageSize % BLOB_STREAM_STORAGE_ALIGNMENT;
+    ASSERT_EQ(alignmentRemainder, 0);
+
+    BlobStreamIn inStream;
+    blobStreamInInitWithStorage(&inStream, storage, storageSize, TESTA_BLOB_SIZE, BLOB_STREAM_CHUNK_SIZE, log);
+    ASSERT_TRUE(inStream.blob == storage);
+
+    static uint8_t chunk[BLOB_STREAM_CHUNK_SIZE];
+    tc_memset_octets(chunk, 0x42, sizeof(chunk));
+    blobStreamInSetChunk(&inStream, 2, chunk, TESTA_BLOB_SIZE % BLOB_STREAM_CHUNK_SIZE);
+    blobStreamInSetChunk(&inStream, 0, chunk, BLOB_STREAM_CHUNK_SIZE);
+    blobStreamInSetChunk(&inStream, 1, chunk, BLOB_STREAM_CHUNK_SIZE);
+    ASSERT_TRUE(blobStreamInIsComplete(&inStream));
+    ASSERT_EQ(storage[TESTA_BLOB_SIZE - 1], 0x42);
+
+    blobStreamInDestroy(&inStream);
+
+    static uint8_t blob[TESTA_BLOB_SIZE];
+    BlobStreamOut outStream;
+    size_t outStorageSize = blobStreamOutStorageSize(TESTA_BLOB_SIZE, BLOB_STREAM_CHUNK_SIZE);
+    ASSERT_TRUE(outStorageSize <= 4096);
+    blobStreamOutInitWithStorage(&outStream, storage, outStorageSize, blob, TESTA_BLOB_SIZE,
+                                 BLOB_STREAM_CHUNK_SIZE, log);
+    ASSERT_EQ(outStream.chunkCount, 3);
+    blobStreamOutMarkReceived(&outStream, 3, 0);
+    ASSERT_TRUE(blobStreamOutIsComplete(&outStream));
+    blobStreamOutDestroy(&outStream);
+}
+
+UTEST(BlobStreamChunkGeometry, powerOfTwo)
+{
+    BlobStreamChunkGeometry geometry;
+    blobStreamChunkGeometryInit(&geometry, 2231, 1024);
+    ASSERT_TRUE(geometry.isPowerOfTwo);
+    ASSERT_EQ(geometry.chunkShift, 10);
+    ASSERT_EQ(geometry.chunkCount, 3);
+    ASSERT_EQ(geometry.lastChunkOctetCount, 2231 - 2048);
+    ASSERT_EQ(blobStreamChunkGeometryOffset(&geometry, 2), 2048);
+    ASSERT_EQ(blobStreamChunkGeometryOctetCount(&geometry, 1), 1024);
+    ASSERT_EQ(blobStreamChunkGeometryOctetCount(&geometry, 2), 2231 - 2048);
+
+    blobStreamChunkGeometryInit(&geometry, 3000, 1000);
+    ASSERT_FALSE(geometry.isPowerOfTwo);
+    ASSERT_EQ(geometry.chunkCount, 3);
+    ASSERT_EQ(geometry.lastChunkOctetCount, 1000);
+    ASSERT_EQ(blobStreamChunkGeometryOffset(&geometry, 2), 2000);
+}
+
+UTEST(BlobStreamIn, receiveManyChunks)
+{
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "test";
+
+#define TESTD_CHUNK_COUNT (1024 * 1024)
+#define TESTD_CHUNK_SIZE (8)
+    size_t octetCount = TESTD_CHUNK_COUNT * TESTD_CHUNK_SIZE;
+    size_t storageSize = blobStreamInStorageSize(octetCount, TESTD_CHUNK_SIZE);
+    uint8_t* allocated = malloc(storageSize + BLOB_STREAM_STORAGE_ALIGNMENT);
+    uint8_t* storage = allocated + (BLOB_STREAM_STORAGE_ALIGNMENT - ((uintptr_t) allocated & 63)) % 64;
+
+    BlobStreamIn inStream;
+    blobStreamInInitWithStorage(&inStream, storage, storageSize, octetCount, TESTD_CHUNK_SIZE, log);
+
+    static const uint8_t chunk[TESTD_CHUNK_SIZE] = {1, 2, 3, 4, 5, 6, 7, 8};
+    for (size_t i = 0; i < TESTD_CHUNK_COUNT; ++i) {
+        blobStreamInSetChunk(&inStream, (BlobStreamChunkId) i, chunk, TESTD_CHUNK_SIZE);
+    }
+    ASSERT_TRUE(blobStreamInIsComplete(&inStream));
+    ASSERT_EQ(inStream.blob[octetCount - 1], 8);
+
+    blobStreamInDestroy(&inStream);
+    free(allocated);
+}
+
+static int receiveAll(BlobStreamLogicIn* logicIn, const uint8_t* octets, size_t octetCount)
+{
+    FldInStream inStream;
+    fldInStreamInit(&inStream, octets, octetCount);
+    while (inStream.pos < inStream.size) {
+        int err = blobStreamLogicInReceive(logicIn, &inStream);
+        if (err < 0) {
+            return err;
+        }
+    }
+    return 0;
+}
+
+UTEST(BlobStreamLogic, jumboChunksWithNegotiation)
+{
+    Mem memory;
+    createMemory(&memory);
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "test";
+
+#define TESTE_BLOB_SIZE (40000)
+    static uint8_t blob[TESTE_BLOB_SIZE];
+    for (size_t i = 0; i < TESTE_BLOB_SIZE; ++i) {
+        blob[i] = (uint8_t) (i * 7);
+    }
+
+    BlobStreamOutPool outPool;
+    blobStreamOutPoolInit(&outPool, &memory.linearAllocator.info, &memory.slabAllocator.info, 1, TESTE_BLOB_SIZE,
+                          9000, log);
+    BlobStreamOut* outStream = blobStreamOutPoolAcquire(&outPool, blob, TESTE_BLOB_SIZE, 16000);
+    ASSERT_TRUE(outStream != 0);
+    outStream->maxChunksPerSend = 16;
+
+    BlobStreamLogicOut logicOut;
+    blobStreamLogicOutInit(&logicOut, outStream, 0x0042);
+
+    static uint8_t datagram[64 * 1024];
+    FldOutStream outDatagram;
+    fldOutStreamInit(&outDatagram, datagram, sizeof(datagram));
+    ASSERT_EQ(blobStreamLogicOutStartTransfer(&logicOut, &outDatagram), 0);
+
+    FldInStream inDatagram;
+    fldInStreamInit(&inDatagram, datagram, outDatagram.pos);
+    BlobStreamStartTransfer startTransfer;
+    ASSERT_EQ(blobStreamLogicInReadStartTransfer(&inDatagram, 9000, &startTransfer), 0);
+    ASSERT_EQ(startTransfer.fixedChunkSize, 9000);
+    ASSERT_EQ(startTransfer.transferId, 0x0042);
+
+    size_t storageSize = blobStreamInStorageSize(startTransfer.octetCount, startTransfer.fixedChunkSize);
+    uint8_t* allocated = malloc(storageSize + BLOB_STREAM_STORAGE_ALIGNMENT);
+    uint8_t* storage = allocated + (BLOB_STREAM_STORAGE_ALIGNMENT - ((uintptr_t) allocated & 63)) % 64;
+    BlobStreamIn inStream;
+    blobStreamInInitWithStorage(&inStream, storage, storageSize, startTransfer.octetCount,
+                                startTransfer.fixedChunkSize, log);
+    BlobStreamLogicIn logicIn;
+    blobStreamLogicInInit(&logicIn, &inStream, startTransfer.transferId);
+
+    fldOutStreamInit(&outDatagram, datagram, sizeof(datagram));
+    ASSERT_EQ(blobStreamLogicInSendAckStartTransfer(&startTransfer, &outDatagram), 0);
+    fldInStreamInit(&inDatagram, datagram, outDatagram.pos);
+    ASSERT_EQ(blobStreamLogicOutReceive(&logicOut, &inDatagram), 0);
+    ASSERT_EQ(outStream->fixedChunkSize, 9000);
+    ASSERT_EQ(outStream->chunkCount, 5);
+
+    const BlobStreamOutEntry* entries[16];
+    int entryCount = blobStreamLogicOutPrepareSend(&logicOut, 0, entries, 16);
+    ASSERT_EQ(entryCount, 5);
+
+    fldOutStreamInit(&outDatagram, datagram, sizeof(datagram));
+    size_t segmentOctetSize;
+    int runCount = blobStreamLogicOutSendEntryRun(&outDatagram, entries, (size_t) entryCount, 0x0042,
+                                                  &segmentOctetSize);
+    ASSERT_EQ(runCount, 5);
+    ASSERT_EQ(segmentOctetSize, 9000 + BLOB_STREAM_SET_CHUNK_HEADER_OCTET_SIZE);
+    ASSERT_EQ(outDatagram.pos, 4 * segmentOctetSize + BLOB_STREAM_SET_CHUNK_HEADER_OCTET_SIZE + 4000);
+
+    ASSERT_EQ(receiveAll(&logicIn, datagram, outDatagram.pos), 0);
+    ASSERT_TRUE(blobStreamInIsComplete(&inStream));
+    ASSERT_EQ(tc_memcmp(inStream.blob, blob, TESTE_BLOB_SIZE), 0);
+
+    fldOutStreamInit(&outDatagram, datagram, sizeof(datagram));
+    ASSERT_EQ(blobStreamLogicInSend(&logicIn, &outDatagram), 0);
+    fldInStreamInit(&inDatagram, datagram, outDatagram.pos);
+    ASSERT_EQ(blobStreamLogicOutReceive(&logicOut, &inDatagram), 0);
+    ASSERT_TRUE(blobStreamLogicOutIsComplete(&logicOut));
+
+    blobStreamInDestroy(&inStream);
+    free(allocated);
+    blobStreamOutPoolRelease(&outPool, outStream);
+    blobStreamOutPoolDestroy(&outPool);
+}
+
+UTEST(BlobStreamLogic, lowerChunkSizeWithinCapacity)
+{
+    Mem memory;
+    createMemory(&memory);
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "test";
+
+    static uint8_t blob[1000];
+    BlobStreamOut outStream;
+    blobStreamOutInit(&outStream, &memory.linearAllocator.info, &memory.slabAllocator.info, blob, sizeof(blob), 256,
+                      log);
+    ASSERT_EQ(blobStreamOutMinChunkSize(&outStream), 250);
+    // Octets 512 to 767, which are in chunks 2 and 3 when the chunk size is 250
+    ASSERT_EQ(blobStreamOutAddPriorityRange(&outStream, 2, 1), 0);
+    BlobStreamLogicOut logicOut;
+    blobStreamLogicOutInit(&logicOut, &outStream, 0x0043);
+
+    static uint8_t datagram[64];
+    FldOutStream outDatagram;
+    fldOutStreamInit(&outDatagram, datagram, sizeof(datagram));
+    ASSERT_EQ(blobStreamLogicOutStartTransfer(&logicOut, &outDatagram), 0);
+
+    // A receiver that only accepts 128 octet chunks refuses, since the sender only has entries for four chunks
+    FldInStream inDatagram;
+    fldInStreamInit(&inDatagram, datagram, outDatagram.pos);
+    BlobStreamStartTransfer startTransfer;
+    ASSERT_EQ(blobStreamLogicInReadStartTransfer(&inDatagram, 128, &startTransfer), -4);
+
+    // An ack with a chunk size below the minimum is rejected without acking the start transfer
+    BlobStreamStartTransfer tooSmall = {.transferId = 0x0043, .octetCount = sizeof(blob), .fixedChunkSize = 128};
+    fldOutStreamInit(&outDatagram, datagram, sizeof(datagram));
+    ASSERT_EQ(blobStreamLogicInSendAckStartTransfer(&tooSmall, &outDatagram), 0);
+    fldInStreamInit(&inDatagram, datagram, outDatagram.pos);
+    ASSERT_EQ(blobStreamLogicOutReceive(&logicOut, &inDatagram), -2);
+    ASSERT_FALSE(logicOut.isStartTransferAcked);
+    ASSERT_EQ(outStream.fixedChunkSize, 256);
+
+    fldOutStreamInit(&outDatagram, datagram, sizeof(datagram));
+    ASSERT_EQ(blobStreamLogicOutStartTransfer(&logicOut, &outDatagram), 0);
+    fldInStreamInit(&inDatagram, datagram, outDatagram.pos);
+    ASSERT_EQ(blobStreamLogicInReadStartTransfer(&inDatagram, 250, &startTransfer), 0);
+    ASSERT_EQ(startTransfer.fixedChunkSize, 250);
+    fldOutStreamInit(&outDatagram, datagram, sizeof(datagram));
+    ASSERT_EQ(blobStreamLogicInSendAckStartTransfer(&startTransfer, &outDatagram), 0);
+    fldInStreamInit(&inDatagram, datagram, outDatagram.pos);
+    ASSERT_EQ(blobStreamLogicOutReceive(&logicOut, &inDatagram), 0);
+    ASSERT_TRUE(logicOut.isStartTransferAcked);
+    ASSERT_EQ(outStream.fixedChunkSize, 250);
+    ASSERT_EQ(outStream.chunkCount, 4);
+    ASSERT_EQ(outStream.priorityRangeCount, 1);
+    ASSERT_EQ(outStream.priorityRanges[0].firstChunkId, 2);
+    ASSERT_EQ(outStream.priorityRanges[0].endChunkId, 4);
+
+    // The previous transfer is not kept after a salvage, so a salvaged stream can not change chunk size
+    static uint8_t previousBlob[1000];
+    BlobStreamOut previousStream;
+    blobStreamOutInit(&previousStream, &memory.linearAllocator.info, &memory.slabAllocator.info, previousBlob,
+                      sizeof(previousBlob), 256, log);
+    BlobStreamOut salvagedStream;
+    blobStreamOutInit(&salvagedStream, &memory.linearAllocator.info, &memory.slabAllocator.info, blob, sizeof(blob),
+                      256, log);
+    ASSERT_EQ(blobStreamOutSalvage(&salvagedStream, 0x0042, &previousStream), 0);
+    ASSERT_EQ(blobStreamOutMinChunkSize(&salvagedStream), 256);
+    BlobStreamLogicOut salvagedLogicOut;
+    blobStreamLogicOutInit(&salvagedLogicOut, &salvagedStream, 0x0044);
+    BlobStreamStartTransfer salvagedSmaller = {.transferId = 0x0044, .octetCount = sizeof(blob), .fixedChunkSize = 250};
+    fldOutStreamInit(&outDatagram, datagram, sizeof(datagram));
+    ASSERT_EQ(blobStreamLogicInSendAckStartTransfer(&salvagedSmaller, &outDatagram), 0);
+    fldInStreamInit(&inDatagram, datagram, outDatagram.pos);
+    ASSERT_EQ(blobStreamLogicOutReceive(&salvagedLogicOut, &inDatagram), -2);
+    ASSERT_FALSE(salvagedLogicOut.isStartTransferAcked);
+    ASSERT_TRUE(salvagedStream.isDelta);
+
+    blobStreamOutDestroy(&salvagedStream);
+    blobStreamOutDestroy(&previousStream);
+    blobStreamOutDestroy(&outStream);
+}
+
+static int transferUntilComplete(BlobStreamLogicOut* logicOut, BlobStreamLogicIn* logicIn, size_t maxIterations,
+                                 size_t* octetsOnWire)
+{
+    static uint8_t datagram[64 * 1024];
+    MonotonicTimeMs now = 0;
+
+    for (size_t iteration = 0; iteration < maxIterations; ++iteration) {
+        const BlobStreamOutEntry* entries[16];
+        int entryCount = blobStreamLogicOutPrepareSend(logicOut, now, entries, 16);
+        for (int i = 0; i < entryCount; ++i) {
+            FldOutStream outDatagram;
+            fldOutStreamInit(&outDatagram, datagram, sizeof(datagram));
+            blobStreamLogicOutSendEntry(&outDatagram, entries[i], logicOut->transferId);
+            *octetsOnWire += outDatagram.pos;
+            int err = receiveAll(logicIn, datagram, outDatagram.pos);
+            if (err < 0) {
+                return err;
+            }
+        }
+
+        FldOutStream ackDatagram;
+        fldOutStreamInit(&ackDatagram, datagram, sizeof(datagram));
+        blobStreamLogicInSend(logicIn, &ackDatagram);
+        FldInStream inDatagram;
+        fldInStreamInit(&inDatagram, datagram, ackDatagram.pos);
+        while (inDatagram.pos < inDatagram.size) {
+            if (blobStreamLogicOutReceive(logicOut, &inDatagram) < 0) {
+                break;
+            }
+        }
+
+        if (blobStreamLogicOutIsComplete(logicOut)) {
+            return 0;
+        }
+        now += 100;
+    }
+
+    return -1;
+}
+
+typedef struct SimulatedLink {
+    uint8_t datagrams[64][32];
+    size_t octetCounts[64];
+    MonotonicTimeMs deliverAt[64];
+    size_t head;
+    size_t count;
+    MonotonicTimeMs latency;
+    uint32_t lossPercent;
+    uint32_t randomState;
+} SimulatedLink;
+
+static bool simulatedLinkIsLost(SimulatedLink* self)
+{
+    self->randomState = self->randomState * 1103515245u + 12345u;
+    return (self->randomState >> 16) % 100 < self->lossPercent;
+}
+
+static size_t roundsWithAckFrequency(size_t ackEveryChunkCount, uint32_t lossPercent, size_t* ackCount)
+{
+    Mem memory;
+    createMemory(&memory);
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "test";
+
+#define TESTP_CHUNK_SIZE (100)
+#define TESTP_BLOB_SIZE (6400)
+    static uint8_t blob[TESTP_BLOB_SIZE];
+    for (size_t i = 0; i < TESTP_BLOB_SIZE; ++i) {
+        blob[i] = (uint8_t) (i * 5 + 2);
+    }
+
+    static uint8_t outStorageBuffer[16384 + BLOB_STREAM_STORAGE_ALIGNMENT];
+    uint8_t* outStorage = outStorageBuffer + (BLOB_STREAM_STORAGE_ALIGNMENT -
+                                              ((uintptr_t) outStorageBuffer & 63)) % 64;
+    BlobStreamOut outStream;
+    blobStreamOutInitWithStorage(&outStream, outStorage, blobStreamOutStorageSize(TESTP_BLOB_SIZE, TESTP_CHUNK_SIZE),
+                                 blob, TESTP_BLOB_SIZE, TESTP_CHUNK_SIZE, log);
+    outStream.maxChunksPerSend = 16;
+    BlobStreamLogicOut logicOut;
+    blobStreamLogicOutInit(&logicOut, &outStream, 4);
+
+    static uint8_t inStorageBuffer[16384 + BLOB_STREAM_STORAGE_ALIGNMENT];
+    uint8_t* inStorage = inStorageBuffer + (BLOB_STREAM_STORAGE_ALIGNMENT - ((uintptr_t) inStorageBuffer & 63)) % 64;
+    BlobStreamIn inStream;
+    blobStreamInInitWithStorage(&inStream, inStorage, blobStreamInStorageSize(TESTP_BLOB_SIZE, TESTP_CHUNK_SIZE),
+                                TESTP_BLOB_SIZE, TESTP_CHUNK_SIZE, log);
+    BlobStreamLogicIn logicIn;
+    blobStreamLogicInInit(&logicIn, &inStream, 4);
+    blobStreamLogicInSetAckFrequency(&logicIn, ackEveryChunkCount, 20);
+
+    // The receiver is asked for an ack after every datagram and once more at the end of every round
+    SimulatedLink link;
+    link.lossPercent = lossPercent;
+    link.randomState = 3;
+    *ackCount = 0;
+    static uint8_t datagram[256];
+    MonotonicTimeMs now = 0;
+    size_t round = 0;
+    for (; round < 100 && !blobStreamLogicOutIsComplete(&logicOut); ++round, now += 10) {
+        const BlobStreamOutEntry* entries[16];
+        int entryCount = blobStreamLogicOutPrepareSend(&logicOut, now, entries, 16);
+        for (int entryIndex = 0; entryIndex <= entryCount; ++entryIndex) {
+            if (entryIndex < entryCount) {
+                FldOutStream outDatagram;
+                fldOutStreamInit(&outDatagram, datagram, sizeof(datagram));
+                blobStreamLogicOutSendEntry(&outDatagram, entries[entryIndex], 4);
+                if (simulatedLinkIsLost(&link)) {
+                    continue;
+                }
+                receiveAll(&logicIn, datagram, outDatagram.pos);
+            }
+
+            FldOutStream ackOut;
+            fldOutStreamInit(&ackOut, datagram, sizeof(datagram));
+            if (blobStreamLogicInSendIfDue(&logicIn, now, &ackOut) == 1) {
+                (*ackCount)++;
+                FldInStream ackIn;
+                fldInStreamInit(&ackIn, datagram, ackOut.pos);
+                blobStreamLogicOutReceive(&logicOut, &ackIn);
+            }
+        }
+    }
+
+    return blobStreamInIsComplete(&inStream) && tc_memcmp(inStream.blob, blob, TESTP_BLOB_SIZE) == 0 ? round : 0;
+}
+
+UTEST(BlobStreamLogic, ackCoalescing)
+{
+    size_t everyChunkAckCount;
+    size_t everyChunkRounds = roundsWithAckFrequency(1, 0, &everyChunkAckCount);
+    size_t coalescedAckCount;
+    size_t coalescedRounds = roundsWithAckFrequency(8, 0, &coalescedAckCount);
+    ASSERT_TRUE(everyChunkRounds > 0);
+    ASSERT_EQ(coalescedRounds, everyChunkRounds);
+    ASSERT_TRUE(coalescedAckCount * 5 <= everyChunkAckCount);
+
+    // Gaps are acked right away, so loss recovery is not slowed down
+    size_t lossyEveryChunkRounds = roundsWithAckFrequency(1, 10, &everyChunkAckCount);
+    size_t lossyCoalescedRounds = roundsWithAckFrequency(8, 10, &coalescedAckCount);
+    ASSERT_TRUE(lossyEveryChunkRounds > 0);
+    ASSERT_TRUE(lossyCoalescedRounds > 0 && lossyCoalescedRounds <= lossyEveryChunkRounds + 1);
+    ASSERT_TRUE(coalescedAckCount < everyChunkAckCount);
+
+    // Nothing is pending after an ack
+    Mem memory;
+    createMemory(&memory);
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "test";
+    BlobStreamIn inStream;
+    blobStreamInInit(&inStream, &memory.linearAllocator.info, &memory.slabAllocator.info, 300, TESTP_CHUNK_SIZE, log);
+    BlobStreamLogicIn logicIn;
+    blobStreamLogicInInit(&logicIn, &inStream, 4);
+    blobStreamLogicInSetAckFrequency(&logicIn, 8, 20);
+    ASSERT_FALSE(blobStreamLogicInIsAckPending(&logicIn));
+    static const uint8_t chunk[TESTP_CHUNK_SIZE];
+    BlobStreamOutEntry entry;
+    entry.octets = chunk;
+    entry.octetCount = TESTP_CHUNK_SIZE;
+    entry.chunkId = 0;
+    entry.encoding = BLOB_STREAM_CHUNK_ENCODING_RAW;
+    static uint8_t datagram[256];
+    FldOutStream outDatagram;
+    fldOutStreamInit(&outDatagram, datagram, sizeof(datagram));
+    blobStreamLogicOutSendEntry(&outDatagram, &entry, 4);
+    ASSERT_EQ(receiveAll(&logicIn, datagram, outDatagram.pos), 0);
+    ASSERT_TRUE(blobStreamLogicInIsAckPending(&logicIn));
+    ASSERT_FALSE(blobStreamLogicInIsAckDue(&logicIn, 100));
+    ASSERT_FALSE(blobStreamLogicInIsAckDue(&logicIn, 119));
+    ASSERT_TRUE(blobStreamLogicInIsAckDue(&logicIn, 120));
+    FldOutStream ackOut;
+    fldOutStreamInit(&ackOut, datagram, sizeof(datagram));
+    ASSERT_EQ(blobStreamLogicInSendIfDue(&logicIn, 120, &ackOut), 1);
+    ASSERT_FALSE(blobStreamLogicInIsAckPending(&logicIn));
+    ASSERT_EQ(blobStreamLogicInSendIfDue(&logicIn, 200, &ackOut), 0);
+    blobStreamInDestroy(&inStream);
+}
+
+UTEST(BlobStreamLogic, receiveWindow)
+{
+    Mem memory;
+    createMemory(&memory);
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "test";
+
+    static uint8_t blob[TESTP_BLOB_SIZE];
+    for (size_t i = 0; i < TESTP_BLOB_SIZE; ++i) {
+        blob[i] = (uint8_t) (i * 3 + 1);
+    }
+
+    static uint8_t outStorageBuffer[16384 + BLOB_STREAM_STORAGE_ALIGNMENT];
+    uint8_t* outStorage = outStorageBuffer + (BLOB_STREAM_STORAGE_ALIGNMENT -
+                                              ((uintptr_t) outStorageBuffer & 63)) % 64;
+    BlobStreamOut outStream;
+    blobStreamOutInitWithStorage(&outStream, outStorage, blobStreamOutStorageSize(TESTP_BLOB_SIZE, TESTP_CHUNK_SIZE),
+                                 blob, TESTP_BLOB_SIZE, TESTP_CHUNK_SIZE, log);
+    outStream.maxChunksPerSend = 16;
+    BlobStreamLogicOut logicOut;
+    blobStreamLogicOutInit(&logicOut, &outStream, 5);
+
+    static uint8_t inStorageBuffer[16384 + BLOB_STREAM_STORAGE_ALIGNMENT];
+    uint8_t* inStorage = inStorageBuffer + (BLOB_STREAM_STORAGE_ALIGNMENT - ((uintptr_t) inStorageBuffer & 63)) % 64;
+    BlobStreamIn inStream;
+    blobStreamInInitWithStorage(&inStream, inStorage, blobStreamInStorageSize(TESTP_BLOB_SIZE, TESTP_CHUNK_SIZE),
+                                TESTP_BLOB_SIZE, TESTP_CHUNK_SIZE, log);
+    BlobStreamLogicIn logicIn;
+    blobStreamLogicInInit(&logicIn, &inStream, 5);
+
+    // A stalled consumer closes the window, and chunks outside of it are dropped
+    blobStreamLogicInSetReceiveWindow(&logicIn, 0);
+    static uint8_t datagram[256];
+    FldOutStream outDatagram;
+    fldOutStreamInit(&outDatagram, datagram, sizeof(datagram));
+    blobStreamLogicOutSendEntry(&outDatagram, &outStream.entries[0], 5);
+    ASSERT_EQ(receiveAll(&logicIn, datagram, outDatagram.pos), 0);
+    ASSERT_FALSE(bitArrayIsSet(&inStream.bitArray, 0));
+    ASSERT_EQ(logicIn.droppedChunkCount, 1);
+
+    FldOutStream ackOut;
+    fldOutStreamInit(&ackOut, datagram, sizeof(datagram));
+    ASSERT_EQ(blobStreamLogicInSendIfDue(&logicIn, 0, &ackOut), 1);
+    FldInStream ackIn;
+    fldInStreamInit(&ackIn, datagram, ackOut.pos);
+    ASSERT_EQ(blobStreamLogicOutReceive(&logicOut, &ackIn), 0);
+    const BlobStreamOutEntry* entries[16];
+    ASSERT_EQ(blobStreamLogicOutPrepareSend(&logicOut, 0, entries, 16), 0);
+
+    // Opening the window is acked right away and the sender only sends inside of it
+    blobStreamLogicInSetReceiveWindow(&logicIn, 8);
+    fldOutStreamInit(&ackOut, datagram, sizeof(datagram));
+    ASSERT_EQ(blobStreamLogicInSendIfDue(&logicIn, 0, &ackOut), 1);
+    fldInStreamInit(&ackIn, datagram, ackOut.pos);
+    ASSERT_EQ(blobStreamLogicOutReceive(&logicOut, &ackIn), 0);
+    ASSERT_EQ(blobStreamLogicOutPrepareSend(&logicOut, 0, entries, 16), 8);
+    ASSERT_EQ(entries[7]->chunkId, 7);
+
+    // Every chunk is sent exactly once, since nothing is dropped
+    size_t octetsOnWire = 0;
+    ASSERT_EQ(transferUntilComplete(&logicOut, &logicIn, 100, &octetsOnWire), 0);
+    ASSERT_TRUE(blobStreamInIsComplete(&inStream));
+    ASSERT_EQ(tc_memcmp(inStream.blob, blob, TESTP_BLOB_SIZE), 0);
+    ASSERT_EQ(logicIn.droppedChunkCount, 1);
+    ASSERT_EQ(octetsOnWire, (TESTP_BLOB_SIZE / TESTP_CHUNK_SIZE) * (1 + 2 + 4 + 2 + TESTP_CHUNK_SIZE));
+}
+
+static size_t octetsOnWireWithFormat(bool isCompact, bool isTransferIdElided, size_t* ackOctetCount)
+{
+    Mem memory;
+    createMemory(&memory);
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "test";
+
+#define TESTQ_CHUNK_SIZE (32)
+#define TESTQ_BLOB_SIZE (2040)
+    static uint8_t blob[TESTQ_BLOB_SIZE];
+    for (size_t i = 0; i < TESTQ_BLOB_SIZE; ++i) {
+        blob[i] = (uint8_t) (i * 13 + 5);
+    }
+
+    static uint8_t outStorageBuffer[16384 + BLOB_STREAM_STORAGE_ALIGNMENT];
+    uint8_t* outStorage = outStorageBuffer + (BLOB_STREAM_STORAGE_ALIGNMENT -
+                                              ((uintptr_t) outStorageBuffer & 63)) % 64;
+    BlobStreamOut outStream;
+    blobStreamOutInitWithStorage(&outStream, outStorage, blobStreamOutStorageSize(TESTQ_BLOB_SIZE, TESTQ_CHUNK_SIZE),
+                                 blob, TESTQ_BLOB_SIZE, TESTQ_CHUNK_SIZE, log);
+    outStream.maxChunksPerSend = 16;
+    BlobStreamLogicOut logicOut;
+    blobStreamLogicOutInit(&logicOut, &outStream, 6);
+    if (isCompact) {
+        blobStreamLogicOutSetCompact(&logicOut, isTransferIdElided);
+    }
+
+    static uint8_t datagram[1200];
+    FldOutStream startOut;
+    fldOutStreamInit(&startOut, datagram, sizeof(datagram));
+    blobStreamLogicOutStartTransfer(&logicOut, &startOut);
+    FldInStream startIn;
+    fldInStreamInit(&startIn, datagram, startOut.pos);
+    BlobStreamStartTransfer startTransfer;
+    blobStreamLogicInReadStartTransfer(&startIn, BLOB_STREAM_MAX_CHUNK_SIZE, &startTransfer);
+
+    BlobStreamIn inStream;
+    blobStreamInInit(&inStream, &memory.linearAllocator.info, &memory.slabAllocator.info, startTransfer.octetCount,
+                     startTransfer.fixedChunkSize, log);
+    BlobStreamLogicIn logicIn;
+    blobStreamLogicInInit(&logicIn, &inStream, startTransfer.transferId);
+    if (startTransfer.isCompact) {
+        blobStreamLogicInSetCompact(&logicIn, startTransfer.isTransferIdElided);
+    }
+    FldOutStream ackStartOut;
+    fldOutStreamInit(&ackStartOut, datagram, sizeof(datagram));
+    blobStreamLogicInSendAckStartTransfer(&startTransfer, &ackStartOut);
+    FldInStream ackStartIn;
+    fldInStreamInit(&ackStartIn, datagram, ackStartOut.pos);
+    blobStreamLogicOutReceive(&logicOut, &ackStartIn);
+
+    size_t octetsOnWire = 0;
+    *ackOctetCount = 0;
+    MonotonicTimeMs now = 0;
+    for (size_t round = 0; round < 20 && !blobStreamLogicOutIsComplete(&logicOut); ++round, now += 100) {
+        const BlobStreamOutEntry* entries[16];
+        int entryCount = blobStreamLogicOutPrepareSend(&logicOut, now, entries, 16);
+        FldOutStream outDatagram;
+        fldOutStreamInit(&outDatagram, datagram, sizeof(datagram));
+        if (entryCount > 0 && blobStreamLogicOutSendEntries(&logicOut, &outDatagram, entries, (size_t) entryCount) !=
+                                  entryCount) {
+            return 0;
+        }
+        octetsOnWire += outDatagram.pos;
+        if (receiveAll(&logicIn, datagram, outDatagram.pos) < 0) {
+            return 0;
+        }
+
+        FldOutStream ackOut;
+        fldOutStreamInit(&ackOut, datagram, sizeof(datagram));
+        blobStreamLogicInSend(&logicIn, &ackOut);
+        *ackOctetCount = ackOut.pos;
+        FldInStream ackIn;
+        fldInStreamInit(&ackIn, datagram, ackOut.pos);
+        blobStreamLogicOutReceive(&logicOut, &ackIn);
+    }
+
+    bool isReceived = blobStreamInIsComplete(&inStream) && tc_memcmp(inStream.blob, blob, TESTQ_BLOB_SIZE) == 0;
+    blobStreamInDestroy(&inStream);
+
+    return isReceived && logicOut.isCompact == isCompact ? octetsOnWire : 0;
+}
+
+UTEST(BlobStreamLogic, receiveWindowInterleaved)
+{
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "test";
+
+    static uint8_t blob[TESTP_BLOB_SIZE];
+    for (size_t i = 0; i < TESTP_BLOB_SIZE; ++i) {
+        blob[i] = (uint8_t) (i * 7 + 3);
+    }
+
+    // Windows smaller than the interleave stride must not stall the transfer
+    const size_t windowChunkCounts[] = {1, 4, 12};
+    for (size_t windowIndex = 0; windowIndex < 3; ++windowIndex) {
+        static uint8_t outStorageBuffer[16384 + BLOB_STREAM_STORAGE_ALIGNMENT];
+        uint8_t* outStorage = outStorageBuffer + (BLOB_STREAM_STORAGE_ALIGNMENT -
+                                                  ((uintptr_t) outStorageBuffer & 63)) % 64;
+        BlobStreamOut outStream;
+        blobStreamOutInitWithStorage(&outStream, outStorage,
+                                     blobStreamOutStorageSize(TESTP_BLOB_SIZE, TESTP_CHUNK_SIZE), blob,
+                                     TESTP_BLOB_SIZE, TESTP_CHUNK_SIZE, log);
+        blobStreamOutSetOrder(&outStream, BlobStreamOutOrderInterleaved);
+        outStream.maxChunksPerSend = 16;
+        BlobStreamLogicOut logicOut;
+        blobStreamLogicOutInit(&logicOut, &outStream, 5);
+
+        static uint8_t inStorageBuffer[16384 + BLOB_STREAM_STORAGE_ALIGNMENT];
+        uint8_t* inStorage = inStorageBuffer + (BLOB_STREAM_STORAGE_ALIGNMENT -
+                                                ((uintptr_t) inStorageBuffer & 63)) % 64;
+        BlobStreamIn inStream;
+        blobStreamInInitWithStorage(&inStream, inStorage, blobStreamInStorageSize(TESTP_BLOB_SIZE, TESTP_CHUNK_SIZE),
+                                    TESTP_BLOB_SIZE, TESTP_CHUNK_SIZE, log);
+        BlobStreamLogicIn logicIn;
+        blobStreamLogicInInit(&logicIn, &inStream, 5);
+        blobStreamLogicInSetReceiveWindow(&logicIn, windowChunkCounts[windowIndex]);
+
+        // The sender starts before it knows about the window, so only the first round can be dropped
+        size_t octetsOnWire = 0;
+        ASSERT_EQ(transferUntilComplete(&logicOut, &logicIn, 200, &octetsOnWire), 0);
+        ASSERT_TRUE(blobStreamInIsComplete(&inStream));
+        ASSERT_EQ(tc_memcmp(inStream.blob, blob, TESTP_BLOB_SIZE), 0);
+        ASSERT_TRUE(logicIn.droppedChunkCount <= 16);
+    }
+}
+
+#define TESTY_CHUNK_SIZE (10)
+#define TESTY_BLOB_SIZE (10240)
+
+static int sendNewChunksInWindow(BlobStreamOut* outStream, MonotonicTimeMs now, size_t firstChunkId,
+                                 size_t endChunkId)
+{
+    const BlobStreamOutEntry* entries[16];
+    int entryCount = blobStreamOutGetChunksToSend(outStream, now, entries, 16);
+    for (int i = 0; i < entryCount; ++i) {
+        if (entries[i]->chunkId < firstChunkId || entries[i]->chunkId >= endChunkId || entries[i]->sendCount != 1) {
+            return -1;
+        }
+        if (i > 0 && entries[i]->chunkId == entries[i - 1]->chunkId + 1) {
+            return -2;
+        }
+    }
+
+    return entryCount;
+}
+
+UTEST(BlobStreamOut, interleavesWithinReceiveWindow)
+{
+    Mem memory;
+    createMemory(&memory);
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "test";
+
+    static uint8_t blob[TESTY_BLOB_SIZE];
+    BlobStreamOut outStream;
+    blobStreamOutInit(&outStream, &memory.linearAllocator.info, &memory.slabAllocator.info, blob, TESTY_BLOB_SIZE,
+                      TESTY_CHUNK_SIZE, log);
+    blobStreamOutSetOrder(&outStream, BlobStreamOutOrderInterleaved);
+    outStream.maxChunksPerSend = 16;
+    blobStreamOutSetReceiveWindow(&outStream, 16);
+
+    // Only the chunks within the window are interleaved
+    ASSERT_EQ(sendNewChunksInWindow(&outStream, 0, 0, 16), 16);
+
+    // Nothing is visited while the window is full
+    ASSERT_EQ(sendNewChunksInWindow(&outStream, 1, 0, 16), 0);
+    ASSERT_EQ(outStream.orderBlockFirstChunkId, 16);
+    ASSERT_EQ(outStream.orderBlockChunkCount, 0);
+
+    blobStreamOutMarkReceived(&outStream, 8, 0);
+    blobStreamOutSetReceiveWindow(&outStream, 24);
+    ASSERT_EQ(sendNewChunksInWindow(&outStream, 2, 16, 24), 8);
+
+    // A shrinking window starts the block again, and no new chunk is left behind
+    blobStreamOutSetReceiveWindow(&outStream, 20);
+    ASSERT_EQ(sendNewChunksInWindow(&outStream, 3, 0, 20), 0);
+    blobStreamOutSetReceiveWindow(&outStream, 32);
+    ASSERT_EQ(sendNewChunksInWindow(&outStream, 4, 24, 32), 8);
+
+    blobStreamOutDestroy(&outStream);
+}
+
+UTEST(BlobStreamLogic, compactFormat)
+{
+    static uint8_t buf[BLOB_STREAM_VAR_INT_MAX_OCTET_SIZE * 4];
+    FldOutStream varIntOut;
+    fldOutStreamInit(&varIntOut, buf, sizeof(buf));
+    blobStreamVarIntWrite(&varIntOut, 0x7f);
+    blobStreamVarIntWrite(&varIntOut, 0x80);
+    blobStreamVarIntWrite(&varIntOut, UINT64_MAX);
+    blobStreamVarIntWrite(&varIntOut, blobStreamZigZagEncode(-3));
+    ASSERT_EQ(varIntOut.pos, 1 + 2 + BLOB_STREAM_VAR_INT_MAX_OCTET_SIZE + 1);
+    FldInStream varIntIn;
+    fldInStreamInit(&varIntIn, buf, varIntOut.pos);
+    uint64_t values[4];
+    for (size_t i = 0; i < 4; ++i) {
+        ASSERT_EQ(blobStreamVarIntRead(&varIntIn, &values[i]), 0);
+    }
+    ASSERT_EQ(values[0], 0x7f);
+    ASSERT_EQ(values[1], 0x80);
+    ASSERT_EQ(values[2], UINT64_MAX);
+    ASSERT_EQ(blobStreamZigZagDecode(values[3]), -3);
+
+    size_t regularAckOctetCount;
+    size_t regularOctets = octetsOnWireWithFormat(false, false, &regularAckOctetCount);
+    size_t compactAckOctetCount;
+    size_t compactOctets = octetsOnWireWithFormat(true, false, &compactAckOctetCount);
+    size_t scopedAckOctetCount;
+    size_t scopedOctets = octetsOnWireWithFormat(true, true, &scopedAckOctetCount);
+
+    ASSERT_TRUE(regularOctets > 0 && compactOctets > 0 && scopedOctets > 0);
+    ASSERT_EQ(regularAckOctetCount, 1 + 2 + 4 + 8 + 4);
+    ASSERT_TRUE(compactAckOctetCount <= 8);
+    ASSERT_EQ(scopedAckOctetCount, compactAckOctetCount - 2);
+    ASSERT_TRUE(compactOctets * 100 < regularOctets * 85);
+    ASSERT_TRUE(scopedOctets < compactOctets);
+}
+
+UTEST(BlobStreamLogic, receiveDatagram)
+{
+    Mem memory;
+    createMemory(&memory);
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "test";
+
+    static uint8_t blob[TESTP_BLOB_SIZE];
+    for (size_t i = 0; i < TESTP_BLOB_SIZE; ++i) {
+        blob[i] = (uint8_t) (i * 9 + 4);
+    }
+
+    static uint8_t outStorageBuffer[16384 + BLOB_STREAM_STORAGE_ALIGNMENT];
+    uint8_t* outStorage = outStorageBuffer + (BLOB_STREAM_STORAGE_ALIGNMENT -
+                                              ((uintptr_t) outStorageBuffer & 63)) % 64;
+    BlobStreamOut outStream;
+    blobStreamOutInitWithStorage(&outStream, outStorage, blobStreamOutStorageSize(TESTP_BLOB_SIZE, TESTP_CHUNK_SIZE),
+                                 blob, TESTP_BLOB_SIZE, TESTP_CHUNK_SIZE, log);
+    outStream.maxChunksPerSend = 12;
+    BlobStreamLogicOut logicOut;
+    blobStreamLogicOutInit(&logicOut, &outStream, 8);
+
+    static uint8_t inStorageBuffer[16384 + BLOB_STREAM_STORAGE_ALIGNMENT];
+    uint8_t* inStorage = inStorageBuffer + (BLOB_STREAM_STORAGE_ALIGNMENT - ((uintptr_t) inStorageBuffer & 63)) % 64;
+    BlobStreamIn inStream;
+    blobStreamInInitWithStorage(&inStream, inStorage, blobStreamInStorageSize(TESTP_BLOB_SIZE, TESTP_CHUNK_SIZE),
+                                TESTP_BLOB_SIZE, TESTP_CHUNK_SIZE, log);
+    BlobStreamLogicIn logicIn;
+    blobStreamLogicInInit(&logicIn, &inStream, 8);
+
+    const BlobStreamOutEntry* entries[12];
+    ASSERT_EQ(blobStreamLogicOutPrepareSend(&logicOut, 0, entries, 12), 12);
+    static uint8_t datagram[1500];
+    FldOutStream outDatagram;
+    fldOutStreamInit(&outDatagram, datagram, sizeof(datagram));
+    ASSERT_EQ(blobStreamLogicOutSendEntries(&logicOut, &outDatagram, entries, 12), 12);
+    blobStreamOutSetDeadline(&outStream, 60, 4, 1);
+    const BlobStreamOutEntry* ignored[12];
+    blobStreamLogicOutPrepareSend(&logicOut, 2, ignored, 12);
+    size_t fromChunkId = 0;
+    ASSERT_EQ(blobStreamLogicOutSendExpired(&logicOut, &outDatagram, &fromChunkId), 1);
+
+    // A truncated datagram is rejected before any chunk is applied
+    FldInStream truncated;
+    fldInStreamInit(&truncated, datagram, outDatagram.pos - 1);
+    ASSERT_TRUE(blobStreamLogicInReceiveDatagram(&logicIn, &truncated) < 0);
+    ASSERT_FALSE(bitArrayIsSet(&inStream.bitArray, 0));
+
+    FldInStream inDatagram;
+    fldInStreamInit(&inDatagram, datagram, outDatagram.pos);
+    ASSERT_EQ(blobStreamLogicInReceiveDatagram(&logicIn, &inDatagram), 13);
+    ASSERT_EQ(inDatagram.pos, inDatagram.size);
+    ASSERT_TRUE(bitArrayIsSet(&inStream.bitArray, 11));
+    ASSERT_TRUE(blobStreamInIsChunkExpired(&inStream, 63));
+    ASSERT_EQ(tc_memcmp(inStream.blob, blob, 12 * TESTP_CHUNK_SIZE), 0);
+
+    // An illegal range in a later command rejects the whole datagram, so the first command is not applied either
+    uint8_t illegalDatagram[64];
+    FldOutStream illegalOut;
+    fldOutStreamInit(&illegalOut, illegalDatagram, sizeof(illegalDatagram));
+    for (size_t i = 0; i < 2; ++i) {
+        fldOutStreamWriteUInt8(&illegalOut, BLOB_STREAM_LOGIC_CMD_CHUNKS_EXPIRED);
+        fldOutStreamWriteUInt16(&illegalOut, 8);
+        fldOutStreamWriteUInt16(&illegalOut, 1);
+        fldOutStreamWriteUInt32(&illegalOut, i == 0 ? 20 : 40);
+        fldOutStreamWriteUInt32(&illegalOut, i == 0 ? 1 : 100);
+    }
+    FldInStream illegalIn;
+    fldInStreamInit(&illegalIn, illegalDatagram, illegalOut.pos);
+    ASSERT_EQ(blobStreamLogicInReceiveDatagram(&logicIn, &illegalIn), -3);
+    ASSERT_FALSE(blobStreamInIsChunkExpired(&inStream, 20));
+
+    // Acks can be batched the same way, and unknown commands are rejected
+    FldOutStream ackOut;
+    fldOutStreamInit(&ackOut, datagram, sizeof(datagram));
+    blobStreamLogicInSend(&logicIn, &ackOut);
+    blobStreamLogicInSend(&logicIn, &ackOut);
+    FldInStream ackIn;
+    fldInStreamInit(&ackIn, datagram, ackOut.pos);
+    ASSERT_EQ(blobStreamLogicOutReceiveDatagram(&logicOut, &ackIn), 2);
+    ASSERT_EQ(outStream.receivedChunkCount, 12 + 4);
+
+    datagram[ackOut.pos] = 0xee;
+    fldInStreamInit(&ackIn, datagram, ackOut.pos + 1);
+    ASSERT_EQ(blobStreamLogicOutReceiveDatagram(&logicOut, &ackIn), -2);
+    fldInStreamInit(&ackIn, datagram + ackOut.pos, 1);
+    ASSERT_EQ(blobStreamLogicOutReceive(&logicOut, &ackIn), -2);
+    ASSERT_EQ(tc_memcmp(blobStreamCmdToString(0xee), "Unknown", 8), 0);
+}
+
+static void simulatedLinkDeliver(SimulatedLink* self, MonotonicTimeMs now, size_t octetCount)
+{
+    if (simulatedLinkIsLost(self) || self->count == 64) {
+        return;
+    }
+    size_t tail = (self->head + self->count) % 64;
+    self->octetCounts[tail] = octetCount;
+    self->deliverAt[tail] = now + self->latency;
+    self->count++;
+}
+
+static uint8_t* simulatedLinkTail(SimulatedLink* self)
+{
+    return self->datagrams[(self->head + self->count) % 64];
+}
+
+static MonotonicTimeMs completionTimeWithTailLossProbe(uint32_t seed, MonotonicTimeMs minProbeTimeout)
+{
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "test";
+
+#define TESTS_CHUNK_SIZE (16)
+#define TESTS_BLOB_SIZE (160)
+    static uint8_t blob[TESTS_BLOB_SIZE];
+    for (size_t i = 0; i < TESTS_BLOB_SIZE; ++i) {
+        blob[i] = (uint8_t) (i * 3 + 1);
+    }
+
+    static uint8_t outStorageBuffer[4096 + BLOB_STREAM_STORAGE_ALIGNMENT];
+    uint8_t* outStorage = outStorageBuffer + (BLOB_STREAM_STORAGE_ALIGNMENT -
+                                              ((uintptr_t) outStorageBuffer & 63)) % 64;
+    BlobStreamOut outStream;
+    blobStreamOutInitWithStorage(&outStream, outStorage, blobStreamOutStorageSize(TESTS_BLOB_SIZE, TESTS_CHUNK_SIZE),
+                                 blob, TESTS_BLOB_SIZE, TESTS_CHUNK_SIZE, log);
+    outStream.thresholdForRedundancy = 200;
+    blobStreamOutSetTailLossProbe(&outStream, minProbeTimeout);
+    BlobStreamLogicOut logicOut;
+    blobStreamLogicOutInit(&logicOut, &outStream, 6);
+
+    static uint8_t inStorageBuffer[4096 + BLOB_STREAM_STORAGE_ALIGNMENT];
+    uint8_t* inStorage = inStorageBuffer + (BLOB_STREAM_STORAGE_ALIGNMENT - ((uintptr_t) inStorageBuffer & 63)) % 64;
+    BlobStreamIn inStream;
+    blobStreamInInitWithStorage(&inStream, inStorage, blobStreamInStorageSize(TESTS_BLOB_SIZE, TESTS_CHUNK_SIZE),
+                                TESTS_BLOB_SIZE, TESTS_CHUNK_SIZE, log);
+    BlobStreamLogicIn logicIn;
+    blobStreamLogicInInit(&logicIn, &inStream, 6);
+
+    // 10 ms each way and 10% loss in both directions
+    static SimulatedLink links[2];
+    for (size_t i = 0; i < 2; ++i) {
+        links[i].head = 0;
+        links[i].count = 0;
+        links[i].latency = 10;
+        links[i].lossPercent = 10;
+        links[i].randomState = seed * 2 + (uint32_t) i + 1;
+    }
+    SimulatedLink* forward = &links[0];
+    SimulatedLink* back = &links[1];
+
+    MonotonicTimeMs now = 0;
+    for (; now < 10000 && !blobStreamLogicOutIsComplete(&logicOut); ++now) {
+        const BlobStreamOutEntry* entries[8];
+        int entryCount = blobStreamLogicOutPrepareSend(&logicOut, now, entries, 8);
+        for (int entryIndex = 0; entryIndex < entryCount; ++entryIndex) {
+            FldOutStream outDatagram;
+            fldOutStreamInit(&outDatagram, simulatedLinkTail(forward), sizeof(forward->datagrams[0]));
+            blobStreamLogicOutSendEntry(&outDatagram, entries[entryIndex], logicOut.transferId);
+            simulatedLinkDeliver(forward, now, outDatagram.pos);
+        }
+
+        while (forward->count > 0 && forward->deliverAt[forward->head] <= now) {
+            receiveAll(&logicIn, forward->datagrams[forward->head], forward->octetCounts[forward->head]);
+            forward->head = (forward->head + 1) % 64;
+            forward->count--;
+        }
+
+        FldOutStream ackOut;
+        fldOutStreamInit(&ackOut, simulatedLinkTail(back), sizeof(back->datagrams[0]));
+        if (blobStreamLogicInSendIfDue(&logicIn, now, &ackOut) == 1) {
+            simulatedLinkDeliver(back, now, ackOut.pos);
+        }
+
+        while (back->count > 0 && back->deliverAt[back->head] <= now) {
+            FldInStream ackIn;
+            fldInStreamInit(&ackIn, back->datagrams[back->head], back->octetCounts[back->head]);
+            blobStreamLogicOutReceive(&logicOut, &ackIn);
+            back->head = (back->head + 1) % 64;
+            back->count--;
+        }
+    }
+
+    return blobStreamInIsComplete(&inStream) ? now : 0;
+}
+
+static int compareTime(const void* a, const void* b)
+{
+    MonotonicTimeMs first = *(const MonotonicTimeMs*) a;
+    MonotonicTimeMs second = *(const MonotonicTimeMs*) b;
+    return (first > second) - (first < second);
+}
+
+UTEST(BlobStreamOut, tailLossProbe)
+{
+#define TESTS_RUN_COUNT (200)
+    static MonotonicTimeMs withoutProbe[TESTS_RUN_COUNT];
+    static MonotonicTimeMs withProbe[TESTS_RUN_COUNT];
+    for (uint32_t i = 0; i < TESTS_RUN_COUNT; ++i) {
+        withoutProbe[i] = completionTimeWithTailLossProbe(i, 0);
+        withProbe[i] = completionTimeWithTailLossProbe(i, 5);
+        ASSERT_TRUE(withoutProbe[i] > 0);
+        ASSERT_TRUE(withProbe[i] > 0);
+    }
+    qsort(withoutProbe, TESTS_RUN_COUNT, sizeof(withoutProbe[0]), compareTime);
+    qsort(withProbe, TESTS_RUN_COUNT, sizeof(withProbe[0]), compareTime);
+
+    size_t p99Index = TESTS_RUN_COUNT * 99 / 100 - 1;
+    // A lost tail chunk costs a probe timeout instead of thresholdForRedundancy
+    ASSERT_TRUE(withProbe[p99Index] * 3 < withoutProbe[p99Index] * 2);
+    ASSERT_TRUE(withProbe[TESTS_RUN_COUNT / 2] * 2 < withoutProbe[TESTS_RUN_COUNT / 2]);
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "test";
+
+    // The probe resends the most recently sent chunks, newest first
+    static uint8_t blob[12 * 10];
+    static uint8_t storageBuffer[4096 + BLOB_STREAM_STORAGE_ALIGNMENT];
+    uint8_t* storage = storageBuffer + (BLOB_STREAM_STORAGE_ALIGNMENT - ((uintptr_t) storageBuffer & 63)) % 64;
+    BlobStreamOut outStream;
+    blobStreamOutInitWithStorage(&outStream, storage, blobStreamOutStorageSize(sizeof(blob), 10), blob,
+                                 sizeof(blob), 10, log);
+    blobStreamOutSetTailLossProbe(&outStream, 5);
+    outStream.maxChunksPerSend = 12;
+    const BlobStreamOutEntry* entries[12];
+    ASSERT_EQ(blobStreamOutGetChunksToSend(&outStream, 0, entries, 12), 12);
+    blobStreamOutMarkReceived(&outStream, 1, 0);
+    outStream.maxChunksPerSend = 3;
+    ASSERT_EQ(blobStreamOutGetChunksToSend(&outStream, 10, entries, 12), 0);
+    ASSERT_EQ(blobStreamOutGetChunksToSend(&outStream, 30, entries, 12), 3);
+    ASSERT_EQ(entries[0]->chunkId, 11);
+    ASSERT_EQ(entries[1]->chunkId, 10);
+    ASSERT_EQ(entries[2]->chunkId, 9);
+}
+
+UTEST(BlobStreamOut, microsecondTimeBase)
+{
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "test";
+
+#define TESTT_CHUNK_SIZE (1000)
+#define TESTT_BLOB_SIZE (20000)
+    static uint8_t blob[TESTT_BLOB_SIZE];
+    static uint8_t storageBuffer[8192 + BLOB_STREAM_STORAGE_ALIGNMENT];
+    uint8_t* storage = storageBuffer + (BLOB_STREAM_STORAGE_ALIGNMENT - ((uintptr_t) storageBuffer & 63)) % 64;
+    ASSERT_TRUE(blobStreamOutStorageSize(TESTT_BLOB_SIZE, TESTT_CHUNK_SIZE) <= 8192);
+    BlobStreamOut outStream;
+    blobStreamOutInitWithStorage(&outStream, storage, blobStreamOutStorageSize(TESTT_BLOB_SIZE, TESTT_CHUNK_SIZE),
+                                 blob, TESTT_BLOB_SIZE, TESTT_CHUNK_SIZE, log);
+    blobStreamOutSetTimeBase(&outStream, BLOB_STREAM_TIME_BASE_MICROSECONDS);
+    ASSERT_EQ(outStream.thresholdForRedundancy, 50000);
+
+    // One gigabit per second is one chunk every 8 us, after a first burst of maxChunksPerSend
+    blobStreamOutSetPacingRate(&outStream, 125000000);
+    const BlobStreamOutEntry* entries[8];
+    ASSERT_EQ(blobStreamOutGetChunksToSend(&outStream, 1000, entries, 8), 5);
+    ASSERT_EQ(blobStreamOutGetChunksToSend(&outStream, 1004, entries, 8), 0);
+    ASSERT_EQ(blobStreamOutGetChunksToSend(&outStream, 1008, entries, 8), 1);
+    ASSERT_EQ(entries[0]->chunkId, 5);
+    ASSERT_EQ(blobStreamOutGetChunksToSend(&outStream, 1024, entries, 8), 2);
+
+    // A round trip of 150 us is kept with full resolution
+    blobStreamOutMarkReceived(&outStream, 5, 0);
+    ASSERT_EQ(blobStreamOutGetChunksToSend(&outStream, 1150, entries, 8), 5);
+    ASSERT_TRUE(outStream.hasRtt);
+    ASSERT_EQ(outStream.smoothedRtt, 150);
+    blobStreamOutSetTailLossProbe(&outStream, 100);
+    ASSERT_EQ(blobStreamOutProbeTimeout(&outStream), 300);
+}
+
+UTEST(BlobStreamOut, pacingWhenPolledEveryTick)
+{
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "test";
+
+#define TESTW_CHUNK_SIZE (100)
+#define TESTW_BLOB_SIZE (1200 * TESTW_CHUNK_SIZE)
+    static uint8_t blob[TESTW_BLOB_SIZE];
+    static uint8_t storageBuffer[128 * 1024 + BLOB_STREAM_STORAGE_ALIGNMENT];
+    uint8_t* storage = storageBuffer + (BLOB_STREAM_STORAGE_ALIGNMENT - ((uintptr_t) storageBuffer & 63)) % 64;
+    ASSERT_TRUE(blobStreamOutStorageSize(TESTW_BLOB_SIZE, TESTW_CHUNK_SIZE) <= 128 * 1024);
+    BlobStreamOut outStream;
+    blobStreamOutInitWithStorage(&outStream, storage, blobStreamOutStorageSize(TESTW_BLOB_SIZE, TESTW_CHUNK_SIZE),
+                                 blob, TESTW_BLOB_SIZE, TESTW_CHUNK_SIZE, log);
+    blobStreamOutSetTimeBase(&outStream, BLOB_STREAM_TIME_BASE_MICROSECONDS);
+
+    // A chunk is earned every 1000 us, but each poll only earns half an octet
+    blobStreamOutSetPacingRate(&outStream, 100000);
+    const BlobStreamOutEntry* entries[8];
+    size_t sentCount = 0;
+    for (MonotonicTimeMs now = 0; now <= 1000000; now += 5) {
+        int count = blobStreamOutGetChunksToSend(&outStream, now, entries, 8);
+        ASSERT_TRUE(count >= 0);
+        sentCount += (size_t) count;
+    }
+    ASSERT_EQ(sentCount, outStream.maxChunksPerSend + 1000);
+}
+
+UTEST(BlobStreamCompress, roundTrip)
+{
+    static uint8_t source[4096];
+    for (size_t i = 0; i < sizeof(source); ++i) {
+        source[i] = (uint8_t) ((i / 64) % 7);
+    }
+
+    static uint8_t compressed[4096];
+    int compressedOctetCount = blobStreamCompress(source, sizeof(source), compressed, sizeof(compressed) - 1);
+    ASSERT_TRUE(compressedOctetCount > 0);
+    ASSERT_TRUE(compressedOctetCount < 1024);
+
+    static uint8_t decompressed[4096];
+    int decompressedOctetCount = blobStreamDecompress(compressed, (size_t) compressedOctetCount, decompressed,
+                                                      sizeof(decompressed));
+    ASSERT_EQ(decompressedOctetCount, 4096);
+    ASSERT_EQ(tc_memcmp(source, decompressed, sizeof(source)), 0);
+
+    uint32_t seed = 1;
+    for (size_t i = 0; i < sizeof(source); ++i) {
+        seed = seed * 1103515245 + 12345;
+        source[i] = (uint8_t) (seed >> 16);
+    }
+    ASSERT_TRUE(blobStreamCompress(source, sizeof(source), compressed, sizeof(source) - 1) < 0);
+}
+
+UTEST(BlobStreamLogic, compressedChunks)
+{
+    Mem memory;
+    createMemory(&memory);
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "test";
+
+#define TESTF_BLOB_SIZE (2100)
+    static uint8_t blob[TESTF_BLOB_SIZE];
+    for (size_t i = 0; i < TESTF_BLOB_SIZE; ++i) {
+        blob[i] = (uint8_t) (i < 1024 ? (i / 16) : (i * 97) >> 3);
+    }
+    uint32_t seed = 7;
+    for (size_t i = 1024; i < 2048; ++i) {
+        seed = seed * 1103515245 + 12345;
+        blob[i] = (uint8_t) (seed >> 16);
+    }
+
+    BlobStreamOut outStream;
+    blobStreamOutInit(&outStream, &memory.linearAllocator.info, &memory.slabAllocator.info, blob, TESTF_BLOB_SIZE,
+                      BLOB_STREAM_CHUNK_SIZE, log);
+    static uint8_t compressionCache[TESTF_BLOB_SIZE];
+    ASSERT_EQ(blobStreamOutSetCompressionCache(&outStream, compressionCache, sizeof(compressionCache)), 0);
+    blobStreamOutPrecompress(&outStream);
+    ASSERT_EQ(outStream.entries[0].encoding, BLOB_STREAM_CHUNK_ENCODING_LZ);
+    ASSERT_TRUE(outStream.entries[0].octetCount < 512);
+    ASSERT_EQ(outStream.entries[1].encoding, BLOB_STREAM_CHUNK_ENCODING_RAW);
+
+    BlobStreamLogicOut logicOut;
+    blobStreamLogicOutInit(&logicOut, &outStream, 3);
+
+    BlobStreamIn inStream;
+    blobStreamInInit(&inStream, &memory.linearAllocator.info, &memory.slabAllocator.info, TESTF_BLOB_SIZE,
+                     BLOB_STREAM_CHUNK_SIZE, log);
+    BlobStreamLogicIn logicIn;
+    blobStreamLogicInInit(&logicIn, &inStream, 3);
+
+    size_t octetsOnWire = 0;
+    ASSERT_EQ(transferUntilComplete(&logicOut, &logicIn, 10, &octetsOnWire), 0);
+    ASSERT_TRUE(blobStreamInIsComplete(&inStream));
+    ASSERT_EQ(tc_memcmp(inStream.blob, blob, TESTF_BLOB_SIZE), 0);
+    ASSERT_TRUE(octetsOnWire < TESTF_BLOB_SIZE);
+
+    blobStreamInDestroy(&inStream);
+    blobStreamOutDestroy(&outStream);
+}
+
+UTEST(BlobStreamLogic, deltaAgainstBaseline)
+{
+    Mem memory;
+    createMemory(&memory);
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "test";
+
+#define TESTG_BLOB_SIZE (2000)
+#define TESTG_CHUNK_SIZE (128)
+    static uint8_t baseline[TESTG_BLOB_SIZE];
+    static uint8_t blob[TESTG_BLOB_SIZE];
+    uint32_t seed = 11;
+    for (size_t i = 0; i < TESTG_BLOB_SIZE; ++i) {
+        seed = seed * 1103515245 + 12345;
+        baseline[i] = (uint8_t) (seed >> 16);
+    }
+    tc_memcpy_octets(blob, baseline, TESTG_BLOB_SIZE);
+    blob[3 * TESTG_CHUNK_SIZE + 17] ^= 0x5a;
+    blob[3 * TESTG_CHUNK_SIZE + 90] ^= 0x01;
+    blob[TESTG_BLOB_SIZE - 1] ^= 0xff;
+
+    BlobStreamOut outStream;
+    blobStreamOutInit(&outStream, &memory.linearAllocator.info, &memory.slabAllocator.info, blob, TESTG_BLOB_SIZE,
+                      TESTG_CHUNK_SIZE, log);
+    static uint8_t compressionCache[TESTG_BLOB_SIZE];
+    static uint8_t deltaCache[TESTG_BLOB_SIZE];
+    ASSERT_EQ(blobStreamOutSetCompressionCache(&outStream, compressionCache, sizeof(compressionCache)), 0);
+    ASSERT_EQ(blobStreamOutSetBaseline(&outStream, 42, baseline, TESTG_BLOB_SIZE, deltaCache), 0);
+    ASSERT_EQ(outStream.entries[0].encoding, BLOB_STREAM_CHUNK_ENCODING_UNCHANGED);
+    ASSERT_TRUE(outStream.entries[1].isReceived);
+    ASSERT_EQ(outStream.entries[4].encoding, BLOB_STREAM_CHUNK_ENCODING_UNCHANGED);
+
+    BlobStreamLogicOut logicOut;
+    blobStreamLogicOutInit(&logicOut, &outStream, 5);
+
+    static uint8_t startDatagram[64];
+    FldOutStream startOut;
+    fldOutStreamInit(&startOut, startDatagram, sizeof(startDatagram));
+    ASSERT_EQ(blobStreamLogicOutStartTransfer(&logicOut, &startOut), 0);
+    FldInStream startIn;
+    fldInStreamInit(&startIn, startDatagram, startOut.pos);
+    BlobStreamStartTransfer startTransfer;
+    ASSERT_EQ(blobStreamLogicInReadStartTransfer(&startIn, BLOB_STREAM_MAX_CHUNK_SIZE, &startTransfer), 0);
+    ASSERT_TRUE(startTransfer.isDelta);
+    ASSERT_EQ(startTransfer.baselineId, 42u);
+
+    BlobStreamIn inStream;
+    blobStreamInInit(&inStream, &memory.linearAllocator.info, &memory.slabAllocator.info, startTransfer.octetCount,
+                     startTransfer.fixedChunkSize, log);
+    blobStreamInSetBaseline(&inStream, baseline, TESTG_BLOB_SIZE);
+    BlobStreamLogicIn logicIn;
+    blobStreamLogicInInit(&logicIn, &inStream, startTransfer.transferId);
+
+    size_t octetsOnWire = 0;
+    ASSERT_EQ(transferUntilComplete(&logicOut, &logicIn, 10, &octetsOnWire), 0);
+    ASSERT_TRUE(blobStreamInIsComplete(&inStream));
+    ASSERT_EQ(tc_memcmp(inStream.blob, blob, TESTG_BLOB_SIZE), 0);
+    ASSERT_TRUE(octetsOnWire < TESTG_CHUNK_SIZE * 3);
+
+    blobStreamInDestroy(&inStream);
+    blobStreamOutDestroy(&outStream);
+}
+
+UTEST(BlobStreamChunkCache, leastRecentlyUsed)
+{
+    Mem memory;
+    createMemory(&memory);
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "test";
+
+    BlobStreamChunkCache cache;
+    blobStreamChunkCacheInit(&cache, &memory.linearAllocator.info, 3, 16, log);
+
+    uint8_t chunks[4][16];
+    BlobStreamChunkHash hashes[4];
+    for (size_t i = 0; i < 4; ++i) {
+        tc_memset_octets(chunks[i], (int) (0x10 + i), sizeof(chunks[i]));
+        hashes[i] = blobStreamChunkHash(chunks[i], sizeof(chunks[i]));
+        if (i > 0) {
+            ASSERT_NE(hashes[i], hashes[i - 1]);
+        }
+    }
+
+    blobStreamChunkCacheInsert(&cache, hashes[0], chunks[0], sizeof(chunks[0]));
+    blobStreamChunkCacheInsert(&cache, hashes[1], chunks[1], sizeof(chunks[1]));
+    blobStreamChunkCacheInsert(&cache, hashes[2], chunks[2], sizeof(chunks[2]));
+    ASSERT_TRUE(blobStreamChunkCacheFind(&cache, hashes[0]) != 0);
+
+    // chunk 1 is now the least recently used
+    blobStreamChunkCacheInsert(&cache, hashes[3], chunks[3], sizeof(chunks[3]));
+    ASSERT_EQ(cache.count, 3u);
+    ASSERT_TRUE(blobStreamChunkCacheFind(&cache, hashes[1]) == 0);
+
+    const BlobStreamChunkCacheEntry* entry = blobStreamChunkCacheFind(&cache, hashes[2]);
+    ASSERT_TRUE(entry != 0);
+    ASSERT_EQ(entry->octetCount, sizeof(chunks[2]));
+    ASSERT_EQ(tc_memcmp(entry->octets, chunks[2], sizeof(chunks[2])), 0);
+    ASSERT_TRUE(blobStreamChunkCacheFind(&cache, hashes[0]) != 0);
+    ASSERT_TRUE(blobStreamChunkCacheFind(&cache, hashes[3]) != 0);
+}
+
+UTEST(BlobStreamLogic, dedupeFromChunkCache)
+{
+    Mem memory;
+    createMemory(&memory);
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "test";
+
+#define TESTH_BLOB_SIZE (2000)
+#define TESTH_CHUNK_SIZE (128)
+    static uint8_t blob[TESTH_BLOB_SIZE];
+    uint32_t seed = 3;
+    for (size_t i = 0; i < TESTH_BLOB_SIZE; ++i) {
+        seed = seed * 1103515245 + 12345;
+        blob[i] = (uint8_t) (seed >> 16);
+    }
+
+    BlobStreamChunkCache cache;
+    blobStreamChunkCacheInit(&cache, &memory.linearAllocator.info, 32, TESTH_CHUNK_SIZE, log);
+    for (size_t chunkId = 0; chunkId < 12; ++chunkId) {
+        const uint8_t* octets = blob + chunkId * TESTH_CHUNK_SIZE;
+        blobStreamChunkCacheInsert(&cache, blobStreamChunkHash(octets, TESTH_CHUNK_SIZE), octets, TESTH_CHUNK_SIZE);
+    }
+
+    BlobStreamOut outStream;
+    blobStreamOutInit(&outStream, &memory.linearAllocator.info, &memory.slabAllocator.info, blob, TESTH_BLOB_SIZE,
+                      TESTH_CHUNK_SIZE, log);
+    BlobStreamLogicOut logicOut;
+    blobStreamLogicOutInit(&logicOut, &outStream, 9);
+
+    BlobStreamIn inStream;
+    blobStreamInInit(&inStream, &memory.linearAllocator.info, &memory.slabAllocator.info, TESTH_BLOB_SIZE,
+                     TESTH_CHUNK_SIZE, log);
+    BlobStreamLogicIn logicIn;
+    blobStreamLogicInInit(&logicIn, &inStream, 9);
+    blobStreamLogicInSetChunkCache(&logicIn, &cache);
+
+    static uint8_t datagram[1200];
+    FldOutStream hashesOut;
+    fldOutStreamInit(&hashesOut, datagram, sizeof(datagram));
+    ASSERT_EQ(blobStreamLogicOutSendChunkHashes(&logicOut, &hashesOut, 0), (int) outStream.chunkCount);
+    ASSERT_EQ(receiveAll(&logicIn, datagram, hashesOut.pos), 0);
+    ASSERT_EQ(inStream.receivedChunkCount, 12u);
+
+    FldOutStream ackOut;
+    fldOutStreamInit(&ackOut, datagram, sizeof(datagram));
+    ASSERT_EQ(blobStreamLogicInSend(&logicIn, &ackOut), 0);
+    FldInStream ackIn;
+    fldInStreamInit(&ackIn, datagram, ackOut.pos);
+    while (ackIn.pos < ackIn.size) {
+        ASSERT_EQ(blobStreamLogicOutReceive(&logicOut, &ackIn), 0);
+    }
+    ASSERT_TRUE(outStream.entries[11].isReceived);
+    ASSERT_FALSE(outStream.entries[12].isReceived);
+
+    size_t octetsOnWire = 0;
+    ASSERT_EQ(transferUntilComplete(&logicOut, &logicIn, 10, &octetsOnWire), 0);
+    ASSERT_TRUE(blobStreamInIsComplete(&inStream));
+    ASSERT_EQ(tc_memcmp(inStream.blob, blob, TESTH_BLOB_SIZE), 0);
+    ASSERT_TRUE(octetsOnWire < TESTH_BLOB_SIZE - 12 * TESTH_CHUNK_SIZE + 8 * BLOB_STREAM_SET_CHUNK_HEADER_OCTET_SIZE);
+
+    const uint8_t* lastChunk = blob + 15 * TESTH_CHUNK_SIZE;
+    size_t lastChunkOctetCount = TESTH_BLOB_SIZE - 15 * TESTH_CHUNK_SIZE;
+    ASSERT_TRUE(blobStreamChunkCacheFind(&cache, blobStreamChunkHash(lastChunk, lastChunkOctetCount)) != 0);
+
+    blobStreamInDestroy(&inStream);
+    blobStreamOutDestroy(&outStream);
+}
+
+UTEST(BlobStreamLogic, resumeFromState)
+{
+    Mem memory;
+    createMemory(&memory);
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "test";
+
+#define TESTI_BLOB_SIZE (2000)
+#define TESTI_CHUNK_SIZE (128)
+    static uint8_t blob[TESTI_BLOB_SIZE];
+    for (size_t i = 0; i < TESTI_BLOB_SIZE; ++i) {
+        blob[i] = (uint8_t) (i * 13);
+    }
+
+    BlobStreamIn interruptedStream;
+    blobStreamInInit(&interruptedStream, &memory.linearAllocator.info, &memory.slabAllocator.info, TESTI_BLOB_SIZE,
+                     TESTI_CHUNK_SIZE, log);
+    for (BlobStreamChunkId chunkId = 0; chunkId < 10; ++chunkId) {
+        if (chunkId != 4) {
+            blobStreamInSetChunk(&interruptedStream, chunkId, blob + chunkId * TESTI_CHUNK_SIZE, TESTI_CHUNK_SIZE);
+        }
+    }
+    blobStreamInSetChunk(&interruptedStream, 15, blob + 15 * TESTI_CHUNK_SIZE, TESTI_BLOB_SIZE - 15 * TESTI_CHUNK_SIZE);
+
+    static uint8_t state[TESTI_BLOB_SIZE + 64];
+    FldOutStream stateOut;
+    fldOutStreamInit(&stateOut, state, sizeof(state));
+    ASSERT_EQ(blobStreamInWriteState(&interruptedStream, &stateOut), 0);
+    ASSERT_EQ(stateOut.pos, blobStreamInStateOctetCount(&interruptedStream));
+    blobStreamInDestroy(&interruptedStream);
+
+    BlobStreamIn inStream;
+    blobStreamInInit(&inStream, &memory.linearAllocator.info, &memory.slabAllocator.info, TESTI_BLOB_SIZE,
+                     TESTI_CHUNK_SIZE, log);
+    FldInStream stateIn;
+    fldInStreamInit(&stateIn, state, stateOut.pos);
+    ASSERT_EQ(blobStreamInReadState(&inStream, &stateIn), 0);
+    ASSERT_EQ(inStream.receivedChunkCount, 10u);
+
+    BlobStreamLogicIn logicIn;
+    blobStreamLogicInInit(&logicIn, &inStream, 2);
+
+    BlobStreamOut outStream;
+    blobStreamOutInit(&outStream, &memory.linearAllocator.info, &memory.slabAllocator.info, blob, TESTI_BLOB_SIZE,
+                      TESTI_CHUNK_SIZE, log);
+    BlobStreamLogicOut logicOut;
+    blobStreamLogicOutInit(&logicOut, &outStream, 2);
+
+    static uint8_t datagram[64];
+    FldOutStream resumeOut;
+    fldOutStreamInit(&resumeOut, datagram, sizeof(datagram));
+    size_t fromChunkId = 0;
+    ASSERT_EQ(blobStreamLogicInSendResume(&logicIn, &resumeOut, &fromChunkId), 3);
+    ASSERT_EQ(fromChunkId, 16u);
+    FldInStream resumeIn;
+    fldInStreamInit(&resumeIn, datagram, resumeOut.pos);
+    ASSERT_EQ(blobStreamLogicOutReceive(&logicOut, &resumeIn), 0);
+    ASSERT_TRUE(outStream.entries[3].isReceived);
+    ASSERT_FALSE(outStream.entries[4].isReceived);
+
+    // Overlapping ranges are rejected, so a resume can not cost more than one pass over the chunks
+    fldOutStreamInit(&resumeOut, datagram, sizeof(datagram));
+    fldOutStreamWriteUInt8(&resumeOut, BLOB_STREAM_LOGIC_CMD_RESUME_TRANSFER);
+    fldOutStreamWriteUInt16(&resumeOut, 2);
+    fldOutStreamWriteUInt16(&resumeOut, 2);
+    fldOutStreamWriteUInt32(&resumeOut, 0);
+    fldOutStreamWriteUInt32(&resumeOut, 4);
+    fldOutStreamWriteUInt32(&resumeOut, 2);
+    fldOutStreamWriteUInt32(&resumeOut, 4);
+    fldInStreamInit(&resumeIn, datagram, resumeOut.pos);
+    ASSERT_EQ(blobStreamLogicOutReceive(&logicOut, &resumeIn), -4);
+    ASSERT_FALSE(outStream.entries[4].isReceived);
+
+    size_t octetsOnWire = 0;
+    ASSERT_EQ(transferUntilComplete(&logicOut, &logicIn, 10, &octetsOnWire), 0);
+    ASSERT_TRUE(blobStreamInIsComplete(&inStream));
+    ASSERT_EQ(tc_memcmp(inStream.blob, blob, TESTI_BLOB_SIZE), 0);
+    ASSERT_EQ(octetsOnWire, 6 * (TESTI_CHUNK_SIZE + BLOB_STREAM_SET_CHUNK_HEADER_OCTET_SIZE));
+
+    blobStreamInDestroy(&inStream);
+    blobStreamOutDestroy(&outStream);
+}
+
+UTEST(BlobStreamLogic, expiredChunksAreNotResent)
+{
+    Mem memory;
+    createMemory(&memory);
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "test";
+
+#define TESTJ_BLOB_SIZE (450)
+#define TESTJ_CHUNK_SIZE (100)
+    static uint8_t blob[TESTJ_BLOB_SIZE];
+    for (size_t i = 0; i < TESTJ_BLOB_SIZE; ++i) {
+        blob[i] = (uint8_t) (i * 5 + 1);
+    }
+
+    BlobStreamOut outStream;
+    blobStreamOutInit(&outStream, &memory.linearAllocator.info, &memory.slabAllocator.info, blob, TESTJ_BLOB_SIZE,
+                      TESTJ_CHUNK_SIZE, log);
+    BlobStreamLogicOut logicOut;
+    blobStreamLogicOutInit(&logicOut, &outStream, 3);
+    ASSERT_EQ(blobStreamOutSetDeadline(&outStream, 0, outStream.chunkCount, 500), 0);
+    ASSERT_EQ(blobStreamOutSetDeadline(&outStream, 2, 2, 100), 0);
+
+    BlobStreamIn inStream;
+    blobStreamInInit(&inStream, &memory.linearAllocator.info, &memory.slabAllocator.info, TESTJ_BLOB_SIZE,
+                     TESTJ_CHUNK_SIZE, log);
+    BlobStreamLogicIn logicIn;
+    blobStreamLogicInInit(&logicIn, &inStream, 3);
+
+    // Chunks 2 and 3 are lost
+    const BlobStreamOutEntry* entries[8];
+    ASSERT_EQ(blobStreamLogicOutPrepareSend(&logicOut, 0, entries, 8), 5);
+    static uint8_t datagram[256];
+    for (size_t i = 0; i < 5; ++i) {
+        if (i == 2 || i == 3) {
+            continue;
+        }
+        FldOutStream outDatagram;
+        fldOutStreamInit(&outDatagram, datagram, sizeof(datagram));
+        blobStreamLogicOutSendEntry(&outDatagram, entries[i], logicOut.transferId);
+        ASSERT_EQ(receiveAll(&logicIn, datagram, outDatagram.pos), 0);
+    }
+
+    // Past the deadline of the lost chunks, so they are not resent
+    ASSERT_EQ(blobStreamLogicOutPrepareSend(&logicOut, 200, entries, 8), 3);
+    for (size_t i = 0; i < 3; ++i) {
+        ASSERT_TRUE(entries[i]->chunkId != 2 && entries[i]->chunkId != 3);
+    }
+    ASSERT_EQ(outStream.expiredChunkCount, 2u);
+    size_t firstChunkId;
+    size_t chunkCount;
+    ASSERT_TRUE(blobStreamOutNextExpiredRange(&outStream, 0, &firstChunkId, &chunkCount));
+    ASSERT_EQ(firstChunkId, 2u);
+    ASSERT_EQ(chunkCount, 2u);
+    ASSERT_FALSE(blobStreamOutNextExpiredRange(&outStream, 4, &firstChunkId, &chunkCount));
+
+    FldOutStream expiredOut;
+    fldOutStreamInit(&expiredOut, datagram, sizeof(datagram));
+    size_t fromChunkId = 0;
+    ASSERT_EQ(blobStreamLogicOutSendExpired(&logicOut, &expiredOut, &fromChunkId), 1);
+    ASSERT_EQ(receiveAll(&logicIn, datagram, expiredOut.pos), 0);
+    ASSERT_TRUE(blobStreamInIsComplete(&inStream));
+    ASSERT_TRUE(blobStreamInIsChunkExpired(&inStream, 3));
+    ASSERT_FALSE(blobStreamInIsChunkExpired(&inStream, 4));
+    ASSERT_EQ(inStream.blob[2 * TESTJ_CHUNK_SIZE], 0);
+    ASSERT_EQ(tc_memcmp(inStream.blob + 4 * TESTJ_CHUNK_SIZE, blob + 4 * TESTJ_CHUNK_SIZE, 50), 0);
+
+    FldOutStream ackOut;
+    fldOutStreamInit(&ackOut, datagram, sizeof(datagram));
+    ASSERT_EQ(blobStreamLogicInSend(&logicIn, &ackOut), 0);
+    FldInStream ackIn;
+    fldInStreamInit(&ackIn, datagram, ackOut.pos);
+    ASSERT_EQ(blobStreamLogicOutReceive(&logicOut, &ackIn), 0);
+    ASSERT_TRUE(blobStreamOutIsComplete(&outStream));
+    ASSERT_EQ(blobStreamOutInFlightCount(&outStream), 0u);
+    fldOutStreamInit(&expiredOut, datagram, sizeof(datagram));
+    fromChunkId = 0;
+    ASSERT_EQ(blobStreamLogicOutSendExpired(&logicOut, &expiredOut, &fromChunkId), 0);
+
+    blobStreamInDestroy(&inStream);
+    blobStreamOutDestroy(&outStream);
+}
+
+static size_t roundsUntilSent(BlobStreamOut* blobStream, BlobStreamChunkId firstChunkId, size_t chunkCount)
+{
+    const BlobStreamOutEntry* entries[8];
+    size_t sentCount = 0;
+    for (size_t round = 1; round < 100; ++round) {
+        int entryCount = blobStreamOutGetChunksToSend(blobStream, 0, entries, 8);
+        for (int i = 0; i < entryCount; ++i) {
+            if (entries[i]->chunkId >= firstChunkId && entries[i]->chunkId < firstChunkId + chunkCount) {
+                sentCount++;
+            }
+        }
+        if (sentCount == chunkCount) {
+            return round;
+        }
+    }
+    return 0;
+}
+
+UTEST(BlobStreamOut, orderingPolicies)
+{
+    Mem memory;
+    createMemory(&memory);
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "test";
+
+#define TESTU_CHUNK_SIZE (10)
+#define TESTU_BLOB_SIZE (200)
+    static uint8_t blob[TESTU_BLOB_SIZE];
+
+    BlobStreamOut sequential;
+    blobStreamOutInit(&sequential, &memory.linearAllocator.info, &memory.slabAllocator.info, blob, TESTU_BLOB_SIZE,
+                      TESTU_CHUNK_SIZE, log);
+    ASSERT_EQ(roundsUntilSent(&sequential, 16, 4), 4u);
+
+    // The index at the end of the blob is needed first
+    BlobStreamOut prioritized;
+    blobStreamOutInit(&prioritized, &memory.linearAllocator.info, &memory.slabAllocator.info, blob, TESTU_BLOB_SIZE,
+                      TESTU_CHUNK_SIZE, log);
+    ASSERT_EQ(blobStreamOutAddPriorityRange(&prioritized, 16, 4), 0);
+    const BlobStreamOutEntry* entries[8];
+    ASSERT_EQ(blobStreamOutGetChunksToSend(&prioritized, 0, entries, 8), 5);
+    ASSERT_EQ(entries[0]->chunkId, 16u);
+    ASSERT_EQ(entries[3]->chunkId, 19u);
+    ASSERT_EQ(entries[4]->chunkId, 0u);
+
+    ASSERT_EQ(blobStreamOutRequestChunks(&prioritized, 10, 1), 0);
+    ASSERT_EQ(blobStreamOutGetChunksToSend(&prioritized, 10, entries, 8), 5);
+    ASSERT_EQ(entries[0]->chunkId, 10u);
+    ASSERT_EQ(entries[1]->chunkId, 1u);
+
+    // Resends are in the order the chunks were sent, acknowledged chunks are skipped
+    blobStreamOutMarkChunkReceived(&prioritized, 17);
+    ASSERT_EQ(blobStreamOutGetChunksToSend(&prioritized, 100, entries, 8), 5);
+    ASSERT_EQ(entries[0]->chunkId, 16u);
+    ASSERT_EQ(entries[1]->chunkId, 18u);
+    ASSERT_EQ(entries[3]->chunkId, 0u);
+    ASSERT_EQ(entries[4]->chunkId, 10u);
+
+    BlobStreamOut interleaved;
+    blobStreamOutInit(&interleaved, &memory.linearAllocator.info, &memory.slabAllocator.info, blob, TESTU_BLOB_SIZE,
+                      TESTU_CHUNK_SIZE, log);
+    blobStreamOutSetOrder(&interleaved, BlobStreamOutOrderInterleaved);
+    bool isSent[TESTU_BLOB_SIZE / TESTU_CHUNK_SIZE] = {0};
+    BlobStreamChunkId previousChunkId = 0;
+    for (size_t round = 0; round < 4; ++round) {
+        ASSERT_EQ(blobStreamOutGetChunksToSend(&interleaved, 0, entries, 8), 5);
+        for (size_t i = 0; i < 5; ++i) {
+            BlobStreamChunkId chunkId = entries[i]->chunkId;
+            ASSERT_FALSE(isSent[chunkId]);
+            isSent[chunkId] = true;
+            if (round + i > 0) {
+                ASSERT_TRUE(chunkId != previousChunkId + 1 && chunkId + 1 != previousChunkId);
+            }
+            previousChunkId = chunkId;
+        }
+    }
+    ASSERT_TRUE(blobStreamOutIsAllSent(&interleaved));
+
+    blobStreamOutDestroy(&interleaved);
+    blobStreamOutDestroy(&prioritized);
+    blobStreamOutDestroy(&sequential);
+}
+
+UTEST(BlobStreamLogic, pullModeRequestsMissingChunks)
+{
+    Mem memory;
+    createMemory(&memory);
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "test";
+
+#define TESTV_CHUNK_SIZE (10)
+#define TESTV_BLOB_SIZE (200)
+    static uint8_t blob[TESTV_BLOB_SIZE];
+    for (size_t i = 0; i < TESTV_BLOB_SIZE; ++i) {
+        blob[i] = (uint8_t) (i * 3 + 7);
+    }
+
+    BlobStreamOut outStream;
+    blobStreamOutInit(&outStream, &memory.linearAllocator.info, &memory.slabAllocator.info, blob, TESTV_BLOB_SIZE,
+                      TESTV_CHUNK_SIZE, log);
+    BlobStreamLogicOut logicOut;
+    blobStreamLogicOutInit(&logicOut, &outStream, 4);
+
+    BlobStreamIn inStream;
+    blobStreamInInit(&inStream, &memory.linearAllocator.info, &memory.slabAllocator.info, TESTV_BLOB_SIZE,
+                     TESTV_CHUNK_SIZE, log);
+    BlobStreamLogicIn logicIn;
+    blobStreamLogicInInit(&logicIn, &inStream, 4);
+    blobStreamLogicInSetPullMode(&logicIn, 4, 10, 100);
+
+    static uint8_t datagram[256];
+    size_t sentCount = 0;
+    bool isChunkLost = false;
+    MonotonicTimeMs now = 0;
+    for (; now < 1000 && !blobStreamInIsComplete(&inStream); now += 10) {
+        FldOutStream requestOut;
+        fldOutStreamInit(&requestOut, datagram, sizeof(datagram));
+        int rangeCount = blobStreamLogicInSendRequest(&logicIn, now, &requestOut);
+        ASSERT_TRUE(rangeCount >= 0);
+        if (rangeCount > 0) {
+            FldInStream requestIn;
+            fldInStreamInit(&requestIn, datagram, requestOut.pos);
+            ASSERT_EQ(blobStreamLogicOutReceive(&logicOut, &requestIn), 0);
+        }
+
+        const BlobStreamOutEntry* entries[8];
+        int entryCount = blobStreamLogicOutPrepareSend(&logicOut, now, entries, 8);
+        ASSERT_TRUE(entryCount <= 4);
+        for (int i = 0; i < entryCount; ++i) {
+            sentCount++;
+            if (entries[i]->chunkId == 5 && !isChunkLost) {
+                isChunkLost = true;
+                continue;
+            }
+            FldOutStream outDatagram;
+            fldOutStreamInit(&outDatagram, datagram, sizeof(datagram));
+            blobStreamLogicOutSendEntry(&outDatagram, entries[i], logicOut.transferId);
+            ASSERT_EQ(receiveAll(&logicIn, datagram, outDatagram.pos), 0);
+        }
+    }
+
+    ASSERT_TRUE(blobStreamInIsComplete(&inStream));
+    ASSERT_EQ(tc_memcmp(inStream.blob, blob, TESTV_BLOB_SIZE), 0);
+    // Only the lost chunk is sent twice, and only after the retry interval
+    ASSERT_EQ(sentCount, 21u);
+    ASSERT_TRUE(now > 100);
+    ASSERT_TRUE(outStream.isPullMode);
+
+    const BlobStreamOutEntry* entries[8];
+    ASSERT_EQ(blobStreamLogicOutPrepareSend(&logicOut, now + 1000, entries, 8), 0);
+
+    blobStreamInDestroy(&inStream);
+    blobStreamOutDestroy(&outStream);
+}
+
+UTEST(BlobStreamMultiSource, simulatedSources)
+{
+    Mem memory;
+    createMemory(&memory);
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "test";
+
+#define TESTM_SOURCE_COUNT (3)
+#define TESTN_CHUNK_SIZE (10)
+#define TESTN_BLOB_SIZE (600)
+    static uint8_t blob[TESTN_BLOB_SIZE];
+    for (size_t i = 0; i < TESTN_BLOB_SIZE; ++i) {
+        blob[i] = (uint8_t) (i * 11 + 3);
+    }
+
+    static uint8_t storageBuffer[TESTM_SOURCE_COUNT][8192 + BLOB_STREAM_STORAGE_ALIGNMENT];
+    static BlobStreamOut outStreams[TESTM_SOURCE_COUNT];
+    static BlobStreamLogicOut logicOuts[TESTM_SOURCE_COUNT];
+    static SimulatedLink links[TESTM_SOURCE_COUNT];
+    const MonotonicTimeMs latencies[TESTM_SOURCE_COUNT] = {10, 40, 10};
+    const uint32_t lossPercents[TESTM_SOURCE_COUNT] = {0, 25, 50};
+
+    BlobStreamIn inStream;
+    blobStreamInInit(&inStream, &memory.linearAllocator.info, &memory.slabAllocator.info, TESTN_BLOB_SIZE,
+                     TESTN_CHUNK_SIZE, log);
+    BlobStreamMultiSource multiSource;
+    blobStreamMultiSourceInit(&multiSource, &memory.linearAllocator.info, &inStream, 16, 100, log);
+
+    BlobStreamStartTransfer otherBlob = {
+        .transferId = 7, .octetCount = TESTN_BLOB_SIZE + 1, .fixedChunkSize = TESTN_CHUNK_SIZE};
+    ASSERT_EQ(blobStreamMultiSourceAddSource(&multiSource, &otherBlob), -2);
+
+    for (size_t i = 0; i < TESTM_SOURCE_COUNT; ++i) {
+        uint8_t* storage = storageBuffer[i] + (BLOB_STREAM_STORAGE_ALIGNMENT -
+                                               ((uintptr_t) storageBuffer[i] & 63)) % 64;
+        size_t storageSize = blobStreamOutStorageSize(TESTN_BLOB_SIZE, TESTN_CHUNK_SIZE);
+        ASSERT_TRUE(storageSize <= 8192);
+        blobStreamOutInitWithStorage(&outStreams[i], storage, storageSize, blob, TESTN_BLOB_SIZE, TESTN_CHUNK_SIZE,
+                                     log);
+        blobStreamLogicOutInit(&logicOuts[i], &outStreams[i], (BlobStreamTransferId) (20 + i));
+        BlobStreamStartTransfer startTransfer = {
+            .transferId = logicOuts[i].transferId, .octetCount = TESTN_BLOB_SIZE, .fixedChunkSize = TESTN_CHUNK_SIZE};
+        ASSERT_EQ(blobStreamMultiSourceAddSource(&multiSource, &startTransfer), (int) i);
+        links[i].head = 0;
+        links[i].count = 0;
+        links[i].latency = latencies[i];
+        links[i].lossPercent = lossPercents[i];
+        links[i].randomState = (uint32_t) (i + 1);
+    }
+
+    static uint8_t datagram[256];
+    MonotonicTimeMs now = 0;
+    for (; now < 20000 && !blobStreamMultiSourceIsComplete(&multiSource); now += 10) {
+        for (size_t i = 0; i < TESTM_SOURCE_COUNT; ++i) {
+            SimulatedLink* link = &links[i];
+            FldOutStream requestOut;
+            fldOutStreamInit(&requestOut, datagram, sizeof(datagram));
+            int requestedCount = blobStreamMultiSourceSendRequest(&multiSource, i, now, &requestOut);
+            ASSERT_TRUE(requestedCount >= 0);
+            if (requestedCount > 0) {
+                FldInStream requestIn;
+                fldInStreamInit(&requestIn, datagram, requestOut.pos);
+                ASSERT_EQ(blobStreamLogicOutReceive(&logicOuts[i], &requestIn), 0);
+            }
+
+            const BlobStreamOutEntry* entries[8];
+            int entryCount = blobStreamLogicOutPrepareSend(&logicOuts[i], now, entries, 8);
+            for (int entryIndex = 0; entryIndex < entryCount; ++entryIndex) {
+                if (simulatedLinkIsLost(link) || link->count == 64) {
+                    continue;
+                }
+                size_t tail = (link->head + link->count) % 64;
+                FldOutStream outDatagram;
+                fldOutStreamInit(&outDatagram, link->datagrams[tail], sizeof(link->datagrams[tail]));
+                ASSERT_EQ(blobStreamLogicOutSendEntry(&outDatagram, entries[entryIndex], logicOuts[i].transferId),
+                          0);
+                link->octetCounts[tail] = outDatagram.pos;
+                link->deliverAt[tail] = now + link->latency;
+                link->count++;
+            }
+
+            while (link->count > 0 && link->deliverAt[link->head] <= now) {
+                FldInStream inDatagram;
+                fldInStreamInit(&inDatagram, link->datagrams[link->head], link->octetCounts[link->head]);
+                ASSERT_EQ(blobStreamMultiSourceReceive(&multiSource, i, now, &inDatagram), 0);
+                link->head = (link->head + 1) % 64;
+                link->count--;
+            }
+        }
+    }
+
+    ASSERT_TRUE(blobStreamMultiSourceIsComplete(&multiSource));
+    ASSERT_EQ(tc_memcmp(inStream.blob, blob, TESTN_BLOB_SIZE), 0);
+    const BlobStreamSource* sources = multiSource.sources;
+    ASSERT_TRUE(sources[0].deliveredChunkCount > sources[1].deliveredChunkCount);
+    ASSERT_TRUE(sources[0].deliveredChunkCount > sources[2].deliveredChunkCount);
+    ASSERT_TRUE(sources[1].smoothedRtt > sources[0].smoothedRtt);
+    ASSERT_TRUE(sources[2].timedOutChunkCount > 0);
+    ASSERT_TRUE(sources[0].window > sources[2].window);
+
+    // A source with different content is disabled
+    static uint8_t corrupted[TESTN_CHUNK_SIZE];
+    BlobStreamOutEntry corruptedEntry;
+    corruptedEntry.octets = corrupted;
+    corruptedEntry.octetCount = TESTN_CHUNK_SIZE;
+    corruptedEntry.chunkId = 4;
+    corruptedEntry.encoding = BLOB_STREAM_CHUNK_ENCODING_RAW;
+    FldOutStream corruptedOut;
+    fldOutStreamInit(&corruptedOut, datagram, sizeof(datagram));
+    blobStreamLogicOutSendEntry(&corruptedOut, &corruptedEntry, logicOuts[1].transferId);
+    FldInStream corruptedIn;
+    fldInStreamInit(&corruptedIn, datagram, corruptedOut.pos);
+    ASSERT_EQ(blobStreamMultiSourceReceive(&multiSource, 1, now, &corruptedIn), -4);
+    ASSERT_FALSE(sources[1].isEnabled);
+
+    blobStreamInDestroy(&inStream);
+}
+
+#define TESTO_CHUNK_SIZE (100)
+#define TESTO_BLOB_SIZE (2000)
+#define TESTO_MAX_RECEIVER_COUNT (1000)
+
+static size_t fanOutOctetsOnWire(size_t receiverCount, size_t* evictedCount)
+{
+    Mem memory;
+    createMemory(&memory);
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "test";
+
+    static uint8_t blob[TESTO_BLOB_SIZE];
+    for (size_t i = 0; i < TESTO_BLOB_SIZE; ++i) {
+        blob[i] = (uint8_t) (i * 7 + 1);
+    }
+
+    static uint8_t outStorageBuffer[8192 + BLOB_STREAM_STORAGE_ALIGNMENT];
+    uint8_t* outStorage = outStorageBuffer + (BLOB_STREAM_STORAGE_ALIGNMENT -
+                                              ((uintptr_t) outStorageBuffer & 63)) % 64;
+    size_t outStorageSize = blobStreamOutStorageSize(TESTO_BLOB_SIZE, TESTO_CHUNK_SIZE);
+    BlobStreamOut group;
+    blobStreamOutInitWithStorage(&group, outStorage, outStorageSize, blob, TESTO_BLOB_SIZE, TESTO_CHUNK_SIZE, log);
+    BlobStreamFanOut fanOut;
+    blobStreamFanOutInit(&fanOut, &memory.linearAllocator.info, &group, 9, receiverCount, log);
+
+    size_t inStorageSize = blobStreamInStorageSize(TESTO_BLOB_SIZE, TESTO_CHUNK_SIZE);
+    size_t inStorageStride = (inStorageSize + 63) & ~(size_t) 63;
+    uint8_t* allocated = malloc(inStorageStride * receiverCount + BLOB_STREAM_STORAGE_ALIGNMENT);
+    uint8_t* inStorage = allocated + (BLOB_STREAM_STORAGE_ALIGNMENT - ((uintptr_t) allocated & 63)) % 64;
+    static BlobStreamIn inStreams[TESTO_MAX_RECEIVER_COUNT];
+    static BlobStreamLogicIn logicIns[TESTO_MAX_RECEIVER_COUNT];
+    static uint32_t randomStates[TESTO_MAX_RECEIVER_COUNT];
+    for (size_t i = 0; i < receiverCount; ++i) {
+        blobStreamInInitWithStorage(&inStreams[i], inStorage + i * inStorageStride, inStorageSize, TESTO_BLOB_SIZE,
+                                    TESTO_CHUNK_SIZE, log);
+        blobStreamLogicInInit(&logicIns[i], &inStreams[i], 9);
+        randomStates[i] = (uint32_t) (i * 7919 + 1);
+    }
+
+    // Every receiver loses one percent of the group datagrams, and receiver 3 loses most of them
+    size_t octetsOnWire = 0;
+    static uint8_t datagram[256];
+    MonotonicTimeMs now = 0;
+    for (size_t round = 0; round < 100 && !blobStreamFanOutIsComplete(&fanOut); ++round, now += 60) {
+        const BlobStreamOutEntry* entries[8];
+        int entryCount = blobStreamFanOutPrepareSend(&fanOut, now, entries, 8);
+        for (int entryIndex = 0; entryIndex < entryCount; ++entryIndex) {
+            FldOutStream outDatagram;
+            fldOutStreamInit(&outDatagram, datagram, sizeof(datagram));
+            blobStreamLogicOutSendEntry(&outDatagram, entries[entryIndex], 9);
+            octetsOnWire += outDatagram.pos;
+            for (size_t i = 0; i < receiverCount; ++i) {
+                randomStates[i] = randomStates[i] * 1103515245u + 12345u;
+                uint32_t lossPercent = i == 3 ? 70 : 1;
+                if ((randomStates[i] >> 16) % 100 >= lossPercent) {
+                    receiveAll(&logicIns[i], datagram, outDatagram.pos);
+                }
+            }
+        }
+
+        for (size_t i = 0; i < receiverCount; ++i) {
+            FldOutStream ackOut;
+            fldOutStreamInit(&ackOut, datagram, sizeof(datagram));
+            blobStreamLogicInSend(&logicIns[i], &ackOut);
+            FldInStream ackIn;
+            fldInStreamInit(&ackIn, datagram, ackOut.pos);
+            blobStreamFanOutReceive(&fanOut, i, &ackIn);
+        }
+    }
+
+    size_t completeCount = 0;
+    for (size_t i = 0; i < receiverCount; ++i) {
+        if (fanOut.receivers[i].isEvicted) {
+            static uint8_t unicastStorageBuffer[8192 + BLOB_STREAM_STORAGE_ALIGNMENT];
+            uint8_t* unicastStorage = unicastStorageBuffer + (BLOB_STREAM_STORAGE_ALIGNMENT -
+                                                              ((uintptr_t) unicastStorageBuffer & 63)) % 64;
+            BlobStreamOut unicast;
+            blobStreamOutInitWithStorage(&unicast, unicastStorage, outStorageSize, blob, TESTO_BLOB_SIZE,
+                                         TESTO_CHUNK_SIZE, log);
+            if (blobStreamFanOutPrepareUnicast(&fanOut, i, &unicast) <= 0) {
+                continue;
+            }
+            BlobStreamLogicOut unicastLogic;
+            blobStreamLogicOutInit(&unicastLogic, &unicast, 9);
+            transferUntilComplete(&unicastLogic, &logicIns[i], 10, &octetsOnWire);
+        }
+        if (blobStreamInIsComplete(&inStreams[i]) && tc_memcmp(inStreams[i].blob, blob, TESTO_BLOB_SIZE) == 0) {
+            completeCount++;
+        }
+    }
+
+    *evictedCount = fanOut.evictedCount;
+    free(allocated);
+
+    return completeCount == receiverCount ? octetsOnWire : 0;
+}
+
+UTEST(BlobStreamFanOut, bytesOnWirePerReceiver)
+{
+    size_t smallEvictedCount;
+    size_t smallGroupOctets = fanOutOctetsOnWire(TESTO_MAX_RECEIVER_COUNT / 10, &smallEvictedCount);
+    size_t largeEvictedCount;
+    size_t largeGroupOctets = fanOutOctetsOnWire(TESTO_MAX_RECEIVER_COUNT, &largeEvictedCount);
+
+    ASSERT_TRUE(smallGroupOctets > TESTO_BLOB_SIZE);
+    ASSERT_TRUE(largeGroupOctets > TESTO_BLOB_SIZE);
+    ASSERT_TRUE(smallEvictedCount >= 1);
+    ASSERT_TRUE(largeEvictedCount >= 1 && largeEvictedCount <= TESTO_MAX_RECEIVER_COUNT / 100);
+
+    // Ten times the receivers hardly changes what is sent, and each receiver costs far less than a unicast blob
+    ASSERT_TRUE(largeGroupOctets < 4 * TESTO_BLOB_SIZE);
+    ASSERT_TRUE(largeGroupOctets * 10 < smallGroupOctets * 12);
+    ASSERT_TRUE(largeGroupOctets / TESTO_MAX_RECEIVER_COUNT < TESTO_BLOB_SIZE / 100);
+}
+
+UTEST(BlobStreamMux, routesManyTransfers)
+{
+    Mem memory;
+    createMemory(&memory);
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "test";
+
+#define TESTJ_TRANSFER_COUNT (10000)
+    size_t muxMemorySize = TESTJ_TRANSFER_COUNT * (sizeof(BlobStreamMuxEntry) + 16) + 64 * 1024 * 4;
+    uint8_t* muxMemory = malloc(muxMemorySize);
+    ImprintLinearAllocator muxAllocator;
+    imprintLinearAllocatorInit(&muxAllocator, muxMemory, muxMemorySize, "mux");
+
+    BlobStreamMux mux;
+    blobStreamMuxInit(&mux, &muxAllocator.info, TESTJ_TRANSFER_COUNT, log);
+
+    static uint8_t blob[300];
+    BlobStreamOut sharedStream;
+    blobStreamOutInit(&sharedStream, &memory.linearAllocator.info, &memory.slabAllocator.info, blob, sizeof(blob), 100,
+                      log);
+    BlobStreamOut outStream;
+    blobStreamOutInit(&outStream, &memory.linearAllocator.info, &memory.slabAllocator.info, blob, sizeof(blob), 100,
+                      log);
+
+    BlobStreamTransferId targetId = 0;
+    for (size_t i = 0; i < TESTJ_TRANSFER_COUNT - 1; ++i) {
+        BlobStreamLogicOut* logicOut = blobStreamMuxAddOut(&mux, i == 4711 ? &outStream : &sharedStream);
+        ASSERT_TRUE(logicOut != 0);
+        if (i == 4711) {
+            targetId = logicOut->transferId;
+        }
+    }
+    ASSERT_TRUE(blobStreamMuxFindOut(&mux, targetId)->blobStream == &outStream);
+
+    BlobStreamIn inStream;
+    blobStreamInInit(&inStream, &memory.linearAllocator.info, &memory.slabAllocator.info, sizeof(blob), 100, log);
+    ASSERT_TRUE(blobStreamMuxAddIn(&mux, &inStream, targetId) != 0);
+    ASSERT_TRUE(blobStreamMuxAddOut(&mux, &sharedStream) == 0);
+
+    static uint8_t datagram[64];
+    FldOutStream ackOut;
+    fldOutStreamInit(&ackOut, datagram, sizeof(datagram));
+    fldOutStreamWriteUInt8(&ackOut, BLOB_STREAM_LOGIC_CMD_ACK_CHUNK);
+    fldOutStreamWriteUInt16(&ackOut, targetId);
+    fldOutStreamWriteUInt32(&ackOut, 3);
+    fldOutStreamWriteUInt64(&ackOut, 0);
+    fldOutStreamWriteUInt32(&ackOut, 3);
+    FldInStream ackIn;
+    fldInStreamInit(&ackIn, datagram, ackOut.pos);
+    ASSERT_EQ(blobStreamMuxReceive(&mux, &ackIn), 0);
+    ASSERT_TRUE(blobStreamOutIsComplete(&outStream));
+    ASSERT_FALSE(blobStreamOutIsComplete(&sharedStream));
+
+    FldOutStream chunkOut;
+    fldOutStreamInit(&chunkOut, datagram, sizeof(datagram));
+    fldOutStreamWriteUInt8(&chunkOut, BLOB_STREAM_LOGIC_CMD_SET_CHUNK);
+    fldOutStreamWriteUInt16(&chunkOut, targetId);
+    fldOutStreamWriteUInt32(&chunkOut, 0);
+    fldOutStreamWriteUInt16(&chunkOut, 0);
+    FldInStream chunkIn;
+    fldInStreamInit(&chunkIn, datagram, chunkOut.pos);
+    ASSERT_TRUE(blobStreamMuxReceive(&mux, &chunkIn) < 0);
+
+    ASSERT_EQ(blobStreamMuxRemoveOut(&mux, targetId), 0);
+    ASSERT_TRUE(blobStreamMuxFindOut(&mux, targetId) == 0);
+    ASSERT_TRUE(blobStreamMuxFindIn(&mux, targetId) != 0);
+    BlobStreamLogicOut* recycled = blobStreamMuxAddOut(&mux, &sharedStream);
+    ASSERT_TRUE(recycled != 0);
+    ASSERT_NE(recycled->transferId, targetId);
+
+    for (size_t i = 0; i < mux.activeCount; ++i) {
+        const BlobStreamMuxEntry* entry = &mux.entries[mux.activeEntries[i]];
+        ASSERT_EQ(entry->activeIndex, i);
+    }
+
+    blobStreamInDestroy(&inStream);
+    blobStreamOutDestroy(&outStream);
+    blobStreamOutDestroy(&sharedStream);
+    free(muxMemory);
+}
+
+static void receiveMuxChunk(BlobStreamMux* mux, BlobStreamTransferId transferId, uint32_t chunkId)
+{
+    static uint8_t datagram[1 + 2 + 4 + 2 + 100];
+    FldOutStream chunkOut;
+    fldOutStreamInit(&chunkOut, datagram, sizeof(datagram));
+    fldOutStreamWriteUInt8(&chunkOut, BLOB_STREAM_LOGIC_CMD_SET_CHUNK);
+    fldOutStreamWriteUInt16(&chunkOut, transferId);
+    fldOutStreamWriteUInt32(&chunkOut, chunkId);
+    fldOutStreamWriteUInt16(&chunkOut, 100);
+    FldInStream chunkIn;
+    fldInStreamInit(&chunkIn, datagram, sizeof(datagram));
+    blobStreamMuxReceive(mux, &chunkIn);
+}
+
+UTEST(BlobStreamMux, acksEveryTransferInTurn)
+{
+    Mem memory;
+    createMemory(&memory);
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "test";
+
+#define TESTX_TRANSFER_COUNT (8)
+#define TESTX_ACK_CHUNK_OCTET_SIZE (1 + 2 + 4 + 8 + 4)
+    BlobStreamMux mux;
+    blobStreamMuxInit(&mux, &memory.linearAllocator.info, TESTX_TRANSFER_COUNT, log);
+    BlobStreamIn inStreams[TESTX_TRANSFER_COUNT];
+    for (size_t i = 0; i < TESTX_TRANSFER_COUNT; ++i) {
+        blobStreamInInit(&inStreams[i], &memory.linearAllocator.info, &memory.slabAllocator.info, 1000, 100, log);
+        ASSERT_TRUE(blobStreamMuxAddIn(&mux, &inStreams[i], (BlobStreamTransferId) (i + 1)) != 0);
+        receiveMuxChunk(&mux, (BlobStreamTransferId) (i + 1), 1);
+    }
+    ASSERT_EQ(mux.pendingAckCount, TESTX_TRANSFER_COUNT);
+
+    // Only two acks fit, and the first two transfers always have a new ack due, but the others still get their turn
+    bool isAcked[TESTX_TRANSFER_COUNT + 1] = {false};
+    for (uint32_t round = 0; round < TESTX_TRANSFER_COUNT / 2; ++round) {
+        receiveMuxChunk(&mux, 1, 2 + round);
+        receiveMuxChunk(&mux, 2, 2 + round);
+        uint8_t datagram[2 * TESTX_ACK_CHUNK_OCTET_SIZE];
+        FldOutStream ackOut;
+        fldOutStreamInit(&ackOut, datagram, sizeof(datagram));
+        ASSERT_EQ(blobStreamMuxSendIn(&mux, 0, &ackOut), 2);
+        for (size_t offset = 0; offset < ackOut.pos; offset += TESTX_ACK_CHUNK_OCTET_SIZE) {
+            ASSERT_EQ(datagram[offset], BLOB_STREAM_LOGIC_CMD_ACK_CHUNK);
+            isAcked[datagram[offset + 2]] = true;
+        }
+    }
+    for (size_t i = 1; i <= TESTX_TRANSFER_COUNT; ++i) {
+        ASSERT_TRUE(isAcked[i]);
+    }
+
+    // Removed transfers leave the pending list
+    ASSERT_EQ(blobStreamMuxRemoveIn(&mux, 1), 0);
+    ASSERT_EQ(blobStreamMuxRemoveIn(&mux, 2), 0);
+    ASSERT_EQ(mux.pendingAckCount, 0);
+
+    for (size_t i = 0; i < TESTX_TRANSFER_COUNT; ++i) {
+        blobStreamInDestroy(&inStreams[i]);
+    }
+}
+
+UTEST(BlobStreamMux, startsInSingleFlight)
+{
+    Mem memory;
+    createMemory(&memory);
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "test";
+
+#define TESTR_BLOB_SIZE (1000)
+#define TESTR_CHUNK_SIZE (256)
+    BlobStreamInPool pool;
+    blobStreamInPoolInit(&pool, &memory.linearAllocator.info, &memory.slabAllocator.info, 1, 2048, TESTR_CHUNK_SIZE,
+                         log);
+    BlobStreamMux mux;
+    blobStreamMuxInit(&mux, &memory.linearAllocator.info, 4, log);
+    blobStreamMuxSetInPool(&mux, &pool, TESTR_CHUNK_SIZE);
+
+    static uint8_t blob[TESTR_BLOB_SIZE];
+    for (size_t i = 0; i < TESTR_BLOB_SIZE; ++i) {
+        blob[i] = (uint8_t) (i * 7);
+    }
+    BlobStreamOut outStream;
+    blobStreamOutInit(&outStream, &memory.linearAllocator.info, &memory.slabAllocator.info, blob, TESTR_BLOB_SIZE,
+                      TESTR_CHUNK_SIZE, log);
+    BlobStreamLogicOut logicOut;
+    blobStreamLogicOutInit(&logicOut, &outStream, 0x0077);
+
+    // The first datagram carries the start transfer and the whole blob
+    static uint8_t datagram[1200];
+    const BlobStreamOutEntry* entries[8];
+    FldOutStream flightOut;
+    fldOutStreamInit(&flightOut, datagram, sizeof(datagram));
+    ASSERT_EQ(blobStreamLogicOutSendFlight(&logicOut, 0, &flightOut, entries, 8), 4);
+
+    FldInStream flightIn;
+    fldInStreamInit(&flightIn, datagram, flightOut.pos);
+    while (flightIn.pos < flightIn.size) {
+        ASSERT_EQ(blobStreamMuxReceive(&mux, &flightIn), 0);
+    }
+    BlobStreamLogicIn* logicIn = blobStreamMuxFindIn(&mux, 0x0077);
+    ASSERT_TRUE(logicIn != 0);
+    ASSERT_TRUE(blobStreamInIsComplete(logicIn->blobStream));
+    ASSERT_EQ(memcmp(logicIn->blobStream->blob, blob, TESTR_BLOB_SIZE), 0);
+
+    // The answer has both the ack start transfer and the ack that completes the sender
+    static uint8_t answer[64];
+    FldOutStream ackOut;
+    fldOutStreamInit(&ackOut, answer, sizeof(answer));
+    ASSERT_EQ(blobStreamMuxSendIn(&mux, 0, &ackOut), 2);
+    FldInStream ackIn;
+    fldInStreamInit(&ackIn, answer, ackOut.pos);
+    ASSERT_EQ(blobStreamLogicOutReceiveDatagram(&logicOut, &ackIn), 2);
+    ASSERT_TRUE(logicOut.isStartTransferAcked);
+    ASSERT_TRUE(blobStreamLogicOutIsComplete(&logicOut));
+
+    // A late duplicate start transfer is acked again, but does not create a second transfer
+    fldOutStreamInit(&flightOut, datagram, sizeof(datagram));
+    blobStreamLogicOutStartTransfer(&logicOut, &flightOut);
+    fldInStreamInit(&flightIn, datagram, flightOut.pos);
+    ASSERT_EQ(blobStreamMuxReceive(&mux, &flightIn), 0);
+    ASSERT_EQ(mux.activeCount, 1);
+    fldOutStreamInit(&ackOut, answer, sizeof(answer));
+    ASSERT_EQ(blobStreamMuxSendIn(&mux, 0, &ackOut), 1);
+
+    // A receiver that lowers the chunk size drops the chunks of the first flight, so the sender starts over
+    BlobStreamOutPool outPool;
+    blobStreamOutPoolInit(&outPool, &memory.linearAllocator.info, &memory.slabAllocator.info, 1, TESTR_BLOB_SIZE,
+                          TESTR_CHUNK_SIZE / 2, log);
+    BlobStreamOut* largeOutStream = blobStreamOutPoolAcquire(&outPool, blob, TESTR_BLOB_SIZE, TESTR_CHUNK_SIZE);
+    ASSERT_TRUE(largeOutStream != 0);
+    largeOutStream->maxChunksPerSend = 8;
+    BlobStreamLogicOut largeLogicOut;
+    blobStreamLogicOutInit(&largeLogicOut, largeOutStream, 0x0078);
+    fldOutStreamInit(&flightOut, datagram, sizeof(datagram));
+    ASSERT_EQ(blobStreamLogicOutSendFlight(&largeLogicOut, 0, &flightOut, entries, 8), 4);
+
+    BlobStreamStartTransfer lowered = {
+        .transferId = 0x0078, .octetCount = TESTR_BLOB_SIZE, .fixedChunkSize = TESTR_CHUNK_SIZE / 2};
+    fldOutStreamInit(&ackOut, answer, sizeof(answer));
+    ASSERT_EQ(blobStreamLogicInSendAckStartTransfer(&lowered, &ackOut), 0);
+    fldInStreamInit(&ackIn, answer, ackOut.pos);
+    ASSERT_EQ(blobStreamLogicOutReceive(&largeLogicOut, &ackIn), 0);
+    ASSERT_TRUE(largeLogicOut.isStartTransferAcked);
+    ASSERT_EQ(largeOutStream->chunkCount, 8);
+    ASSERT_EQ(largeOutStream->sentChunkEntryCount, 0);
+    fldOutStreamInit(&flightOut, datagram, sizeof(datagram));
+    ASSERT_EQ(blobStreamLogicOutSendFlight(&largeLogicOut, 1, &flightOut, entries, 8), 8);
+
+    // Once acked, the chunk size is fixed, even when there are entries for a lower one
+    ASSERT_EQ(blobStreamOutMinChunkSize(largeOutStream), 125);
+    fldInStreamInit(&ackIn, answer, ackOut.pos);
+    answer[4] = 126;
+    ASSERT_EQ(blobStreamLogicOutReceive(&largeLogicOut, &ackIn), -3);
+
+    blobStreamOutPoolRelease(&outPool, largeOutStream);
+    blobStreamOutPoolDestroy(&outPool);
+
+    ASSERT_EQ(pool.freeCount, 0);
+    ASSERT_EQ(blobStreamMuxRemoveIn(&mux, 0x0077), 0);
+    ASSERT_EQ(pool.freeCount, 1);
+
+    blobStreamOutDestroy(&outStream);
+    blobStreamInPoolDestroy(&pool);
+}
+
+UTEST(BlobStreamScheduler, priorityAndWeight)
+{
+    Mem memory;
+    createMemory(&memory);
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "test";
+
+#define TESTK_CHUNK_SIZE (100)
+#define TESTK_ENTRY_OCTET_SIZE (TESTK_CHUNK_SIZE + BLOB_STREAM_SET_CHUNK_ENCODED_HEADER_OCTET_SIZE)
+    static uint8_t blob[2000];
+
+    BlobStreamOut bulkA;
+    BlobStreamOut bulkB;
+    BlobStreamOut control;
+    blobStreamOutInit(&bulkA, &memory.linearAllocator.info, &memory.slabAllocator.info, blob, sizeof(blob),
+                      TESTK_CHUNK_SIZE, log);
+    blobStreamOutInit(&bulkB, &memory.linearAllocator.info, &memory.slabAllocator.info, blob, sizeof(blob),
+                      TESTK_CHUNK_SIZE, log);
+    blobStreamOutInit(&control, &memory.linearAllocator.info, &memory.slabAllocator.info, blob, 150,
+                      TESTK_CHUNK_SIZE, log);
+
+    BlobStreamLogicOut logicA;
+    BlobStreamLogicOut logicB;
+    BlobStreamLogicOut logicControl;
+    blobStreamLogicOutInit(&logicA, &bulkA, 1);
+    blobStreamLogicOutInit(&logicB, &bulkB, 2);
+    blobStreamLogicOutInit(&logicControl, &control, 3);
+
+    BlobStreamScheduler scheduler;
+    blobStreamSchedulerInit(&scheduler, &memory.linearAllocator.info, 4, TESTK_CHUNK_SIZE + 9, log);
+    ASSERT_EQ(blobStreamSchedulerAdd(&scheduler, &logicA, 1, 3), 0);
+    ASSERT_EQ(blobStreamSchedulerAdd(&scheduler, &logicB, 1, 1), 0);
+
+    BlobStreamScheduledEntry results[32];
+    int resultCount = blobStreamSchedulerPrepareSend(&scheduler, 0, 8 * TESTK_ENTRY_OCTET_SIZE, results, 32);
+    ASSERT_EQ(resultCount, 8);
+    size_t countA = 0;
+    for (int i = 0; i < resultCount; ++i) {
+        countA += results[i].logic == &logicA;
+    }
+    ASSERT_EQ(countA, 6u);
+
+    // The control blob is added while the bulk transfers saturate the budget, but is sent completely first
+    ASSERT_EQ(blobStreamSchedulerAdd(&scheduler, &logicControl, 0, 1), 0);
+    resultCount = blobStreamSchedulerPrepareSend(&scheduler, 10, 4 * TESTK_ENTRY_OCTET_SIZE, results, 32);
+    ASSERT_EQ(resultCount, 4);
+    ASSERT_TRUE(results[0].logic == &logicControl);
+    ASSERT_TRUE(results[1].logic == &logicControl);
+    ASSERT_TRUE(blobStreamOutIsAllSent(&control));
+    ASSERT_TRUE(results[2].logic != &logicControl);
+
+    ASSERT_EQ(blobStreamSchedulerRemove(&scheduler, &logicControl), 0);
+    ASSERT_EQ(scheduler.streamCount, 2u);
+
+    blobStreamOutDestroy(&control);
+    blobStreamOutDestroy(&bulkB);
+    blobStreamOutDestroy(&bulkA);
+}
+
+static void countCompleted(void* userData, BlobStreamTransferId transferId, BlobStreamOut* blobStream,
+                           bool wasSuperseded)
+{
+    (void) transferId;
+    (void) blobStream;
+    if (!wasSuperseded) {
+        (*(size_t*) userData)++;
+    }
+}
+
+static void ackPipelineTransfer(BlobStreamPipeline* pipeline, BlobStreamLogicIn* logicIn)
+{
+    static uint8_t ackDatagram[64];
+    FldOutStream ackOut;
+    fldOutStreamInit(&ackOut, ackDatagram, sizeof(ackDatagram));
+    blobStreamLogicInSend(logicIn, &ackOut);
+    FldInStream ackIn;
+    fldInStreamInit(&ackIn, ackDatagram, ackOut.pos);
+    blobStreamPipelineReceive(pipeline, &ackIn);
+}
+
+UTEST(BlobStreamPipeline, backToBackTransfers)
+{
+    Mem memory;
+    createMemory(&memory);
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "test";
+
+#define TESTL_CHUNK_SIZE (100)
+#define TESTL_TRANSFER_COUNT (3)
+    static uint8_t blobs[TESTL_TRANSFER_COUNT][300];
+    BlobStreamOut outStreams[TESTL_TRANSFER_COUNT];
+    BlobStreamIn inStreams[TESTL_TRANSFER_COUNT];
+    BlobStreamLogicIn logicIns[TESTL_TRANSFER_COUNT];
+
+    BlobStreamPipeline pipeline;
+    blobStreamPipelineInit(&pipeline, &memory.linearAllocator.info, 4, 100, 6 * TESTL_CHUNK_SIZE, log);
+
+    size_t completedCount = 0;
+    for (size_t i = 0; i < TESTL_TRANSFER_COUNT; ++i) {
+        tc_memset_octets(blobs[i], (int) (0x40 + i), sizeof(blobs[i]));
+        blobStreamOutInit(&outStreams[i], &memory.linearAllocator.info, &memory.slabAllocator.info, blobs[i],
+                          sizeof(blobs[i]), TESTL_CHUNK_SIZE, log);
+        BlobStreamLogicOut* logicOut = blobStreamPipelineEnqueue(&pipeline, &outStreams[i], countCompleted,
+                                                                 &completedCount);
+        ASSERT_EQ(logicOut->transferId, 100 + i);
+        blobStreamInInit(&inStreams[i], &memory.linearAllocator.info, &memory.slabAllocator.info, sizeof(blobs[i]),
+                         TESTL_CHUNK_SIZE, log);
+        blobStreamLogicInInit(&logicIns[i], &inStreams[i], logicOut->transferId);
+    }
+
+    static uint8_t datagram[256];
+    MonotonicTimeMs now = 0;
+    for (size_t tick = 0; tick < 4 && completedCount < TESTL_TRANSFER_COUNT; ++tick) {
+        BlobStreamScheduledEntry results[16];
+        int resultCount = blobStreamPipelinePrepareSend(&pipeline, now, results, 16);
+        if (tick == 0) {
+            // The second transfer starts before the first one is acknowledged, the third must wait for the budget
+            ASSERT_EQ(resultCount, 6);
+            ASSERT_EQ(results[3].logic->transferId, 101);
+            ASSERT_EQ(blobStreamPipelineInFlightOctetCount(&pipeline), 6 * TESTL_CHUNK_SIZE);
+        }
+        for (int i = 0; i < resultCount; ++i) {
+            FldOutStream outDatagram;
+            fldOutStreamInit(&outDatagram, datagram, sizeof(datagram));
+            blobStreamLogicOutSendEntry(&outDatagram, results[i].entry, results[i].logic->transferId);
+            size_t transferIndex = results[i].logic->transferId - 100;
+            ASSERT_EQ(receiveAll(&logicIns[transferIndex], datagram, outDatagram.pos), 0);
+        }
+        for (size_t i = 0; i < TESTL_TRANSFER_COUNT; ++i) {
+            ackPipelineTransfer(&pipeline, &logicIns[i]);
+        }
+        now += 100;
+    }
+
+    ASSERT_EQ(completedCount, (size_t) TESTL_TRANSFER_COUNT);
+    ASSERT_EQ(pipeline.count, 0u);
+    for (size_t i = 0; i < TESTL_TRANSFER_COUNT; ++i) {
+        ASSERT_TRUE(blobStreamInIsComplete(&inStreams[i]));
+        ASSERT_EQ(tc_memcmp(inStreams[i].blob, blobs[i], sizeof(blobs[i])), 0);
+        blobStreamInDestroy(&inStreams[i]);
+        blobStreamOutDestroy(&outStreams[i]);
+    }
+}
+
+static void countSuperseded(void* userData, BlobStreamTransferId transferId, BlobStreamOut* blobStream,
+                            bool wasSuperseded)
+{
+    (void) transferId;
+    (void) blobStream;
+    if (wasSuperseded) {
+        (*(size_t*) userData)++;
+    }
+}
+
+UTEST(BlobStreamPipeline, latestWinsWithSalvage)
+{
+    Mem memory;
+    createMemory(&memory);
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "test";
+
+#define TESTM_CHUNK_SIZE (100)
+#define TESTM_BLOB_SIZE (500)
+    static uint8_t olderBlob[TESTM_BLOB_SIZE];
+    static uint8_t newerBlob[TESTM_BLOB_SIZE];
+    for (size_t i = 0; i < TESTM_BLOB_SIZE; ++i) {
+        olderBlob[i] = (uint8_t) (i * 7);
+    }
+    tc_memcpy_octets(newerBlob, olderBlob, TESTM_BLOB_SIZE);
+    newerBlob[4 * TESTM_CHUNK_SIZE + 3] ^= 0xff;
+
+    BlobStreamPipeline pipeline;
+    blobStreamPipelineInit(&pipeline, &memory.linearAllocator.info, 2, 1, 64 * TESTM_CHUNK_SIZE, log);
+    blobStreamPipelineSetLatestWins(&pipeline, true);
+    size_t supersededCount = 0;
+
+    BlobStreamOut olderOut;
+    blobStreamOutInit(&olderOut, &memory.linearAllocator.info, &memory.slabAllocator.info, olderBlob,
+                      TESTM_BLOB_SIZE, TESTM_CHUNK_SIZE, log);
+    BlobStreamLogicOut* olderLogic = blobStreamPipelineEnqueue(&pipeline, &olderOut, countSuperseded,
+                                                               &supersededCount);
+    BlobStreamIn olderIn;
+    blobStreamInInit(&olderIn, &memory.linearAllocator.info, &memory.slabAllocator.info, TESTM_BLOB_SIZE,
+                     TESTM_CHUNK_SIZE, log);
+    BlobStreamLogicIn olderLogicIn;
+    blobStreamLogicInInit(&olderLogicIn, &olderIn, olderLogic->transferId);
+
+    // Only the first three chunks of the older transfer reach the receiver
+    static uint8_t datagram[256];
+    BlobStreamScheduledEntry results[8];
+    int resultCount = blobStreamPipelinePrepareSend(&pipeline, 0, results, 8);
+    ASSERT_EQ(resultCount, 5);
+    for (int i = 0; i < 3; ++i) {
+        FldOutStream outDatagram;
+        fldOutStreamInit(&outDatagram, datagram, sizeof(datagram));
+        blobStreamLogicOutSendEntry(&outDatagram, results[i].entry, olderLogic->transferId);
+        ASSERT_EQ(receiveAll(&olderLogicIn, datagram, outDatagram.pos), 0);
+    }
+    ackPipelineTransfer(&pipeline, &olderLogicIn);
+
+    BlobStreamOut newerOut;
+    blobStreamOutInit(&newerOut, &memory.linearAllocator.info, &memory.slabAllocator.info, newerBlob,
+                      TESTM_BLOB_SIZE, TESTM_CHUNK_SIZE, log);
+    BlobStreamLogicOut* newerLogic = blobStreamPipelineEnqueue(&pipeline, &newerOut, countSuperseded,
+                                                               &supersededCount);
+    ASSERT_EQ(supersededCount, 1u);
+    ASSERT_EQ(pipeline.count, 1u);
+    ASSERT_EQ(newerOut.entries[0].encoding, BLOB_STREAM_CHUNK_ENCODING_UNCHANGED);
+    ASSERT_EQ(newerOut.entries[3].encoding, BLOB_STREAM_CHUNK_ENCODING_RAW);
+    resultCount = blobStreamPipelinePrepareSend(&pipeline, 1, results, 8);
+    ASSERT_TRUE(resultCount > 0);
+    for (int i = 0; i < resultCount; ++i) {
+        ASSERT_TRUE(results[i].logic == newerLogic);
+    }
+
+    FldOutStream startOut;
+    fldOutStreamInit(&startOut, datagram, sizeof(datagram));
+    blobStreamLogicOutStartTransfer(newerLogic, &startOut);
+    FldInStream startIn;
+    fldInStreamInit(&startIn, datagram, startOut.pos);
+    BlobStreamStartTransfer startTransfer;
+    ASSERT_EQ(blobStreamLogicInReadStartTransfer(&startIn, BLOB_STREAM_MAX_CHUNK_SIZE, &startTransfer), 0);
+    ASSERT_TRUE(startTransfer.isDelta);
+    ASSERT_EQ(startTransfer.baselineId, olderLogicIn.transferId);
+
+    BlobStreamIn newerIn;
+    blobStreamInInit(&newerIn, &memory.linearAllocator.info, &memory.slabAllocator.info, startTransfer.octetCount,
+                     startTransfer.fixedChunkSize, log);
+    blobStreamInSetBaseline(&newerIn, olderIn.blob, olderIn.octetCount);
+    BlobStreamLogicIn newerLogicIn;
+    blobStreamLogicInInit(&newerLogicIn, &newerIn, startTransfer.transferId);
+
+    size_t octetsOnWire = 0;
+    ASSERT_EQ(transferUntilComplete(newerLogic, &newerLogicIn, 10, &octetsOnWire), 0);
+    ASSERT_EQ(tc_memcmp(newerIn.blob, newerBlob, TESTM_BLOB_SIZE), 0);
+    ASSERT_TRUE(octetsOnWire < 2 * (TESTM_CHUNK_SIZE + BLOB_STREAM_SET_CHUNK_HEADER_OCTET_SIZE) + 16);
+
+    blobStreamInDestroy(&newerIn);
+    blobStreamInDestroy(&olderIn);
+    blobStreamOutDestroy(&newerOut);
+    blobStreamOutDestroy(&olderOut);
+}